@@ -1,4 +1,5 @@
 #include <iostream>
+#include <map>
 #include <fstream>
 #include <sstream>
 #include <vector>
@@ -44,12 +45,13 @@ retry:
   }
 }
 
-void bench_worker::do_cmdlog_redo_workload_function(uint32_t i, void *param) {
+void bench_worker::do_cmdlog_redo_workload_function(
+    uint32_t i, const ermia::CommandLog::LogRecord *record) {
   ASSERT(workload.size() == 0 && cmdlog_redo_workload.size());
 retry:
   util::timer t;
   const unsigned long old_seed = r.get_seed();
-  const auto ret = cmdlog_redo_workload[i].fn(this, param);
+  const auto ret = cmdlog_redo_workload[i].fn(this, record);
   if (finish_workload(ret, i, t)) {
     r.set_seed(old_seed);
     goto retry;
@@ -76,7 +78,9 @@ bool bench_worker::finish_workload(rc_t ret, uint32_t workload_idx, util::timer
     if (!ermia::config::is_backup_srv() && ermia::config::group_commit) {
       ermia::logmgr->enqueue_committed_xct(worker_id, t.get_start());
     } else {
-      latency_numer_us += t.lap();
+      uint64_t us = t.lap();
+      latency_numer_us += us;
+      latency_hist[ermia::chkptmgr and ermia::chkptmgr->InProgress()].add(us);
     }
     backoff_shifts >>= 1;
   } else {
@@ -272,6 +276,7 @@ void bench_runner::run() {
   if (ermia::config::read_view_stat_interval_ms) {
     read_view_observer = std::move(std::thread(measure_read_view_lsn));
   }
+  ermia::rep::StartReplicationStats();
 
   if (ermia::config::worker_threads) {
     start_measurement();
@@ -280,6 +285,7 @@ void bench_runner::run() {
     std::mutex trigger_lock;
     std::unique_lock<std::mutex> lock(trigger_lock);
     ermia::rep::backup_shutdown_trigger.wait(lock);
+    ermia::rep::StopReplicationStats();
     if (ermia::config::replay_policy != ermia::config::kReplayNone &&
         ermia::config::replay_policy != ermia::config::kReplayBackground) {
       while (ermia::volatile_read(ermia::rep::replayed_lsn_offset) <
@@ -315,7 +321,19 @@ void bench_runner::measure_read_view_lsn() {
   std::ofstream out_file(ermia::config::read_view_stat_file, std::ios::out | std::ios::trunc);
   LOG_IF(FATAL, !out_file.is_open()) << "Read view stat file not open";
   DEFER(out_file.close());
-  out_file << "Time,LSN,DLSN" << std::endl;
+  // Backups also report how stale (in ms) the global and each table's read
+  // view is
+  std::map<std::string, ermia::TableDescriptor *> tables;
+  out_file << "Time,LSN,DLSN";
+  if (ermia::config::is_backup_srv()) {
+    tables.insert(ermia::TableDescriptor::name_map.begin(),
+                  ermia::TableDescriptor::name_map.end());
+    out_file << ",StalenessMs";
+    for (auto &tbl : tables) {
+      out_file << "," << tbl.first << "Ms";
+    }
+  }
+  out_file << std::endl;
   while (!ermia::config::IsShutdown()) {
     while (ermia::config::IsForwardProcessing()) {
       uint64_t lsn = 0;
@@ -327,12 +345,43 @@ void bench_runner::measure_read_view_lsn() {
       }
       uint64_t t = std::chrono::system_clock::now().time_since_epoch() /
                    std::chrono::milliseconds(1);
-      out_file << t << "," << lsn << "," << dlsn << std::endl;
+      out_file << t << "," << lsn << "," << dlsn;
+      if (ermia::config::is_backup_srv()) {
+        out_file << "," << ermia::rep::ReadViewStaleness(lsn) / 1e6;
+        for (auto &tbl : tables) {
+          uint64_t view = ermia::rep::GetReadView(&tbl.second, 1);
+          out_file << "," << ermia::rep::ReadViewStaleness(view) / 1e6;
+        }
+      }
+      out_file << std::endl;
       usleep(ermia::config::read_view_stat_interval_ms * 1000);
     }
   }
 }
 
+void bench_runner::print_footprint() {
+  util::timer t;
+  auto footprints = db->GetFootprint(std::thread::hardware_concurrency());
+  std::cerr << "--- memory footprint (" << t.lap() / 1000 << " ms) ---" << std::endl;
+  uint64_t total = 0;
+  for (auto &fp : footprints) {
+    std::cerr << "table " << fp.name << " " << fp.TotalBytes() << " bytes: "
+              << "oid_array " << fp.tuple_array_bytes + fp.aux_array_bytes
+              << ", keys " << fp.key_bytes
+              << ", live " << fp.live_versions << " versions/" << fp.live_bytes
+              << " bytes, dead " << fp.dead_versions << " versions/"
+              << fp.dead_bytes << " bytes, avg_chain_length "
+              << fp.AvgChainLength() << std::endl;
+    for (auto &i : fp.indexes) {
+      std::cerr << "  index " << i.name << (i.is_primary ? " (primary)" : "")
+                << " " << i.nkeys << " keys, " << i.nnodes << " nodes, "
+                << i.node_bytes << " bytes" << std::endl;
+    }
+    total += fp.TotalBytes();
+  }
+  std::cerr << "total " << total << " bytes" << std::endl;
+}
+
 void bench_runner::start_measurement() {
   workers = make_workers();
   ALWAYS_ASSERT(!workers.empty());
@@ -358,7 +407,7 @@ void bench_runner::start_measurement() {
         exit(execl("/usr/bin/perf","perf","record", "-F", "99", "-e", ermia::config::perf_record_event.c_str(),
                    "-p", parent_pid.str().c_str(), nullptr));
       } else {
-        exit(execl("/usr/bin/perf","perf","stat", "-B", "-e",  "cache-references,cache-misses,cycles,instructions,branches,faults", 
+        exit(execl("/usr/bin/perf","perf","stat", "-B", "-e",  "cache-references,cache-misses,cycles,instructions,branches,faults,dTLB-loads,dTLB-load-misses", 
                    "-p", parent_pid.str().c_str(), nullptr));
       }
     } else {
@@ -457,19 +506,24 @@ void bench_runner::start_measurement() {
     slept++;
   };
 
-  // Backups run forever until told to stop.
+  // Backups run forever until told to stop, unless they take over as the
+  // primary, which then runs the benchmark period from there.
+  uint64_t start = 0;
   if (ermia::config::is_backup_srv()) {
-    while (!ermia::config::IsShutdown()) {
+    while (!ermia::config::IsShutdown() and ermia::config::is_backup_srv()) {
       gather_stats();
     }
-  } else {
-    while (slept < ermia::config::benchmark_seconds) {
+    start = slept;
+  }
+  if (!ermia::config::IsShutdown()) {
+    while (slept - start < ermia::config::benchmark_seconds) {
       gather_stats();
     }
   }
   running = false;
 
   ermia::volatile_write(ermia::config::state, ermia::config::kStateShutdown);
+  ermia::rep::StopReplicationStats();
   for (size_t i = 0; i < ermia::config::worker_threads; i++) {
     workers[i]->Join();
   }
@@ -564,6 +618,18 @@ void bench_runner::start_measurement() {
       }
     }
   }
+  uint64_t agg_redo_records = 0;
+  uint64_t max_replay_latency_us = 0;
+  if (ermia::config::is_backup_srv() && ermia::config::log_ship_hash_replay) {
+    ermia::parallel_hash_replay *f = (ermia::parallel_hash_replay *)ermia::logmgr->get_backup_replay_functor();
+    if (f) {
+      agg_latency_us = f->redo_latency_us;
+      agg_redo_batches = f->redo_batches;
+      agg_redo_size = f->redo_size;
+      agg_redo_records = f->redo_records;
+      max_replay_latency_us = f->max_redo_latency_us;
+    }
+  }
 
   const double agg_replay_latency_ms = agg_latency_us / 1000.0;
 
@@ -578,7 +644,26 @@ void bench_runner::start_measurement() {
     }
   }
 
-  if (ermia::config::enable_chkpt) delete ermia::chkptmgr;
+  // Commit latencies outside and during checkpoints
+  latency_histogram latency_hist[2];
+  for (size_t i = 0; i < ermia::config::worker_threads; i++) {
+    latency_hist[0].merge(workers[i]->get_latency_hist(false));
+    latency_hist[1].merge(workers[i]->get_latency_hist(true));
+  }
+  if (!ermia::config::is_backup_srv() && ermia::config::group_commit) {
+    // Recorded as the flusher dequeues commits, see finish_workload
+    typedef ermia::sm_log_alloc_mgr::commit_queue commit_queue;
+    latency_hist[0].merge(commit_queue::latency_hist[0]);
+    latency_hist[1].merge(commit_queue::latency_hist[1]);
+  }
+  latency_histogram all_latency_hist = latency_hist[0];
+  all_latency_hist.merge(latency_hist[1]);
+
+  ermia::sm_chkpt_mgr::stats chkpt_stats = {};
+  if (ermia::config::enable_chkpt) {
+    chkpt_stats = ermia::chkptmgr->GetStats();
+    delete ermia::chkptmgr;
+  }
 
   if (ermia::config::verbose) {
     std::cerr << "--- table statistics ---" << std::endl;
@@ -592,6 +677,9 @@ void bench_runner::start_measurement() {
       else
         std::cerr << " (+" << delta << " records)" << std::endl;
     }
+    if (ermia::config::print_footprint) {
+      print_footprint();
+    }
     std::cerr << "--- benchmark statistics ---" << std::endl;
     std::cerr << "runtime: " << elapsed_sec << " sec" << std::endl;
     std::cerr << "cpu_util: " << total_util / elapsed_sec << "%" << std::endl;
@@ -603,6 +691,31 @@ void bench_runner::start_measurement() {
     std::cerr << "avg_per_core_throughput: " << avg_per_core_throughput
          << " ops/sec/core" << std::endl;
     std::cerr << "avg_latency: " << avg_latency_ms << " ms" << std::endl;
+    if (all_latency_hist.total()) {
+      std::cerr << "p99_latency: " << all_latency_hist.percentile(0.99) / 1000.0
+                << " ms" << std::endl;
+    }
+    if (ermia::config::enable_chkpt) {
+      std::cerr << "chkpt_count: " << chkpt_stats.checkpoints << std::endl;
+      std::cerr << "chkpt_throughput: "
+                << (double)chkpt_stats.bytes / ermia::config::MB /
+                       std::max(chkpt_stats.ns / 1e9, 1e-9)
+                << " MB/sec" << std::endl;
+      std::cerr << "chkpt_stall_time: " << chkpt_stats.stall_ns / 1e6 << " ms"
+                << std::endl;
+      std::cerr << "chkpt_throttle_time: " << chkpt_stats.throttle_ns / 1e6
+                << " ms" << std::endl;
+      if (latency_hist[0].total()) {
+        std::cerr << "p99_latency_no_chkpt: "
+                  << latency_hist[0].percentile(0.99) / 1000.0 << " ms"
+                  << std::endl;
+      }
+      if (latency_hist[1].total()) {
+        std::cerr << "p99_latency_in_chkpt: "
+                  << latency_hist[1].percentile(0.99) / 1000.0 << " ms"
+                  << std::endl;
+      }
+    }
     std::cerr << "agg_abort_rate: " << agg_abort_rate << " aborts/sec" << std::endl;
     std::cerr << "avg_per_core_abort_rate: " << avg_per_core_abort_rate
          << " aborts/sec/core" << std::endl;
@@ -615,6 +728,15 @@ void bench_runner::start_measurement() {
       std::cerr << "agg_redo_batches: " << agg_redo_batches << std::endl;
       std::cerr << "ms_per_redo_batch: " << agg_replay_latency_ms / (double)agg_redo_batches << std::endl;
       std::cerr << "agg_redo_size: " << agg_redo_size << " bytes" << std::endl;
+      if (agg_redo_records) {
+        std::cerr << "replay_throughput: "
+                  << agg_redo_records / (agg_replay_latency_ms / 1000.0)
+                  << " records/s, "
+                  << agg_redo_size / 1048576.0 / (agg_replay_latency_ms / 1000.0)
+                  << " MB/s" << std::endl;
+        std::cerr << "max_replay_lag: " << max_replay_latency_us / 1000.0
+                  << " ms" << std::endl;
+      }
     }
   }
 
@@ -7,6 +7,7 @@
 
 #include "../ermia.h"
 #include "../util.h"
+#include "../dbcore/sm-cmd-log.h"
 #include "../dbcore/sm-log-alloc.h"
 #include "../dbcore/sm-coroutine.h"
 
@@ -34,6 +35,8 @@ static std::vector<T> unique_filter(const std::vector<T> &v) {
   return ret;
 }
 
+using util::latency_histogram;
+
 class bench_loader : public ermia::thread::Runner {
  public:
   bench_loader(unsigned long seed, ermia::Engine *db,
@@ -118,7 +121,7 @@ class bench_worker : public ermia::thread::Runner {
   ~bench_worker() {}
 
   /* For the r/w workload using command log shipping on backups */
-  typedef rc_t (*cmdlog_redo_fn_t)(bench_worker *, void * /* parameters */);
+  typedef rc_t (*cmdlog_redo_fn_t)(bench_worker *, const ermia::CommandLog::LogRecord *);
   struct cmdlog_redo_workload_desc {
     cmdlog_redo_workload_desc() {}
     cmdlog_redo_workload_desc(const std::string &name, cmdlog_redo_fn_t fn)
@@ -178,11 +181,16 @@ class bench_worker : public ermia::thread::Runner {
     return double(latency_numer_us) / double(ntxn_commits);
   }
 
+  // [1] has commits that overlapped a checkpoint, [0] the rest
+  inline const latency_histogram &get_latency_hist(bool during_chkpt) const {
+    return latency_hist[during_chkpt];
+  }
+
   const tx_stat_map get_txn_counts() const;
   const tx_stat_map get_cmdlog_txn_counts() const;
 
   void do_workload_function(uint32_t i);
-  void do_cmdlog_redo_workload_function(uint32_t i, void *param);
+  void do_cmdlog_redo_workload_function(uint32_t i, const ermia::CommandLog::LogRecord *record);
   uint32_t fetch_workload();
   bool finish_workload(rc_t ret, uint32_t workload_idx, util::timer t);
 
@@ -205,6 +213,7 @@ class bench_worker : public ermia::thread::Runner {
 
  private:
   uint64_t latency_numer_us;
+  latency_histogram latency_hist[2];
   unsigned backoff_shifts;
 
   // stats
@@ -251,6 +260,9 @@ class bench_runner {
 
   static void measure_read_view_lsn();
 
+  // Print per-table/index memory usage, see Engine::GetFootprint()
+  void print_footprint();
+
  protected:
   // only called once
   virtual std::vector<bench_loader *> make_loaders() = 0;
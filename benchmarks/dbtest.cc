@@ -33,20 +33,58 @@ DEFINE_string(benchmark_options, "", "Benchmark-specific opetions.");
 DEFINE_bool(index_probe_only, false, "Whether the read is only probing into index");
 DEFINE_uint64(threads, 1, "Number of worker threads to run transactions.");
 DEFINE_uint64(node_memory_gb, 12, "GBs of memory to allocate per node.");
+DEFINE_string(oid_array_hugepage, "none",
+              "Page type backing OID arrays. "
+              "none - regular pages; "
+              "thp - transparent huge pages (madvise); "
+              "2mb/1gb - hugetlb pages, must be reserved beforehand");
+DEFINE_uint64(oid_array_prefault_mb, 0,
+              "MBs of each table's OID arrays to keep mapped and prefaulted "
+              "ahead of the allocator high water mark by a background thread. "
+              "0 - grow on the insert path.");
 DEFINE_bool(numa_spread, false, "Whether to pin threads in spread mode (compact if false)");
 DEFINE_string(tmpfs_dir, "/dev/shm",
               "Path to a tmpfs location. Used by log buffer.");
 DEFINE_string(log_data_dir, "/tmpfs/ermia-log", "Log directory.");
 DEFINE_uint64(log_segment_mb, 8192, "Log segment size in MB.");
 DEFINE_uint64(log_buffer_mb, 16, "Log buffer size in MB.");
+DEFINE_string(log_checksum, "auto",
+              "Log block checksum. "
+              "auto - crc32c if the CPU has SSE4.2, adler32 otherwise; "
+              "adler32; crc32c");
+DEFINE_uint64(log_streams, 1,
+              "Number of files (and flusher threads) each log segment is "
+              "striped over. 0 - one per NUMA node.");
+DEFINE_bool(log_uring, false,
+            "Write the log with O_DIRECT through io_uring, several writes in "
+            "flight per flush, into preallocated segments.");
+DEFINE_uint64(log_uring_depth, 8,
+              "Maximum number of in-flight writes per log flush with "
+              "-log_uring.");
+DEFINE_bool(log_reclaim, false,
+            "Delete log segments that end before the latest checkpoint after "
+            "each checkpoint. Requires -enable_chkpt.");
+DEFINE_bool(log_recycle_segments, false,
+            "With -log_reclaim, reuse a few reclaimed segment files for new "
+            "segments instead of deleting them.");
 DEFINE_bool(log_ship_by_rdma, false, "Whether to use RDMA for log shipping.");
+DEFINE_bool(log_ship_compress, false,
+            "Whether to LZ4-compress log batches shipped to backups over TCP.");
 DEFINE_bool(phantom_prot, false, "Whether to enable phantom protection.");
 DEFINE_uint64(read_view_stat_interval_ms, 0,
   "Time interval between two outputs of read view LSN in milliseconds."
   "0 means do not output");
 DEFINE_string(read_view_stat_file, "/dev/shm/ermia_read_view_stat",
   "Where to store all the read view LSN outputs. Recommend tmpfs.");
+DEFINE_uint64(rep_stat_interval_ms, 0,
+  "Time interval between two samples of replication statistics in "
+  "milliseconds. 0 means do not sample");
+DEFINE_string(rep_stat_dest, "/dev/shm/ermia_rep_stat",
+  "Where to write replication statistics: a file, or unix:<path> to send "
+  "each sample as a datagram to a local socket.");
 DEFINE_bool(print_cpu_util, false, "Whether to print CPU utilization.");
+DEFINE_bool(print_footprint, false,
+            "Whether to print per-table/index memory usage at the end of a run.");
 DEFINE_bool(enable_perf, false, "Whether to run Linux perf along with benchmark.");
 DEFINE_string(perf_record_event, "", "Perf record event");
 #if defined(SSN) || defined(SSI)
@@ -80,6 +118,18 @@ DEFINE_string(
     "eager - load everything to memory during recovery.");
 DEFINE_bool(enable_chkpt, false, "Whether to enable checkpointing.");
 DEFINE_uint64(chkpt_interval, 10, "Checkpoint interval in seconds.");
+DEFINE_uint64(chkpt_max_deltas, 0,
+              "Number of incremental checkpoints (only OID pages changed "
+              "since the previous checkpoint) to take between full ones. "
+              "0 means every checkpoint is full.");
+DEFINE_uint64(chkpt_buffer_mb, 16,
+              "Size of each of the three buffers checkpoints are written "
+              "through, in MB.");
+DEFINE_uint64(chkpt_io_mbps, 0,
+              "Limit checkpoint writes to this many MB/s; 0 means no limit.");
+DEFINE_uint64(chkpt_threads, 1,
+              "Number of threads taking each checkpoint, spread across NUMA "
+              "nodes; each writes its own chunk file.");
 DEFINE_bool(null_log_device, false, "Whether to skip writing log records.");
 DEFINE_bool(
     truncate_at_bench_start, false,
@@ -98,6 +148,24 @@ DEFINE_uint64(group_commit_size_kb, 4,
               "Group commit flush size interval in KB.");
 DEFINE_bool(enable_gc, false, "Whether to enable garbage collection.");
 DEFINE_uint64(num_backups, 0, "Number of backup servers. For primary only.");
+DEFINE_uint64(ship_quorum, 0,
+              "Number of backups that must acknowledge a shipped log batch "
+              "before the primary moves on (TCP only); 0 means all.");
+DEFINE_uint64(ship_fanout, 0,
+              "Ship the log to this many backups and have each backup "
+              "forward it to as many more (TCP only); 1 makes a chain, 0 "
+              "means the primary ships to every backup.");
+DEFINE_uint64(bootstrap_streams, 0,
+              "Bring up backups over this many TCP connections each, in "
+              "checksummed chunks that survive disconnects; 0 streams the "
+              "chkpt and log over a single connection.");
+DEFINE_uint64(bootstrap_chunk_mb, 64,
+              "Size of the chunks backups are bootstrapped in, in MB.");
+DEFINE_bool(log_ship_shm, false,
+            "Ship the log to backups on the same host through shared memory "
+            "instead of TCP.");
+DEFINE_uint64(log_ship_shm_mb, 64,
+              "Size of each backup's shared memory log shipping ring, in MB.");
 DEFINE_bool(wait_for_backups, true,
             "Whether to wait for backups to become online before starting "
             "transactions.");
@@ -105,7 +173,16 @@ DEFINE_string(persist_policy, "sync",
               "Up to what time must the shipped log be persistent."
               "pipelined - not persisted until the next shipping"
               "sync - request immediate ack on persistence from backups"
-              "async - don't care at all, i.e., asynchronous log shipping");
+              "async - don't care at all, i.e., asynchronous log shipping"
+              "adaptive - pipelined, switching to async and back under load");
+DEFINE_uint64(persist_latency_us, 1000,
+              "Adaptive persist policy: commit latency (us) above which "
+              "the primary stops waiting for backups.");
+DEFINE_uint64(persist_max_lag_mb, 16,
+              "Adaptive persist policy: most log (MB) backups may leave "
+              "unacknowledged while shipping asynchronously.");
+DEFINE_uint64(persist_adapt_interval_ms, 100,
+              "Adaptive persist policy: how often to reconsider it, in ms.");
 DEFINE_bool(command_log, false, "Whether to use command logging.");
 DEFINE_uint64(command_log_buffer_mb, 16, "Size of command log buffer.");
 DEFINE_bool(log_ship_offset_replay, false, "Whether to parallel offset based replay.");
@@ -149,8 +226,14 @@ DEFINE_bool(
     "Create a version object directly and install it on the main arrays."
     "(for comparison and experimental purpose only).");
 DEFINE_uint64(replay_threads, 0, "How many replay threads to use.");
+DEFINE_bool(log_ship_hash_replay, false,
+            "Whether to decode shipped log once and replay it by (FID, OID) "
+            "hash partitions. For backups only.");
 DEFINE_bool(persist_nvram_on_replay, true,
             "Whether to issue clwb/clflush (if specified) during replay.");
+DEFINE_bool(promote_on_primary_loss, false,
+            "Whether to take over as the primary when the connection to the "
+            "primary is lost, then run for -seconds. For backups only.");
 
 static std::vector<std::string> split_ws(const std::string &s) {
   std::vector<std::string> r;
@@ -174,6 +257,7 @@ int main(int argc, char **argv) {
   ermia::config::benchmark = FLAGS_benchmark;
   ermia::config::state = ermia::config::kStateLoading;
   ermia::config::print_cpu_util = FLAGS_print_cpu_util;
+  ermia::config::print_footprint = FLAGS_print_footprint;
   ermia::config::htt_is_on = FLAGS_htt;
   ermia::config::enable_perf = FLAGS_enable_perf;
   ermia::config::perf_record_event = FLAGS_perf_record_event;
@@ -185,14 +269,43 @@ int main(int argc, char **argv) {
   ermia::config::index_probe_only = FLAGS_index_probe_only;
   ermia::config::verbose = FLAGS_verbose;
   ermia::config::node_memory_gb = FLAGS_node_memory_gb;
+  if (FLAGS_oid_array_hugepage == "none") {
+    ermia::config::oid_array_hugepage = ermia::dynarray::kHugePageNone;
+  } else if (FLAGS_oid_array_hugepage == "thp") {
+    ermia::config::oid_array_hugepage = ermia::dynarray::kHugePageTransparent;
+  } else if (FLAGS_oid_array_hugepage == "2mb") {
+    ermia::config::oid_array_hugepage = ermia::dynarray::kHugePage2MB;
+  } else if (FLAGS_oid_array_hugepage == "1gb") {
+    ermia::config::oid_array_hugepage = ermia::dynarray::kHugePage1GB;
+  } else {
+    LOG(FATAL) << "Invalid OID array huge page type: " << FLAGS_oid_array_hugepage;
+  }
+  ermia::config::oid_array_prefault_mb = FLAGS_oid_array_prefault_mb;
   ermia::config::numa_spread = FLAGS_numa_spread;
   ermia::config::tmpfs_dir = FLAGS_tmpfs_dir;
   ermia::config::log_dir = FLAGS_log_data_dir;
   ermia::config::log_segment_mb = FLAGS_log_segment_mb;
+  if (FLAGS_log_checksum == "auto") {
+    ermia::config::log_checksum = crc32c_hw_available()
+                                      ? ermia::LOG_CHECKSUM_CRC32C
+                                      : ermia::LOG_CHECKSUM_ADLER32;
+  } else if (FLAGS_log_checksum == "adler32") {
+    ermia::config::log_checksum = ermia::LOG_CHECKSUM_ADLER32;
+  } else if (FLAGS_log_checksum == "crc32c") {
+    ermia::config::log_checksum = ermia::LOG_CHECKSUM_CRC32C;
+  } else {
+    LOG(FATAL) << "Invalid log checksum: " << FLAGS_log_checksum;
+  }
   ermia::config::log_buffer_mb = FLAGS_log_buffer_mb;
+  ermia::config::log_streams = FLAGS_log_streams;
+  ermia::config::log_uring = FLAGS_log_uring;
+  ermia::config::log_uring_depth = FLAGS_log_uring_depth;
+  ermia::config::log_reclaim = FLAGS_log_reclaim;
+  ermia::config::log_recycle_segments = FLAGS_log_recycle_segments;
   ermia::config::phantom_prot = FLAGS_phantom_prot;
   ermia::config::recover_functor = new ermia::parallel_oid_replay(FLAGS_threads);
   ermia::config::log_ship_by_rdma = FLAGS_log_ship_by_rdma;
+  ermia::config::log_ship_compress = FLAGS_log_ship_compress;
 
   ermia::config::amac_version_chain = FLAGS_amac_version_chain;
 
@@ -213,6 +326,8 @@ int main(int argc, char **argv) {
   ermia::config::log_redo_partitions = ermia::rep::kMaxLogBufferPartitions;
   ermia::config::read_view_stat_interval_ms = FLAGS_read_view_stat_interval_ms;
   ermia::config::read_view_stat_file = FLAGS_read_view_stat_file;
+  ermia::config::rep_stat_interval_ms = FLAGS_rep_stat_interval_ms;
+  ermia::config::rep_stat_dest = FLAGS_rep_stat_dest;
 
   ermia::config::command_log = FLAGS_command_log;
   ermia::config::command_log_buffer_mb = FLAGS_command_log_buffer_mb;
@@ -240,7 +355,10 @@ int main(int argc, char **argv) {
       ermia::config::cycles_per_byte = 0;
     }
 
-    ermia::config::benchmark_seconds = ~uint32_t{0};  // Backups run forever
+    // Backups run forever, or for -seconds after taking over as the primary
+    ermia::config::promote_on_primary_loss = FLAGS_promote_on_primary_loss;
+    ermia::config::benchmark_seconds =
+        FLAGS_promote_on_primary_loss ? FLAGS_seconds : ~uint32_t{0};
     ermia::config::quick_bench_start = FLAGS_quick_bench_start;
     ermia::config::wait_for_primary = FLAGS_wait_for_primary;
     ermia::config::log_ship_by_rdma = FLAGS_log_ship_by_rdma;
@@ -268,6 +386,7 @@ int main(int argc, char **argv) {
                  << FLAGS_replay_policy;
     }
     ermia::config::full_replay = FLAGS_full_replay;
+    ermia::config::log_ship_hash_replay = FLAGS_log_ship_hash_replay;
 
     ermia::config::replay_threads = FLAGS_replay_threads;
     LOG_IF(FATAL, ermia::config::threads < ermia::config::replay_threads);
@@ -300,6 +419,10 @@ int main(int argc, char **argv) {
     ermia::config::group_commit_bytes = FLAGS_group_commit_size_kb * 1024;
     ermia::config::enable_chkpt = FLAGS_enable_chkpt;
     ermia::config::chkpt_interval = FLAGS_chkpt_interval;
+    ermia::config::chkpt_max_deltas = FLAGS_chkpt_max_deltas;
+    ermia::config::chkpt_buffer_mb = FLAGS_chkpt_buffer_mb;
+    ermia::config::chkpt_io_mbps = FLAGS_chkpt_io_mbps;
+    ermia::config::chkpt_threads = FLAGS_chkpt_threads;
     ermia::config::parallel_loading = FLAGS_parallel_loading;
     ermia::config::enable_gc = FLAGS_enable_gc;
 
@@ -317,6 +440,12 @@ int main(int argc, char **argv) {
     ermia::config::log_ship_offset_replay = FLAGS_log_ship_offset_replay;
     ermia::config::log_key_for_update = FLAGS_log_key_for_update;
     ermia::config::num_backups = FLAGS_num_backups;
+    ermia::config::ship_quorum = FLAGS_ship_quorum;
+    ermia::config::ship_fanout = FLAGS_ship_fanout;
+    ermia::config::bootstrap_streams = FLAGS_bootstrap_streams;
+    ermia::config::bootstrap_chunk_mb = FLAGS_bootstrap_chunk_mb;
+    ermia::config::log_ship_shm = FLAGS_log_ship_shm;
+    ermia::config::log_ship_shm_mb = FLAGS_log_ship_shm_mb;
     ermia::config::wait_for_backups = FLAGS_wait_for_backups;
     if (FLAGS_persist_policy == "sync") {
       ermia::config::persist_policy = ermia::config::kPersistSync;
@@ -326,6 +455,14 @@ int main(int argc, char **argv) {
         << "Not supported: NVRAM + async ship";
     } else if (FLAGS_persist_policy == "pipelined") {
       ermia::config::persist_policy = ermia::config::kPersistPipelined;
+    } else if (FLAGS_persist_policy == "adaptive") {
+      // Backups see a pipelined primary that now and then marks batches
+      // as asynchronous
+      ermia::config::persist_policy = ermia::config::kPersistPipelined;
+      ermia::config::persist_adaptive = true;
+      ermia::config::persist_latency_us = FLAGS_persist_latency_us;
+      ermia::config::persist_max_lag_mb = FLAGS_persist_max_lag_mb;
+      ermia::config::persist_adapt_interval_ms = FLAGS_persist_adapt_interval_ms;
     } else {
       LOG(FATAL) << "Invalid persist policy: "
                  << FLAGS_persist_policy;
@@ -355,6 +492,8 @@ int main(int argc, char **argv) {
 #endif
 #elif defined(MVCC)
   std::cerr << "MVOCC";
+#elif defined(OCC)
+  std::cerr << "OCC";
 #else
   std::cerr << "SI";
 #endif
@@ -374,22 +513,48 @@ int main(int argc, char **argv) {
   std::cerr << "  enable-perf       : " << ermia::config::enable_perf << std::endl;
   std::cerr << "  index-probe-only  : " << FLAGS_index_probe_only << std::endl;
   std::cerr << "  log-buffer-mb     : " << ermia::config::log_buffer_mb << std::endl;
+  std::cerr << "  log-checksum      : "
+            << (ermia::config::log_checksum == ermia::LOG_CHECKSUM_CRC32C ? "crc32c" : "adler32")
+            << (adler32_avx2_available() ? " (avx2 adler32)" : "") << std::endl;
   std::cerr << "  log-dir           : " << ermia::config::log_dir << std::endl;
+  std::cerr << "  log-streams       : " << ermia::config::log_streams << std::endl;
+  std::cerr << "  log-uring         : " << ermia::config::log_uring;
+  if (ermia::config::log_uring) {
+    std::cerr << " (depth " << ermia::config::log_uring_depth << ")";
+  }
+  std::cerr << std::endl;
+  std::cerr << "  log-reclaim       : " << ermia::config::log_reclaim;
+  if (ermia::config::log_recycle_segments) {
+    std::cerr << " (recycle)";
+  }
+  std::cerr << std::endl;
   std::cerr << "  log-ship-by-rdma  : " << ermia::config::log_ship_by_rdma << std::endl;
+  std::cerr << "  log-ship-compress : " << ermia::config::log_ship_compress << std::endl;
   std::cerr << "  log_ship_offset_replay  : " << ermia::config::log_ship_offset_replay << std::endl;
   std::cerr << "  logbuf-partitions : " << ermia::config::log_redo_partitions << std::endl;
   std::cerr << "  masstree_internal_node_size: " << ermia::ConcurrentMasstree::InternalNodeSize() << std::endl;
   std::cerr << "  masstree_leaf_node_size    : " << ermia::ConcurrentMasstree::LeafNodeSize() << std::endl;
   std::cerr << "  node-memory       : " << ermia::config::node_memory_gb << "GB" << std::endl;
+  std::cerr << "  oid-array-hugepage: " << FLAGS_oid_array_hugepage << std::endl;
+  std::cerr << "  oid-array-prefault: " << ermia::config::oid_array_prefault_mb << "MB" << std::endl;
   std::cerr << "  num-threads       : " << ermia::config::threads << std::endl;
   std::cerr << "  numa-nodes        : " << ermia::config::numa_nodes << std::endl;
   std::cerr << "  numa-mode         : " << (ermia::config::numa_spread ? "spread" : "compact") << std::endl;
   std::cerr << "  perf-record-event : " << ermia::config::perf_record_event << std::endl;
-  std::cerr << "  persist-policy    : " << FLAGS_persist_policy << std::endl;
+  std::cerr << "  persist-policy    : " << FLAGS_persist_policy;
+  if (ermia::config::persist_adaptive) {
+    std::cerr << " (" << ermia::config::persist_latency_us << "us commit latency, "
+              << ermia::config::persist_max_lag_mb << "MB max lag, every "
+              << ermia::config::persist_adapt_interval_ms << "ms)";
+  }
+  std::cerr << std::endl;
   std::cerr << "  physical-workers-only: " << ermia::config::physical_workers_only << std::endl;
   std::cerr << "  print-cpu-util    : " << ermia::config::print_cpu_util << std::endl;
+  std::cerr << "  print-footprint   : " << ermia::config::print_footprint << std::endl;
   std::cerr << "  read_view_stat_interval : " << ermia::config::read_view_stat_interval_ms << "ms" << std::endl;
   std::cerr << "  read_view_stat_file     : " << ermia::config::read_view_stat_file << std::endl;
+  std::cerr << "  rep_stat_interval : " << ermia::config::rep_stat_interval_ms << "ms" << std::endl;
+  std::cerr << "  rep_stat_dest     : " << ermia::config::rep_stat_dest << std::endl;
   std::cerr << "  threadpool        : " << ermia::config::threadpool << std::endl;
   std::cerr << "  tmpfs-dir         : " << ermia::config::tmpfs_dir << std::endl;
   std::cerr << "  tls-alloc         : " << FLAGS_tls_alloc << std::endl;
@@ -404,27 +569,42 @@ int main(int argc, char **argv) {
   if (ermia::config::is_backup_srv()) {
     std::cerr << "  cycles-per-byte   : " << ermia::config::cycles_per_byte << std::endl;
     std::cerr << "  full-replay       : " << ermia::config::full_replay << std::endl;
+    std::cerr << "  log-ship-hash-replay : " << ermia::config::log_ship_hash_replay << std::endl;
     std::cerr << "  log-ship-warm-up  : " << FLAGS_log_ship_warm_up << std::endl;
     std::cerr << "  persist-nvram-on-replay : " << ermia::config::persist_nvram_on_replay << std::endl;
+    std::cerr << "  promote-on-primary-loss : " << ermia::config::promote_on_primary_loss << std::endl;
     std::cerr << "  quick-bench-start : " << ermia::config::quick_bench_start << std::endl;
     std::cerr << "  replay-policy     : " << FLAGS_replay_policy << std::endl;
     std::cerr << "  replay-threads    : " << ermia::config::replay_threads << std::endl;
     std::cerr << "  wait-for-primary  : " << ermia::config::wait_for_primary << std::endl;
   } else {
     std::cerr << "  backoff-txns      : " << FLAGS_backoff_aborted_transactions << std::endl;
+    std::cerr << "  bootstrap-chunk   : " << ermia::config::bootstrap_chunk_mb << "MB" << std::endl;
+    std::cerr << "  bootstrap-streams : " << ermia::config::bootstrap_streams << std::endl;
+    std::cerr << "  chkpt-buffer      : " << ermia::config::chkpt_buffer_mb << "MB x 3 per thread" << std::endl;
     std::cerr << "  chkpt-interval    : " << ermia::config::chkpt_interval << std::endl;
+    std::cerr << "  chkpt-io-limit    : " << ermia::config::chkpt_io_mbps << "MB/s" << std::endl;
+    std::cerr << "  chkpt-max-deltas  : " << ermia::config::chkpt_max_deltas << std::endl;
+    std::cerr << "  chkpt-threads     : " << ermia::config::chkpt_threads << std::endl;
     std::cerr << "  commit-queue      : " << ermia::config::group_commit_queue_length << std::endl;
     std::cerr << "  enable-chkpt      : " << ermia::config::enable_chkpt << std::endl;
     std::cerr << "  enable-gc         : " << ermia::config::enable_gc << std::endl;
     std::cerr << "  group-commit      : " << ermia::config::group_commit << std::endl;
     std::cerr << "  group-commit-size : " << ermia::config::group_commit_size_kb << "KB" << std::endl;
     std::cerr << "  log-key-for-update: " << ermia::config::log_key_for_update << std::endl;
+    std::cerr << "  log-ship-shm      : " << ermia::config::log_ship_shm;
+    if (ermia::config::log_ship_shm) {
+      std::cerr << " (" << ermia::config::log_ship_shm_mb << "MB ring)";
+    }
+    std::cerr << std::endl;
     std::cerr << "  null-log-device   : " << ermia::config::null_log_device << std::endl;
     std::cerr << "  num-backups       : " << ermia::config::num_backups << std::endl;
     std::cerr << "  parallel-loading: : " << ermia::config::parallel_loading << std::endl;
     std::cerr << "  recovery-warm-up  : " << FLAGS_recovery_warm_up << std::endl;
     std::cerr << "  retry-txns        : " << FLAGS_retry_aborted_transactions << std::endl;
     std::cerr << "  scale-factor      : " << FLAGS_scale_factor << std::endl;
+    std::cerr << "  ship-fanout       : " << ermia::config::ship_fanout << std::endl;
+    std::cerr << "  ship-quorum       : " << ermia::config::ship_quorum << std::endl;
     std::cerr << "  truncate-at-bench-start : " << ermia::config::truncate_at_bench_start << std::endl;
     std::cerr << "  wait-for-backups  : " << ermia::config::wait_for_backups << std::endl;
   }
@@ -513,6 +513,13 @@ rc_t tpcc_worker::txn_order_status() {
   const uint64_t read_only_mask =
       ermia::config::enable_safesnap ? ermia::transaction::TXN_FLAG_READ_ONLY : 0;
   ermia::transaction *txn = db->NewTransaction(read_only_mask, *arena, txn_buf());
+  if (ermia::config::is_backup_srv()) {
+    ermia::TableDescriptor *tables[] = {
+        tbl_customer(warehouse_id)->GetTableDescriptor(),
+        tbl_oorder(warehouse_id)->GetTableDescriptor(),
+        tbl_order_line(warehouse_id)->GetTableDescriptor()};
+    txn->SetReadView(tables, 3);
+  }
   ermia::scoped_str_arena s_arena(arena);
   // NB: since txn_order_status() is a RO txn, we assume that
   // locking is un-necessary (since we can just read from some old snapshot)
@@ -640,6 +647,13 @@ rc_t tpcc_worker::txn_stock_level() {
   const uint64_t read_only_mask =
       ermia::config::enable_safesnap ? ermia::transaction::TXN_FLAG_READ_ONLY : 0;
   ermia::transaction *txn = db->NewTransaction(read_only_mask, *arena, txn_buf());
+  if (ermia::config::is_backup_srv()) {
+    ermia::TableDescriptor *tables[] = {
+        tbl_district(warehouse_id)->GetTableDescriptor(),
+        tbl_order_line(warehouse_id)->GetTableDescriptor(),
+        tbl_stock(warehouse_id)->GetTableDescriptor()};
+    txn->SetReadView(tables, 3);
+  }
   ermia::scoped_str_arena s_arena(arena);
   // NB: since txn_stock_level() is a RO txn, we assume that
   // locking is un-necessary (since we can just read from some old snapshot)
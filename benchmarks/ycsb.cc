@@ -80,8 +80,8 @@ class ycsb_sequential_worker : public ycsb_base_worker {
       rc_t rc = rc_t{RC_INVALID};
       table_index->GetRecord(txn, rc, k, v);  // Read
 
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
-      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
+      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC/OCC
 #else
       // Under SI this must succeed
       ALWAYS_ASSERT(rc._val == RC_TRUE);
@@ -170,15 +170,18 @@ class ycsb_sequential_worker : public ycsb_base_worker {
   // Read-modify-write transaction. Sequential execution only
   rc_t txn_rmw() {
     ermia::transaction *txn = db->NewTransaction(0, *arena, txn_buf());
+    rmw_keys.clear();
     for (uint i = 0; i < g_reps_per_tx; ++i) {
-      ermia::varstr &k = GenerateKey(txn);
+      uint64_t key_id = 0;
+      ermia::varstr &k = GenerateKey(txn, &key_id);
+      rmw_keys.push_back(key_id);
       ermia::varstr &v = str(sizeof(ycsb_kv::value));
       // TODO(tzwang): add read/write_all_fields knobs
       rc_t rc = rc_t{RC_INVALID};
       table_index->GetRecord(txn, rc, k, v);  // Read
 
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
-      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
+      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC/OCC
 #else
       // Under SI this must succeed
       LOG_IF(FATAL, rc._val != RC_TRUE);
@@ -205,8 +208,8 @@ class ycsb_sequential_worker : public ycsb_base_worker {
       rc_t rc = rc_t{RC_INVALID};
       table_index->GetRecord(txn, rc, k, v);  // Read
 
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
-      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
+      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC/OCC
 #else
       // Under SI this must succeed
       ALWAYS_ASSERT(rc._val == RC_TRUE);
@@ -217,6 +220,11 @@ class ycsb_sequential_worker : public ycsb_base_worker {
       memcpy((char*)(&v) + sizeof(ermia::varstr), (char *)v.data(), v.size());
     }
     TryCatch(db->Commit(txn));
+    if (ermia::config::command_log && !ermia::config::is_backup_srv()) {
+      // Only the updated keys; partitioned by the first one
+      ermia::CommandLog::cmd_log->Insert(rmw_keys[0], YCSB_CLID_RMW, rmw_keys.data(),
+                                         rmw_keys.size() * sizeof(uint64_t));
+    }
     return {RC_TRUE};
   }
 
@@ -229,8 +237,8 @@ class ycsb_sequential_worker : public ycsb_base_worker {
       rc = table_index->Scan(txn, range.start_key, &range.end_key, callback);
 
       ALWAYS_ASSERT(callback.size() <= g_scan_max_length);
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
-      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
+      TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC/OCC
 #else
       ALWAYS_ASSERT(rc._val == RC_TRUE);
 #endif
@@ -268,8 +276,8 @@ class ycsb_sequential_worker : public ycsb_base_worker {
               callback.Invoke(iter.key().data(), iter.key().length(), valptr);
             }
           }
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
-        TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
+        TryCatch(rc);  // Might abort if we use SSI/SSN/MVOCC/OCC
 #else
         ALWAYS_ASSERT(rc._val == RC_TRUE);
 #endif
@@ -286,6 +294,7 @@ class ycsb_sequential_worker : public ycsb_base_worker {
   std::vector<ermia::ConcurrentMasstree::AMACState> as;
   std::vector<ermia::varstr *> keys;
   std::vector<ermia::varstr *> values;
+  std::vector<uint64_t> rmw_keys;  // Updated by the current RMW, for the command log
 };
 
 void ycsb_do_test(ermia::Engine *db, int argc, char **argv) {
@@ -32,6 +32,9 @@ enum class ReadTransactionType {
 #define YCSB_VALUE_FIELDS(x, y) x(inline_str_fixed<8>, y_value)
 DO_STRUCT(ycsb_kv, YCSB_KEY_FIELDS, YCSB_VALUE_FIELDS);
 
+// Command log transaction types (index into get_cmdlog_redo_workload())
+#define YCSB_CLID_RMW 0
+
 inline void BuildKey(uint64_t key, ermia::varstr &k) {
   ASSERT (sizeof(ycsb_kv::key) % sizeof(uint64_t) == 0);
   static const char *prefix = "corobase";
@@ -134,12 +137,7 @@ class ycsb_bench_runner : public bench_runner {
     return ret;
   }
 
-  virtual std::vector<bench_worker *> make_cmdlog_redoers() {
-    // Not implemented
-    LOG(FATAL) << "Not applicable";
-    std::vector<bench_worker *> ret;
-    return ret;
-  }
+  virtual std::vector<bench_worker *> make_cmdlog_redoers();
 
   virtual std::vector<bench_worker *> make_workers() {
     util::fast_random r(8544290);
@@ -157,8 +155,9 @@ class ycsb_base_worker : public bench_worker {
  public:
   ycsb_base_worker(unsigned int worker_id, unsigned long seed, ermia::Engine *db,
                    const std::map<std::string, ermia::OrderedIndex *> &open_tables,
-                   spin_barrier *barrier_a, spin_barrier *barrier_b)
-      : bench_worker(worker_id, true, seed, db, open_tables, barrier_a, barrier_b),
+                   spin_barrier *barrier_a, spin_barrier *barrier_b,
+                   bool is_worker = true)
+      : bench_worker(worker_id, is_worker, seed, db, open_tables, barrier_a, barrier_b),
         table_index((ermia::ConcurrentMasstreeIndex*)open_tables.at("USERTABLE")) {
       const unsigned int key_rng_seed = 1237 + worker_id;
       uniform_rng = foedus::assorted::UniformRandom(key_rng_seed);
@@ -213,10 +212,14 @@ class ycsb_base_worker : public bench_worker {
     return r;
   }
 
-  ermia::varstr &GenerateKey(ermia::transaction *t) {
+  ermia::varstr &GenerateKey(ermia::transaction *t, uint64_t *key_id = nullptr) {
     ermia::varstr &k = t ? *t->string_allocator().next(sizeof(ycsb_kv::key)) : str(sizeof(ycsb_kv::key));
     new (&k) ermia::varstr((char *)&k + sizeof(ermia::varstr), sizeof(ycsb_kv::key));
-    ::BuildKey(rng_gen_key(), k);
+    uint64_t id = rng_gen_key();
+    ::BuildKey(id, k);
+    if (key_id) {
+      *key_id = id;
+    }
     return k;
   }
 
@@ -268,3 +271,60 @@ class ycsb_scan_callback : public ermia::OrderedIndex::ScanCallback {
     unsigned char key_buf[sizeof(ycsb_kv::key)];
     unsigned char value_buf[sizeof(ycsb_kv::value)];
 };
+
+#ifndef ADV_COROUTINE
+// Replays RMW transactions from the command log on backups. An RMW's
+// modify step always writes the same value, so the record only needs
+// to carry the keys it updated.
+class ycsb_cmdlog_redoer : public ycsb_base_worker {
+ public:
+  ycsb_cmdlog_redoer(unsigned int worker_id, unsigned long seed, ermia::Engine *db,
+                     const std::map<std::string, ermia::OrderedIndex *> &open_tables)
+    : ycsb_base_worker(worker_id, seed, db, open_tables, nullptr, nullptr, false) {}
+
+  virtual workload_desc_vec get_workload() const override {
+    LOG(FATAL) << "Not applicable";
+  }
+
+  virtual cmdlog_redo_workload_desc_vec get_cmdlog_redo_workload() const override {
+    cmdlog_redo_workload_desc_vec w;
+    w.push_back(cmdlog_redo_workload_desc("RMW", RedoRMW));
+    return w;
+  }
+
+  static rc_t RedoRMW(bench_worker *w, const ermia::CommandLog::LogRecord *r) {
+    return static_cast<ycsb_cmdlog_redoer *>(w)->redo_rmw(r);
+  }
+
+  rc_t redo_rmw(const ermia::CommandLog::LogRecord *r) {
+    const uint64_t *keys = (const uint64_t *)r->params;
+    ermia::transaction *txn = db->NewTransaction(0, *arena, txn_buf());
+    for (uint32_t i = 0; i < r->param_size / sizeof(uint64_t); ++i) {
+      ermia::varstr &k = *txn->string_allocator().next(sizeof(ycsb_kv::key));
+      new (&k) ermia::varstr((char *)&k + sizeof(ermia::varstr), sizeof(ycsb_kv::key));
+      ::BuildKey(keys[i], k);
+      ermia::varstr &v = str(sizeof(ycsb_kv::value));
+      new (&v) ermia::varstr((char *)&v + sizeof(ermia::varstr), sizeof(ycsb_kv::value));
+      new (v.data()) ycsb_kv::value("a");
+      TryCatch(table_index->UpdateRecord(txn, k, v));
+    }
+    TryCatch(db->Commit(txn));
+    return {RC_TRUE};
+  }
+};
+#endif  // ADV_COROUTINE
+
+template<class WorkerType>
+std::vector<bench_worker *> ycsb_bench_runner<WorkerType>::make_cmdlog_redoers() {
+  std::vector<bench_worker *> ret;
+#ifdef ADV_COROUTINE
+  LOG(FATAL) << "Not applicable";
+#else
+  ALWAYS_ASSERT(ermia::config::is_backup_srv() && ermia::config::command_log);
+  util::fast_random r(8544290);
+  for (size_t i = 0; i < ermia::config::replay_threads; i++) {
+    ret.push_back(new ycsb_cmdlog_redoer(i, r.next(), db, open_tables));
+  }
+#endif
+  return ret;
+}
@@ -360,20 +360,29 @@ start_over:
           if (state == TXN::TXN_CMMTD) {
             ASSERT(volatile_read(holder->end));
             ASSERT(owner == holder_xid);
+#ifdef OCC
+            // OCC reads the latest committed version
+            goto handle_visible;
+#else
             if (holder->end < t->xc->begin) {
               goto handle_visible;
             }
             goto handle_invisible;
+#endif
           }
         } else {
           // Already committed, now do visibility test
           ASSERT(cur_obj->GetPersistentAddress().asi_type() == fat_ptr::ASI_LOG ||
                  cur_obj->GetPersistentAddress().asi_type() == fat_ptr::ASI_CHK ||
                  cur_obj->GetPersistentAddress() == NULL_PTR);  // Delete
+#ifdef OCC
+          goto handle_visible;
+#else
           uint64_t lsn_offset = LSN::from_ptr(clsn).offset();
           if (lsn_offset <= t->xc->begin) {
             goto handle_visible;
           }
+#endif
         }
         goto handle_invisible;
       }
@@ -564,20 +573,29 @@ start_over:
           if (state == TXN::TXN_CMMTD) {
             ASSERT(volatile_read(holder->end));
             ASSERT(owner == holder_xid);
+#ifdef OCC
+            // OCC reads the latest committed version
+            goto handle_visible;
+#else
             if (holder->end < t->xc->begin) {
               goto handle_visible;
             }
             goto handle_invisible;
+#endif
           }
         } else {
           // Already committed, now do visibility test
           ASSERT(cur_obj->GetPersistentAddress().asi_type() == fat_ptr::ASI_LOG ||
                  cur_obj->GetPersistentAddress().asi_type() == fat_ptr::ASI_CHK ||
                  cur_obj->GetPersistentAddress() == NULL_PTR);  // Delete
+#ifdef OCC
+          goto handle_visible;
+#else
           uint64_t lsn_offset = LSN::from_ptr(clsn).offset();
           if (lsn_offset <= t->xc->begin) {
             goto handle_visible;
           }
+#endif
         }
         goto handle_invisible;
       }
@@ -774,7 +792,7 @@ forward:
     // check dirty writes
     else {
       ASSERT(clsn.asi_type() == fat_ptr::ASI_LOG);
-#ifndef RC
+#if !defined(RC) && !defined(OCC)
       // First updater wins: if some concurrent tx committed first,
       // I have to abort. Same as in Oracle. Otherwise it's an isolation
       // failure: I can modify concurrent transaction's writes.
@@ -863,6 +881,8 @@ forward:
       } else {  // prev is committed (or precommitted but in post-commit now) head
 #if defined(SSI) || defined(SSN) || defined(MVOCC)
         // TODO
+#elif defined(OCC)
+        volatile_write(prev->sstamp, t->xc->owner.to_ptr());
 #endif
         t->add_to_write_set(tuple_array->get(oid));
         prev_persistent_ptr = prev_obj->GetPersistentAddress();
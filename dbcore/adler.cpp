@@ -344,21 +344,122 @@ adler32_memcpy_sse(char *dest, char const *src, size_t nbytes, uint32_t sofar) {
   return adler32_sse(src, nbytes, sofar, op);
 }
 
+#endif
+
+/* AVX2 kernel, in the style of zlib-ng: each 32-byte step adds the
+   bytes into [vs1] with a sum of absolute differences and their
+   position-weighted sum into [vs2]; the contribution of [a] to [b]
+   accumulates in [vs3] and is scaled by 32 once per block. Blocks are
+   capped at NMAX bytes, the most that can be processed before the
+   32-bit lanes might overflow.
+
+   Compiled with a target attribute and picked at runtime, so the
+   binary does not require AVX2. Unlike the SSE version, there are no
+   alignment requirements for the memcpy variant.
+ */
+#include <immintrin.h>
+
+static size_t const ADLER32_NMAX = 5552;
+
+/* Below this size the scalar head/tail dominates and SSE is faster
+   (see test-adler.cpp).
+ */
+static size_t const ADLER32_AVX2_MIN_BYTES = 256;
+
+__attribute__((target("avx2"))) static uint64_t adler32_avx2_hsum(__m256i v) {
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, v);
+  uint64_t sum = 0;
+  for (int i = 0; i < 8; i++) sum += lanes[i];
+  return sum;
+}
+
+template <bool Copy>
+__attribute__((target("avx2"))) static uint32_t adler32_avx2_impl(
+    char *dest, char const *src, size_t nbytes, uint32_t sofar) {
+  uint64_t a = sofar & 0xffff, b = sofar >> 16;
+  __m256i const weights =
+      _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19,
+                       18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3,
+                       2, 1);
+  __m256i const ones = _mm256_set1_epi16(1);
+  __m256i const zero = _mm256_setzero_si256();
+
+  while (nbytes >= 32) {
+    size_t n = nbytes < ADLER32_NMAX ? nbytes : ADLER32_NMAX;
+    n -= n % 32;
+    nbytes -= n;
+
+    __m256i vs1 = _mm256_setzero_si256(), vs2 = _mm256_setzero_si256();
+    __m256i vs3 = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i const *)(src + i));
+      if (Copy) _mm256_storeu_si256((__m256i *)(dest + i), v);
+      vs3 = _mm256_add_epi32(vs3, vs1);
+      vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+      __m256i w = _mm256_maddubs_epi16(v, weights);
+      vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(w, ones));
+    }
+    vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vs3, 5));
+
+    b += n * a + adler32_avx2_hsum(vs2);
+    a += adler32_avx2_hsum(vs1);
+    a %= MOD_ADLER;
+    b %= MOD_ADLER;
+    src += n;
+    if (Copy) dest += n;
+  }
+
+  for (size_t i = 0; i < nbytes; i++) {
+    if (Copy) dest[i] = src[i];
+    a += (uint8_t)src[i];
+    b += a;
+  }
+  a %= MOD_ADLER;
+  b %= MOD_ADLER;
+  return (b << 16) | a;
+}
+
+bool adler32_avx2_available() {
+  static bool const available = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }();
+  return available;
+}
+
+uint32_t adler32_avx2(char const *data, size_t nbytes, uint32_t sofar) {
+  return adler32_avx2_impl<false>(nullptr, data, nbytes, sofar);
+}
+uint32_t adler32_memcpy_avx2(char *dest, char const *src, size_t nbytes,
+                             uint32_t sofar) {
+  return adler32_avx2_impl<true>(dest, src, nbytes, sofar);
+}
+
 // the globally visible symbols
+#ifdef __SSSE3__
 uint32_t adler32(char const *data, size_t nbytes, uint32_t sofar) {
+  if (nbytes >= ADLER32_AVX2_MIN_BYTES and adler32_avx2_available())
+    return adler32_avx2(data, nbytes, sofar);
   return adler32_sse(data, nbytes, sofar);
 }
 uint32_t adler32_memcpy(char *dest, char const *src, size_t nbytes,
                         uint32_t sofar) {
+  if (nbytes >= ADLER32_AVX2_MIN_BYTES and adler32_avx2_available())
+    return adler32_memcpy_avx2(dest, src, nbytes, sofar);
   return adler32_memcpy_sse(dest, src, nbytes, sofar);
 }
 #else
 #warning SSSE3 not available, falling back to vanilla implementation
 uint32_t adler32(char const *data, size_t nbytes, uint32_t sofar) {
+  if (nbytes >= ADLER32_AVX2_MIN_BYTES and adler32_avx2_available())
+    return adler32_avx2(data, nbytes, sofar);
   return adler32_vanilla(data, nbytes, sofar);
 }
 uint32_t adler32_memcpy(char *dest, char const *src, size_t nbytes,
                         uint32_t sofar) {
+  if (nbytes >= ADLER32_AVX2_MIN_BYTES and adler32_avx2_available())
+    return adler32_memcpy_avx2(dest, src, nbytes, sofar);
   return adler32_memcpy_vanilla(dest, src, nbytes, sofar);
 }
 #endif
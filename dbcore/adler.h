@@ -25,6 +25,11 @@
    bandwidth limitations, or short runs, might eat into that
    throughtput.
 
+   If the CPU supports AVX2 (checked at runtime, the binary does not
+   require it), adler32() and adler32_memcpy() use a 32-byte wide
+   kernel instead, roughly doubling SSE throughput for inputs of a
+   few hundred bytes or more.
+
    WARNING: adler32 is wickedly fast, but has several significant
    weaknesses [1]. Perhaps the most troubling one for our purposes is
    the fact that it performs poorly for small inputs (where "small" is
@@ -49,6 +54,9 @@ uint32_t adler32_vanilla(char const *data, size_t nbytes,
 uint32_t adler32_sse(char const *data, size_t nbytes,
                      uint32_t sofar = ADLER32_CSUM_INIT);
 #endif
+bool adler32_avx2_available();
+uint32_t adler32_avx2(char const *data, size_t nbytes,
+                      uint32_t sofar = ADLER32_CSUM_INIT);
 
 /* Combine two adjacent checksums into a single one and return the
    result. Useful for creating the aggregate checksum that would have
@@ -72,5 +80,7 @@ uint32_t adler32_memcpy_vanilla(char *dest, char const *src, size_t nbytes,
 uint32_t adler32_memcpy_sse(char *dest, char const *src, size_t nbytes,
                             uint32_t sofar = ADLER32_CSUM_INIT);
 #endif
+uint32_t adler32_memcpy_avx2(char *dest, char const *src, size_t nbytes,
+                             uint32_t sofar = ADLER32_CSUM_INIT);
 
 #endif
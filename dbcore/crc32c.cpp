@@ -0,0 +1,193 @@
+/* CRC32C (Castagnoli) checksums.
+
+   The scalar version is the classic byte-at-a-time table lookup. The
+   SSE4.2 version feeds 8-byte words to the crc32 instruction; large
+   inputs are split into three interleaved streams to hide the
+   instruction's 3-cycle latency, and the streams are stitched back
+   together by multiplying with precomputed powers of x.
+
+   Polynomial arithmetic (multmodp/x2nmodp) follows zlib's crc32.c.
+ */
+
+#include "crc32c.h"
+
+#include <cstring>
+
+#include <nmmintrin.h>
+
+// reflected Castagnoli polynomial
+static uint32_t const CRC32C_POLY = 0x82f63b78;
+
+/* Length of each of the three streams in the interleaved SSE4.2 loop;
+   inputs shorter than three strides use a single stream.
+ */
+static size_t const CRC32C_STRIDE = 1024;
+
+/* Multiply a(x) by b(x) modulo p(x), with all three in reflected bit
+   order (x^0 is the most significant bit).
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = uint32_t(1) << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+struct crc32c_tables {
+  uint32_t bytes[256];
+  uint32_t x2n[32];     // x^(2^n) mod p(x)
+  uint32_t stride1;     // x^(8*CRC32C_STRIDE) mod p(x)
+  uint32_t stride2;     // x^(8*2*CRC32C_STRIDE) mod p(x)
+
+  crc32c_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      bytes[i] = c;
+    }
+    uint32_t p = uint32_t(1) << 30;  // x^1
+    x2n[0] = p;
+    for (int n = 1; n < 32; n++) x2n[n] = p = multmodp(p, p);
+    stride1 = x8nmodp(CRC32C_STRIDE);
+    stride2 = x8nmodp(2 * CRC32C_STRIDE);
+  }
+
+  // x^(8*n) mod p(x)
+  uint32_t x8nmodp(size_t n) const {
+    uint32_t p = uint32_t(1) << 31;  // x^0 == 1
+    unsigned k = 3;
+    while (n) {
+      if (n & 1) p = multmodp(x2n[k & 31], p);
+      n >>= 1;
+      k++;
+    }
+    return p;
+  }
+};
+
+static crc32c_tables const &tables() {
+  static crc32c_tables const t;
+  return t;
+}
+
+bool crc32c_hw_available() {
+  static bool const available = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+  }();
+  return available;
+}
+
+uint32_t crc32c_merge(uint32_t left, uint32_t right, size_t right_size) {
+  return multmodp(tables().x8nmodp(right_size), left) ^ right;
+}
+
+/* The kernels below work on the raw (non-inverted) CRC register;
+   the public functions take care of the pre/post conditioning.
+ */
+template <bool Copy>
+static uint32_t crc32c_vanilla_raw(char *dest, char const *src, size_t nbytes,
+                                   uint32_t crc) {
+  uint32_t const *table = tables().bytes;
+  for (size_t i = 0; i < nbytes; i++) {
+    if (Copy) dest[i] = src[i];
+    crc = table[(crc ^ (uint8_t)src[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+template <bool Copy>
+__attribute__((target("sse4.2"))) static uint64_t crc32c_sse42_stream(
+    char *dest, char const *src, size_t nwords, uint64_t crc) {
+  for (size_t i = 0; i < nwords; i++) {
+    uint64_t w;
+    memcpy(&w, src + 8 * i, 8);
+    if (Copy) memcpy(dest + 8 * i, &w, 8);
+    crc = _mm_crc32_u64(crc, w);
+  }
+  return crc;
+}
+
+template <bool Copy>
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42_raw(
+    char *dest, char const *src, size_t nbytes, uint32_t crc) {
+  // single bytes up to the next 8-byte boundary
+  for (; nbytes and ((uintptr_t)src & 0x7); nbytes--) {
+    if (Copy) *dest++ = *src;
+    crc = _mm_crc32_u8(crc, *src++);
+  }
+
+  // three interleaved streams for the bulk of the data
+  crc32c_tables const &t = tables();
+  while (nbytes >= 3 * CRC32C_STRIDE) {
+    uint64_t c0 = crc, c1 = 0, c2 = 0;
+    char const *s = src;
+    char *d = dest;
+    for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, s + i, 8);
+      memcpy(&w1, s + i + CRC32C_STRIDE, 8);
+      memcpy(&w2, s + i + 2 * CRC32C_STRIDE, 8);
+      if (Copy) {
+        memcpy(d + i, &w0, 8);
+        memcpy(d + i + CRC32C_STRIDE, &w1, 8);
+        memcpy(d + i + 2 * CRC32C_STRIDE, &w2, 8);
+      }
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    crc = multmodp(t.stride2, (uint32_t)c0) ^ multmodp(t.stride1, (uint32_t)c1) ^
+          (uint32_t)c2;
+    src += 3 * CRC32C_STRIDE;
+    if (Copy) dest += 3 * CRC32C_STRIDE;
+    nbytes -= 3 * CRC32C_STRIDE;
+  }
+
+  size_t nwords = nbytes / 8;
+  crc = crc32c_sse42_stream<Copy>(dest, src, nwords, crc);
+  src += 8 * nwords;
+  if (Copy) dest += 8 * nwords;
+  nbytes -= 8 * nwords;
+
+  for (; nbytes; nbytes--) {
+    if (Copy) *dest++ = *src;
+    crc = _mm_crc32_u8(crc, *src++);
+  }
+  return crc;
+}
+
+uint32_t crc32c_vanilla(char const *data, size_t nbytes, uint32_t sofar) {
+  return ~crc32c_vanilla_raw<false>(nullptr, data, nbytes, ~sofar);
+}
+
+uint32_t crc32c_memcpy_vanilla(char *dest, char const *src, size_t nbytes,
+                               uint32_t sofar) {
+  return ~crc32c_vanilla_raw<true>(dest, src, nbytes, ~sofar);
+}
+
+uint32_t crc32c_sse42(char const *data, size_t nbytes, uint32_t sofar) {
+  return ~crc32c_sse42_raw<false>(nullptr, data, nbytes, ~sofar);
+}
+
+uint32_t crc32c_memcpy_sse42(char *dest, char const *src, size_t nbytes,
+                             uint32_t sofar) {
+  return ~crc32c_sse42_raw<true>(dest, src, nbytes, ~sofar);
+}
+
+uint32_t crc32c(char const *data, size_t nbytes, uint32_t sofar) {
+  return crc32c_hw_available() ? crc32c_sse42(data, nbytes, sofar)
+                               : crc32c_vanilla(data, nbytes, sofar);
+}
+
+uint32_t crc32c_memcpy(char *dest, char const *src, size_t nbytes,
+                       uint32_t sofar) {
+  return crc32c_hw_available() ? crc32c_memcpy_sse42(dest, src, nbytes, sofar)
+                               : crc32c_memcpy_vanilla(dest, src, nbytes, sofar);
+}
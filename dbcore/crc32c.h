@@ -0,0 +1,52 @@
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stdint.h>
+#include <cstddef>
+
+/* CRC32C (Castagnoli polynomial, as used by iSCSI, ext4 and friends).
+
+   Unlike adler32, CRC32C catches all short bursts and behaves well
+   for the small (sub-kB) inputs that dominate our log blocks, and
+   SSE4.2 computes it in hardware at roughly one 8-byte word per
+   cycle. The scalar fallback is table driven and several times slower.
+
+   The interface mirrors adler.h: checksums can be continued by
+   passing a previous result as [sofar], and two adjacent checksums can
+   be merged as long as the length of the right hand piece is known.
+   Merging costs O(log right_size) carry-less multiplies, so it is
+   cheap enough to use once per log block.
+
+   The hardware kernel is compiled with a target attribute and picked
+   at runtime, so the binary itself does not require SSE4.2.
+ */
+
+static uint32_t const CRC32C_CSUM_INIT = 0;
+
+/* Whether this machine can run the SSE4.2 kernel (checked once via
+   cpuid).
+ */
+bool crc32c_hw_available();
+
+uint32_t crc32c(char const *data, size_t nbytes,
+                uint32_t sofar = CRC32C_CSUM_INIT);
+uint32_t crc32c_vanilla(char const *data, size_t nbytes,
+                        uint32_t sofar = CRC32C_CSUM_INIT);
+uint32_t crc32c_sse42(char const *data, size_t nbytes,
+                      uint32_t sofar = CRC32C_CSUM_INIT);
+
+/* Combine two adjacent checksums into a single one, see adler32_merge.
+ */
+uint32_t crc32c_merge(uint32_t left, uint32_t right, size_t right_size);
+
+/* Compute a checksum and perform a memcpy at the same time. Unlike
+   adler32_memcpy there is no constraint on relative alignment.
+ */
+uint32_t crc32c_memcpy(char *dest, char const *src, size_t nbytes,
+                       uint32_t sofar = CRC32C_CSUM_INIT);
+uint32_t crc32c_memcpy_vanilla(char *dest, char const *src, size_t nbytes,
+                               uint32_t sofar = CRC32C_CSUM_INIT);
+uint32_t crc32c_memcpy_sse42(char *dest, char const *src, size_t nbytes,
+                             uint32_t sofar = CRC32C_CSUM_INIT);
+
+#endif
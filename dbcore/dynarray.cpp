@@ -27,6 +27,7 @@
 #include "sm-config.h"
 
 #include <cerrno>
+#include <mutex>
 
 #include <sys/mman.h>
 
@@ -38,23 +39,57 @@ namespace ermia {
 static_assert(sizeof(dynarray) == DEFAULT_ALIGNMENT,
               "Dynarray is not the expected size");
 
-/* Our implementation is limited to 2**48 bits due to our choice of
-   "page" size and 32-bit size/capacity variables.
+/* Our implementation is limited to 2**44 bytes due to our choice of
+   "page" size and the 28-bit capacity field (the other four bits hold
+   the huge page type).
 
    We actually chose the page size to avoid running afoul of Windows'
    large mapping granularity; it's a nice side benefit that most
    systems have a 48-bit address space (so no point going larger).
  */
-size_t dynarray::max_size() { return size_t(UINT32_MAX) << page_bits(); }
+size_t dynarray::max_size() {
+  return ((size_t(1) << 28) - 1) << page_bits();
+}
 
-dynarray::dynarray() : _capacity(0), _size(0), _data(0) {}
+static const size_t k2MB = size_t(1) << 21;
+static const size_t k1GB = size_t(1) << 30;
+
+static size_t huge_page_size(int hugepage) {
+  switch (hugepage) {
+    case dynarray::kHugePageTransparent:
+    case dynarray::kHugePage2MB:
+      return k2MB;
+    case dynarray::kHugePage1GB:
+      return k1GB;
+    default:
+      return dynarray::page_size();
+  }
+}
 
-dynarray::dynarray(size_t capacity, size_t size) : _size(0) {
-  // round up to the nearest page boundary
-  capacity = align_up(capacity, page_size());
-  size = align_up(size, page_size());
+// Round [size] up to what an array of [hugepage] pages can map: 1GB
+// arrays use 2MB pages for their first GB
+static size_t round_size(int hugepage, size_t size) {
+  if (hugepage == dynarray::kHugePage1GB and size <= k1GB) {
+    return align_up(size, k2MB);
+  }
+  return align_up(size, huge_page_size(hugepage));
+}
 
-  _capacity = capacity >> page_bits();
+// Hugetlb ranges are mapped with MAP_FIXED, which would throw away
+// whatever a concurrent grower mapped there already; growth is rare
+// enough to serialize it
+static std::mutex hugetlb_mutex;
+
+dynarray::dynarray() : _capacity(0), _hugepage(kHugePageNone), _size(0), _data(0) {}
+
+dynarray::dynarray(size_t capacity, size_t size, int hugepage)
+    : _hugepage(hugepage), _size(0) {
+  THROW_IF(hugepage < kHugePageNone or hugepage > kHugePage1GB,
+           illegal_argument, "Invalid huge page type %d", hugepage);
+
+  // round up to the nearest (huge) page boundary
+  capacity = round_size(_hugepage, capacity);
+  size = round_size(_hugepage, size);
 
   THROW_IF(max_size() < capacity, illegal_argument,
            "Requested dynarray capacity is too large (%zd bytes)", capacity);
@@ -63,6 +98,8 @@ dynarray::dynarray(size_t capacity, size_t size) : _size(0) {
       capacity < size, illegal_argument,
       "Dynarray size cannot be larger than its capacity (%zd vs %zd bytes)",
       size, capacity);
+  _capacity = capacity >> page_bits();
+
   /*
     The magical incantation below tells mmap to reserve address
     space within the process without actually allocating any
@@ -75,12 +112,31 @@ dynarray::dynarray(size_t capacity, size_t size) : _size(0) {
     blow everything away by unmapping 0..reserved_size.
 
     Tested on Cygwin/x86_64, Linux-2.6.18/x86 and Solaris-10/Sparc.
-  */
 
+    Hugetlb arrays reserve address space the same way, and map
+    hugetlb pages over it (MAP_FIXED) as they grow. Those mappings
+    reserve their pages from the pool when they are made, so that's
+    where we find out the pool ran dry, rather than with SIGBUS on
+    first touch.
+  */
   int flags = MAP_NORESERVE | MAP_ANON | MAP_PRIVATE;
-  _data = (char *)mmap(0, capacity, PROT_NONE, flags, -1, 0);
-  THROW_IF(_data == MAP_FAILED, os_error, errno,
+  // Over-reserve by one huge page so the start can be aligned to it,
+  // otherwise the kernel can't use huge pages for the first/last bits.
+  size_t unit = huge_page_size(_hugepage);
+  size_t slop = unit > page_size() ? unit : 0;
+  char *raw = (char *)mmap(0, capacity + slop, PROT_NONE, flags, -1, 0);
+  THROW_IF(raw == MAP_FAILED, os_error, errno,
            "Unable to create dynarray with capacity %zd bytes", capacity);
+  _data = (char *)align_up((uintptr_t)raw, unit);
+  if (slop) {
+    size_t head = _data - raw;
+    if (head) munmap(raw, head);
+    if (slop - head) munmap(_data + capacity, slop - head);
+    if (_hugepage == kHugePageTransparent) {
+      int err = madvise(_data, capacity, MADV_HUGEPAGE);
+      LOG_IF(WARNING, err) << "madvise(MADV_HUGEPAGE) failed, errno=" << errno;
+    }
+  }
   DEFER_UNLESS(success, munmap(_data, capacity));
 
   if (size) _adjust_mapping(_size, size, size, true);
@@ -108,17 +164,31 @@ dynarray &dynarray::operator=(dynarray &&victim) noexcept {
 
 void swap(dynarray &a, dynarray &b) noexcept {
   using std::swap;
-  swap(a._capacity, b._capacity);
+  // bitfields can't bind to references
+  uint32_t capacity = a._capacity, hugepage = a._hugepage;
+  a._capacity = b._capacity;
+  a._hugepage = b._hugepage;
+  b._capacity = capacity;
+  b._hugepage = hugepage;
   swap(a._size, b._size);
   swap(a._data, b._data);
 }
 
-size_t dynarray::size() const { return size_t(_size) << page_bits(); }
+size_t dynarray::size() const {
+  return size_t(volatile_read(_size)) << page_bits();
+}
 
 size_t dynarray::capacity() const { return size_t(_capacity) << page_bits(); }
 
+size_t dynarray::growth_unit() const {
+  if (_hugepage == kHugePage1GB and size() < k1GB) {
+    return k2MB;
+  }
+  return huge_page_size(_hugepage);
+}
+
 void dynarray::truncate(size_t new_size) {
-  new_size = align_up(new_size, page_size());
+  new_size = round_size(_hugepage, new_size);
   THROW_IF(size() < new_size, illegal_argument,
            "Attempt to truncate to larger size");
 
@@ -126,8 +196,8 @@ void dynarray::truncate(size_t new_size) {
 }
 
 void dynarray::resize(size_t new_size) {
-  // round up to the nearest page boundary
-  new_size = align_up(new_size, page_size());
+  // round up to the nearest (huge) page boundary
+  new_size = round_size(_hugepage, new_size);
 
   THROW_IF(new_size < size(), illegal_argument,
            "Attempt to resize to a smaller size");
@@ -136,13 +206,22 @@ void dynarray::resize(size_t new_size) {
   _adjust_mapping(size(), new_size, new_size, true);
 }
 
-void dynarray::ensure_size(size_t min_size) {
-  min_size = align_up(min_size, page_size());
-  if (size() < min_size) {
-    resize(min_size + 128 * config::MB);
+void dynarray::ensure_size(size_t min_size, size_t extra) {
+  min_size = round_size(_hugepage, min_size);
+  size_t cur = size();
+  if (cur < min_size) {
+    size_t new_size = round_size(_hugepage, min_size + extra);
+    if (new_size > capacity()) new_size = std::max(min_size, capacity());
+    // Someone else might be growing the array at the same time: remapping
+    // a range that's already RW is harmless and _size only moves forward.
+    _adjust_mapping(cur, new_size, new_size, true);
   }
 }
 
+void dynarray::ensure_size(size_t min_size) {
+  ensure_size(min_size, 128 * config::MB);
+}
+
 void dynarray::_adjust_mapping(size_t begin, size_t end, size_t new_size,
                                bool make_readable) {
   THROW_IF(new_size > capacity(), illegal_argument,
@@ -152,11 +231,82 @@ void dynarray::_adjust_mapping(size_t begin, size_t end, size_t new_size,
   ASSERT(is_aligned(begin, page_size()));
   ASSERT(is_aligned(end, page_size()));
   int prot = make_readable ? (PROT_READ | PROT_WRITE) : PROT_NONE;
+  std::unique_lock<std::mutex> l(hugetlb_mutex, std::defer_lock);
+  if (_is_hugetlb()) {
+    l.lock();
+    if (make_readable) {
+      // Somebody else may have grown the array meanwhile
+      begin = std::max(begin, size());
+      end = std::max(begin, end);
+    }
+  }
   if (begin != end) {
-    int err = mprotect(_data + begin, end - begin, prot);
-    mlock(_data + begin, end - begin);  // prefault the space
-    THROW_IF(err, os_error, errno, "Unable to resize dynarray");
-    _size = new_size >> page_bits();
+    if (_is_hugetlb()) {
+      if (make_readable) {
+        _map_hugetlb(begin, end);
+      } else {
+        _unmap_hugetlb(begin, end);
+      }
+    } else {
+      int err = mprotect(_data + begin, end - begin, prot);
+      THROW_IF(err, os_error, errno, "Unable to resize dynarray");
+      if (make_readable) {
+        // prefault the space
+        mlock(_data + begin, end - begin);
+      }
+    }
+    if (make_readable) {
+      uint32_t pages = new_size >> page_bits();
+      uint32_t old = volatile_read(_size);
+      while (old < pages and not __sync_bool_compare_and_swap(&_size, old, pages)) {
+        old = volatile_read(_size);
+      }
+    } else {
+      _size = new_size >> page_bits();
+    }
   }
 }
+
+void dynarray::_map_hugetlb(size_t begin, size_t end) {
+  static bool warned = false;
+  // 1GB arrays: 2MB pages below 1GB
+  size_t split = _hugepage == kHugePage1GB
+                     ? std::min(std::max(begin, k1GB), end)
+                     : end;
+  struct range {
+    size_t begin, end;
+    int shift;
+  } ranges[] = {{begin, split, 21}, {split, end, 30}};
+  for (auto &r : ranges) {
+    if (r.begin == r.end) {
+      continue;
+    }
+    // Without MAP_NORESERVE the pages are reserved from the pool right
+    // away, and MAP_POPULATE faults them in
+    void *p = mmap(_data + r.begin, r.end - r.begin, PROT_READ | PROT_WRITE,
+                   MAP_FIXED | MAP_ANON | MAP_PRIVATE | MAP_HUGETLB |
+                       MAP_POPULATE | (r.shift << MAP_HUGE_SHIFT),
+                   -1, 0);
+    if (p != MAP_FAILED) {
+      continue;
+    }
+    LOG_IF(WARNING, !warned)
+        << "Unable to map " << (r.end - r.begin) << " bytes of "
+        << (r.shift == 21 ? "2MB" : "1GB") << " hugetlb pages (errno=" << errno
+        << "), using transparent huge pages where the pool runs out";
+    warned = true;
+    p = mmap(_data + r.begin, r.end - r.begin, PROT_READ | PROT_WRITE,
+             MAP_FIXED | MAP_NORESERVE | MAP_ANON | MAP_PRIVATE, -1, 0);
+    THROW_IF(p == MAP_FAILED, os_error, errno, "Unable to resize dynarray");
+    madvise(p, r.end - r.begin, MADV_HUGEPAGE);
+    mlock(p, r.end - r.begin);
+  }
+}
+
+void dynarray::_unmap_hugetlb(size_t begin, size_t end) {
+  // Back to reserved address space, returning the pages to the pool
+  void *p = mmap(_data + begin, end - begin, PROT_NONE,
+                 MAP_FIXED | MAP_NORESERVE | MAP_ANON | MAP_PRIVATE, -1, 0);
+  THROW_IF(p == MAP_FAILED, os_error, errno, "Unable to truncate dynarray");
+}
 }  // namespace ermia
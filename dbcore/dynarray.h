@@ -66,6 +66,21 @@ struct dynarray {
    */
   static size_t max_size();
 
+  /* Backing page types. Transparent asks the kernel (madvise) to back
+     the array with 2MB pages when it can; 2MB/1GB map explicit hugetlb
+     pages, which must be reserved beforehand (vm.nr_hugepages or
+     hugepagesz=1G at boot). Hugetlb pages are taken from the pool as
+     the array grows; a range the pool can't cover falls back to
+     transparent huge pages. 1GB arrays use 2MB pages for their first
+     GB, so small arrays don't each take a whole 1GB page.
+   */
+  enum HugePage {
+    kHugePageNone = 0,
+    kHugePageTransparent = 1,
+    kHugePage2MB = 2,
+    kHugePage1GB = 3,
+  };
+
   /* Create a useless array with maximum capacity of zero bytes. It
      can only become useful by plundering an rvalue reference of a
      useful array.
@@ -76,9 +91,11 @@ struct dynarray {
   dynarray();
 
   /* Create a new array of [size] bytes that can grow to a maximum
-     of [capacity] bytes.
+     of [capacity] bytes, backed by [hugepage] pages. With huge pages
+     both numbers (and every later resize) are rounded up to the
+     growth unit.
   */
-  dynarray(size_t capacity, size_t size = 0);
+  dynarray(size_t capacity, size_t size = 0, int hugepage = kHugePageNone);
 
   ~dynarray();
 
@@ -94,6 +111,12 @@ struct dynarray {
    */
   size_t capacity() const;
 
+  /* The granularity of growth at the current size: the base page size,
+     or the huge page size if the array is backed by huge pages (2MB
+     below 1GB for 1GB arrays).
+   */
+  size_t growth_unit() const;
+
   /* Maps in memory to bring the total to /new_size/ bytes.
    */
   void resize(size_t new_size);
@@ -101,8 +124,14 @@ struct dynarray {
   /* Ensures that at least [new_size] bytes are ready to use.
 
      Unlike resize(), this function accepts any value of [new_size]
-     (doing nothing if the array is already big enough).
+     (doing nothing if the array is already big enough). Concurrent
+     callers are fine: the array only ever grows, so a racing caller
+     that asked for less never shrinks the recorded size.
+
+     [extra] bytes beyond [min_size] are mapped (and prefaulted) in the
+     same call so the next few calls are no-ops.
    */
+  void ensure_size(size_t min_size, size_t extra);
   void ensure_size(size_t min_size);
 
   /* UNSAFE, but useful for debugging */
@@ -127,8 +156,16 @@ struct dynarray {
  private:
   void _adjust_mapping(size_t begin, size_t end, size_t new_size,
                        bool make_readable);
-
-  uint32_t _capacity;
+  void _map_hugetlb(size_t begin, size_t end);
+  void _unmap_hugetlb(size_t begin, size_t end);
+  bool _is_hugetlb() const {
+    return _hugepage == kHugePage2MB or _hugepage == kHugePage1GB;
+  }
+
+  // Four bits of the capacity hold the huge page type, so the
+  // struct stays 16 bytes.
+  uint32_t _capacity : 28;
+  uint32_t _hugepage : 4;
   uint32_t _size;
   char *_data;
 
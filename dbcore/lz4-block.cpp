@@ -0,0 +1,144 @@
+/* LZ4 block format codec, see lz4-block.h.
+
+   A block is a sequence of (literals, match) pairs. Each starts with
+   a token byte: the high nibble is the literal length and the low
+   nibble the match length minus four; a nibble of 15 means "more
+   length bytes follow", each adding up to 255. The literals follow,
+   then a 16-bit little endian offset back into the output. The last
+   sequence has literals only. By convention the last five bytes are
+   always literals and no match starts within the last twelve.
+ */
+
+#include "lz4-block.h"
+
+#include <cstring>
+
+static size_t const LZ4_MIN_MATCH = 4;
+static size_t const LZ4_LAST_LITERALS = 5;
+static size_t const LZ4_MF_LIMIT = 12;
+static size_t const LZ4_MAX_OFFSET = 65535;
+static unsigned const LZ4_HASH_LOG = 12;
+
+static inline uint32_t read32(char const *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Emit a length nibble's extension bytes
+static inline char *put_length(char *op, size_t len) {
+  for (; len >= 255; len -= 255) *op++ = (char)255;
+  *op++ = (char)len;
+  return op;
+}
+
+static inline char *put_literals(char *op, char const *lit, size_t litlen,
+                                 uint8_t match_nibble) {
+  uint8_t token = (uint8_t)((litlen < 15 ? litlen : 15) << 4) | match_nibble;
+  *op++ = (char)token;
+  if (litlen >= 15) op = put_length(op, litlen - 15);
+  if (litlen) memcpy(op, lit, litlen);
+  return op + litlen;
+}
+
+size_t lz4_compress(char const *src, size_t nbytes, char *dest,
+                    size_t capacity) {
+  char *op = dest;
+  char *const oend = dest + capacity;
+  size_t anchor = 0;
+
+  if (nbytes > LZ4_MF_LIMIT) {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    size_t const limit = nbytes - LZ4_MF_LIMIT;
+    size_t const match_limit = nbytes - LZ4_LAST_LITERALS;
+    size_t ip = 0;
+    while (ip < limit) {
+      uint32_t h = lz4_hash(read32(src + ip));
+      size_t cand = table[h];
+      table[h] = (uint32_t)ip;
+      if (cand >= ip or ip - cand > LZ4_MAX_OFFSET or
+          read32(src + cand) != read32(src + ip)) {
+        // Skip faster through incompressible stretches
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      size_t mlen = LZ4_MIN_MATCH;
+      while (ip + mlen < match_limit and src[cand + mlen] == src[ip + mlen])
+        ++mlen;
+
+      size_t litlen = ip - anchor;
+      size_t ml = mlen - LZ4_MIN_MATCH;
+      size_t need = 1 + litlen / 255 + 1 + litlen + 2 + ml / 255 + 1;
+      if ((size_t)(oend - op) < need) return 0;
+      op = put_literals(op, src + anchor, litlen,
+                        (uint8_t)(ml < 15 ? ml : 15));
+      uint16_t off = (uint16_t)(ip - cand);
+      *op++ = (char)(off & 0xff);
+      *op++ = (char)(off >> 8);
+      if (ml >= 15) op = put_length(op, ml - 15);
+
+      ip += mlen;
+      anchor = ip;
+      if (ip < limit) table[lz4_hash(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+    }
+  }
+
+  size_t litlen = nbytes - anchor;
+  if ((size_t)(oend - op) < 1 + litlen / 255 + 1 + litlen) return 0;
+  op = put_literals(op, src + anchor, litlen, 0);
+  return op - dest;
+}
+
+// Read a length extension; false on truncated input
+static inline bool get_length(char const *src, size_t csize, size_t &ip,
+                              size_t &len) {
+  uint8_t b;
+  do {
+    if (ip >= csize) return false;
+    b = (uint8_t)src[ip++];
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+bool lz4_decompress(char const *src, size_t csize, char *dest, size_t nbytes) {
+  size_t ip = 0, op = 0;
+  while (ip < csize) {
+    uint8_t token = (uint8_t)src[ip++];
+
+    size_t litlen = token >> 4;
+    if (litlen == 15 and not get_length(src, csize, ip, litlen)) return false;
+    if (litlen > csize - ip or litlen > nbytes - op) return false;
+    memcpy(dest + op, src + ip, litlen);
+    ip += litlen;
+    op += litlen;
+    if (ip == csize) break;  // the last sequence has no match
+
+    if (csize - ip < 2) return false;
+    size_t off = (uint8_t)src[ip] | ((size_t)(uint8_t)src[ip + 1] << 8);
+    ip += 2;
+    if (off == 0 or off > op) return false;
+
+    size_t mlen = token & 15;
+    if (mlen == 15 and not get_length(src, csize, ip, mlen)) return false;
+    mlen += LZ4_MIN_MATCH;
+    if (mlen > nbytes - op) return false;
+
+    char *d = dest + op;
+    char const *m = d - off;
+    if (off >= mlen) {
+      memcpy(d, m, mlen);
+    } else {
+      // Overlapping copy replicates the last [off] bytes
+      for (size_t i = 0; i < mlen; i++) d[i] = m[i];
+    }
+    op += mlen;
+  }
+  return op == nbytes;
+}
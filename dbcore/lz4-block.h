@@ -0,0 +1,42 @@
+#ifndef __LZ4_BLOCK_H
+#define __LZ4_BLOCK_H
+
+#include <stdint.h>
+#include <cstddef>
+
+/* A small, dependency-free codec for the LZ4 block format.
+
+   Only the raw block format is implemented (no frames, no checksums,
+   no dictionaries); the caller is expected to carry the uncompressed
+   size alongside the compressed bytes. Output is compatible with
+   LZ4_decompress_safe, and our decompressor accepts anything
+   LZ4_compress_default produces.
+
+   The compressor is the classic greedy single-probe matcher with a
+   4K-entry hash table, which trades a few percent of ratio against
+   the reference implementation for simplicity. Log records are
+   dominated by repeated headers, keys and mostly unchanged tuple
+   images, which this handles well.
+ */
+
+/* Worst-case compressed size of [nbytes] of input.
+ */
+inline size_t lz4_compress_bound(size_t nbytes) {
+  return nbytes + nbytes / 255 + 16;
+}
+
+/* Compress [nbytes] from [src] into [dest], which has room for
+   [capacity] bytes. Returns the compressed size, or zero if the
+   result would not fit (use lz4_compress_bound to make sure it does).
+ */
+size_t lz4_compress(char const *src, size_t nbytes, char *dest,
+                    size_t capacity);
+
+/* Decompress [csize] bytes from [src] into [dest], which must receive
+   exactly [nbytes]. Returns false if the input is malformed or does
+   not decompress to exactly [nbytes]; never reads or writes out of
+   bounds.
+ */
+bool lz4_decompress(char const *src, size_t csize, char *dest, size_t nbytes);
+
+#endif
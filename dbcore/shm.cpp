@@ -0,0 +1,287 @@
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "shm.h"
+#include "stopwatch.h"
+
+namespace shm {
+
+// Spin this many times before sleeping; sleepers also wake up on their
+// own after kSleepNs to look again
+static const uint32_t kSpins = 4096;
+static const long kSleepNs = 100 * 1000 * 1000;
+
+static std::string control_name(const std::string& name) {
+  return name + "-ctl";
+}
+
+static void* map(const std::string& name, size_t size, bool create,
+                 bool writable) {
+  int flags = writable ? O_RDWR : O_RDONLY;
+  if (create) {
+    flags |= O_CREAT | O_EXCL;
+  }
+  int fd = shm_open(name.c_str(), flags, 0600);
+  if (fd < 0) {
+    LOG_IF(FATAL, create) << "Unable to create shared memory " << name << ": "
+                          << strerror(errno);
+    return nullptr;
+  }
+  if (create) {
+    LOG_IF(FATAL, ftruncate(fd, size) != 0)
+        << "Unable to size shared memory " << name << ": " << strerror(errno);
+  }
+  void* p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  LOG_IF(FATAL, p == MAP_FAILED)
+      << "Unable to map shared memory " << name << ": " << strerror(errno);
+  return p;
+}
+
+// Sleep on [word] until [ready], telling the other side through [sleeps];
+// false if the other side is no longer [alive] (checked before sleeping)
+template <typename Ready, typename Alive>
+static bool wait_until(std::atomic<uint32_t>& word,
+                       std::atomic<uint32_t>& sleeps, Ready ready,
+                       Alive alive) {
+  for (uint32_t i = 0; i < kSpins; ++i) {
+    if (ready()) {
+      return true;
+    }
+  }
+  bool ok = true;
+  while (true) {
+    // Whoever makes us ready bumps [word] after that, so either we see
+    // it ready below or the futex sees [word] changed
+    uint32_t seq = word.load();
+    sleeps.store(1);
+    if (ready()) {
+      break;
+    }
+    if (!alive()) {
+      ok = false;
+      break;
+    }
+    struct timespec timeout = {0, kSleepNs};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seq,
+            &timeout, nullptr, 0);
+  }
+  sleeps.store(0);
+  return ok;
+}
+
+static bool process_exists(pid_t pid) {
+  return kill(pid, 0) == 0 or errno != ESRCH;
+}
+
+static void notify(std::atomic<uint32_t>& word, std::atomic<uint32_t>& sleeps) {
+  word.fetch_add(1);
+  if (sleeps.load()) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1,
+            nullptr, nullptr, 0);
+  }
+}
+
+ring* ring::create(const std::string& name, uint64_t size) {
+  ALWAYS_ASSERT(size);
+  shm_unlink(name.c_str());
+  shm_unlink(control_name(name).c_str());
+  char* data = (char*)map(name, size, true, true);
+  control* ctl =
+      new (map(control_name(name), sizeof(control), true, true)) control;
+  ctl->size = size;
+  ctl->writer = getpid();
+  ctl->reader = 0;
+  ctl->abandoned = false;
+  ctl->tail = ctl->head = ctl->acks = 0;
+  ctl->tail_seq = ctl->head_seq = 0;
+  ctl->reader_sleeps = ctl->writer_sleeps = 0;
+  return new ring(name, true, ctl, data);
+}
+
+ring* ring::attach(const std::string& name) {
+  control* ctl = (control*)map(control_name(name), sizeof(control), false, true);
+  if (!ctl) {
+    return nullptr;
+  }
+  char* data = (char*)map(name, ctl->size, false, false);
+  if (!data) {
+    munmap(ctl, sizeof(control));
+    return nullptr;
+  }
+  ctl->reader = getpid();
+  return new ring(name, false, ctl, data);
+}
+
+ring::~ring() {
+  munmap(_data, _size);
+  munmap(_ctl, sizeof(control));
+  if (_owner) {
+    shm_unlink(_name.c_str());
+    shm_unlink(control_name(_name).c_str());
+  }
+}
+
+size_t ring::reserve(size_t want, char*& dest) {
+  uint64_t tail = _ctl->tail.load(std::memory_order_relaxed);
+  auto alive = [&] {
+    // Not attached yet counts as alive
+    pid_t reader = _ctl->reader.load();
+    return !_ctl->abandoned.load() and (!reader or process_exists(reader));
+  };
+  if (!wait_until(_ctl->head_seq, _ctl->writer_sleeps,
+                  [&] { return tail - _ctl->head.load() < _size; }, alive)) {
+    return 0;
+  }
+  uint64_t room = _size - (tail - _ctl->head.load());
+  uint64_t pos = tail % _size;
+  dest = _data + pos;
+  return std::min<uint64_t>(want, std::min(room, _size - pos));
+}
+
+void ring::publish(size_t n) {
+  _ctl->tail.store(_ctl->tail.load(std::memory_order_relaxed) + n);
+  notify(_ctl->tail_seq, _ctl->reader_sleeps);
+}
+
+bool ring::write(const void* data, size_t size) {
+  const char* src = (const char*)data;
+  while (size) {
+    char* dest = nullptr;
+    size_t n = reserve(size, dest);
+    if (!n) {
+      return false;
+    }
+    memcpy(dest, src, n);
+    publish(n);
+    src += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ring::write_file(int fd, off_t offset, size_t size) {
+  while (size) {
+    char* dest = nullptr;
+    size_t room = reserve(size, dest);
+    if (!room) {
+      return false;
+    }
+    ssize_t n = pread(fd, dest, room, offset);
+    LOG_IF(FATAL, n <= 0) << "Error reading file to ship: " << errno;
+    publish(n);
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ring::read(void* buf, size_t size) {
+  char* out = (char*)buf;
+  auto alive = [&] {
+    return !_abandoned.load() and process_exists(_ctl->writer);
+  };
+  while (size) {
+    uint64_t head = _ctl->head.load(std::memory_order_relaxed);
+    if (!wait_until(_ctl->tail_seq, _ctl->reader_sleeps,
+                    [&] { return _ctl->tail.load() != head; }, alive)) {
+      return false;
+    }
+    uint64_t pos = head % _size;
+    size_t n = std::min<uint64_t>(
+        size, std::min(_ctl->tail.load() - head, _size - pos));
+    memcpy(out, _data + pos, n);
+    _ctl->head.store(head + n);
+    notify(_ctl->head_seq, _ctl->writer_sleeps);
+    out += n;
+    size -= n;
+  }
+  return true;
+}
+
+void ring::abandon() {
+  _abandoned.store(true);
+  _ctl->abandoned.store(true);
+  // Wakes up the reader like the writer would, and the writer like we
+  // would
+  notify(_ctl->tail_seq, _ctl->reader_sleeps);
+  notify(_ctl->head_seq, _ctl->writer_sleeps);
+}
+
+void ring::ack() { _ctl->acks.fetch_add(1, std::memory_order_release); }
+
+uint64_t ring::acks() { return _ctl->acks.load(std::memory_order_acquire); }
+
+channel::channel(ring* r)
+    : _ring(r), _posted(0), _expected_acks(0), _failed(false), _acks(0) {}
+
+channel::~channel() { delete _ring; }
+
+uint64_t channel::post(const tcp::channel::piece* pieces, uint32_t npieces,
+                       bool expect_ack) {
+  ALWAYS_ASSERT(npieces <= tcp::channel::kMaxPieces);
+  std::unique_lock<std::mutex> pl(_post_mutex);
+  if (failed()) {
+    return ++_posted;
+  }
+  if (expect_ack) {
+    {
+      std::unique_lock<std::mutex> l(_mutex);
+      _ack_posted_ns.push_back(stopwatch_t::now());
+    }
+    _expected_acks.fetch_add(1, std::memory_order_release);
+  }
+  bool ok = true;
+  for (uint32_t i = 0; i < npieces and ok; ++i) {
+    if (pieces[i].file_fd >= 0) {
+      ok = _ring->write_file(pieces[i].file_fd, pieces[i].file_offset,
+                             pieces[i].size);
+    } else {
+      ok = _ring->write(pieces[i].data, pieces[i].size);
+    }
+  }
+  if (!ok) {
+    LOG(ERROR) << "The reader of " << _ring->name()
+               << " is gone, no longer shipping to it";
+    _failed.store(true, std::memory_order_release);
+  }
+  return ++_posted;
+}
+
+uint64_t channel::acks() {
+  uint64_t n = _ring->acks();
+  if (n != _acks.load(std::memory_order_acquire)) {
+    record_acks(n);
+  }
+  return n;
+}
+
+void channel::record_acks(uint64_t acks) {
+  std::unique_lock<std::mutex> l(_mutex);
+  uint64_t now = stopwatch_t::now();
+  for (uint64_t a = _acks.load(std::memory_order_relaxed); a < acks; ++a) {
+    if (!_ack_posted_ns.empty()) {
+      _ack_latency.add((now - _ack_posted_ns.front()) / 1000);
+      _ack_posted_ns.pop_front();
+    }
+  }
+  if (acks > _acks.load(std::memory_order_relaxed)) {
+    _acks.store(acks, std::memory_order_release);
+  }
+}
+
+util::latency_histogram channel::ack_latency() {
+  acks();
+  std::unique_lock<std::mutex> l(_mutex);
+  return _ack_latency;
+}
+}  // namespace shm
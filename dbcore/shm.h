@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "../macros.h"
+#include "../util.h"
+#include "tcp.h"
+
+namespace shm {
+
+/* A byte stream from one process to another on the same host, through
+   shared memory instead of the network stack.
+
+   The data goes around a ring in its own shared memory object, which
+   only the writer maps writable; the reader maps it read-only and
+   copies out of it. How far each side got, the ACKs the reader returns
+   and the futex words the two sleep on live in a separate control
+   object that both map writable. Each side spins for a bit before it
+   goes to sleep, and only wakes the other up if it said it sleeps.
+   A sleeping reader also checks that the writer's process is still
+   there, so it doesn't wait forever for a dead primary; likewise a
+   writer waiting for room checks on the reader, which records its pid
+   when it attaches.
+
+   There must be exactly one writer and one reader.
+ */
+class ring {
+ public:
+  // Writer: create the ring, replacing leftovers of the same [name]
+  static ring* create(const std::string& name, uint64_t size);
+
+  // Reader: map the ring [name], or null if nobody created it here
+  static ring* attach(const std::string& name);
+
+  ~ring();
+
+  inline const std::string& name() { return _name; }
+
+  // Writer: copy [size] bytes in, waiting for room as needed; false if
+  // the reader is gone or abandoned the ring before all of it went in
+  bool write(const void* data, size_t size);
+
+  // Writer: read [size] bytes at [offset] of [fd] into the ring; false
+  // like write()
+  bool write_file(int fd, off_t offset, size_t size);
+
+  // Reader: copy exactly [size] bytes out, waiting for them as needed;
+  // false if the writer is gone or abandon() was called first
+  bool read(void* buf, size_t size);
+
+  // Reader: stop waiting for the writer, from any thread; the writer
+  // stops waiting for us, too
+  void abandon();
+
+  // Reader: acknowledge a message
+  void ack();
+
+  // ACKs the reader returned so far
+  uint64_t acks();
+
+ private:
+  struct control {
+    uint64_t size;
+    pid_t writer;
+    std::atomic<pid_t> reader;  // 0 until the reader attached
+    std::atomic<bool> abandoned;
+    // Bytes written so far, and the futex word the reader waits on
+    std::atomic<uint64_t> tail CACHE_ALIGNED;
+    std::atomic<uint32_t> tail_seq;
+    std::atomic<uint32_t> reader_sleeps;
+    // Bytes read so far, and the futex word the writer waits on
+    std::atomic<uint64_t> head CACHE_ALIGNED;
+    std::atomic<uint32_t> head_seq;
+    std::atomic<uint32_t> writer_sleeps;
+    std::atomic<uint64_t> acks CACHE_ALIGNED;
+  };
+
+  std::string _name;
+  bool _owner;
+  control* _ctl;
+  char* _data;
+  uint64_t _size;
+  std::atomic<bool> _abandoned;
+
+  ring(const std::string& name, bool owner, control* ctl, char* data)
+      : _name(name),
+        _owner(owner),
+        _ctl(ctl),
+        _data(data),
+        _size(ctl->size),
+        _abandoned(false) {}
+
+  // Writer: wait for room, and return where the next (up to) [want]
+  // contiguous bytes go; 0 if the reader is gone
+  size_t reserve(size_t want, char*& dest);
+  void publish(size_t n);
+};
+
+/* The primary's end of a ring to a co-located backup, which looks like
+   a tcp::channel to whoever ships the log.
+
+   Unlike tcp::channel there is no sender thread: post() copies the
+   message into the ring itself (file pieces are read into it), so
+   the pieces may be reused as soon as it returns, and wait_sent() has
+   nothing to wait for. ACK latencies are recorded whenever somebody
+   looks at the ACKs.
+
+   Once the backup is gone the channel fails: posts are dropped and
+   tcp::wait_acks no longer waits for it.
+ */
+class channel {
+ public:
+  // Takes over [r]
+  channel(ring* r);
+  ~channel();
+
+  uint64_t post(const tcp::channel::piece* pieces, uint32_t npieces,
+                bool expect_ack);
+  inline void wait_sent(uint64_t seq) { MARK_REFERENCED(seq); }
+
+  uint64_t acks();
+  inline uint64_t expected_acks() {
+    return _expected_acks.load(std::memory_order_acquire);
+  }
+  inline bool failed() { return _failed.load(std::memory_order_acquire); }
+
+  // ACK latencies (in microseconds) so far
+  util::latency_histogram ack_latency();
+
+ private:
+  ring* _ring;
+  std::mutex _post_mutex;  // one writer at a time
+  uint64_t _posted;
+  std::atomic<uint64_t> _expected_acks;
+  std::atomic<bool> _failed;
+  std::mutex _mutex;  // protects the rest
+  std::atomic<uint64_t> _acks;
+  std::deque<uint64_t> _ack_posted_ns;  // of messages not yet ACKed
+  util::latency_histogram _ack_latency;
+
+  void record_acks(uint64_t acks);
+};
+}  // namespace shm
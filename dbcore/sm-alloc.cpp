@@ -3,6 +3,7 @@
 #include <sys/mman.h>
 
 #include <atomic>
+#include <deque>
 #include <future>
 
 #include "sm-alloc.h"
@@ -235,6 +236,23 @@ void deallocate(fat_ptr p) {
   tls_free_object_pool->Put(p);
 }
 
+// Versions unlinked by this thread, with the epoch they were unlinked in
+static thread_local std::deque<std::pair<fat_ptr, epoch_num>> *tls_unlinked;
+
+void deallocate_after_epoch(fat_ptr p, epoch_num e) {
+  if (!tls_unlinked) {
+    tls_unlinked = new std::deque<std::pair<fat_ptr, epoch_num>>;
+  }
+  tls_unlinked->emplace_back(p, e);
+  // Readers might still visit a version unlinked in epoch N until epoch N+2,
+  // which is gone once gc_epoch gets there
+  epoch_num safe = volatile_read(gc_epoch);
+  while (!tls_unlinked->empty() and tls_unlinked->front().second + 2 <= safe) {
+    deallocate(tls_unlinked->front().first);
+    tls_unlinked->pop_front();
+  }
+}
+
 // epoch mgr callbacks
 void global_init(void *) {
   volatile_write(gc_lsn, 0);
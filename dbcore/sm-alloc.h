@@ -106,6 +106,9 @@ struct thread_data {
 void prepare_node_memory();
 void *allocate(size_t size);
 void deallocate(fat_ptr p);
+// Recycle [p], unlinked from its version chain in epoch [e], once readers
+// that might still be on it are gone (see gc_lsn)
+void deallocate_after_epoch(fat_ptr p, epoch_num e);
 void *allocate_onnode(size_t size);
 epoch_mgr::tls_storage *get_tls(void *);
 void global_init(void *);
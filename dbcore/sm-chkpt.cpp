@@ -1,9 +1,14 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <numa.h>
+#include <algorithm>
+#include <functional>
 #include "../ermia.h"
 
 #include "rcu.h"
 #include "sm-chkpt.h"
+#include "stopwatch.h"
+#include "sm-rep.h"
 #include "sm-table.h"
 #include "sm-thread.h"
 
@@ -20,6 +25,181 @@ int sm_chkpt_mgr::base_chkpt_fd = -1;
 
 uint32_t sm_chkpt_mgr::num_recovery_threads = 1;
 
+chkpt_writer::chkpt_writer(uint32_t node, double io_mbps)
+    : _node(node),
+      _io_mbps(io_mbps),
+      _shutdown(false),
+      _buffer_size(size_t{config::chkpt_buffer_mb} * config::MB),
+      _buf_pos(0),
+      _submitted(0),
+      _written(0),
+      _fd(-1),
+      _io_start_ns(0),
+      _io_bytes(0),
+      _stats{} {
+  for (auto& b : _buffers) {
+    b = (char*)numa_alloc_onnode(_buffer_size, _node);
+    LOG_IF(FATAL, !b) << "Unable to allocate checkpoint buffers";
+  }
+  _writer = new std::thread(&chkpt_writer::writer, this);
+}
+
+chkpt_writer::~chkpt_writer() {
+  {
+    std::unique_lock<std::mutex> l(_io_mutex);
+    _shutdown = true;
+    _io_cv.notify_all();
+  }
+  _writer->join();
+  delete _writer;
+  for (auto& b : _buffers) {
+    numa_free(b, _buffer_size);
+  }
+}
+
+void chkpt_writer::open(const char* name) {
+  ASSERT(oidmgr and oidmgr->dfd);
+  // The writer is idle between files
+  std::unique_lock<std::mutex> l(_io_mutex);
+  ASSERT(_written == _submitted and _fd == -1);
+  _fd = os_openat(oidmgr->dfd, name, O_CREAT | O_TRUNC | O_WRONLY);
+  _buf_pos = 0;
+  _io_start_ns = stopwatch_t::now();
+  _io_bytes = 0;
+}
+
+void chkpt_writer::close() {
+  if (_buf_pos) {
+    submit_buffer();
+  }
+  {
+    std::unique_lock<std::mutex> l(_io_mutex);
+    _io_cv.wait(l, [this] { return _written == _submitted; });
+  }
+  os_fsync(_fd);
+  os_close(_fd);
+  _fd = -1;
+}
+
+void chkpt_writer::write_buffer(void* p, size_t s) {
+  char* src = (char*)p;
+  while (s) {
+    if (_buf_pos == _buffer_size) {
+      submit_buffer();
+    }
+    size_t n = std::min(s, _buffer_size - _buf_pos);
+    memcpy(_buffers[_submitted % kNumBuffers] + _buf_pos, src, n);
+    _buf_pos += n;
+    src += n;
+    s -= n;
+  }
+}
+
+void chkpt_writer::submit_buffer() {
+  std::unique_lock<std::mutex> l(_io_mutex);
+  _fill_sizes[_submitted % kNumBuffers] = _buf_pos;
+  _stats.bytes += _buf_pos;
+  ++_submitted;
+  _buf_pos = 0;
+  _io_cv.notify_all();
+  // The buffer to fill next must have been written out
+  if (_submitted - _written >= kNumBuffers) {
+    stopwatch_t sw;
+    _io_cv.wait(l, [this] { return _submitted - _written < kNumBuffers; });
+    _stats.stall_ns += sw.time_ns();
+  }
+}
+
+void chkpt_writer::writer() {
+  if (numa_available() >= 0) {
+    numa_run_on_node(_node);
+  }
+  std::unique_lock<std::mutex> l(_io_mutex);
+  while (true) {
+    _io_cv.wait(l, [this] { return _written < _submitted or _shutdown; });
+    if (_written == _submitted) {
+      break;
+    }
+    char* buf = _buffers[_written % kNumBuffers];
+    size_t size = _fill_sizes[_written % kNumBuffers];
+    int fd = _fd;
+    uint64_t start_ns = _io_start_ns;
+    l.unlock();
+
+    uint64_t throttle_ns = 0;
+    for (size_t off = 0; off < size; off += kIoChunkSize) {
+      size_t n = std::min(kIoChunkSize, size - off);
+      os_write(fd, buf + off, n);
+      _io_bytes += n;
+      if (_io_mbps > 0) {
+        uint64_t due =
+            start_ns + (uint64_t)(_io_bytes * 1e9 / (_io_mbps * config::MB));
+        uint64_t now = stopwatch_t::now();
+        if (now < due) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+          throttle_ns += due - now;
+        }
+      }
+    }
+
+    l.lock();
+    ++_written;
+    _stats.throttle_ns += throttle_ns;
+    _io_cv.notify_all();
+  }
+}
+
+sm_chkpt_mgr::sm_chkpt_mgr(LSN chkpt_begin)
+    : _shutdown(false),
+      _daemon(nullptr),
+      _stats{},
+      _last_cstart(chkpt_begin),
+      _base_chkpt_lsn(chkpt_begin),
+      _full_cstart(chkpt_begin),
+      _num_deltas(0),
+      _need_full(true),
+      _in_progress(false) {
+  // The rate limit is for the whole chkpt
+  uint32_t nodes = numa_available() >= 0 ? numa_max_node() + 1 : 1;
+  for (uint32_t i = 0; i < config::chkpt_threads; ++i) {
+    _writers.push_back(new chkpt_writer(
+        i % nodes, (double)config::chkpt_io_mbps / config::chkpt_threads));
+  }
+}
+
+sm_chkpt_mgr::~sm_chkpt_mgr() {
+  volatile_write(_shutdown, true);
+  take();
+  if (_daemon) {
+    _daemon->join();
+  }
+  stats s = GetStats();
+  for (auto* w : _writers) {
+    delete w;
+  }
+  LOG_IF(INFO, s.checkpoints)
+      << "[Checkpoint] " << s.checkpoints << " checkpoints, "
+      << s.bytes / config::MB << "MB in " << s.ns / 1e6 << "ms ("
+      << (double)s.bytes / config::MB / std::max(s.ns / 1e9, 1e-9)
+      << "MB/s), stalled " << s.stall_ns / 1e6 << "ms, throttled "
+      << s.throttle_ns / 1e6 << "ms";
+}
+
+sm_chkpt_mgr::stats sm_chkpt_mgr::GetStats() {
+  stats s;
+  {
+    std::unique_lock<std::mutex> l(_wait_chkpt_mutex);
+    s = _stats;
+  }
+  for (auto* w : _writers) {
+    chkpt_writer::stats ws = w->GetStats();
+    s.bytes += ws.bytes;
+    s.stall_ns += ws.stall_ns;
+    s.throttle_ns += ws.throttle_ns;
+  }
+  return s;
+}
+
 void sm_chkpt_mgr::take(bool wait) {
   if (wait) {
     std::unique_lock<std::mutex> lock(_wait_chkpt_mutex);
@@ -47,6 +227,8 @@ void sm_chkpt_mgr::do_chkpt() {
     return;
   }
   ASSERT(volatile_read(_in_progress));
+  stopwatch_t sw;
+  uint64_t bytes_before = GetStats().bytes;
   RCU::rcu_enter();
   // Flush before taking the chkpt: after the flush it's guaranteed
   // that all logs before cstart is durable, no holes possible.
@@ -55,10 +237,15 @@ void sm_chkpt_mgr::do_chkpt() {
   auto cstart = logmgr->flush();
   ASSERT(cstart >= _last_cstart);
   if (_last_cstart == cstart) {
+    RCU::rcu_exit();
+    std::unique_lock<std::mutex> l(_wait_chkpt_mutex);
+    _wait_chkpt_cv.notify_all();
+    volatile_write(_in_progress, false);
     return;
   }
-  prepare_file(cstart);
-  oidmgr->PrimaryTakeChkpt();
+  bool full = _need_full or _num_deltas >= config::chkpt_max_deltas;
+  prepare_file(cstart, full);
+  oidmgr->PrimaryTakeChkpt(full ? INVALID_LSN : _last_cstart);
   // FIXME (tzwang): originally we should put info about the chkpt
   // in a log record and then commit that sys transaction that's
   // responsible for doing chkpt. But that would interfere with
@@ -76,63 +263,137 @@ void sm_chkpt_mgr::do_chkpt() {
   //
   // (align_up is there to supress an ASSERT in sm-log-file.cpp when
   // iterating files in the log dir)
-  os_fsync(_fd);
-  os_close(_fd);
   logmgr->update_chkpt_mark(
       cstart, LSN::make(align_up(cstart.offset() + 1), cstart.segment()));
-  scavenge();
+  scavenge(cstart, full);
+  if (full) {
+    _full_cstart = cstart;
+    _num_deltas = 0;
+    _need_full = false;
+  } else {
+    ++_num_deltas;
+  }
+  if (config::log_reclaim) {
+    reclaim_log(cstart);
+  }
   _last_cstart = cstart;
   RCU::rcu_exit();
+  uint64_t ns = sw.time_ns();
+  uint64_t bytes = GetStats().bytes - bytes_before;
   LOG(INFO) << "[Checkpoint] marker: 0x" << std::hex << cstart.offset()
-            << std::dec;
+            << std::dec << (full ? " (full), " : " (incremental), ")
+            << bytes / config::MB << "MB in " << ns / 1e6 << "ms ("
+            << (double)bytes / config::MB / std::max(ns / 1e9, 1e-9)
+            << "MB/s)";
 
   std::unique_lock<std::mutex> l(_wait_chkpt_mutex);
+  ++_stats.checkpoints;
+  _stats.ns += ns;
   _wait_chkpt_cv.notify_all();
   volatile_write(_in_progress, false);
   __sync_synchronize();
 }
 
-void sm_chkpt_mgr::scavenge() {
-  // Don't scavenge the (possibly open) base_chkpt
-  if (_last_cstart > _base_chkpt_lsn) {
-    char buf[CHKPT_DATA_FILE_NAME_BUFSZ];
-    size_t n = os_snprintf(buf, sizeof(buf), CHKPT_DATA_FILE_NAME_FMT,
-                           _last_cstart._val);
-    ASSERT(n < sizeof(buf));
-    ASSERT(oidmgr and oidmgr->dfd);
-    os_unlinkat(oidmgr->dfd, buf);
+// A full chkpt at [cstart] makes every older chkpt file redundant;
+// an incremental one needs all of them back to its full chkpt.
+// Recovery copies everything it reads into memory, so the chain we
+// recovered from can go too. Backups being bootstrapped may still be
+// fetching an older one; it goes with the next full chkpt.
+void sm_chkpt_mgr::scavenge(LSN cstart, bool full) {
+  if (not full) {
+    return;
+  }
+  // Same as for log segments, see rep::AcquireBootstrapHold
+  logmgr->lock_segments();
+  DEFER(logmgr->unlock_segments());
+  if (rep::bootstrap_holds.load(std::memory_order_acquire)) {
+    return;
+  }
+  ASSERT(oidmgr and oidmgr->dfd);
+  std::vector<std::string> stale;
+  dirent_iterator dir(config::log_dir.c_str());
+  for (char const* fname : dir) {
+    // Manifests and their chunk files alike
+    uint64_t lsn_val = 0;
+    if (sscanf(fname, CHKPT_DATA_FILE_NAME_FMT, &lsn_val) == 1 or
+        sscanf(fname, CHKPT_DELTA_FILE_NAME_FMT, &lsn_val) == 1) {
+      if (lsn_val < cstart._val) {
+        stale.emplace_back(fname);
+      }
+    }
+  }
+  for (auto& fname : stale) {
+    os_unlinkat(oidmgr->dfd, fname.c_str());
   }
 }
 
-void sm_chkpt_mgr::prepare_file(LSN cstart) {
-  char buf[CHKPT_DATA_FILE_NAME_BUFSZ];
-  size_t n =
-      os_snprintf(buf, sizeof(buf), CHKPT_DATA_FILE_NAME_FMT, cstart._val);
-  ASSERT(n < sizeof(buf));
-  ASSERT(oidmgr and oidmgr->dfd);
-  _fd = os_openat(oidmgr->dfd, buf, O_CREAT | O_WRONLY);
-  _buf_pos = _dur_pos = 0;
+// Drop the log segments made redundant by the checkpoint at [cstart].
+// Versions are normally memory resident and the checkpoint pinned any
+// that weren't, but versions left in the log by recovery (without
+// eager warm-up) may still be loaded from anywhere after the base
+// checkpoint. Replication may also still need older segments.
+void sm_chkpt_mgr::reclaim_log(LSN cstart) {
+  uint64_t horizon = cstart.offset();
+  if (sm_log::need_recovery and not config::eager_warm_up()) {
+    horizon = std::min(horizon, _base_chkpt_lsn.offset());
+  }
+  if (config::num_backups) {
+    // New backups are brought up from the full chkpt
+    horizon = std::min(horizon, _full_cstart.offset());
+  }
+  // Replication's horizon is read under the segment lock, which
+  // bootstrap holds are taken under too
+  uint32_t n = logmgr->reclaim_segments(horizon, rep::LogRetentionHorizon);
+  if (n) {
+    LOG(INFO) << "[Checkpoint] reclaimed " << n << " log segment(s) before 0x"
+              << std::hex << horizon << std::dec;
+  }
+}
+
+void sm_chkpt_mgr::prepare_file(LSN cstart, bool full) {
+  size_t n = os_snprintf(
+      _name, sizeof(_name),
+      full ? CHKPT_DATA_FILE_NAME_FMT : CHKPT_DELTA_FILE_NAME_FMT, cstart._val);
+  ASSERT(n < sizeof(_name));
 }
 
-void sm_chkpt_mgr::write_buffer(void* p, size_t s) {
-  if (s > kBufferSize) {
-    // Too large, write to file directly
-    sync_buffer();
-    ALWAYS_ASSERT(false);
+chkpt_writer* sm_chkpt_mgr::OpenChunk(uint32_t i) {
+  ASSERT(i < _writers.size());
+  if (_writers.size() == 1) {
+    _writers[0]->open(_name);
   } else {
-    if (_buf_pos + s > kBufferSize) {
-      sync_buffer();
-      _buf_pos = _dur_pos = 0;
-    }
-    ASSERT(_buf_pos + s <= kBufferSize);
-    memcpy(_buffer + _buf_pos, p, s);
-    _buf_pos += s;
+    char buf[CHKPT_CHUNK_FILE_NAME_BUFSZ];
+    size_t n = os_snprintf(buf, sizeof(buf), "%s" CHKPT_CHUNK_SUFFIX_FMT,
+                           _name, i);
+    ASSERT(n < sizeof(buf));
+    _writers[i]->open(buf);
   }
+  return _writers[i];
 }
 
-void sm_chkpt_mgr::do_recovery(char* chkpt_name, OID oid_partition,
-                               uint64_t start_offset) {
-#if 0
+void sm_chkpt_mgr::WriteManifest(const char* header, size_t size) {
+  ASSERT(_writers.size() > 1);
+  // [header][number of chunks][node of chunk 0][node of chunk 1]...
+  std::vector<uint32_t> chunks;
+  chunks.push_back(_writers.size());
+  for (auto* w : _writers) {
+    chunks.push_back(w->node());
+  }
+  int fd = os_openat(oidmgr->dfd, _name, O_CREAT | O_TRUNC | O_WRONLY);
+  os_write(fd, header, size);
+  os_write(fd, chunks.data(), chunks.size() * sizeof(uint32_t));
+  os_fsync(fd);
+  os_close(fd);
+}
+
+// Apply the records of one chkpt file (full or incremental), or one
+// of its chunks, that belong to [oid_partition] of [npartitions].
+// Incremental chkpts are applied in order on top of the full one, so a
+// record replaces whatever the OID held.
+void sm_chkpt_mgr::do_recovery(const char* chkpt_name, OID oid_partition,
+                               uint32_t npartitions, uint64_t start_offset) {
+  // Backups may still be fetching it
+  rep::BackupWaitForBootstrapFile(chkpt_name);
   int fd = os_openat(oidmgr->dfd, chkpt_name, O_RDONLY);
   lseek(fd, start_offset, SEEK_SET);
   DEFER(close(fd));
@@ -183,85 +444,258 @@ void sm_chkpt_mgr::do_recovery(char* chkpt_name, OID oid_partition,
 
     // Benchmark code should have already registered the table with the engine
     ALWAYS_ASSERT(TableDescriptor::FidExists(tuple_fid));
-    ALWAYS_ASSERT(TableDescriptor::FidExists(key_fid));
     ALWAYS_ASSERT(oidmgr->file_exists(tuple_fid));
     ALWAYS_ASSERT(oidmgr->file_exists(key_fid));
 
     oid_array* oa = oidmgr->get_array(tuple_fid);
     oid_array* ka = oidmgr->get_array(key_fid);
 
-    // Populate the OID/key array and index
+    // Backups keep no key array, insert to the index right away;
+    // primaries rebuild indexes from the key arrays once the whole
+    // chain is applied (see rebuild_indexes).
     // FIXME(tzwang): support other index types
-    ConcurrentMasstreeIndex* index = (ConcurrentMasstreeIndex *)IndexDescriptor::GetIndex(key_fid);
-    bool is_primary = index->GetDescriptor()->IsPrimary();
+    ConcurrentMasstreeIndex* index = (ConcurrentMasstreeIndex*)
+        TableDescriptor::Get(tuple_fid)->GetPrimaryIndex();
     ALWAYS_ASSERT(index);
     while (1) {
       // Read the OID
       OID o = *(OID*)read_buffer(sizeof(OID));
       nbytes += sizeof(OID);
       if (o == himark) break;
+      bool mine = o % npartitions == oid_partition;
 
-      // Key
+      // Key, zero length for a tombstone
       uint32_t key_size = *(uint32_t*)read_buffer(sizeof(uint32_t));
       nbytes += sizeof(uint32_t);
-      ALWAYS_ASSERT(key_size);
-      if (o % num_recovery_threads == oid_partition) {
-        varstr* key = (varstr*)MM::allocate(sizeof(varstr) + key_size);
-        new (key) varstr((char*)key + sizeof(varstr), key_size);
-        memcpy((void*)key->p, read_buffer(key->l), key->l);
-        ALWAYS_ASSERT(key->size());
-        ALWAYS_ASSERT(
-            index->masstree_.insert_if_absent(*key, o, NULL, 0));
-        if (!config::is_backup_srv()) {
-          oidmgr->oid_put_new(ka, o, fat_ptr::make(key, INVALID_SIZE_CODE));
+      if (key_size == 0) {
+        if (mine) {
+          fat_ptr old = oidmgr->oid_get(oa, o);
+          if (old.offset()) {
+            oidmgr->oid_put(oa, o, NULL_PTR);
+            MM::deallocate(old);
+          }
+          if (!config::is_backup_srv()) {
+            oidmgr->oid_put(ka, o, NULL_PTR);
+          }
         }
-      } else {
-        read_buffer(key_size);
-        // lseek(fd, key_size, SEEK_CUR);
+        continue;
       }
+      char* key_data = read_buffer(key_size);
       nbytes += key_size;
+      if (mine) {
+        varstr* key = nullptr;
+        if (!config::is_backup_srv()) {
+          // Updates keep the key, no need for another copy
+          varstr* old_key = (varstr*)oidmgr->oid_get(ka, o).offset();
+          if (old_key and old_key->size() == key_size and
+              memcmp(old_key->data(), key_data, key_size) == 0) {
+            key = old_key;
+          }
+        }
+        if (!key) {
+          key = (varstr*)MM::allocate(sizeof(varstr) + key_size);
+          new (key) varstr((char*)key + sizeof(varstr), key_size);
+          memcpy((void*)key->p, key_data, key->l);
+          ALWAYS_ASSERT(key->size());
+          if (config::is_backup_srv()) {
+            ALWAYS_ASSERT(sync_wait_coro(
+                index->GetMasstree().insert_if_absent(*key, o, nullptr)));
+          } else {
+            oidmgr->oid_put(ka, o, fat_ptr::make(key, INVALID_SIZE_CODE));
+          }
+        }
+      }
 
-      // Tuple data for primary index only
-      if (is_primary) {
-        // Size code
-        uint8_t size_code = *(uint8_t*)read_buffer(sizeof(uint8_t));
-        nbytes += sizeof(uint8_t);
-        ALWAYS_ASSERT(size_code != INVALID_SIZE_CODE);
-        auto data_size = decode_size_aligned(size_code);
-        if (o % num_recovery_threads == oid_partition) {
-          fat_ptr pdest = fat_ptr::make((uintptr_t)nbytes, size_code,
-                                        fat_ptr::ASI_CHK_FLAG);
-          Object* obj =
-              (Object*)MM::allocate(decode_size_aligned(size_code));
-          new (obj) Object(pdest, NULL_PTR, 0, false);
-          // Pin it regardless - the clsn needs to be comparable with other
-          // versions
-          obj->Pin();
-          ASSERT(obj->GetClsn().offset());
-          oidmgr->oid_put_new(oa, o, fat_ptr::make(obj, size_code, 0));
+      // Size code and the object
+      uint8_t size_code = *(uint8_t*)read_buffer(sizeof(uint8_t));
+      nbytes += sizeof(uint8_t);
+      ALWAYS_ASSERT(size_code != INVALID_SIZE_CODE);
+      auto data_size = decode_size_aligned(size_code);
+      Object* image = (Object*)read_buffer(data_size);
+      nbytes += data_size;
+      if (mine) {
+        // Bring the version in as the only, committed one
+        Object* obj = (Object*)MM::allocate(data_size);
+        new (obj) Object(image->GetPersistentAddress(), NULL_PTR, 0, true);
+        obj->SetClsn(image->GetClsn());
+        memcpy(obj->GetPayload(), image->GetPayload(),
+               data_size - sizeof(Object));
+        ASSERT(obj->GetClsn().asi_type() == fat_ptr::ASI_LOG);
+        fat_ptr old = oidmgr->oid_get(oa, o);
+        oidmgr->oid_put(oa, o, fat_ptr::make(obj, size_code, 0));
+        if (old.offset()) {
+          MM::deallocate(old);
         }
-        read_buffer(data_size);
-        nbytes += data_size;
       }
     }
   }
-#endif
+}
+
+// Primary index bulk load after chkpt recovery, one per table. Thread
+// p first collects the (key, OID) pairs of the p-th slice of the table's
+// OIDs into runs[p] and sorts them. Keys sampled from all runs then cut
+// the key space into one range per thread, so that thread r can merge
+// range r out of all runs and insert it in key order: each thread only
+// touches the few Masstree leaves at the end of its range, and the
+// rightmost leaf splits without moving keys (see leaf::split_into).
+struct sm_chkpt_mgr::index_load {
+  typedef std::pair<varstr*, OID> entry;
+  TableDescriptor* td;
+  OID himark;
+  std::vector<std::vector<entry>> runs;
+  std::vector<varstr*> splitters;  // range r is [r - 1, r)
+
+  static bool less(const entry& a, const entry& b) { return *a.first < *b.first; }
+};
+
+void sm_chkpt_mgr::sort_keys(std::vector<index_load>* loads,
+                             OID oid_partition) {
+  for (auto& l : *loads) {
+    oid_array* oa = l.td->GetTupleArray();
+    oid_array* ka = l.td->GetKeyArray();
+    OID start = (uint64_t)l.himark * oid_partition / num_recovery_threads;
+    OID end = (uint64_t)l.himark * (oid_partition + 1) / num_recovery_threads;
+    auto& run = l.runs[oid_partition];
+    for (OID o = start; o < end; ++o) {
+      varstr* key = (varstr*)oidmgr->oid_get(ka, o).offset();
+      if (key and oidmgr->oid_get(oa, o).offset()) {
+        run.emplace_back(key, o);
+      }
+    }
+    std::sort(run.begin(), run.end(), index_load::less);
+  }
+}
+
+void sm_chkpt_mgr::load_keys(std::vector<index_load>* loads, uint32_t range) {
+  typedef index_load::entry entry;
+  typedef std::vector<entry>::iterator iterator;
+  for (auto& l : *loads) {
+    if (range > l.splitters.size()) {
+      continue;  // too few keys to go around
+    }
+    // FIXME(tzwang): support other index types
+    ConcurrentMasstreeIndex* index =
+        (ConcurrentMasstreeIndex*)l.td->GetPrimaryIndex();
+    ALWAYS_ASSERT(index);
+
+    // Our part of each run
+    std::vector<std::pair<iterator, iterator>> parts;
+    for (auto& run : l.runs) {
+      iterator begin = run.begin(), end = run.end();
+      if (range > 0) {
+        begin = std::lower_bound(run.begin(), run.end(),
+                                 entry(l.splitters[range - 1], 0),
+                                 index_load::less);
+      }
+      if (range < l.splitters.size()) {
+        end = std::lower_bound(begin, run.end(), entry(l.splitters[range], 0),
+                               index_load::less);
+      }
+      if (begin != end) {
+        parts.emplace_back(begin, end);
+      }
+    }
+
+    // Merge them, smallest key on top
+    auto greater = [](const std::pair<iterator, iterator>& a,
+                      const std::pair<iterator, iterator>& b) {
+      return index_load::less(*b.first, *a.first);
+    };
+    std::make_heap(parts.begin(), parts.end(), greater);
+    while (!parts.empty()) {
+      std::pop_heap(parts.begin(), parts.end(), greater);
+      auto& p = parts.back();
+      ALWAYS_ASSERT(sync_wait_coro(index->GetMasstree().insert_if_absent(
+          *p.first->first, p.first->second, nullptr)));
+      if (++p.first == p.second) {
+        parts.pop_back();
+      } else {
+        std::push_heap(parts.begin(), parts.end(), greater);
+      }
+    }
+  }
+}
+
+// Insert every recovered key to its table's primary index, see
+// index_load.
+void sm_chkpt_mgr::rebuild_indexes() {
+  util::scoped_timer t("index_rebuild");
+  static const uint32_t kSamplesPerRun = 64;
+  std::vector<index_load> loads;
+  for (auto& nm : TableDescriptor::name_map) {
+    TableDescriptor* td = nm.second;
+    if (!td->GetTupleArray()) {
+      continue;
+    }
+    auto* alloc = oidmgr->get_allocator(td->GetTupleFid());
+    loads.emplace_back();
+    loads.back().td = td;
+    loads.back().himark = alloc->head.hiwater_mark;
+    loads.back().runs.resize(num_recovery_threads);
+  }
+
+  auto run_all = [&](std::function<void(uint32_t)> fn) {
+    std::vector<thread::Thread*> workers;
+    for (uint32_t i = 0; i < num_recovery_threads; ++i) {
+      auto* t = thread::GetThread(true /* physical */);
+      ALWAYS_ASSERT(t);
+      thread::Thread::Task task = std::bind(fn, i);
+      t->StartTask(task);
+      workers.push_back(t);
+    }
+    for (auto& w : workers) {
+      w->Join();
+      thread::PutThread(w);
+    }
+  };
+
+  run_all([&loads](uint32_t i) { sort_keys(&loads, i); });
+
+  uint64_t nkeys = 0;
+  for (auto& l : loads) {
+    std::vector<index_load::entry> samples;
+    for (auto& run : l.runs) {
+      nkeys += run.size();
+      for (uint32_t i = 0; i < kSamplesPerRun and i < run.size(); ++i) {
+        samples.push_back(run[run.size() * i / kSamplesPerRun]);
+      }
+    }
+    std::sort(samples.begin(), samples.end(), index_load::less);
+    for (uint32_t r = 1; r < num_recovery_threads and !samples.empty(); ++r) {
+      l.splitters.push_back(
+          samples[samples.size() * r / num_recovery_threads].first);
+    }
+  }
+
+  run_all([&loads](uint32_t i) { load_keys(&loads, i); });
+  LOG(INFO) << "[Checkpoint] Loaded " << nkeys << " keys into "
+            << loads.size() << " indexes";
 }
 
 void sm_chkpt_mgr::recover(LSN chkpt_start) {
-#if 0
   util::scoped_timer t("chkpt_recovery");
   // Take the sum to make sure we have threads to to the work
   num_recovery_threads = config::worker_threads + config::replay_threads;
   LOG_IF(FATAL, num_recovery_threads < 1) << "No threads for chkpt recovery";
-  // Find the chkpt file and recover from there
-  char buf[CHKPT_DATA_FILE_NAME_BUFSZ];
-  uint64_t n =
-      os_snprintf(buf, sizeof(buf), CHKPT_DATA_FILE_NAME_FMT, chkpt_start._val);
-  LOG(INFO) << "[CHKPT Recovery] " << buf;
-  ASSERT(n < sizeof(buf));
-  ALWAYS_ASSERT(base_chkpt_fd == -1);
-  base_chkpt_fd = os_openat(oidmgr->dfd, buf, O_RDONLY);
+
+  // Walk the parent links back to the full chkpt
+  std::vector<std::string> chain;
+  for (LSN lsn = chkpt_start; lsn != INVALID_LSN;) {
+    char buf[CHKPT_DATA_FILE_NAME_BUFSZ];
+    os_snprintf(buf, sizeof(buf), CHKPT_DATA_FILE_NAME_FMT, lsn._val);
+    rep::BackupWaitForBootstrapFile(buf);
+    int fd = openat(oidmgr->dfd, buf, O_RDONLY);
+    if (fd < 0) {
+      os_snprintf(buf, sizeof(buf), CHKPT_DELTA_FILE_NAME_FMT, lsn._val);
+      fd = os_openat(oidmgr->dfd, buf, O_RDONLY);
+    }
+    size_t n = os_pread(fd, (char*)&lsn, sizeof(LSN), 0);
+    os_close(fd);
+    THROW_IF(n != sizeof(LSN), log_file_error, "Truncated checkpoint %s", buf);
+    chain.emplace_back(buf);
+  }
+  LOG(INFO) << "[CHKPT Recovery] " << chain.back() << " + "
+            << chain.size() - 1 << " incremental";
 
   // Read a large chunk each time (hopefully we only need it once for the
   // header)
@@ -269,81 +703,138 @@ void sm_chkpt_mgr::recover(LSN chkpt_start) {
   char* buffer = (char*)malloc(kBufferSize);
   DEFER(free(buffer));
 
-  uint64_t file_offset = 0;
-  uint64_t buf_offset = 0;
-  uint64_t cur_buffer_size = read(base_chkpt_fd, buffer, kBufferSize);
-
-  auto read_buffer = [&](uint32_t size) {
-    if (buf_offset + size > cur_buffer_size) {
-      file_offset += buf_offset;
-      lseek(base_chkpt_fd, file_offset, SEEK_SET);
-      cur_buffer_size = read(base_chkpt_fd, buffer, kBufferSize);
-      if (cur_buffer_size == 0) {
-        return (char*)nullptr;
-      }
-      buf_offset = 0;
-    }
-    uint64_t roff = buf_offset;
-    buf_offset += size;
-    return &buffer[roff];
-  };
+  // Oldest first
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    const char* fname = it->c_str();
+    int fd = os_openat(oidmgr->dfd, fname, O_RDONLY);
+    DEFER(os_close(fd));
 
-  // Recover files first from the chkpt header
-  uint32_t nfiles = *(uint32_t*)read_buffer(sizeof(uint32_t));
-  ALWAYS_ASSERT(nfiles);
-  LOG(INFO) << nfiles << " tables";
-  uint64_t nbytes = sizeof(uint32_t);
-
-  for (uint32_t i = 0; i < nfiles; ++i) {
-    // Format: [table name length, table name, table FID, table himark]
-    // Read the table's name
-    size_t len = *(size_t*)read_buffer(sizeof(size_t));
-    ;
-    nbytes += sizeof(size_t);
-    char name_buf[256];
-    memcpy(name_buf, read_buffer(len), len);
-    nbytes += len;
-    std::string name(name_buf, len);
-
-    // FIDs
-    FID tuple_fid = *(FID*)read_buffer(sizeof(FID));
-    ;
-    nbytes += sizeof(FID);
+    uint64_t file_offset = 0;
+    uint64_t buf_offset = 0;
+    uint64_t cur_buffer_size = read(fd, buffer, kBufferSize);
 
-    FID key_fid = *(FID*)read_buffer(sizeof(FID));
-    ;
-    nbytes += sizeof(FID);
+    auto read_buffer = [&](uint32_t size) {
+      if (buf_offset + size > cur_buffer_size) {
+        file_offset += buf_offset;
+        lseek(fd, file_offset, SEEK_SET);
+        cur_buffer_size = read(fd, buffer, kBufferSize);
+        if (cur_buffer_size == 0) {
+          return (char*)nullptr;
+        }
+        buf_offset = 0;
+      }
+      uint64_t roff = buf_offset;
+      buf_offset += size;
+      return &buffer[roff];
+    };
 
-    // High mark
-    OID himark = *(OID*)read_buffer(sizeof(OID));
-    nbytes += sizeof(FID);
+    // Skip the parent, then recover files from the chkpt header
+    read_buffer(sizeof(LSN));
+    uint32_t nfiles = *(uint32_t*)read_buffer(sizeof(uint32_t));
+    ALWAYS_ASSERT(nfiles);
+    LOG(INFO) << fname << ": " << nfiles << " tables";
+    uint64_t nbytes = sizeof(LSN) + sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < nfiles; ++i) {
+      // Format: [table name length, table name, tuple/key FID, himark]
+      size_t len = *(size_t*)read_buffer(sizeof(size_t));
+      nbytes += sizeof(size_t);
+      char name_buf[256];
+      ALWAYS_ASSERT(len <= sizeof(name_buf));
+      memcpy(name_buf, read_buffer(len), len);
+      nbytes += len;
+      std::string name(name_buf, len);
+
+      FID tuple_fid = *(FID*)read_buffer(sizeof(FID));
+      nbytes += sizeof(FID);
+      FID key_fid = *(FID*)read_buffer(sizeof(FID));
+      nbytes += sizeof(FID);
+      OID himark = *(OID*)read_buffer(sizeof(OID));
+      nbytes += sizeof(OID);
 
-    // Benchmark code should have already registered the table with the engine
-    ALWAYS_ASSERT(IndexDescriptor::NameExists(name));
-    ALWAYS_ASSERT(IndexDescriptor::GetIndex(name));
+      // Benchmark code should have already registered the table with the
+      // engine
+      ALWAYS_ASSERT(TableDescriptor::NameExists(name));
+      TableDescriptor* td = TableDescriptor::Get(name);
+      // Checkpoints only carry primary keys, and log recovery doesn't
+      // insert keys on the primary; backups get secondary keys from
+      // the shipped log (see BackupMapIndexes)
+      LOG_IF(FATAL, !config::is_backup_srv() and td->NumSecondaryIndexes())
+          << "Cannot recover " << name
+          << "'s secondary indexes from a checkpoint";
+      if (!oidmgr->file_exists(tuple_fid)) {
+        td->Recover(tuple_fid, key_fid, himark);
+        LOG(INFO) << "[CHKPT Recovery] " << name << "(" << tuple_fid << ", "
+                  << key_fid << ")";
+      } else if (himark > 0) {
+        // Seen in an older chkpt of the chain; it may have grown since
+        ALWAYS_ASSERT(td->GetTupleFid() == tuple_fid);
+        td->GetTupleArray()->ensure_size(himark);
+        oidmgr->get_array(key_fid)->ensure_size(himark);
+        oidmgr->recreate_allocator(tuple_fid, himark);
+      }
+    }
 
-    IndexDescriptor::Get(name)->Recover(tuple_fid, key_fid, himark);
-    LOG(INFO) << "[CHKPT Recovery] " << name << "(" << tuple_fid << ", "
-              << key_fid << ")";
-  }
-  LOG(INFO) << "[Checkpoint] Prepared files";
+    // Chunk table: [number of chunks][node of each], no chunks if the
+    // data follows right here
+    uint32_t nchunks = *(uint32_t*)read_buffer(sizeof(uint32_t));
+    nbytes += sizeof(uint32_t);
+    std::vector<uint32_t> nodes;
+    for (uint32_t i = 0; i < nchunks; ++i) {
+      nodes.push_back(*(uint32_t*)read_buffer(sizeof(uint32_t)));
+    }
 
-  // Now deal with the real data, get many threads to do it in parallel
-  std::vector<thread::Thread*> workers;
-  for (uint32_t i = 0; i < num_recovery_threads; ++i) {
-    auto* t = thread::GetThread(true /* physical */);
-    ALWAYS_ASSERT(t);
-    thread::Thread::Task task = std::bind(&do_recovery, buf, i, nbytes);
-    t->StartTask(task);
-    workers.push_back(t);
+    // Now deal with the real data, get many threads to do it in parallel.
+    // Each chunk is split among threads on the node that wrote it, which
+    // is also where its memory will come from.
+    std::vector<thread::Thread*> workers;
+    std::vector<std::string> chunk_names;
+    if (nchunks == 0) {
+      for (uint32_t i = 0; i < num_recovery_threads; ++i) {
+        auto* t = thread::GetThread(true /* physical */);
+        ALWAYS_ASSERT(t);
+        thread::Thread::Task task =
+            std::bind(&do_recovery, fname, i, num_recovery_threads, nbytes);
+        t->StartTask(task);
+        workers.push_back(t);
+      }
+    } else {
+      uint32_t nparts = std::max<uint32_t>(1, num_recovery_threads / nchunks);
+      for (uint32_t c = 0; c < nchunks; ++c) {
+        char buf[CHKPT_CHUNK_FILE_NAME_BUFSZ];
+        os_snprintf(buf, sizeof(buf), "%s" CHKPT_CHUNK_SUFFIX_FMT, fname, c);
+        chunk_names.emplace_back(buf);
+      }
+      for (uint32_t c = 0; c < nchunks; ++c) {
+        for (uint32_t i = 0; i < nparts; ++i) {
+          thread::Thread* t = nullptr;
+          if (nodes[c] < thread::num_thread_pools or !config::threadpool) {
+            t = thread::GetThread(nodes[c], true /* physical */);
+          }
+          if (!t) {
+            // The node has no threads left (or the chkpt was taken on a
+            // bigger machine), any will do
+            t = thread::GetThread(true /* physical */);
+          }
+          ALWAYS_ASSERT(t);
+          thread::Thread::Task task = std::bind(
+              &do_recovery, chunk_names[c].c_str(), i, nparts, 0);
+          t->StartTask(task);
+          workers.push_back(t);
+        }
+      }
+    }
+
+    for (auto& w : workers) {
+      w->Join();
+      thread::PutThread(w);
+    }
   }
 
-  for (auto& w : workers) {
-    w->Join();
-    thread::PutThread(w);
+  if (!config::is_backup_srv()) {
+    rebuild_indexes();
   }
   LOG(INFO) << "[Checkpoint] Recovered";
-#endif
 }
 
 }  // namespace ermia
@@ -4,6 +4,7 @@
 #include <condition_variable>
 #include <thread>
 #include <mutex>
+#include <vector>
 #include "sm-common.h"
 #include "sm-log-impl.h"
 #include "sm-oid.h"
@@ -11,32 +12,120 @@
 #define CHKPT_DATA_FILE_NAME_FMT "oac-%016zx"
 #define CHKPT_DATA_FILE_NAME_BUFSZ sizeof("chd-0123456789abcdef")
 
+// Incremental chkpt data file, see sm_oid_mgr::PrimaryTakeChkpt
+#define CHKPT_DELTA_FILE_NAME_FMT "oad-%016zx"
+
+// Chunk files of a chkpt taken by multiple threads: manifest name + suffix
+#define CHKPT_CHUNK_SUFFIX_FMT ".%02x"
+#define CHKPT_CHUNK_FILE_NAME_BUFSZ sizeof("chd-0123456789abcdef.00")
+
 namespace ermia {
 
-class sm_chkpt_mgr {
+/* Streams one checkpoint file through kNumBuffers buffers of
+   config::chkpt_buffer_mb each: the producer fills them in turn while
+   a writer thread writes out the full ones in order, so the producer
+   only stalls when all buffers are waiting for I/O. The writer issues
+   writes of at most kIoChunkSize, and paces them to [io_mbps] if set,
+   to bound the checkpoint's share of the device. Both the writer
+   thread and the buffers live on NUMA node [node].
+ */
+class chkpt_writer {
  public:
-  sm_chkpt_mgr(LSN chkpt_begin)
-      : _shutdown(false),
-        _buf_pos(0),
-        _dur_pos(0),
-        _fd(-1),
-        _last_cstart(chkpt_begin),
-        _base_chkpt_lsn(chkpt_begin) {}
-
-  ~sm_chkpt_mgr() {
-    volatile_write(_shutdown, true);
-    take();
-    _daemon->join();
-  }
+  // Cumulative over all files written
+  struct stats {
+    uint64_t bytes;
+    uint64_t stall_ns;     // waiting for a free buffer
+    uint64_t throttle_ns;  // writer sleeping for the I/O rate limit
+  };
+
+  chkpt_writer(uint32_t node, double io_mbps);
+  ~chkpt_writer();
+
+  inline uint32_t node() { return _node; }
 
-  inline void sync_buffer() {
-    if (_buf_pos > _dur_pos) {
-      os_write(_fd, _buffer + _dur_pos, _buf_pos - _dur_pos);
-      _dur_pos = _buf_pos;
+  // Start writing [name] in the log directory, truncating it
+  void open(const char* name);
+
+  // Hand what's buffered to the writer, wait until it's all written,
+  // fsync and close the file
+  void close();
+
+  void write_buffer(void* p, size_t s);
+
+  // Reserve [size] contiguous bytes in the buffer, which must be
+  // filled before the next write_buffer/advance_buffer call
+  inline char* advance_buffer(uint32_t size) {
+    ALWAYS_ASSERT(size <= _buffer_size);
+    if (_buf_pos + size > _buffer_size) {
+      submit_buffer();
     }
-    os_fsync(_fd);
+    char* ret = _buffers[_submitted % kNumBuffers] + _buf_pos;
+    _buf_pos += size;
+    return ret;
+  }
+
+  inline stats GetStats() {
+    std::unique_lock<std::mutex> l(_io_mutex);
+    return _stats;
   }
 
+ private:
+  static const uint32_t kNumBuffers = 3;
+  static const size_t kIoChunkSize = 1024 * 1024;
+
+  uint32_t _node;
+  double _io_mbps;
+  bool _shutdown;
+
+  // Buffer [_submitted % kNumBuffers] is being filled up to _buf_pos;
+  // buffers [_written, _submitted) (mod kNumBuffers) are queued for the
+  // writer, which picks them up under _io_mutex.
+  char* _buffers[kNumBuffers];
+  size_t _buffer_size;
+  size_t _buf_pos;
+  size_t _fill_sizes[kNumBuffers];
+  uint64_t _submitted;
+  uint64_t _written;
+  std::mutex _io_mutex;
+  std::condition_variable _io_cv;
+  std::thread* _writer;
+  int _fd;
+  uint64_t _io_start_ns;  // pacing: when this file's I/O started
+  uint64_t _io_bytes;     // and how much of it was written since
+  stats _stats;
+
+  void submit_buffer();
+  void writer();
+};
+
+/* Checkpoints are taken by config::chkpt_threads producers, each
+   serializing a share of every table's OID ranges through its own
+   chkpt_writer into a chunk file (the manifest's name plus
+   CHKPT_CHUNK_SUFFIX_FMT). Producer i and its writer run on NUMA node
+   i % (number of nodes). Once all chunks are durable the manifest -
+   the oac-/oad- file - is written: the chkpt header (parent and
+   tables, see sm_oid_mgr::PrimaryTakeChkpt) followed by the number of
+   chunks and each chunk's node. With a single producer there are no
+   chunk files: the data follows the header in the manifest itself and
+   the chunk count is zero.
+
+   Recovery loads the chunks of each chkpt in parallel, each on a
+   thread of the node that wrote it.
+ */
+class sm_chkpt_mgr {
+ public:
+  // Cumulative over all checkpoints taken
+  struct stats {
+    uint64_t checkpoints;
+    uint64_t bytes;
+    uint64_t ns;           // from start to marker update
+    uint64_t stall_ns;     // waiting for a free buffer
+    uint64_t throttle_ns;  // writers sleeping for the I/O rate limit
+  };
+
+  sm_chkpt_mgr(LSN chkpt_begin);
+  ~sm_chkpt_mgr();
+
   inline void start_chkpt_thread() {
     ASSERT(logmgr and oidmgr);
     _daemon = new std::thread(&sm_chkpt_mgr::daemon, this);
@@ -45,44 +134,59 @@ class sm_chkpt_mgr {
   void take(bool wait = false);
   void do_chkpt();
   void daemon();
-  void write_buffer(void* p, size_t s);
   static void recover(LSN chkpt_start);
 
-  inline char* advance_buffer(uint32_t size) {
-    if (_buf_pos + size > kBufferSize) {
-      sync_buffer();
-      _buf_pos = _dur_pos = 0;
-    }
-    char* ret = _buffer + _buf_pos;
-    _buf_pos += size;
-    return ret;
-  }
+  inline uint32_t NumChunks() { return _writers.size(); }
+  inline uint32_t ChunkNode(uint32_t i) { return _writers[i]->node(); }
+
+  // Open chunk [i] of the chkpt being taken for writing; with a single
+  // chunk that's the manifest
+  chkpt_writer* OpenChunk(uint32_t i);
+
+  // Durably write the manifest of a multi-chunk chkpt: [header]
+  // followed by the chunk table. All chunks must have been closed.
+  void WriteManifest(const char* header, size_t size);
+
+  inline bool InProgress() { return volatile_read(_in_progress); }
+  stats GetStats();
 
   static int base_chkpt_fd;
   static uint32_t num_recovery_threads;
 
  private:
-  static const size_t kBufferSize = 512 * 1024 * 1024;
-
   bool _shutdown;
   std::thread* _daemon;
   std::mutex _daemon_mutex;
   std::condition_variable _daemon_cv;
-  size_t _buf_pos;
-  size_t _dur_pos;
-  char _buffer[kBufferSize];
-  int _fd;
+
+  std::vector<chkpt_writer*> _writers;
+  char _name[CHKPT_DATA_FILE_NAME_BUFSZ];  // manifest being written
+  stats _stats;                             // checkpoints and ns only
+
   LSN _last_cstart;
   LSN _base_chkpt_lsn;
+
+  // Start of the full chkpt the latest incremental ones build on, and
+  // how many of those there are. Dirty page tracking starts afresh at
+  // startup, so the first chkpt taken is always full.
+  LSN _full_cstart;
+  uint32_t _num_deltas;
+  bool _need_full;
+
   std::condition_variable _wait_chkpt_cv;
   std::mutex _wait_chkpt_mutex;
   bool _in_progress;
   uint32_t _num_recovery_threads;
 
-  void prepare_file(LSN cstart);
-  void scavenge();
-  static void do_recovery(char* chkpt_name, OID oid_partition,
-                          uint64_t start_offset);
+  void prepare_file(LSN cstart, bool full);
+  void scavenge(LSN cstart, bool full);
+  void reclaim_log(LSN cstart);
+  static void do_recovery(const char* chkpt_name, OID oid_partition,
+                          uint32_t npartitions, uint64_t start_offset);
+  struct index_load;
+  static void sort_keys(std::vector<index_load>* loads, OID oid_partition);
+  static void load_keys(std::vector<index_load>* loads, uint32_t range);
+  static void rebuild_indexes();
 };
 
 extern sm_chkpt_mgr* chkptmgr;
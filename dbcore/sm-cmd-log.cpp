@@ -17,7 +17,18 @@ std::mutex redo_mutex;
 uint64_t next_replay_offset[2] CACHE_ALIGNED;
 char *bg_buffer = nullptr;
 
-static const uint32_t kRecordSize = 256;
+// The length of the prefix of [buf] made of whole records
+static uint64_t CompleteRecords(char *buf, uint64_t nbytes) {
+  uint64_t off = 0;
+  while (off + sizeof(LogRecord) <= nbytes) {
+    LogRecord *r = (LogRecord*)&buf[off];
+    if (off + r->size > nbytes) {
+      break;
+    }
+    off += r->size;
+  }
+  return off;
+}
 
 void CommandLogManager::TryFlush() {
   if ((flush_status_.fetch_or(1) & 2) == 2) {
@@ -27,20 +38,44 @@ void CommandLogManager::TryFlush() {
   }
 }
 
-void CommandLogManager::Insert(uint32_t partition_id, uint32_t xct_type) {
-  uint64_t off = allocated_.fetch_add(kRecordSize);
-  uint64_t end_off = off + kRecordSize;
+void CommandLogManager::Insert(uint32_t partition_id, uint32_t xct_type,
+                               const void *params, uint32_t param_size) {
+  uint32_t record_size = LogRecord::RecordSize(param_size);
+  // Background replay reads the log in group_commit_bytes chunks
+  LOG_IF(FATAL, record_size > config::group_commit_bytes ||
+                record_size > buffer_size_ / 2)
+    << "Command log record too large: " << record_size;
 
-  LogRecord *r = (LogRecord*)&buffer_[off % buffer_size_];
-  LOG_IF(FATAL, off % buffer_size_ + kRecordSize > buffer_size_);
-  while (end_off - durable_offset_ > buffer_size_) {
-    TryFlush();
-  }
   uint64_t *myoff = &tls_offsets_[thread::MyId()];
-  volatile_write(*myoff, *myoff | (1UL << 63));
+  uint64_t end_off = 0;
+  while (true) {
+    uint64_t off = allocated_.fetch_add(record_size);
+    end_off = off + record_size;
+    while (end_off - durable_offset_ > buffer_size_) {
+      TryFlush();
+    }
+    volatile_write(*myoff, *myoff | (1UL << 63));
+
+    uint32_t start = off % buffer_size_;
+    if (start + record_size <= buffer_size_) {
+      LogRecord *r = new (&buffer_[start])
+        LogRecord(partition_id, xct_type, record_size, param_size);
+      if (param_size) {
+        memcpy(r->params, params, param_size);
+      }
+      break;
+    }
 
-  new (r) LogRecord(partition_id, xct_type);
-  volatile_write(tls_offsets_[thread::MyId()], end_off);
+    // Records don't wrap around the buffer end (so the flusher and the
+    // redoers never have to reassemble one): fill both pieces with skip
+    // records and try again.
+    uint32_t head = buffer_size_ - start;
+    new (&buffer_[start]) LogRecord(0, LogRecord::kSkipTransaction, head, 0);
+    new (&buffer_[0]) LogRecord(0, LogRecord::kSkipTransaction,
+                                record_size - head, 0);
+    volatile_write(*myoff, end_off);
+  }
+  volatile_write(*myoff, end_off);
 
   if (end_off - durable_offset_ >= config::group_commit_bytes) {
     TryFlush();
@@ -122,6 +157,8 @@ void CommandLogManager::BackgroundReplayDaemon() {
   while (!config::IsShutdown()) {
     if (durable_offset_ >= off + config::group_commit_bytes) {
       uint32_t size = pread(fd, bg_buffer, config::group_commit_bytes, off);
+      // Leave a partially read record to the next round
+      size = CompleteRecords(bg_buffer, size);
       off += size;
       if (size) {
         volatile_write(next_replay_offset[idx], off);
@@ -149,27 +186,10 @@ void CommandLogManager::BackgroundReplay(uint32_t redoer_id, RedoWorkloadFunctio
     }
     idx = (idx + 1) % 2;
 
-    int64_t to_replay = target_offset - last_replayed;
-    uint32_t off = 0;
-    uint32_t size = 0;
-    while (to_replay > 0) {
-      LogRecord *r = (LogRecord*)&bg_buffer[off];
-      LOG_IF(FATAL, bg_buffer + off > bg_buffer + config::group_commit_bytes);
-      off += kRecordSize;
-      uint64_t id = r->partition_id % config::replay_threads;
-      if (id == redoer_id) {
-        // "Redo" it
-        id = r->partition_id;  // Pass the actual partition (warehouse for TPCC)
-        LOG_IF(FATAL, r->partition_id < 1);
-        ASSERT(redo_function);
-        redo_function(r->transaction_type, (void*)id);
-        size += kRecordSize;
-      }
-      to_replay -= kRecordSize;
-      LOG_IF(FATAL, to_replay < 0);
-    }
-    DLOG(INFO) << "Redoer " << redoer_id << ": replayed "
-      << size << " bytes, " << size / kRecordSize << " records";
+    uint32_t size = Replay(bg_buffer, config::group_commit_bytes, 0,
+                           target_offset - last_replayed, redoer_id,
+                           redo_function);
+    DLOG(INFO) << "Redoer " << redoer_id << ": replayed " << size << " bytes";
     last_replayed = target_offset;
     uint64_t n = replayed_offset.fetch_add(size);
     if (n + size == target_offset) {
@@ -202,29 +222,13 @@ void CommandLogManager::BackupRedo(uint32_t redoer_id, RedoWorkloadFunction redo
     }
     idx = (idx + 1) % 2;
 
-    int64_t to_replay = target_offset - last_replayed;
     uint64_t off = volatile_read(last_replayed) % buffer_size_;
-    uint32_t size = 0;
     DLOG(INFO) << "Redoer " << redoer_id << std::hex << " to replay "
       << last_replayed << "-" << target_offset << std::dec;
-    while (to_replay > 0) {
-      LogRecord *r = (LogRecord*)&buffer_[off];
-      LOG_IF(FATAL, buffer_ + off > buffer_ + buffer_size_);
-      off += kRecordSize;
-      uint64_t id = r->partition_id % config::replay_threads;
-      if (id == redoer_id) {
-        // "Redo" it
-        id = r->partition_id;  // Pass the actual partition (warehouse for TPCC)
-        LOG_IF(FATAL, r->partition_id < 1);
-        ASSERT(redo_function);
-        redo_function(r->transaction_type, (void*)id);
-        size += kRecordSize;
-      }
-      to_replay -= kRecordSize;
-      LOG_IF(FATAL, to_replay < 0);
-    }
-    DLOG(INFO) << "Redoer " << redoer_id << ": replayed "
-      << size << " bytes, " << size / kRecordSize << " records";
+    uint32_t size = Replay(buffer_, buffer_size_, off,
+                           target_offset - last_replayed, redoer_id,
+                           redo_function);
+    DLOG(INFO) << "Redoer " << redoer_id << ": replayed " << size << " bytes";
     last_replayed = target_offset;
     uint64_t n = replayed_offset.fetch_add(size);
     if (n + size == target_offset) {
@@ -236,21 +240,50 @@ void CommandLogManager::BackupRedo(uint32_t redoer_id, RedoWorkloadFunction redo
   }
 }
 
+// Replay this redoer's share of the [nbytes] of records at [off] of
+// [buf], wrapping around at [buf_size]. Returns the number of bytes
+// accounted to this redoer; skip records count towards redoer 0.
+uint32_t CommandLogManager::Replay(char *buf, uint64_t buf_size, uint64_t off,
+                                   uint64_t nbytes, uint32_t redoer_id,
+                                   RedoWorkloadFunction &redo_function) {
+  uint32_t size = 0;
+  int64_t to_replay = nbytes;
+  while (to_replay > 0) {
+    LogRecord *r = (LogRecord*)&buf[off];
+    LOG_IF(FATAL, r->size < sizeof(LogRecord) || r->size % LogRecord::kAlignment ||
+                  off + r->size > buf_size)
+      << "Corrupt command log record at " << off;
+    if (r->partition_id % config::replay_threads == redoer_id) {
+      if (r->transaction_type != LogRecord::kSkipTransaction) {
+        ASSERT(redo_function);
+        redo_function(r->transaction_type, r);
+      }
+      size += r->size;
+    }
+    to_replay -= r->size;
+    LOG_IF(FATAL, to_replay < 0);
+    off = (off + r->size) % buf_size;
+  }
+  return size;
+}
+
 void CommandLogManager::ShipLog(char *buf, uint32_t size) {
   ASSERT(config::persist_policy == config::kPersistSync);
   ASSERT(rep::backup_sockfds.size());
   DLOG(INFO) << "Shipping " << size << " bytes";
-  for (int &fd : rep::backup_sockfds) {
-    uint32_t nbytes = send(fd, (char*)&size, sizeof(uint32_t), 0);
-    LOG_IF(FATAL, nbytes != sizeof(uint32_t)) << "Incomplete log shipping (header)";
-    nbytes = send(fd, buf, size, 0);
-    LOG_IF(FATAL, nbytes != size) << "Incomplete log shipping: " << nbytes << "/"
-                                  << size;
+  // Send to backups in parallel with the local write
+  std::vector<std::pair<tcp::channel *, uint64_t>> posted;
+  tcp::channel::piece pieces[] = {{&size, sizeof(uint32_t)}, {buf, size}};
+  for (auto *c : rep::backup_channels) {
+    if (c) {
+      posted.emplace_back(c, c->post(pieces, 2, true));
+    }
   }
   os_pwrite(fd_, buf, size, durable_offset_);
-  for (int &fd : rep::backup_sockfds) {
-    tcp::expect_ack(fd);
+  for (auto &p : posted) {
+    p.first->wait_sent(p.second);
   }
+  rep::WaitForBackupAcksTcp();
 }
 
 void CommandLogManager::FlushDaemon() {
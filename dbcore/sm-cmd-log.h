@@ -12,9 +12,16 @@
 namespace ermia {
 
 /* 
- * A very simple implementation of command logging. Each log record
- * is fixed-size (8 bytes) containing a partition ID and a transaction
- * type (support TPCC so far only).
+ * A simple implementation of command logging. Each log record names a
+ * stored procedure (transaction type, an index into the benchmark's
+ * cmdlog_redo_workload), the partition it belongs to and a
+ * variable-length, procedure-defined parameter blob. Backups replay a
+ * record by calling the procedure's redo function with the record.
+ *
+ * Records are replayed by redoer (partition_id % replay_threads), in
+ * log order within each redoer; procedures whose effects don't
+ * commute must therefore map conflicting commands to the same
+ * partition (e.g., the warehouse in TPC-C).
  */
 namespace CommandLog {
 extern std::atomic<uint64_t> replayed_offset;
@@ -23,18 +30,38 @@ extern std::condition_variable redo_cond;
 extern std::mutex redo_mutex;
 extern uint64_t next_replay_offset[2];
 
-typedef std::function<void(uint32_t, void*)> RedoWorkloadFunction;
-
 struct LogRecord {
   static const uint32_t kInvalidPartition = ~uint32_t{0};
   static const uint32_t kInvalidTransaction = ~uint32_t{0};
 
+  // Fills space no record fits in at the end of the log buffer; not
+  // replayed
+  static const uint32_t kSkipTransaction = ~uint32_t{0} - 1;
+
+  // Record sizes are multiples of this, so a skip record (a bare
+  // header) always fits into the space left at the end of the buffer
+  static const uint32_t kAlignment = 16;
+
   uint32_t partition_id;
   uint32_t transaction_type;
-
-  LogRecord() : partition_id(kInvalidPartition), transaction_type(kInvalidTransaction) {}
-  LogRecord(uint32_t part, uint32_t xct) : partition_id(part), transaction_type(xct) {}
+  uint32_t size;  // of the whole record, including padding
+  uint32_t param_size;
+  char params[];
+
+  LogRecord()
+    : partition_id(kInvalidPartition), transaction_type(kInvalidTransaction),
+      size(sizeof(LogRecord)), param_size(0) {}
+  LogRecord(uint32_t part, uint32_t xct, uint32_t size, uint32_t param_size)
+    : partition_id(part), transaction_type(xct), size(size), param_size(param_size) {}
+
+  static uint32_t RecordSize(uint32_t param_size) {
+    return align_up(sizeof(LogRecord) + param_size, kAlignment);
+  }
 };
+static_assert(sizeof(LogRecord) == LogRecord::kAlignment,
+              "Command log record header must be one alignment unit");
+
+typedef std::function<void(uint32_t, const LogRecord*)> RedoWorkloadFunction;
 
 class CommandLogManager {
 private:
@@ -53,6 +80,8 @@ private:
 
   void ShipLog(char *buf, uint32_t size);
   void Flush(bool check_tls = true);
+  uint32_t Replay(char *buf, uint64_t buf_size, uint64_t off, uint64_t nbytes,
+                  uint32_t redoer_id, RedoWorkloadFunction &redo_function);
 
 public:
   CommandLogManager()
@@ -65,7 +94,7 @@ public:
     // Ensure this so we can blindly flush the whole buffer without worrying
     // about boundaries.
     uint32_t buf_size = config::command_log_buffer_mb * config::MB;
-    LOG_IF(FATAL, buf_size % sizeof(LogRecord) != 0);
+    LOG_IF(FATAL, buf_size % LogRecord::kAlignment != 0);
     buffer_ = (char*)malloc(buf_size);
     memset(buffer_, 0, buf_size);
 
@@ -90,7 +119,12 @@ public:
   uint32_t Size() { return buffer_size_; }
   void BackupFlush(uint64_t new_off);
   void FlushDaemon();
-  void Insert(uint32_t partition_id, uint32_t xct_type);
+
+  // Log a command: stored procedure [xct_type] of [partition_id], with
+  // [param_size] bytes of parameters, which its redo function will
+  // find in LogRecord::params.
+  void Insert(uint32_t partition_id, uint32_t xct_type,
+              const void *params = nullptr, uint32_t param_size = 0);
   inline uint64_t GetTlsOffset() {
     return volatile_read(tls_offsets_[thread::MyId()]);
   }
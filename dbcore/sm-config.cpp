@@ -2,6 +2,7 @@
 #include <numa.h>
 #include "../macros.h"
 #include "sm-config.h"
+#include "dynarray.h"
 #include "sm-log-recover-impl.h"
 #include "sm-thread.h"
 #include <iostream>
@@ -37,6 +38,12 @@ int num_backups = 0;
 std::atomic<uint32_t> num_active_backups(0);
 uint64_t log_buffer_mb = 512;
 uint64_t log_segment_mb = 8192;
+int log_checksum = 0;  // LOG_CHECKSUM_ADLER32
+uint32_t log_streams = 1;
+bool log_uring = false;
+uint32_t log_uring_depth = 8;
+bool log_reclaim = false;
+bool log_recycle_segments = false;
 uint32_t log_redo_partitions = 0;
 std::string log_dir("");
 bool null_log_device = false;
@@ -46,10 +53,14 @@ std::string primary_port("10000");
 bool htt_is_on = true;
 bool physical_workers_only = true;
 bool print_cpu_util = false;
+bool print_footprint = false;
 bool enable_perf = false;
 std::string perf_record_event("");
 uint64_t node_memory_gb = 12;
+int oid_array_hugepage = dynarray::kHugePageNone;
+uint64_t oid_array_prefault_mb = 0;
 bool log_ship_offset_replay = false;
+bool log_ship_hash_replay = false;
 int recovery_warm_up_policy = WARM_UP_NONE;
 int log_ship_warm_up_policy = WARM_UP_NONE;
 bool nvram_log_buffer = false;
@@ -61,20 +72,39 @@ uint64_t group_commit_size_kb = 4096;
 uint64_t group_commit_bytes = 4096 * 1024;
 sm_log_recover_impl *recover_functor = nullptr;
 bool log_ship_by_rdma = false;
+bool log_ship_compress = false;
+uint32_t ship_quorum = 0;
+uint32_t ship_fanout = 0;
+uint32_t bootstrap_streams = 0;
+uint32_t bootstrap_chunk_mb = 64;
+bool log_ship_shm = false;
+uint32_t log_ship_shm_mb = 64;
 bool log_key_for_update = false;
 bool enable_chkpt = 0;
 uint64_t chkpt_interval = 50;
+uint32_t chkpt_max_deltas = 0;
+uint64_t chkpt_buffer_mb = 16;
+uint32_t chkpt_io_mbps = 0;
+uint32_t chkpt_threads = 1;
 bool phantom_prot = 0;
 double cycles_per_byte = 0;
 uint32_t state = kStateLoading;
 int replay_policy = kReplayPipelined;
 bool full_replay = false;
 uint32_t replay_threads = 0;
+bool promote_on_primary_loss = false;
+bool backup_promoted = false;
 uint32_t threads = 0;
 bool persist_nvram_on_replay = true;
 int persist_policy = kPersistSync;
+bool persist_adaptive = false;
+uint32_t persist_latency_us = 1000;
+uint32_t persist_max_lag_mb = 16;
+uint32_t persist_adapt_interval_ms = 100;
 uint32_t read_view_stat_interval_ms;
 std::string read_view_stat_file;
+uint32_t rep_stat_interval_ms = 0;
+std::string rep_stat_dest;
 bool command_log = false;
 uint32_t command_log_buffer_mb = 16;
 bool index_probe_only = false;
@@ -96,6 +126,9 @@ void init() {
   if (num_backups) {
     enable_chkpt = true;
   }
+  if (log_streams == 0) {
+    log_streams = std::min<uint32_t>(numa_nodes, kMaxLogStreams);
+  }
   LOG(INFO) << "Workloads may run on " << numa_nodes << " nodes";
 }
 
@@ -104,13 +137,91 @@ void sanity_check() {
   ALWAYS_ASSERT(recover_functor || is_backup_srv());
   ALWAYS_ASSERT(numa_nodes || !threadpool);
   ALWAYS_ASSERT(not group_commit or group_commit_queue_length);
+  LOG_IF(FATAL, log_streams < 1 or log_streams > kMaxLogStreams)
+      << "Log streams must be between 1 and " << kMaxLogStreams;
+  // Backup bootstrap and shipping move whole segment files around
+  LOG_IF(FATAL, log_streams > 1 and (num_backups or is_backup_srv()))
+      << "Multiple log streams are not supported with log shipping";
+  // RDMA ships by one-sided writes straight into the backup's buffer
+  LOG_IF(FATAL, log_ship_compress and log_ship_by_rdma)
+      << "Log shipping compression is only supported over TCP";
+  LOG_IF(FATAL, ship_quorum and log_ship_by_rdma)
+      << "Acknowledgement quorums are only supported over TCP";
+  LOG_IF(FATAL, ship_quorum > (uint32_t)num_backups)
+      << "The acknowledgement quorum exceeds the number of backups";
+  LOG_IF(FATAL, ship_fanout and (log_ship_by_rdma or command_log))
+      << "Log forwarding is only supported for TCP log shipping";
+  LOG_IF(FATAL, bootstrap_streams and log_ship_by_rdma)
+      << "Multi-stream bootstrap is only supported over TCP";
+  LOG_IF(FATAL, bootstrap_streams > kMaxBootstrapStreams)
+      << "Bootstrap streams must be at most " << kMaxBootstrapStreams;
+  LOG_IF(FATAL, bootstrap_streams and
+                    (bootstrap_chunk_mb == 0 or bootstrap_chunk_mb >= 4096))
+      << "Bootstrap chunks must be between 1MB and 4095MB";
+  // Every backup reads its own ring the primary writes to
+  LOG_IF(FATAL, log_ship_shm and (log_ship_by_rdma or command_log or ship_fanout))
+      << "Shared memory log shipping is not supported with RDMA, the "
+         "command log or log forwarding";
+  LOG_IF(FATAL, log_ship_shm and log_ship_shm_mb == 0)
+      << "Shared memory log shipping needs a ring of at least 1MB";
+  // Adaptive shipping marks batches in the TCP size word and throttles on
+  // ACK counts
+  LOG_IF(FATAL, persist_adaptive and (log_ship_by_rdma or command_log))
+      << "Adaptive persist policy is not supported with RDMA or the "
+         "command log";
+  // Commit latency is only known with group commit
+  LOG_IF(FATAL, persist_adaptive and not group_commit)
+      << "Adaptive persist policy needs group commit";
+  LOG_IF(FATAL, persist_adaptive and
+                    (persist_latency_us == 0 or persist_adapt_interval_ms == 0))
+      << "Adaptive persist policy needs a latency target and interval";
+  LOG_IF(FATAL, persist_adaptive and
+                    persist_max_lag_mb * MB < group_commit_bytes)
+      << "The maximum shipping lag must hold at least one group commit";
+  // The primary only hears from the backups it ships to
+  LOG_IF(FATAL, ship_fanout and ship_quorum > ship_fanout)
+      << "The acknowledgement quorum exceeds the shipping fan-out";
+  LOG_IF(FATAL, log_uring and log_streams > 1)
+      << "The io_uring log writer only supports a single log stream";
+  LOG_IF(FATAL, log_uring and log_uring_depth == 0)
+      << "io_uring log writer needs a queue depth of at least 1";
+  LOG_IF(FATAL, log_recycle_segments and not log_reclaim)
+      << "Segment recycling needs log reclamation";
+  LOG_IF(FATAL, log_reclaim and not enable_chkpt)
+      << "Log reclamation needs checkpoints";
+  LOG_IF(FATAL, chkpt_max_deltas and not enable_chkpt)
+      << "Incremental checkpoints need checkpointing enabled";
+  LOG_IF(FATAL, enable_chkpt and chkpt_buffer_mb == 0)
+      << "Checkpoint buffers must be at least 1MB";
+  LOG_IF(FATAL, chkpt_threads < 1 or chkpt_threads > kMaxChkptThreads)
+      << "Checkpoint threads must be between 1 and " << kMaxChkptThreads;
+  // The single-stream bootstrap ships the chkpt as a single file
+  LOG_IF(FATAL, chkpt_threads > 1 and num_backups and bootstrap_streams == 0)
+      << "Multi-threaded checkpoints need -bootstrap_streams with replication";
+  LOG_IF(FATAL, chkpt_threads > 1 and is_backup_srv())
+      << "Multi-threaded checkpoints are not supported on backups";
+  // Backups read versions from their log at any time (see
+  // oid_get_version_backup)
+  LOG_IF(FATAL, log_reclaim and is_backup_srv())
+      << "Log reclamation is not supported on backups";
   if (is_backup_srv()) {
     // Must have replay threads if replay is wanted
     ALWAYS_ASSERT(replay_policy == kReplayNone || replay_threads > 0);
+    // One thread decodes for the others; background replay goes
+    // through parallel_oid_replay
+    LOG_IF(FATAL, log_ship_hash_replay and replay_threads < 2)
+        << "Hash partitioned replay needs at least two replay threads";
+    LOG_IF(FATAL, log_ship_hash_replay and
+                      (replay_policy == kReplayBackground or command_log))
+        << "Hash partitioned replay only supports sync and pipelined replay";
     if (log_ship_by_rdma) {
       // No RDMA based cmdlog for now
       ALWAYS_ASSERT(!command_log);
     }
+    // The new primary must have replayed everything it got
+    LOG_IF(FATAL, promote_on_primary_loss and
+                      (log_ship_by_rdma or replay_policy == kReplayNone))
+        << "Backup promotion needs TCP log shipping and replay";
   }
 }
 
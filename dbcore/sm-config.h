@@ -34,14 +34,29 @@ extern bool physical_workers_only;
 extern uint32_t state;
 extern bool enable_chkpt;
 extern uint64_t chkpt_interval;
+extern uint32_t chkpt_max_deltas;
+extern uint64_t chkpt_buffer_mb;
+extern uint32_t chkpt_io_mbps;
+extern uint32_t chkpt_threads;
+static const uint32_t kMaxChkptThreads = 64;
 extern uint64_t log_buffer_mb;
 extern uint64_t log_segment_mb;
+extern int log_checksum;
+extern uint32_t log_streams;
+static const uint32_t kMaxLogStreams = 16;
+extern bool log_uring;
+extern uint32_t log_uring_depth;
+extern bool log_reclaim;
+extern bool log_recycle_segments;
 extern std::string log_dir;
 extern uint32_t read_view_stat_interval_ms;
 extern std::string read_view_stat_file;
+extern uint32_t rep_stat_interval_ms;
+extern std::string rep_stat_dest;
 extern bool command_log;
 extern uint32_t command_log_buffer_mb;
 extern bool print_cpu_util;
+extern bool print_footprint;
 extern uint32_t arena_size_mb;
 extern bool enable_perf;
 extern std::string perf_record_event;
@@ -51,6 +66,8 @@ extern bool nvram_log_buffer;
 extern uint32_t nvram_delay_type;
 extern sm_log_recover_impl *recover_functor;
 extern uint64_t node_memory_gb;
+extern int oid_array_hugepage;
+extern uint64_t oid_array_prefault_mb;
 extern bool phantom_prot;
 
 // Primary-specific settings
@@ -74,7 +91,16 @@ extern bool wait_for_primary;
 extern int replay_policy;
 extern uint32_t replay_threads;
 extern bool persist_nvram_on_replay;
+extern bool promote_on_primary_loss;
+// Set once a backup took over as the primary (see rep::BackupTakeOver)
+extern bool backup_promoted;
 extern int persist_policy;
+// Primary: persist_policy is pipelined and rep::PersistPolicyDaemon
+// switches to asynchronous shipping and back as the load changes
+extern bool persist_adaptive;
+extern uint32_t persist_latency_us;
+extern uint32_t persist_max_lag_mb;
+extern uint32_t persist_adapt_interval_ms;
 
 // CoroBase-specific settings
 extern bool index_probe_only;
@@ -91,6 +117,10 @@ extern bool full_replay;
 
 extern bool log_ship_offset_replay;
 
+// Backups: decode each shipped batch once and hand its records to replay
+// threads by (FID, OID) hash (see parallel_hash_replay)
+extern bool log_ship_hash_replay;
+
 // How does the backup replay log records?
 // Sync - replay in the critical path; ack 'persisted' only after replaying
 //        **and** persisted log records
@@ -182,13 +212,23 @@ extern std::string primary_srv;
 extern std::string primary_port;
 extern int log_ship_warm_up_policy;
 extern bool log_ship_by_rdma;
+extern bool log_ship_compress;
+extern uint32_t ship_quorum;
+extern uint32_t ship_fanout;
+extern uint32_t bootstrap_streams;
+static const uint32_t kMaxBootstrapStreams = 64;
+extern uint32_t bootstrap_chunk_mb;
+extern bool log_ship_shm;
+extern uint32_t log_ship_shm_mb;
 extern bool log_key_for_update;
 
 extern bool amac_version_chain;
 
 extern double cycles_per_byte;
 
-inline bool is_backup_srv() { return primary_srv.size(); }
+inline bool is_backup_srv() {
+  return primary_srv.size() and not volatile_read(backup_promoted);
+}
 
 inline bool eager_warm_up() {
   return recovery_warm_up_policy == WARM_UP_EAGER ||
@@ -1,4 +1,9 @@
+#include <numa.h>
+#include <sched.h>
+#include <sys/uio.h>
+
 #include "rcu.h"
+#include "sm-chkpt.h"
 #include "sm-cmd-log.h"
 #include "sm-log-alloc.h"
 #include "sm-rep.h"
@@ -25,6 +30,8 @@ enum { DAEMON_HAS_WORK = 0x1, DAEMON_SLEEPING = 0x2 };
 namespace ermia {
 
 uint64_t sm_log_alloc_mgr::commit_queue::total_latency_us = 0;
+uint64_t sm_log_alloc_mgr::commit_queue::total_commits = 0;
+util::latency_histogram sm_log_alloc_mgr::commit_queue::latency_hist[2];
 
 void sm_log_alloc_mgr::set_tls_lsn_offset(uint64_t offset) {
   volatile_write(_tls_lsn_offset[thread::MyId()], offset);
@@ -42,12 +49,17 @@ uint64_t sm_log_alloc_mgr::get_tls_lsn_offset() {
 sm_log_alloc_mgr::sm_log_alloc_mgr(sm_log_recover_impl *rf, void *rfn_arg)
     : _lm(config::null_log_device ? NULL : rf, rfn_arg),
       _durable_flushed_lsn_offset(_lm.get_durable_mark().offset()),
+      _ship_unacked(false),
+      _shipped_async(false),
       _write_daemon_state(0),
       _waiting_for_durable(false),
       _waiting_for_dmark(false),
       _write_daemon_should_wake(false),
       _write_daemon_should_stop(false),
-      _lsn_offset(_lm.get_durable_mark().offset()) {
+      _lsn_offset(_lm.get_durable_mark().offset()),
+      _lsn_combiners(nullptr),
+      _stream_writers(nullptr),
+      _uring_writer(nullptr) {
   _logbuf_partition_size =
       config::log_buffer_mb * config::MB / config::log_redo_partitions;
   ALWAYS_ASSERT(
@@ -55,30 +67,248 @@ sm_log_alloc_mgr::sm_log_alloc_mgr(sm_log_recover_impl *rf, void *rfn_arg)
   _logbuf = sm_log::get_logbuf();
   _logbuf->_head = _logbuf->_tail = get_starting_byte_offset(&_lm);
   if (!config::is_backup_srv() || (config::command_log && config::replay_threads)) {
-    _tls_lsn_offset =
-        (uint64_t *)malloc(sizeof(uint64_t) * config::MAX_THREADS);
-    memset(_tls_lsn_offset, 0, sizeof(uint64_t) * config::MAX_THREADS);
+    StartLogWriter();
+  }
+}
 
-    uint32_t n = config::is_backup_srv() ? config::replay_threads : config::worker_threads;
-    _commit_queue = new commit_queue[n];
-    for (uint32_t i = 0; i < n; ++i) {
-      _commit_queue[i].lm = this;
-    }
+void sm_log_alloc_mgr::StartLogWriter() {
+  _tls_lsn_offset =
+      (uint64_t *)malloc(sizeof(uint64_t) * config::MAX_THREADS);
+  memset(_tls_lsn_offset, 0, sizeof(uint64_t) * config::MAX_THREADS);
 
-    // fire up the log writing daemon
-    _write_daemon_mutex.lock();
-    DEFER(_write_daemon_mutex.unlock());
+  uint32_t n = config::is_backup_srv() ? config::replay_threads : config::worker_threads;
+  _commit_queue = new commit_queue[n];
+  for (uint32_t i = 0; i < n; ++i) {
+    _commit_queue[i].lm = this;
+  }
+
+  if (config::log_streams > 1) {
+    _lsn_combiners = new lsn_combiner[config::log_streams];
+    _stream_writers = new stream_writer[config::log_streams];
+    for (uint32_t i = 0; i < config::log_streams; ++i) {
+      stream_writer &w = _stream_writers[i];
+      w.lm = this;
+      w.stream = i;
+      w.thread = std::thread(&stream_writer::run, &w);
+    }
+  }
 
-    int err =
-        pthread_create(&_write_daemon_tid, NULL, &log_write_daemon_thunk, this);
-    THROW_IF(err, os_error, err, "Unable to start log writer daemon thread");
+  if (config::log_uring and not config::null_log_device and
+      not config::is_backup_srv()) {
+    if (log_uring_writer::available()) {
+      _uring_writer = new log_uring_writer(
+          &_lm, config::log_uring_depth, _logbuf->window_size());
+    } else {
+      LOG(WARNING) << "io_uring is not available, using blocking log writes";
+      config::log_uring = false;
+    }
   }
+
+  // fire up the log writing daemon
+  _write_daemon_mutex.lock();
+  DEFER(_write_daemon_mutex.unlock());
+
+  int err =
+      pthread_create(&_write_daemon_tid, NULL, &log_write_daemon_thunk, this);
+  THROW_IF(err, os_error, err, "Unable to start log writer daemon thread");
+}
+
+void sm_log_alloc_mgr::BackupPromote() {
+  ASSERT(!config::is_backup_srv());
+  LSN dlsn = _lm.get_durable_mark();
+  _durable_flushed_lsn_offset = dlsn.offset();
+  _lsn_offset = dlsn.offset();
+  _logbuf->_head = _logbuf->_tail = get_starting_byte_offset(&_lm);
+  StartLogWriter();
 }
 
 sm_log_alloc_mgr::~sm_log_alloc_mgr() {
   _write_daemon_should_stop = true;
   int err = pthread_join(_write_daemon_tid, NULL);
   LOG_IF(FATAL, err) << "Unable to join log writer daemon thread";
+
+  if (_stream_writers) {
+    for (uint32_t i = 0; i < config::log_streams; ++i) {
+      stream_writer &w = _stream_writers[i];
+      {
+        std::unique_lock<std::mutex> lock(w.mutex);
+        w.should_stop = true;
+      }
+      w.cond.notify_all();
+      w.thread.join();
+      if (w.fd >= 0) {
+        os_close(w.fd);
+      }
+    }
+    delete[] _stream_writers;
+    delete[] _lsn_combiners;
+  }
+  delete _uring_writer;
+}
+
+/* The stream (and thus consolidation array) of the calling thread:
+   the NUMA node it runs on, folded into the number of streams.
+ */
+static uint32_t my_log_stream() {
+  static thread_local int node = -1;
+  if (node < 0) {
+    node = std::max(numa_node_of_cpu(sched_getcpu()), 0);
+  }
+  return node % config::log_streams;
+}
+
+uint64_t sm_log_alloc_mgr::reserve_lsn_offset(uint64_t nbytes) {
+  if (config::log_streams == 1) {
+    return __sync_fetch_and_add(&_lsn_offset, nbytes);
+  }
+
+  typedef lsn_combiner C;
+  ASSERT(nbytes <= C::kBytesMask);
+  C &c = _lsn_combiners[my_log_stream()];
+  while (true) {
+    uint64_t idx = c.current.load(std::memory_order_acquire);
+    C::slot &s = c.slots[idx % C::kSlots];
+    uint64_t old = s.state.fetch_add(nbytes + (uint64_t{1} << C::kMemberShift),
+                                     std::memory_order_acq_rel);
+    if (old & C::kClosed) {
+      // Raced with a leader closing the slot (or with its recycling)
+      continue;
+    }
+
+    if (old == 0) {
+      // Leader: close the group, let the next one form in the next slot
+      // and allocate for everybody.
+      uint64_t total = s.state.exchange(C::kClosed, std::memory_order_acq_rel);
+      c.current.compare_exchange_strong(idx, idx + 1,
+                                        std::memory_order_acq_rel);
+      uint64_t base =
+          __sync_fetch_and_add(&_lsn_offset, total & C::kBytesMask);
+      s.members.store(total >> C::kMemberShift, std::memory_order_relaxed);
+      s.base.store(base, std::memory_order_release);
+    }
+
+    uint64_t base;
+    while ((base = s.base.load(std::memory_order_acquire)) == C::kNoBase) {
+      __builtin_ia32_pause();
+    }
+    uint64_t offset = base + (old & C::kBytesMask);
+
+    // The last one out recycles the slot
+    uint64_t members = s.members.load(std::memory_order_relaxed);
+    if (s.left.fetch_add(1, std::memory_order_acq_rel) + 1 == members) {
+      s.left.store(0, std::memory_order_relaxed);
+      s.base.store(C::kNoBase, std::memory_order_relaxed);
+      s.state.store(0, std::memory_order_release);
+    }
+    return offset;
+  }
+}
+
+/* pwritev the whole iovec array, [IOV_MAX] entries at a time and
+   resuming after short writes. Modifies [iov].
+ */
+static uint64_t os_pwritev_all(int fd, struct iovec *iov, int iovcnt,
+                               off_t offset) {
+  uint64_t n = 0;
+  while (iovcnt) {
+    ssize_t m = pwritev(fd, iov, std::min(iovcnt, IOV_MAX), offset + n);
+    THROW_IF(m < 0, os_error, errno,
+             "Error writing log stream at offset %zd", offset + n);
+    if (not m) break;
+    n += m;
+    while (iovcnt and (size_t)m >= iov->iov_len) {
+      m -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (m) {
+      iov->iov_base = (char *)iov->iov_base + m;
+      iov->iov_len -= m;
+    }
+  }
+  return n;
+}
+
+uint64_t sm_log_alloc_mgr::stream_writer::write_stripes() {
+  uint32_t nstreams = config::log_streams;
+  if (fd < 0 or fd_segnum != sid->segnum) {
+    if (fd >= 0) {
+      os_close(fd);
+    }
+    fd = lm->_lm.open_stream_for_write(sid, stream);
+    fd_segnum = sid->segnum;
+  }
+
+  // Our stripes of [offset, offset+nbytes) are contiguous in our file
+  std::vector<struct iovec> iov;
+  uint64_t file_start = 0;
+  for (uint64_t done = 0; done < nbytes;) {
+    uint64_t file_off, run;
+    uint32_t s = log_stream_locate(offset + done, nstreams, file_off, run);
+    uint64_t len = std::min(run, nbytes - done);
+    if (s == stream) {
+      if (iov.empty()) {
+        file_start = file_off;
+      }
+      iov.push_back({(void *)(buf + done), len});
+    }
+    done += len;
+  }
+  if (iov.empty()) {
+    return 0;
+  }
+  return os_pwritev_all(fd, iov.data(), iov.size(), file_start);
+}
+
+void sm_log_alloc_mgr::stream_writer::run() {
+  if (numa_available() >= 0) {
+    numa_run_on_node(stream % (numa_max_node() + 1));
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] { return should_stop or posted != done; });
+    if (should_stop) {
+      break;
+    }
+    written = write_stripes();
+    done = posted;
+    cond.notify_all();
+  }
+}
+
+uint64_t sm_log_alloc_mgr::write_segment(segment_id *sid, int fd,
+                                         char const *buf, uint64_t nbytes,
+                                         uint64_t offset) {
+  if (_uring_writer) {
+    return _uring_writer->write(sid, buf, nbytes, offset);
+  }
+  if (config::log_streams == 1) {
+    return os_pwrite(fd, buf, nbytes, offset);
+  }
+
+  for (uint32_t i = 0; i < config::log_streams; ++i) {
+    stream_writer &w = _stream_writers[i];
+    {
+      std::unique_lock<std::mutex> lock(w.mutex);
+      w.sid = sid;
+      w.buf = buf;
+      w.nbytes = nbytes;
+      w.offset = offset;
+      w.written = 0;
+      ++w.posted;
+    }
+    w.cond.notify_all();
+  }
+
+  // The flush is durable only once every stream has its share
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < config::log_streams; ++i) {
+    stream_writer &w = _stream_writers[i];
+    std::unique_lock<std::mutex> lock(w.mutex);
+    w.cond.wait(lock, [&w] { return w.done == w.posted; });
+    n += w.written;
+  }
+  return n;
 }
 
 void sm_log_alloc_mgr::enqueue_committed_xct(uint32_t worker_id,
@@ -124,6 +354,7 @@ retry :
 void sm_log_alloc_mgr::dequeue_committed_xcts(uint64_t upto,
                                               uint64_t end_time) {
   uint32_t n = config::is_backup_srv() ? config::replay_threads : config::worker_threads;
+  auto &hist = commit_queue::latency_hist[chkptmgr and chkptmgr->InProgress()];
   for (uint32_t i = 0; i < n; i++) {
     CRITICAL_SECTION(cs, _commit_queue[i].lock);
     uint32_t n = volatile_read(_commit_queue[i].start);
@@ -136,9 +367,12 @@ void sm_log_alloc_mgr::dequeue_committed_xcts(uint64_t upto,
         break;
       }
       _commit_queue[i].total_latency_us += end_time - entry.start_time;
+      hist.add(end_time - entry.start_time);
       dequeue++;
     }
     _commit_queue[i].items -= dequeue;
+    volatile_write(commit_queue::total_commits,
+                   commit_queue::total_commits + dequeue);
     volatile_write(_commit_queue[i].start, (n + dequeue) % config::group_commit_queue_length);
   }
 }
@@ -300,7 +534,11 @@ void sm_log_alloc_mgr::PrimaryShipLog(segment_id *durable_sid,
   }
   LOG_IF(FATAL, nbytes > config::group_commit_bytes + MIN_LOG_BLOCK_SIZE)
         << "Trying to ship too much: " << nbytes;
-  if (config::persist_policy == config::kPersistPipelined) {
+  // Under the adaptive policy only a pipelined batch leaves ACKs and a
+  // global persisted LSN for the next one, whichever way that goes
+  bool async = config::persist_adaptive and rep::persist_async.load();
+  if (config::persist_policy == config::kPersistPipelined and
+      (!config::persist_adaptive or _ship_unacked)) {
     if (config::log_ship_by_rdma) {
       // Wait for the backup to persist (it might act fast and set
       // ReadyToReceive too)
@@ -308,9 +546,7 @@ void sm_log_alloc_mgr::PrimaryShipLog(segment_id *durable_sid,
           rep::kRdmaPersisted | rep::kRdmaReadyToReceive, false);
     } else {
       // Wait for acks from backup
-      for (auto &fd : rep::backup_sockfds) {
-        tcp::expect_ack(fd);
-      }
+      rep::WaitForBackupAcksTcp();
     }
     {
       util::timer t;
@@ -320,13 +556,33 @@ void sm_log_alloc_mgr::PrimaryShipLog(segment_id *durable_sid,
     if (config::log_ship_by_rdma) {
       rep::primary_rdma_set_global_persisted_lsn(_durable_flushed_lsn_offset);
     } else {
-      for (auto &fd : rep::backup_sockfds) {
-        uint32_t nbytes = send(fd, (char*)&_durable_flushed_lsn_offset, sizeof(uint64_t), 0);
-        LOG_IF(FATAL, nbytes != sizeof(uint64_t)) << "Error sending global persisted lsn";
-      }
+      tcp::channel::piece lsn(&_durable_flushed_lsn_offset, sizeof(uint64_t));
+      rep::PostToBackupsTcp(&lsn, 1, false, false);
     }
   }
-  rep::primary_ship_log_buffer_all(buf, nbytes, have_imm, imm);
+  if (async) {
+    // Keep at most config::persist_max_lag_mb un-ACKed, this batch
+    // included
+    uint64_t lag = nbytes;
+    uint32_t batches = 0;
+    for (auto it = _async_batch_sizes.rbegin();
+         it != _async_batch_sizes.rend() and
+         lag + *it <= config::persist_max_lag_mb * config::MB;
+         ++it) {
+      lag += *it;
+      ++batches;
+    }
+    rep::WaitForBackupAcksTcp(false, batches);
+    while (_async_batch_sizes.size() > batches) {
+      _async_batch_sizes.pop_front();
+    }
+    _async_batch_sizes.push_back(nbytes);
+  } else {
+    _async_batch_sizes.clear();
+  }
+  rep::primary_ship_log_buffer_all(buf, nbytes, have_imm, imm, async);
+  _ship_unacked = !async;
+  _shipped_async = async;
 }
 
 // Wait for persistence ack from backups (if required) and dequeue transactions
@@ -355,20 +611,17 @@ void sm_log_alloc_mgr::PrimaryCommitPersistedWork(uint64_t new_offset) {
         // one for the log buffer partition bounds, the other for data
         rep::primary_rdma_poll_send_cq(2);
       } else {
-        for (auto &fd : rep::backup_sockfds) {
-          tcp::expect_ack(fd);
-        }
+        rep::WaitForBackupAcksTcp();
         {
           util::timer t;
           dequeue_committed_xcts(new_offset, t.get_start());
         }
         // Set global persisted LSN
-        for (auto &fd : rep::backup_sockfds) {
-          uint32_t nbytes = send(fd, (char*)&new_offset, sizeof(uint64_t), 0);
-          LOG_IF(FATAL, nbytes != sizeof(uint64_t)) << "Error sending global persisted lsn";
-        }
+        tcp::channel::piece lsn(&new_offset, sizeof(uint64_t));
+        rep::PostToBackupsTcp(&lsn, 1, false, false);
       }
-    } else if (config::persist_policy == config::kPersistAsync) {
+    } else if (config::persist_policy == config::kPersistAsync or
+               _shipped_async) {
       util::timer t;
       dequeue_committed_xcts(new_offset, t.get_start());
     }
@@ -493,7 +746,7 @@ segment_id *sm_log_alloc_mgr::PrimaryFlushLog(uint64_t new_dlsn_offset,
     if (config::null_log_device && (config::num_active_backups == 0 || !config::IsLoading())) {
       n = nbytes;
     } else {
-      n = os_pwrite(active_fd, buf, nbytes, file_offset);
+      n = write_segment(durable_sid, active_fd, buf, nbytes, file_offset);
       if (!config::command_log && config::persist_policy == config::kPersistAsync) {
         rep::async_ship_cond.notify_all();
       }
@@ -629,7 +882,7 @@ log_allocation *sm_log_alloc_mgr::allocate(uint32_t nrec,
 
 start_over:
   size_t nbytes = log_block::size(nrec, payload_bytes);
-  auto lsn_offset = __sync_fetch_and_add(&_lsn_offset, nbytes);
+  auto lsn_offset = reserve_lsn_offset(nbytes);
   auto next_lsn_offset = lsn_offset + nbytes;
 
   /* We are now the proud owners of an LSN offset range, most likely
@@ -716,6 +969,8 @@ grab_buffer:
   log_block *b = (log_block *)buf;
   b->lsn = lsn;
   b->nrec = tmp_nrec;
+  b->checksum_type = config::log_checksum;
+  b->reserved = 0;
   fill_skip_record(&b->records[tmp_nrec], rval.next_lsn, tmp_payload_bytes,
                    false);
 
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <mutex>
+#include <thread>
 #include "sm-log-recover.h"
+#include "sm-log-uring.h"
+#include "../util.h"
 
 namespace ermia {
 
@@ -79,15 +85,41 @@ struct sm_log_alloc_mgr {
                       bool new_seg, uint64_t new_offset, const char *buf);
   void PrimaryCommitPersistedWork(uint64_t new_offset);
   void BackupFlushLog(uint64_t new_dlsn_dlsn);
+  void BackupPromote();
+  // Everything allocating and writing the log needs, for primaries
+  void StartLogWriter();
   uint64_t smallest_tls_lsn_offset();
   void enqueue_committed_xct(uint32_t worker_id, uint64_t start_time);
   void dequeue_committed_xcts(uint64_t up_to, uint64_t end_time);
   int open_segment_for_read(segment_id * sid);
 
+  /* Reserve [nbytes] of LSN space and return its starting offset. With
+     a single log stream this is one fetch-and-add on _lsn_offset; with
+     more, threads of the same NUMA node consolidate their requests
+     first (see lsn_combiner).
+   */
+  uint64_t reserve_lsn_offset(uint64_t nbytes);
+
+  /* Write [nbytes] of log buffer to segment offset [offset] of [sid];
+     [fd] is the segment file. With multiple log streams the stream
+     writers write their stripes in parallel. Returns the number of
+     bytes written.
+   */
+  uint64_t write_segment(segment_id *sid, int fd, char const *buf,
+                         uint64_t nbytes, uint64_t offset);
+
   sm_log_recover_mgr _lm;
   window_buffer *_logbuf;
   uint64_t _durable_flushed_lsn_offset;
 
+  // Adaptive persist policy (config::persist_adaptive), log flusher only:
+  // whether the last batch shipped pipelined still needs its ACKs and
+  // global persisted LSN, whether it went asynchronously instead, and
+  // the sizes of the latest async batches, newest last
+  bool _ship_unacked;
+  bool _shipped_async;
+  std::deque<uint64_t> _async_batch_sizes;
+
   pthread_t _write_daemon_tid;
   os_mutex _write_daemon_mutex;
   os_condvar _write_daemon_cond;
@@ -161,6 +193,9 @@ struct sm_log_alloc_mgr {
     uint32_t items;
     sm_log_alloc_mgr *lm;
     static uint64_t total_latency_us;
+    static uint64_t total_commits;  // dequeued, written by the flusher
+    // Commit latencies outside [0] and during [1] checkpoints
+    static util::latency_histogram latency_hist[2];
     commit_queue() : start(0), items(0), lm(nullptr) {
       queue = new Entry[config::group_commit_queue_length];
     }
@@ -169,5 +204,67 @@ struct sm_log_alloc_mgr {
     inline uint32_t size() { return items; }
   };
   commit_queue *_commit_queue CACHE_ALIGNED;
+
+  // Per-stream consolidation array for LSN allocation, after Aether's
+  // consolidation buffer. Threads of one NUMA node join the current
+  // slot by adding (1 member, nbytes) to its state; the thread that
+  // finds the slot empty becomes the leader: it closes the slot, does a
+  // single fetch-and-add on _lsn_offset for the whole group and
+  // publishes the base, from which every member derives its own
+  // offset. With N streams, _lsn_offset sees at most one atomic per
+  // node per group instead of one per transaction.
+  struct lsn_combiner {
+    static const uint32_t kSlots = 64;
+    static const uint64_t kClosed = uint64_t{1} << 63;
+    static const uint32_t kMemberShift = 40;
+    static const uint64_t kBytesMask = (uint64_t{1} << kMemberShift) - 1;
+    static const uint64_t kNoBase = ~uint64_t{0};
+    struct slot {
+      std::atomic<uint64_t> state;  // kClosed | members | bytes
+      std::atomic<uint64_t> base;
+      std::atomic<uint64_t> members;
+      std::atomic<uint64_t> left;
+      slot() : state(0), base(kNoBase), members(0), left(0) {}
+    } CACHE_ALIGNED;
+    std::atomic<uint64_t> current CACHE_ALIGNED;
+    slot slots[kSlots];
+    lsn_combiner() : current(0) {}
+  };
+  lsn_combiner *_lsn_combiners CACHE_ALIGNED;
+
+  // One writer thread per log stream, pinned to the stream's NUMA node.
+  // write_segment() posts the same job to all of them; each picks out
+  // its own stripes and writes them with pwritev.
+  struct stream_writer {
+    sm_log_alloc_mgr *lm;
+    uint32_t stream;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool should_stop;
+    uint64_t posted;
+    uint64_t done;
+    // The current job
+    segment_id *sid;
+    char const *buf;
+    uint64_t nbytes;
+    uint64_t offset;
+    uint64_t written;
+    // Stream file of segment [fd_segnum]; by number, as segment_ids are
+    // freed and reused once segments are reclaimed
+    int fd;
+    uint32_t fd_segnum;
+
+    stream_writer()
+        : lm(nullptr), stream(0), should_stop(false), posted(0), done(0),
+          sid(nullptr), buf(nullptr), nbytes(0), offset(0), written(0),
+          fd(-1), fd_segnum(0) {}
+    void run();
+    uint64_t write_stripes();
+  };
+  stream_writer *_stream_writers;
+
+  // Direct, asynchronous segment writes (config::log_uring)
+  log_uring_writer *_uring_writer;
 };
 }  // namespace ermia
@@ -9,6 +9,7 @@
 #include "sm-log.h"
 
 #include "adler.h"
+#include "crc32c.h"
 #include "stub-impl.h"
 #include "window-buffer.h"
 
@@ -223,6 +224,40 @@ static_assert(sizeof(log_record) == 16, "log_record must be 16 bytes");
    file; unlike files, LSN are never reused.
 */
 
+/* Checksum algorithms for log blocks. Each block header records the
+   algorithm it was written with, so recovery and backups verify
+   blocks correctly no matter which algorithm the current process
+   prefers (config::log_checksum), and logs written before the field
+   existed (where it was always zero) still read as adler32.
+ */
+enum log_checksum_type : uint8_t {
+  LOG_CHECKSUM_ADLER32 = 0,
+  LOG_CHECKSUM_CRC32C = 1,
+  LOG_CHECKSUM_NTYPES,
+};
+
+inline uint32_t log_checksum_init(uint8_t type) {
+  return type == LOG_CHECKSUM_CRC32C ? CRC32C_CSUM_INIT : ADLER32_CSUM_INIT;
+}
+
+inline uint32_t log_checksum(uint8_t type, char const *data, size_t nbytes,
+                             uint32_t sofar) {
+  return type == LOG_CHECKSUM_CRC32C ? crc32c(data, nbytes, sofar)
+                                     : adler32(data, nbytes, sofar);
+}
+
+inline uint32_t log_checksum_memcpy(uint8_t type, char *dest, char const *src,
+                                    size_t nbytes, uint32_t sofar) {
+  return type == LOG_CHECKSUM_CRC32C ? crc32c_memcpy(dest, src, nbytes, sofar)
+                                     : adler32_memcpy(dest, src, nbytes, sofar);
+}
+
+inline uint32_t log_checksum_merge(uint8_t type, uint32_t left, uint32_t right,
+                                   size_t right_size) {
+  return type == LOG_CHECKSUM_CRC32C ? crc32c_merge(left, right, right_size)
+                                     : adler32_merge(left, right, right_size);
+}
+
 // log block header is 16B (sans records and payload)
 struct LOG_ALIGN log_block {
   /* The checksum covers everything from the start of the log block
@@ -246,7 +281,13 @@ struct LOG_ALIGN log_block {
      this block starts at records[nrec].data and ends at
      records[nrec].data + records[nrec].payload_end.
    */
-  uint32_t nrec;
+  uint16_t nrec;
+
+  /* The log_checksum_type [checksum] was computed with. Covered by
+     the checksum itself.
+   */
+  uint8_t checksum_type;
+  uint8_t reserved;
 
   /* The LSN we think we are. If the checksum is valid, but this
      doesn't match what the log scanner expected, we could have
@@ -301,12 +342,16 @@ struct LOG_ALIGN log_block {
    */
   uint32_t body_checksum() {
     auto *begin = checksum_begin();
-    return adler32(begin, payload_begin() - begin);
+    return log_checksum(checksum_type, begin, payload_begin() - begin,
+                        log_checksum_init(checksum_type));
   }
 
   uint32_t full_checksum() {
+    // a garbage algorithm id never verifies
+    if (checksum_type >= LOG_CHECKSUM_NTYPES) return ~checksum;
     auto *begin = checksum_begin();
-    return adler32(begin, payload_end() - begin);
+    return log_checksum(checksum_type, begin, payload_end() - begin,
+                        log_checksum_init(checksum_type));
   }
 
   /* Return the LSN that identifies the payload for record [i].
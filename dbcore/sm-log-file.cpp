@@ -99,6 +99,7 @@ void sm_log_file_mgr::_pop_oldest() {
   auto *sid = _oldest_segment();
   os_close(sid->fd);
   sid->fd = -1;
+  sid->close_stream_fds();
   free(sid);
   segments[oldest_segnum] = NULL;
   oldest_segnum++;
@@ -111,6 +112,7 @@ void sm_log_file_mgr::_pop_newest() {
   active_segment = segments[sid->segnum - 1];
   os_close(sid->fd);
   sid->fd = -1;
+  sid->close_stream_fds();
   free(sid);
 }
 
@@ -133,6 +135,7 @@ sm_log_file_mgr::segment_array::~segment_array() {
     if (sid) {
       os_close(sid->fd);
       sid->fd = -1;
+      sid->close_stream_fds();
     }
   }
 }
@@ -150,6 +153,11 @@ sm_log_file_mgr::segment_array::~segment_array() {
    searching for end-of-log (the file system is responsible for
    dealing with media errors).
 
+   If the log is striped over several streams (see log_stream_locate),
+   each segment also has files of the form log-$SEGNO-$BEGIN-$END.s$K
+   for streams K=1..N-1, and an empty marker named streams-$N records
+   N so a later run cannot misread the stripes.
+
    One checkpoint marker, an empty file named
    checkpoint-$BEGIN-$END. Whenever a new checkpoint is confirmed to
    be durable, the checkpoint code renames this file to point to
@@ -204,12 +212,18 @@ void sm_log_file_mgr::_make_new_log() {
 
   auto fill_skip_block = [](log_block *b, LSN lsn, size_t payload_size) {
     b->nrec = 0;
+    b->checksum_type = config::log_checksum;
+    b->reserved = 0;
     b->lsn = lsn;
     size_t blocksz = log_block::size(0, payload_size);
     LSN next_lsn = lsn.advance_within_segment(blocksz);
     fill_skip_record(b->records, next_lsn, payload_size, payload_size);
   };
 
+  // fits in the first stripe, so stream 0 gets all of it
+  static_assert(sizeof(buf) <= LOG_STREAM_STRIPE_SIZE,
+                "Initial checkpoint must fit in one log stream stripe");
+
   // fill both blocks
   _chkpt_start_lsn = sid->make_lsn(0);
   fill_skip_block(&b, _chkpt_start_lsn, MIN_LOG_BLOCK_SIZE);
@@ -231,6 +245,12 @@ void sm_log_file_mgr::_make_new_log() {
   // create the checkpoint and durable mark files
   os_truncateat(dfd, cmark_file_name(_chkpt_start_lsn, _chkpt_end_lsn));
   os_truncateat(dfd, dmark_file_name(_durable_lsn));
+  if (config::log_streams > 1) {
+    char sname[STREAMS_FILE_NAME_BUFSZ];
+    os_snprintf(sname, sizeof(sname), STREAMS_FILE_NAME_FMT,
+                config::log_streams);
+    os_truncateat(dfd, sname);
+  }
   os_fsync(dfd);
 }
 
@@ -247,6 +267,7 @@ sm_log_file_mgr::sm_log_file_mgr() {
   bool durable_found = false;
   bool chkpt_found = false;
   bool nxt_seg_found = false;
+  uint32_t nstreams = 1;
 
   std::vector<segment_id *> tmp;
   dirent_iterator dir(config::log_dir.c_str());
@@ -299,9 +320,18 @@ sm_log_file_mgr::sm_log_file_mgr() {
       case 'l': {
         // allowed: log segment
         char canary;
+        uint32_t segnum, stream;
+        uint64_t start, end;
+        if (sscanf(fname, STREAM_FILE_NAME_FMT "%c", &segnum, &start, &end,
+                   &stream, &canary) == 4) {
+          // extra stream of a segment, opened on demand
+          continue;
+        }
+
         segment_id *sid = nullptr;
         int err = posix_memalign((void **)&sid, DEFAULT_ALIGNMENT, sizeof(segment_id));
         LOG_IF(FATAL, err != 0);
+        new (sid) segment_id(-1, 0, 0, 0, 0);
         DEFER_UNLESS(success, free(sid));
 
         int n = sscanf(fname, SEGMENT_FILE_NAME_FMT "%c", &sid->segnum,
@@ -349,8 +379,23 @@ sm_log_file_mgr::sm_log_file_mgr() {
         // OID array chkpt file
         continue;
       }
+      case 's': {
+        // allowed: number of log streams
+        char canary;
+        int n = sscanf(fname, STREAMS_FILE_NAME_FMT "%c", &nstreams, &canary);
+        if (n == 1) {
+          continue;
+        }
+        break;
+      }
       case 'r': {
-        // Background async replay bounds file
+        // Recycled segment file, or the background async replay bounds
+        // file
+        char canary;
+        uint32_t segnum;
+        if (sscanf(fname, RECYCLED_FILE_NAME_FMT "%c", &segnum, &canary) == 1) {
+          recycled_segments.push_back(segnum);
+        }
         continue;
       }
       case 'm': {
@@ -377,6 +422,10 @@ sm_log_file_mgr::sm_log_file_mgr() {
 
   sm_log::need_recovery = true;
 
+  THROW_IF(nstreams != config::log_streams, log_file_error,
+           "Log was written with %u stream(s), but %u configured", nstreams,
+           config::log_streams);
+
   THROW_IF(tmp.size() > NUM_LOG_SEGMENTS, log_file_error,
            "Log directory contains too many segment files: %zd", tmp.size());
   THROW_IF(not chkpt_found, log_file_error,
@@ -467,7 +516,28 @@ void sm_log_file_mgr::_create_nxt_seg_file(bool force) {
   if (doit) {
     ALWAYS_ASSERT(!config::is_backup_srv() || config::command_log);
     nxt_seg_file_name sname(segnum);
-    uint64_t fd = os_openat(dfd, sname, O_CREAT | O_EXCL | O_RDONLY);
+    uint64_t fd = 0;
+    if (recycled_segments.size()) {
+      // Reuse a reclaimed segment file. Empty it first: the file size
+      // is what marks the end of the written log.
+      recycled_file_name rname(recycled_segments.front());
+      recycled_segments.pop_front();
+      os_truncateat(dfd, rname);
+      os_renameat(dfd, rname, dfd, sname);
+      fd = os_openat(dfd, sname, O_RDONLY);
+    } else {
+      fd = os_openat(dfd, sname, O_CREAT | O_EXCL | O_RDONLY);
+    }
+    if (config::log_uring) {
+      // Reserve the blocks now, off the commit path, so that direct
+      // writes to this segment never allocate. KEEP_SIZE leaves the
+      // file size alone, which recovery and backup bootstrap rely on.
+      int wfd = os_openat(dfd, sname, O_WRONLY);
+      int err = fallocate(wfd, FALLOC_FL_KEEP_SIZE, 0, segment_size);
+      LOG_IF(WARNING, err) << "Unable to preallocate log segment " << *sname
+                           << " (" << errno << ")";
+      os_close(wfd);
+    }
     nxt_segment_fd = (fd << 32) | segnum;
   }
 }
@@ -526,6 +596,92 @@ int sm_log_file_mgr::open_for_read(segment_id *sid) {
   return os_openat(dfd, sname, O_RDONLY | O_SYNC);
 }
 
+int sm_log_file_mgr::open_stream_for_write(segment_id *sid, uint32_t stream) {
+  if (stream == 0) {
+    return open_for_write(sid);
+  }
+  file_mutex.lock();
+  DEFER(file_mutex.unlock());
+  _create_nxt_seg_file(false);
+
+  stream_file_name sname(sid, stream);
+  return os_openat(dfd, sname, O_WRONLY | O_SYNC | O_CREAT);
+}
+
+int sm_log_file_mgr::open_for_direct_write(segment_id *sid) {
+  file_mutex.lock();
+  DEFER(file_mutex.unlock());
+  _create_nxt_seg_file(false);
+
+  segment_file_name sname(sid);
+  int fd = openat(dfd, sname, O_RDWR | O_DIRECT);
+  if (fd < 0 and errno == EINVAL) {
+    LOG(WARNING) << "Direct I/O not supported for " << *sname
+                 << ", using buffered writes";
+    fd = openat(dfd, sname, O_RDWR);
+  }
+  LOG_IF(FATAL, fd < 0) << "Unable to open file " << *sname;
+  return fd;
+}
+
+size_t sm_log_file_mgr::pread_segment(segment_id *sid, char *buf,
+                                      size_t nbytes, uint64_t offset) {
+  uint32_t nstreams = config::log_streams;
+  if (nstreams == 1) {
+    return os_pread(sid->fd, buf, nbytes, offset);
+  }
+
+  size_t done = 0;
+  while (done < nbytes) {
+    uint64_t file_off, run;
+    uint32_t stream = log_stream_locate(offset + done, nstreams, file_off, run);
+    size_t want = std::min<uint64_t>(run, nbytes - done);
+    int fd = sid->fd;
+    if (stream) {
+      fd = volatile_read(sid->stream_fd[stream]);
+      if (fd < 0) {
+        stream_file_name sname(sid, stream);
+        fd = openat(dfd, sname, O_RDONLY);
+        if (fd < 0) {
+          // never written: the log ends here
+          THROW_IF(errno != ENOENT, os_error, errno,
+                   "Unable to open log stream file %s", *sname);
+          break;
+        }
+        int old = __sync_val_compare_and_swap(&sid->stream_fd[stream], -1, fd);
+        if (old >= 0) {
+          os_close(fd);
+          fd = old;
+        }
+      }
+    }
+    size_t n = os_pread(fd, buf + done, want, file_off);
+    done += n;
+    if (n < want) break;
+  }
+  return done;
+}
+
+void sm_log_file_mgr::_unlink_streams(segment_id *sid) {
+  for (uint32_t i = 1; i < config::log_streams; ++i) {
+    stream_file_name sname(sid, i);
+    int err = unlinkat(dfd, sname, 0);
+    THROW_IF(err and errno != ENOENT, os_error, errno,
+             "Error unlinking file %s", *sname);
+  }
+}
+
+void sm_log_file_mgr::_truncate_streams(segment_id *sid, uint64_t new_end) {
+  uint64_t len = new_end - sid->start_offset;
+  for (uint32_t i = 1; i < config::log_streams; ++i) {
+    stream_file_name sname(sid, i);
+    if (faccessat(dfd, sname, F_OK, 0) == 0) {
+      os_truncateat(dfd, sname,
+                    log_stream_file_size(len, i, config::log_streams));
+    }
+  }
+}
+
 segment_id *sm_log_file_mgr::prepare_new_segment(uint64_t start) {
   auto *psid = _newest_segment();
   if (start + MIN_LOG_BLOCK_SIZE < psid->end_offset) return 0;
@@ -612,6 +768,7 @@ again:
     THROW_IF(sid->start_offset <= _durable_lsn.offset(), illegal_argument,
              "Attempt to truncate durable mark");
     os_unlinkat(dfd, sname);
+    _unlink_streams(sid);
     _pop_newest();
     goto again;
   }
@@ -630,7 +787,10 @@ again:
   THROW_IF(sid->end_offset < new_end, log_file_error,
            "Truncation offset %zd past end of segment %d", size_t(new_end),
            segnum);
-  os_truncateat(dfd, sname, new_end - sid->start_offset);
+  os_truncateat(dfd, sname,
+                log_stream_file_size(new_end - sid->start_offset, 0,
+                                     config::log_streams));
+  _truncate_streams(sid, new_end);
   os_fsync(dfd);
 }
 
@@ -641,20 +801,49 @@ void sm_log_file_mgr::reclaim_before(uint32_t segnum) {
   THROW_IF(_newest_segment()->segnum < segnum, illegal_argument,
            "Attempt to reclaim end of log");
 
-again:
+  while (_oldest_segment()->segnum < segnum) {
+    _reclaim_oldest();
+  }
+  os_fsync(dfd);
+}
+
+uint32_t sm_log_file_mgr::reclaim_upto(uint64_t offset,
+                                       uint64_t (*limit)()) {
+  file_mutex.lock();
+  DEFER(file_mutex.unlock());
+
+  if (limit) {
+    offset = std::min(offset, limit());
+  }
+
+  uint32_t n = 0;
+  while (_oldest_segment() != _newest_segment() and
+         _oldest_segment()->end_offset <= offset) {
+    _reclaim_oldest();
+    ++n;
+  }
+  if (n) {
+    os_fsync(dfd);
+  }
+  return n;
+}
+
+void sm_log_file_mgr::_reclaim_oldest() {
   auto *sid = _oldest_segment();
-  if (sid->segnum < segnum) {
-    THROW_IF(_durable_lsn.offset() < sid->end_offset, illegal_argument,
-             "Attempt to reclaim durable mark");
-    THROW_IF(_chkpt_start_lsn.offset() < sid->end_offset, illegal_argument,
-             "Attempt to reclaim most recent checkpoint");
+  THROW_IF(_durable_lsn.offset() < sid->end_offset, illegal_argument,
+           "Attempt to reclaim durable mark");
+  THROW_IF(_chkpt_start_lsn.offset() < sid->end_offset, illegal_argument,
+           "Attempt to reclaim most recent checkpoint");
 
-    segment_file_name sname(sid);
+  segment_file_name sname(sid);
+  if (config::log_recycle_segments and
+      recycled_segments.size() < kMaxRecycledSegments) {
+    os_renameat(dfd, sname, dfd, recycled_file_name(sid->segnum));
+    recycled_segments.push_back(sid->segnum);
+  } else {
     os_unlinkat(dfd, sname);
-    _pop_oldest();
-    goto again;
   }
-
-  os_fsync(dfd);
+  _unlink_streams(sid);
+  _pop_oldest();
 }
 }  // namespace ermia
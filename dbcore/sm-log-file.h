@@ -16,6 +16,19 @@
 #define SEGMENT_FILE_NAME_FMT "log-%08x-%012zx-%012zx"
 #define SEGMENT_FILE_NAME_BUFSZ sizeof("log-01234567-0123456789ab-0123456789ab")
 
+// segment, start offset, end offset, stream
+#define STREAM_FILE_NAME_FMT SEGMENT_FILE_NAME_FMT ".s%02x"
+#define STREAM_FILE_NAME_BUFSZ \
+  sizeof("log-01234567-0123456789ab-0123456789ab.s01")
+
+// segment it was reclaimed from
+#define RECYCLED_FILE_NAME_FMT "rcy-%08x"
+#define RECYCLED_FILE_NAME_BUFSZ sizeof("rcy-01234567")
+
+// number of log streams
+#define STREAMS_FILE_NAME_FMT "streams-%02x"
+#define STREAMS_FILE_NAME_BUFSZ sizeof("streams-01")
+
 #include "sm-log-defs.h"
 
 #include <deque>
@@ -32,6 +45,16 @@ struct nxt_seg_file_name {
   char const *operator*() { return buf; }
 };
 
+struct recycled_file_name {
+  char buf[RECYCLED_FILE_NAME_BUFSZ];
+  recycled_file_name(uint32_t segnum) {
+    size_t n = os_snprintf(buf, sizeof(buf), RECYCLED_FILE_NAME_FMT, segnum);
+    ALWAYS_ASSERT(n < sizeof(buf));
+  }
+  operator char const *() { return buf; }
+  char const *operator*() { return buf; }
+};
+
 struct cmark_file_name {
   char buf[CHKPT_FILE_NAME_BUFSZ];
   cmark_file_name(LSN start, LSN end) {
@@ -43,6 +66,47 @@ struct cmark_file_name {
   char const *operator*() { return buf; }
 };
 
+/* Log streams.
+
+   With config::log_streams > 1, each segment is striped over that
+   many files so that one flusher per NUMA node can write (and the
+   kernel can accept) its share of every flush in parallel, without
+   serializing on a single file's inode lock. Stripe [i] of a segment
+   (bytes [i*S, (i+1)*S) from the segment start) lives in stream
+   i % N, at offset (i / N) * S of that stream's file; so the stripes
+   one stream receives from any contiguous flush are contiguous in its
+   file. Stream 0 is the segment file proper, streams 1..N-1 sit next
+   to it with a ".sNN" suffix.
+
+   LSNs, the log buffer and everything above the file layer still see
+   a single log: reads reassemble the stripes by LSN offset.
+ */
+static size_t const LOG_STREAM_STRIPE_SIZE = 4096;
+
+/* Map segment offset [off] to its stream and the offset within that
+   stream's file. [run] receives the number of bytes until the end of
+   the stripe.
+ */
+inline uint32_t log_stream_locate(uint64_t off, uint32_t nstreams,
+                                  uint64_t &file_off, uint64_t &run) {
+  uint64_t stripe = off / LOG_STREAM_STRIPE_SIZE;
+  uint64_t within = off % LOG_STREAM_STRIPE_SIZE;
+  file_off = (stripe / nstreams) * LOG_STREAM_STRIPE_SIZE + within;
+  run = LOG_STREAM_STRIPE_SIZE - within;
+  return stripe % nstreams;
+}
+
+/* The size of [stream]'s file if the segment holds [len] bytes.
+ */
+inline uint64_t log_stream_file_size(uint64_t len, uint32_t stream,
+                                     uint32_t nstreams) {
+  uint64_t full = len / LOG_STREAM_STRIPE_SIZE;
+  uint64_t nfull = full / nstreams + (stream < full % nstreams ? 1 : 0);
+  uint64_t size = nfull * LOG_STREAM_STRIPE_SIZE;
+  if (full % nstreams == stream) size += len % LOG_STREAM_STRIPE_SIZE;
+  return size;
+}
+
 /* The file management part of the log.
 
    This class is responsible for the naming, creation, and deletion of
@@ -58,8 +122,23 @@ struct segment_id {
   uint64_t end_offset;
   uint64_t byte_offset;
 
+  // Read-only fds of streams 1..N-1 (index 0 unused, see [fd]); opened
+  // on first use because the files only appear once a flusher writes.
+  int stream_fd[config::kMaxLogStreams];
+
   segment_id(int fd, uint32_t segnum, uint64_t start, uint64_t end, uint64_t off)
-    : fd(fd), segnum(segnum), start_offset(start), end_offset(end), byte_offset(off) {}
+    : fd(fd), segnum(segnum), start_offset(start), end_offset(end), byte_offset(off) {
+    std::fill(stream_fd, stream_fd + config::kMaxLogStreams, -1);
+  }
+
+  void close_stream_fds() {
+    for (uint32_t i = 1; i < config::kMaxLogStreams; ++i) {
+      if (stream_fd[i] >= 0) {
+        os_close(stream_fd[i]);
+        stream_fd[i] = -1;
+      }
+    }
+  }
 
   bool contains(uint64_t lsn_offset) {
     return start_offset <= lsn_offset and
@@ -111,6 +190,17 @@ struct segment_file_name {
   char const *operator*() { return buf; }
 };
 
+struct stream_file_name {
+  char buf[STREAM_FILE_NAME_BUFSZ];
+  stream_file_name(segment_id *sid, uint32_t stream) {
+    size_t n = os_snprintf(buf, sizeof(buf), STREAM_FILE_NAME_FMT, sid->segnum,
+                           sid->start_offset, sid->end_offset, stream);
+    ALWAYS_ASSERT(n < sizeof(buf));
+  }
+  operator char const *() { return buf; }
+  char const *operator*() { return buf; }
+};
+
 struct sm_log_file_mgr {
   /* A volatile modulo-indexed array, which forms part of the
      segment race-riddled assignment protocol.
@@ -186,6 +276,31 @@ struct sm_log_file_mgr {
   int open_for_write(segment_id *sid);
   int open_for_read(segment_id *sid);
 
+  /* Open stream [stream] of the passed-in segment for writing,
+     creating the stream file if need be. Stream 0 is the segment
+     file itself.
+   */
+  int open_stream_for_write(segment_id *sid, uint32_t stream);
+
+  /* Open the segment for O_DIRECT writing by the io_uring log writer.
+     Falls back to a buffered descriptor if the file system doesn't
+     support direct I/O (e.g., older tmpfs).
+   */
+  int open_for_direct_write(segment_id *sid);
+
+  /* Read [nbytes] at segment offset [offset], reassembling the
+     stripes if the log has more than one stream. Returns the number
+     of bytes read, which is short at the end of the written log.
+   */
+  size_t pread_segment(segment_id *sid, char *buf, size_t nbytes,
+                       uint64_t offset);
+
+  /* Remove (or truncate to [new_end]) the extra stream files of a
+     segment.
+   */
+  void _unlink_streams(segment_id *sid);
+  void _truncate_streams(segment_id *sid, uint64_t new_end);
+
   /* Create a new log segment file, with segment number one higher
      than the current highest segnum.
 
@@ -224,6 +339,23 @@ struct sm_log_file_mgr {
    */
   void reclaim_before(uint32_t segnum);
 
+  /* Reclaim all segments that end at or before LSN offset [offset],
+     except the newest one; returns how many were reclaimed. Same
+     rules as reclaim_before. [limit], if given, further caps
+     [offset] and is called under file_mutex, so whatever it reads
+     can be pinned under the same lock (see lock_segments).
+
+     With config::log_recycle_segments, up to kMaxRecycledSegments
+     reclaimed files are kept (renamed, see RECYCLED_FILE_NAME_FMT)
+     and become future segments instead of creating new files.
+   */
+  uint32_t reclaim_upto(uint64_t offset, uint64_t (*limit)() = nullptr);
+
+  /* Hold off reclaim_upto (through file_mutex) */
+  void lock_segments() { file_mutex.lock(); }
+  void unlock_segments() { file_mutex.unlock(); }
+  static const size_t kMaxRecycledSegments = 2;
+
   /* WARNING: these are only safe to access while holding the
      file_mutex. The STL makes no guarantees whatsoever about what
      happens during races to create or destroy segments. These could
@@ -234,6 +366,7 @@ struct sm_log_file_mgr {
   segment_id *_newest_segment();
   void _pop_oldest();
   void _pop_newest();
+  void _reclaim_oldest();
 
   void _create_nxt_seg_file(bool force);
   segment_id *_prepare_new_segment(uint32_t segnum, uint64_t start,
@@ -251,6 +384,9 @@ struct sm_log_file_mgr {
 
   uint64_t nxt_segment_fd;
 
+  // Reclaimed segment files kept for reuse, by old segment number
+  std::deque<uint32_t> recycled_segments;
+
   LSN _durable_lsn;
 
   LSN _chkpt_start_lsn;
@@ -0,0 +1,239 @@
+#include "../ermia.h"
+#include "rcu.h"
+#include "sm-table.h"
+#include "sm-log-recover-impl.h"
+#include "sm-oid.h"
+#include "sm-rep.h"
+
+namespace ermia {
+
+// Which redo thread owns (fid, oid); spreads consecutive OIDs of the same
+// table over all threads
+static inline uint32_t hash_replay_partition(FID fid, OID oid, uint32_t n) {
+  uint64_t h = ((uint64_t)fid << 32 | oid) * 0x9E3779B97F4A7C15ull;
+  return (h >> 32) % n;
+}
+
+LSN parallel_hash_replay::operator()(void *arg, sm_log_scan_mgr *s,
+                                     LSN from, LSN to) {
+  MARK_REFERENCED(arg);
+  MARK_REFERENCED(from);
+  ALWAYS_ASSERT(nredoers > 0);
+  scanner = s;
+  for (uint32_t i = 0; i < nredoers; ++i) {
+    redo_runner *r = new redo_runner(this);
+    redoers.push_back(r);
+    bool success = r->TryImpersonate(false);
+    ALWAYS_ASSERT(success);
+    r->Start();
+  }
+  decoder = new decode_runner(this);
+  bool success = decoder->TryImpersonate(false);
+  ALWAYS_ASSERT(success);
+  decoder->Start();
+  return to;
+}
+
+uint64_t parallel_hash_replay::redo_runner::push(const record_pos &pos) {
+  uint64_t t = tail.load(std::memory_order_relaxed);
+  while (t - head.load(std::memory_order_acquire) >= kQueueSize) {
+  }
+  queue[t & (kQueueSize - 1)] = pos;
+  tail.store(t + 1, std::memory_order_release);
+  return t + 1;
+}
+
+void parallel_hash_replay::redo_runner::MyWork(char *) {
+  RCU::rcu_register();
+  DEFER(RCU::rcu_deregister());
+
+  // Only ever positioned with seek(), never scans on its own
+  auto *scan =
+      owner->scanner->new_log_scan(INVALID_LSN, config::eager_warm_up(), true);
+  DEFER(delete scan);
+
+  while (true) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      continue;
+    }
+    RCU::rcu_enter();
+    // Index inserts wait for the queue to drain, and so does [head]
+    // once there are any
+    bool index_inserts = false;
+    do {
+      const record_pos &pos = queue[h & (kQueueSize - 1)];
+      scan->seek(pos.block, pos.index);
+      ALWAYS_ASSERT(scan->valid());
+      switch (scan->type()) {
+        case sm_log_scan_mgr::LOG_UPDATE_KEY:
+          owner->recover_update_key(scan);
+          break;
+        case sm_log_scan_mgr::LOG_UPDATE:
+        case sm_log_scan_mgr::LOG_RELOCATE:
+          owner->recover_update(scan, false, true);
+          break;
+        case sm_log_scan_mgr::LOG_DELETE:
+        case sm_log_scan_mgr::LOG_ENHANCED_DELETE:
+          owner->recover_update(scan, true, true);
+          break;
+        case sm_log_scan_mgr::LOG_INSERT_INDEX:
+          owner->recover_index_insert(scan);
+          index_inserts = true;
+          break;
+        case sm_log_scan_mgr::LOG_INSERT:
+          owner->recover_insert(scan, true);
+          break;
+        default:
+          DIE("unreachable");
+      }
+      ++redo_records;
+      ++h;
+      if (!index_inserts) {
+        head.store(h, std::memory_order_release);
+      }
+    } while (h != tail.load(std::memory_order_acquire));
+    if (index_inserts) {
+      owner->flush_index_inserts();
+      head.store(h, std::memory_order_release);
+    }
+    RCU::rcu_exit();
+  }
+}
+
+void parallel_hash_replay::decode_runner::redo_batch(LSN start_lsn,
+                                                     LSN end_lsn) {
+  RCU::rcu_enter();
+  DEFER(RCU::rcu_exit());
+  if (tables.empty()) {
+    // Tables are all known by the time log shipping starts
+    for (auto &t : TableDescriptor::name_map) {
+      TableDescriptor *td = t.second;
+      fid_tables[td->GetTupleFid()] = tables.size();
+      fid_tables[td->GetPersistentAddressFid()] = tables.size();
+      tables.push_back(
+          table_progress{td, 0, std::vector<uint64_t>(owner->nredoers, 0)});
+    }
+  }
+  ++batch;
+
+  uint64_t nrecords = 0, size = 0;
+  uint32_t n = owner->nredoers;
+  // Records of files we can't tie to a table, e.g., secondary indexes, and
+  // records redo doesn't apply (recover_update_key is a no-op): a table is
+  // only as fresh as the records its redo threads actually installed
+  bool untracked = false;
+  FID last_fid = 0;
+  table_progress *progress = nullptr;
+  auto *scan = owner->scanner->new_log_scan(start_lsn, false, true);
+  for (; scan->valid() and scan->payload_lsn().offset() < end_lsn.offset();
+       scan->next()) {
+    if (scan->type() == sm_log_scan_mgr::LOG_FID) {
+      // The main recover function should have already did this
+      ASSERT(oidmgr->file_exists(scan->fid()));
+      continue;
+    }
+    FID fid = scan->fid();
+    uint32_t r = hash_replay_partition(fid, scan->oid(), n);
+    uint64_t mark = owner->redoers[r]->push(
+        record_pos{scan->block_lsn(), scan->record_index()});
+
+    if (fid != last_fid or !progress) {
+      auto it = fid_tables.find(fid);
+      progress = it == fid_tables.end() ? nullptr : &tables[it->second];
+      last_fid = fid;
+    }
+    if (progress and scan->type() != sm_log_scan_mgr::LOG_UPDATE_KEY) {
+      if (progress->batch != batch) {
+        progress->batch = batch;
+        std::fill(progress->marks.begin(), progress->marks.end(), 0);
+      }
+      progress->marks[r] = mark;
+    } else {
+      untracked = true;
+    }
+
+    ++nrecords;
+    size_t psize = scan->payload_size();
+    if (psize != sm_log_scan_mgr::NO_PAYLOAD) {
+      size += psize;
+    }
+  }
+  delete scan;
+
+  publish_tables(end_lsn, untracked);
+
+  // The batch is replayed once every redo thread caught up with us
+  for (auto *r : owner->redoers) {
+    while (!r->drained()) {
+    }
+  }
+  owner->redo_records += nrecords;
+  owner->redo_size += size;
+  DLOG(INFO) << "[Backup] Replayed " << std::hex << start_lsn.offset() << "-"
+             << end_lsn.offset() << std::dec << ", " << nrecords
+             << " records, " << size << " bytes";
+}
+
+// Move each table's replayed LSN to the end of the batch as soon as its own
+// records are replayed; tables without records in the batch go first.
+void parallel_hash_replay::decode_runner::publish_tables(LSN end_lsn,
+                                                         bool untracked) {
+  if (untracked) {
+    // Can't tell which tables the untracked records belong to, so wait for
+    // the whole batch like everyone else
+    return;
+  }
+  std::vector<table_progress *> pending;
+  for (auto &t : tables) {
+    if (t.batch == batch) {
+      pending.push_back(&t);
+    } else {
+      t.td->SetReplayedLsnOffset(end_lsn.offset());
+    }
+  }
+  while (pending.size()) {
+    for (uint32_t i = 0; i < pending.size();) {
+      table_progress *t = pending[i];
+      bool done = true;
+      for (uint32_t r = 0; r < owner->nredoers and done; ++r) {
+        done = owner->redoers[r]->head.load(std::memory_order_acquire) >=
+               t->marks[r];
+      }
+      if (done) {
+        t->td->SetReplayedLsnOffset(end_lsn.offset());
+        pending[i] = pending.back();
+        pending.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+}
+
+void parallel_hash_replay::decode_runner::MyWork(char *) {
+  RCU::rcu_register();
+  DEFER(RCU::rcu_deregister());
+
+  while (true) {
+    for (uint32_t i = 0; i < 2; ++i) {
+      rep::ReplayPipelineStage &stage = rep::pipeline_stages[i];
+      LSN stage_end = INVALID_LSN;
+      do {
+        stage_end = volatile_read(stage.end_lsn);
+      } while (stage_end.offset() <= volatile_read(rep::replayed_lsn_offset));
+
+      util::timer t;
+      LSN stage_start = volatile_read(stage.start_lsn);
+      ASSERT(stage_start.segment() == stage_end.segment());
+      redo_batch(stage_start, stage_end);
+      volatile_write(rep::replayed_lsn_offset, stage_end.offset());
+
+      uint64_t us = t.lap();
+      owner->redo_latency_us += us;
+      owner->max_redo_latency_us = std::max(owner->max_redo_latency_us, us);
+      ++owner->redo_batches;
+    }
+  }
+}
+}  // namespace ermia
@@ -112,6 +112,7 @@ void parallel_offset_replay::redo_runner::redo_logbuf_partition() {
     size += scan->payload_size();
     scan->next();
   }
+  owner->flush_index_inserts();
   redo_latency_us += t.lap();
   redo_size += size;
   ++redo_batches;
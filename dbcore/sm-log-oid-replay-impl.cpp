@@ -152,6 +152,7 @@ void parallel_oid_replay::redo_runner::redo_partition() {
     }
     size += scan->payload_size();
   }
+  owner->flush_index_inserts();
   ASSERT(icount <= iicount);  // No insert log record for 2nd index
   DLOG(INFO) << "[Recovery.log] OID partition " << oid_partition
              << " - inserts/updates/deletes/size: " << icount << "/" << ucount
@@ -9,6 +9,44 @@
 
 namespace ermia {
 
+namespace {
+// Backups: the index inserts a replay thread collected in its current
+// batch, see sm_log_recover_impl::flush_index_inserts
+struct index_batch {
+  struct entry {
+    OrderedIndex* index;
+    size_t key_offset;  // in [keys]
+    uint32_t key_size;
+    OID oid;
+  };
+  std::vector<entry> entries;
+  std::vector<char> keys;
+  // The primary's index FIDs to our indexes, null if unknown
+  std::unordered_map<FID, OrderedIndex*> indexes;
+};
+thread_local index_batch index_inserts;
+
+OrderedIndex* backup_index(FID fid) {
+  auto& indexes = index_inserts.indexes;
+  auto it = indexes.find(fid);
+  if (it != indexes.end()) {
+    return it->second;
+  }
+  // Both maps are filled before replay starts
+  OrderedIndex* index = nullptr;
+  auto name = TableDescriptor::upstream_index_fids.find(fid);
+  if (name != TableDescriptor::upstream_index_fids.end()) {
+    auto i = TableDescriptor::index_map.find(name->second);
+    if (i != TableDescriptor::index_map.end()) {
+      index = i->second;
+    }
+  }
+  LOG_IF(WARNING, !index) << "[Backup] No index for FID " << fid;
+  indexes[fid] = index;
+  return index;
+}
+}  // namespace
+
 // Returns something that we will install on the OID entry.
 fat_ptr sm_log_recover_impl::PrepareObject(
     sm_log_scan_mgr::record_scan* logrec) {
@@ -37,208 +75,158 @@ fat_ptr sm_log_recover_impl::PrepareObject(
 
 void sm_log_recover_impl::recover_insert(sm_log_scan_mgr::record_scan* logrec,
                                          bool latest) {
-#if 0
+  MARK_REFERENCED(latest);
+  // Backups only: the primary recovers tuples from the chkpt, its log
+  // replay can't tie records to tables (see recover_fid)
+  if (!config::is_backup_srv()) {
+    return;
+  }
   FID f = logrec->fid();
   OID o = logrec->oid();
-  if (config::is_backup_srv()) {
-    if (config::full_replay) {
-      oid_array* oa = get_impl(oidmgr)->get_array(f);
-      oa->ensure_size(o);
-      fat_ptr* entry_ptr = oa->get(o);
-      if (volatile_read(entry_ptr->_ptr) == 0) {
-        fat_ptr ptr = PrepareObject(logrec);
-        Object *obj = (Object*)ptr.offset();
-        // Fully instantiate the version
-        obj->Pin(config::persist_policy != config::kPersistAsync);
-        if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, 0, ptr._ptr)) {
-          MM::deallocate(ptr);
-        }
-      }
-    } else {
-      // Install a fat_ptr in the persistent array directly
-      fat_ptr ptr = logrec->payload_ptr();
-      FID pf = IndexDescriptor::Get(f)->GetPersistentAddressFid();
-      oid_array* oa = get_impl(oidmgr)->get_array(pf);
-      oa->ensure_size(o);
-      // Skip if a newer one is already there
-      fat_ptr* entry_ptr = oa->get(o);
-      if (volatile_read(entry_ptr->_ptr) == 0) {
-        __sync_bool_compare_and_swap(&entry_ptr->_ptr, 0, ptr._ptr);
+  if (!TableDescriptor::FidExists(f)) {
+    return;
+  }
+  TableDescriptor* td = TableDescriptor::Get(f);
+  if (config::full_replay) {
+    oid_array* oa = td->GetTupleArray();
+    oa->ensure_size(o + 1);
+    fat_ptr* entry_ptr = oa->get(o);
+    if (volatile_read(entry_ptr->_ptr) == 0) {
+      fat_ptr ptr = PrepareObject(logrec);
+      Object* obj = (Object*)ptr.offset();
+      // Fully instantiate the version
+      obj->Pin(config::persist_policy != config::kPersistAsync);
+      if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, 0, ptr._ptr)) {
+        MM::deallocate(ptr);
       }
     }
   } else {
-    fat_ptr ptr = PrepareObject(logrec);
-    ASSERT(oidmgr->file_exists(f));
-    oid_array* oa = get_impl(oidmgr)->get_array(f);
-    oa->ensure_size(o);
-    // The chkpt recovery process might have picked up this tuple already
-    if (latest) {
-      fat_ptr* entry_ptr = oa->get(o);
-      fat_ptr expected = *entry_ptr;
-      if (expected == NULL_PTR) {
-        __sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr, ptr._ptr);
-      } else {
-        MM::deallocate(ptr);
-      }
-    } else {
-      oidmgr->oid_put_new_if_absent(f, o, ptr);
-      ASSERT(oidmgr->oid_get(oa, o) == ptr);
+    // Install a fat_ptr in the persistent array directly
+    fat_ptr ptr = logrec->payload_ptr();
+    oid_array* oa = td->GetPersistentAddressArray();
+    oa->ensure_size(o + 1);
+    // Skip if a newer one is already there
+    fat_ptr* entry_ptr = oa->get(o);
+    if (volatile_read(entry_ptr->_ptr) == 0) {
+      __sync_bool_compare_and_swap(&entry_ptr->_ptr, 0, ptr._ptr);
     }
   }
-#endif
 }
 
 void sm_log_recover_impl::recover_index_insert(
     sm_log_scan_mgr::record_scan* logrec) {
-#if 0
-  // No need if the chkpt recovery already picked up this tuple
-  FID fid = logrec->fid();
-  IndexDescriptor* id = IndexDescriptor::Get(fid);
-  if (config::is_backup_srv() ||
-      oidmgr->oid_get(id->GetKeyArray(), logrec->oid()).offset() == 0) {
-    recover_index_insert(logrec, id->GetIndex());
+  // Backups only, the primary rebuilds its indexes from the chkpt
+  if (!config::is_backup_srv()) {
+    return;
+  }
+  OrderedIndex* index = backup_index(logrec->fid());
+  if (index) {
+    recover_index_insert(logrec, index);
   }
-#endif
 }
 
 void sm_log_recover_impl::recover_index_insert(
     sm_log_scan_mgr::record_scan* logrec, OrderedIndex* index) {
-#if 0
-  static const uint32_t kBufferSize = 8 * config::MB;
   ASSERT(index);
+  // The whole key varstr is logged, see transaction::LogIndexInsert
   auto sz = align_up(logrec->payload_size());
-  static thread_local char* buf = nullptr;
-  if (!buf) {
-    buf = (char*)malloc(kBufferSize);
-  }
-  char* payload_buf = nullptr;
-  ALWAYS_ASSERT(sz < kBufferSize);
-  if (config::is_backup_srv() ||
-      logrec->payload_lsn().offset() >= logmgr->durable_flushed_lsn_offset()) {
-    // In the log buffer, point directly to it without memcpy
-    ASSERT(config::is_backup_srv());
-    auto* logrec_impl = get_impl(logrec);
-    logrec_impl->scan.has_payloads =
-        true;  // FIXME(tzwang): do this in a better way
-    payload_buf = (char*)logrec_impl->scan.payload();
-    ALWAYS_ASSERT(payload_buf);
-  } else {
-    logrec->load_object(buf, sz);
-    payload_buf = buf;
-  }
-
-  // Extract the real key length (don't use varstr.data()!)
-  size_t len = ((varstr*)payload_buf)->size();
+  auto& b = index_inserts;
+  size_t off = b.keys.size();
+  b.keys.resize(off + sz);
+  logrec->load_object(&b.keys[off], sz);
+  uint32_t len = ((varstr*)&b.keys[off])->size();
   ASSERT(align_up(len + sizeof(varstr)) == sz);
+  b.entries.push_back(
+      index_batch::entry{index, off + sizeof(varstr), len, logrec->oid()});
+}
 
-  oid_array* ka = get_impl(oidmgr)->get_array(logrec->fid());
-  if (!config::is_backup_srv() &&
-      volatile_read(*ka->get(logrec->oid())) != NULL_PTR) {
+void sm_log_recover_impl::flush_index_inserts() {
+  auto& b = index_inserts;
+  if (b.entries.empty()) {
     return;
   }
-
-  varstr payload_key((char*)payload_buf + sizeof(varstr), len);
-  // FIXME(tzwang): support other index types
-  if (((ConcurrentMasstreeIndex*)index)->masstree_.insert_if_absent(payload_key, logrec->oid(),
-                                                     NULL)) {
-    // Don't add the key on backup - on backup chkpt will traverse OID arrays
-    if (!config::is_backup_srv()) {
-      // Construct the varkey to be inserted in the oid array
-      // (skip the varstr struct then it's data)
-      varstr* key = (varstr*)MM::allocate(sizeof(varstr) + len);
-      new (key) varstr((char*)key + sizeof(varstr), len);
-      key->copy_from((char*)payload_buf + sizeof(varstr), len);
-      volatile_write(*ka->get(logrec->oid()),
-                     fat_ptr::make((void*)key, INVALID_SIZE_CODE));
-    }
+  const char* keys = b.keys.data();
+  std::sort(b.entries.begin(), b.entries.end(),
+            [keys](const index_batch::entry& x, const index_batch::entry& y) {
+              if (x.index != y.index) {
+                return x.index < y.index;
+              }
+              int c = memcmp(keys + x.key_offset, keys + y.key_offset,
+                             std::min(x.key_size, y.key_size));
+              return c < 0 or (c == 0 and x.key_size < y.key_size);
+            });
+  for (auto& e : b.entries) {
+    // Keys stay in the index once inserted, so a key that is already
+    // there maps to the same OID
+    varstr key(keys + e.key_offset, e.key_size);
+    // FIXME(tzwang): support other index types
+    sync_wait_coro(((ConcurrentMasstreeIndex*)e.index)
+                       ->GetMasstree()
+                       .insert_if_absent(key, e.oid, nullptr));
   }
-#endif
+  b.entries.clear();
+  b.keys.clear();
 }
 
 void sm_log_recover_impl::recover_update(sm_log_scan_mgr::record_scan* logrec,
                                          bool is_delete, bool latest) {
-#if 0
+  MARK_REFERENCED(is_delete);
+  MARK_REFERENCED(latest);
+  // Backups only, see recover_insert
+  if (!config::is_backup_srv()) {
+    return;
+  }
   FID f = logrec->fid();
   OID o = logrec->oid();
-  ASSERT(oidmgr->file_exists(f));
-
-  if (config::is_backup_srv()) {
-    // Deletes on backups are handled the same way as updates, just
-    // with an empty payload
-    if (config::full_replay) {
-      auto* oa = IndexDescriptor::Get(f)->GetTupleArray();
-      fat_ptr* entry_ptr = oa->get(o);
-      fat_ptr ptr = NULL_PTR;
-      bool success = false;
-    retry_install_obj:
-      fat_ptr expected = volatile_read(*entry_ptr);
-      Object* head_obj = (Object*)expected.offset();
-      if (!head_obj ||
-          head_obj->GetClsn().offset() < logrec->payload_ptr().offset()) {
-        Object* new_obj = nullptr;
-        if (ptr == NULL_PTR) {
-          ptr = PrepareObject(logrec);
-          new_obj = (Object*)ptr.offset();
-          // Fully instantiate the version
-          new_obj->Pin(config::persist_policy != config::kPersistAsync);
-        }
-        new_obj = (Object*)ptr.offset();
-        new_obj->SetNextVolatile(expected);
-        if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr,
-                                          ptr._ptr)) {
-          goto retry_install_obj;
-        }
-        success = true;
-      }
-      if (ptr != NULL_PTR && !success) {
-        MM::deallocate(ptr);
+  if (!TableDescriptor::FidExists(f)) {
+    return;
+  }
+  TableDescriptor* td = TableDescriptor::Get(f);
+  // Deletes on backups are handled the same way as updates, just
+  // with an empty payload
+  if (config::full_replay) {
+    auto* oa = td->GetTupleArray();
+    oa->ensure_size(o + 1);
+    fat_ptr* entry_ptr = oa->get(o);
+    fat_ptr ptr = NULL_PTR;
+    bool success = false;
+  retry_install_obj:
+    fat_ptr expected = volatile_read(*entry_ptr);
+    Object* head_obj = (Object*)expected.offset();
+    if (!head_obj ||
+        head_obj->GetClsn().offset() < logrec->payload_ptr().offset()) {
+      if (ptr == NULL_PTR) {
+        ptr = PrepareObject(logrec);
+        // Fully instantiate the version
+        ((Object*)ptr.offset())
+            ->Pin(config::persist_policy != config::kPersistAsync);
       }
-    } else {
-      FID pf = IndexDescriptor::Get(f)->GetPersistentAddressFid();
-      oid_array* oa = get_impl(oidmgr)->get_array(pf);
-      fat_ptr* entry_ptr = oa->get(o);
-      fat_ptr ptr = logrec->payload_ptr();
-    retry_backup:
-      fat_ptr expected = *entry_ptr;
-      ASSERT(expected.asi_type() == 0 ||
-             expected.asi_type() == fat_ptr::ASI_LOG);
-      if (expected.offset() < ptr.offset()) {
-        if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr,
-                                          ptr._ptr)) {
-          goto retry_backup;
-        }
+      ((Object*)ptr.offset())->SetNextVolatile(expected);
+      if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr,
+                                        ptr._ptr)) {
+        goto retry_install_obj;
       }
+      success = true;
+    }
+    if (ptr != NULL_PTR && !success) {
+      MM::deallocate(ptr);
     }
   } else {
-    ALWAYS_ASSERT(!is_delete);  // Primary ignores delete before reaching here
-    // FIXME(tzwang): during recovery the primary only uses parallel OID replay,
-    // so no write-write-conflicts possible, so we can simply skip deletes here.
-    auto* oa = IndexDescriptor::Get(f)->GetTupleArray();
-    fat_ptr head_ptr = *oa->get(o);
-    fat_ptr ptr = PrepareObject(logrec);
-    Object* new_object = (Object*)ptr.offset();
-    if (latest) {
-    retry_primary:
-      fat_ptr* entry_ptr = oa->get(o);
-      fat_ptr expected = *entry_ptr;
-      new_object->SetNextVolatile(expected);
-      // Go in to see LSN
-      ASSERT(expected.offset());
-      Object* obj = (Object*)expected.offset();
-      if (obj->GetPersistentAddress().offset() <
-          logrec->payload_lsn().offset()) {
-        if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr,
-                                          ptr._ptr)) {
-          goto retry_primary;
-        }
-      } else {
-        MM::deallocate(ptr);
+    oid_array* oa = td->GetPersistentAddressArray();
+    oa->ensure_size(o + 1);
+    fat_ptr* entry_ptr = oa->get(o);
+    fat_ptr ptr = logrec->payload_ptr();
+  retry_backup:
+    fat_ptr expected = volatile_read(*entry_ptr);
+    ASSERT(expected.asi_type() == 0 ||
+           expected.asi_type() == fat_ptr::ASI_LOG);
+    if (expected.offset() < ptr.offset()) {
+      if (!__sync_bool_compare_and_swap(&entry_ptr->_ptr, expected._ptr,
+                                        ptr._ptr)) {
+        goto retry_backup;
       }
-    } else {
-      oidmgr->oid_put(oa, o, ptr);
     }
   }
-#endif
 }
 
 void sm_log_recover_impl::recover_update_key(
@@ -23,6 +23,10 @@ struct sm_log_recover_impl {
   OrderedIndex *recover_fid(sm_log_scan_mgr::record_scan *logrec);
   void recover_index_insert(sm_log_scan_mgr::record_scan *logrec,
                             OrderedIndex *index);
+  // Backups: insert the keys recover_index_insert collected on this
+  // thread, index by index in key order. Replay threads call this at the
+  // end of each batch they replay, before it counts as replayed.
+  void flush_index_inserts();
 
   // The main recovery function; the inheriting class should implement this
   // The implementation shall replay the log from position [from] until [to],
@@ -92,4 +96,96 @@ struct parallel_offset_replay : public sm_log_recover_impl {
   virtual LSN operator()(void *arg, sm_log_scan_mgr *scanner, LSN from,
                          LSN to);
 };
+
+// Log shipping replay that decodes each shipped batch only once: a decoder
+// thread scans the batch and hands every record to one of the redo threads
+// by hashing its (FID, OID), so each redo thread owns a disjoint set of OIDs
+// and replays them in log order without rescanning the log or contending
+// with the others. Records are handed over as (block LSN, index) positions
+// through one single-producer/single-consumer ring per redo thread.
+// Follows the same pipeline stages as parallel_offset_replay, but doesn't
+// need the primary's log buffer partition bounds. Also tracks how far each
+// table is replayed, so that read-only transactions that declare their
+// tables don't wait for the rest of a batch (see rep::GetReadView).
+struct parallel_hash_replay : public sm_log_recover_impl {
+  static const uint32_t kQueueSize = 4096;  // must be a power of two
+
+  struct record_pos {
+    LSN block;
+    uint32_t index;
+  };
+
+  struct redo_runner : public thread::Runner {
+    parallel_hash_replay *owner;
+    record_pos queue[kQueueSize];
+    // The decoder bumps [tail] after adding a record; we bump [head] only
+    // after replaying one, so head == tail means all handed over so far
+    // is replayed.
+    std::atomic<uint64_t> head CACHE_ALIGNED;
+    std::atomic<uint64_t> tail CACHE_ALIGNED;
+    uint64_t redo_records;
+
+    redo_runner(parallel_hash_replay *o)
+        : thread::Runner(), owner(o), head(0), tail(0), redo_records(0) {}
+    virtual void MyWork(char *);
+    // Returns how many records were handed over so far
+    uint64_t push(const record_pos &pos);
+    inline bool drained() {
+      return head.load(std::memory_order_acquire) ==
+             tail.load(std::memory_order_relaxed);
+    }
+  };
+
+  struct decode_runner : public thread::Runner {
+    // A table's records in the current batch are replayed once every redo
+    // thread got past [marks]
+    struct table_progress {
+      TableDescriptor *td;
+      uint64_t batch;  // the last batch that had records of this table
+      std::vector<uint64_t> marks;
+    };
+
+    parallel_hash_replay *owner;
+    std::vector<table_progress> tables;
+    // Tuple and key array FIDs to [tables] entries
+    std::unordered_map<FID, uint32_t> fid_tables;
+    uint64_t batch;
+
+    decode_runner(parallel_hash_replay *o)
+        : thread::Runner(), owner(o), batch(0) {}
+    virtual void MyWork(char *);
+    void redo_batch(LSN start_lsn, LSN end_lsn);
+    void publish_tables(LSN end_lsn, bool untracked);
+  };
+
+  uint32_t nredoers;
+  std::vector<struct redo_runner *> redoers;
+  decode_runner *decoder;
+  sm_log_scan_mgr *scanner;
+
+  // Updated by the decoder only. Each batch's latency runs from when it
+  // became available for replay until all of it is replayed, i.e., how
+  // stale read views on this backup get.
+  uint64_t redo_records;
+  uint64_t redo_size;
+  uint64_t redo_batches;
+  uint64_t redo_latency_us;
+  uint64_t max_redo_latency_us;
+
+  // One of the replay threads decodes, the rest replay
+  parallel_hash_replay()
+      : nredoers(config::replay_threads - 1),
+        decoder(nullptr),
+        scanner(nullptr),
+        redo_records(0),
+        redo_size(0),
+        redo_batches(0),
+        redo_latency_us(0),
+        max_redo_latency_us(0) {
+    LOG(INFO) << "[Backup] 1 decoder and " << nredoers << " replay threads";
+  }
+  virtual ~parallel_hash_replay() {}
+  virtual LSN operator()(void *arg, sm_log_scan_mgr *scanner, LSN from,
+                         LSN to);
+};
 }  // namespace ermia
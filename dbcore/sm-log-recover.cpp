@@ -32,7 +32,9 @@ sm_log_recover_mgr::sm_log_recover_mgr(sm_log_recover_impl *rf, void *rf_arg)
   auto *sid = get_segment(dlsn.segment());
   if (config::is_backup_srv()) {
     if (config::replay_threads > 0 && config::replay_policy != config::kReplayNone) {
-      if (config::log_ship_offset_replay) {
+      if (config::log_ship_hash_replay) {
+        backup_replay_functor = new parallel_hash_replay;
+      } else if (config::log_ship_offset_replay) {
         backup_replay_functor = new parallel_offset_replay;
       } else {
         backup_replay_functor = new parallel_oid_replay(config::replay_threads);
@@ -151,7 +153,8 @@ void sm_log_recover_mgr::block_scanner::_load_block(LSN x,
       // backed logbuf is already flushed, ie durable_flushed_lsn ==
       // durable_lsn.
       _cur_block = _buf;
-      return i + os_pread(sid->fd, ((char *)_buf) + i, nbytes - i, offset + i);
+      return i + _lm->pread_segment(sid, ((char *)_buf) + i, nbytes - i,
+                                    offset + i);
     }
   };
 
@@ -291,7 +294,7 @@ void sm_log_recover_mgr::load_object(char *buf, size_t bufsz, fat_ptr ptr,
     return load_object_from_logbuf(buf, bufsz, ptr, align_bits);
   }
 
-  size_t m = os_pread(sid->fd, buf, nbytes, ptr.offset() - sid->start_offset);
+  size_t m = pread_segment(sid, buf, nbytes, ptr.offset() - sid->start_offset);
   LOG_IF(FATAL, m != nbytes) << "Unable to read full object ("
     << nbytes << " bytes needed, " << m << " read) at " << std::hex << ptr.offset()
     << " ,durable offset " << logmgr->durable_flushed_lsn().offset() << std::dec;
@@ -348,6 +351,17 @@ LSN sm_log_scan_mgr::record_scan::block_lsn() {
   return get_impl(this)->scan._bscan->lsn;
 }
 
+uint32_t sm_log_scan_mgr::record_scan::record_index() {
+  return get_impl(this)->scan._i;
+}
+
+void sm_log_scan_mgr::record_scan::seek(LSN block, uint32_t i) {
+  auto *impl = get_impl(this);
+  impl->scan._bscan._overflow_chain.clear();
+  impl->scan._bscan._load_block(block, false);
+  impl->scan._i = i;
+}
+
 // same!
 void sm_log_scan_mgr::header_scan::next() { ++get_impl(this)->scan; }
 void sm_log_scan_mgr::record_scan::next() { ++get_impl(this)->scan; }
@@ -0,0 +1,237 @@
+#include "sm-log-uring.h"
+
+#include "sm-common.h"
+#include "sm-exceptions.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace ermia {
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      nullptr, 0);
+}
+
+static void *map_ring(int fd, size_t size, off_t what) {
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, what);
+  THROW_IF(p == MAP_FAILED, os_error, errno, "Unable to map io_uring");
+  return p;
+}
+
+bool log_uring_writer::available() {
+  static bool const ok = [] {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(1, &p);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }();
+  return ok;
+}
+
+log_uring_writer::log_uring_writer(sm_log_file_mgr *lm, uint32_t depth,
+                                   uint64_t max_bytes)
+    : _lm(lm),
+      _depth(depth),
+      _max_bytes(max_bytes),
+      _fd(-1),
+      _fd_segnum(0),
+      _tail_offset(0),
+      _tail_valid(false) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  _ring_fd = sys_io_uring_setup(_depth, &p);
+  THROW_IF(_ring_fd < 0, os_error, errno, "Unable to set up io_uring");
+
+  _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+  }
+  _sq_ptr = map_ring(_ring_fd, _sq_ring_size, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    _cq_ptr = _sq_ptr;
+  } else {
+    _cq_ptr = map_ring(_ring_fd, _cq_ring_size, IORING_OFF_CQ_RING);
+  }
+  _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = (struct io_uring_sqe *)map_ring(_ring_fd, _sqes_size,
+                                          IORING_OFF_SQES);
+
+  char *sq = (char *)_sq_ptr;
+  _sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  _sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  _sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = (char *)_cq_ptr;
+  _cq_head = (unsigned *)(cq + p.cq_off.head);
+  _cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  _cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  _stage_size = align_up(_max_bytes, kPageSize) + 2 * kPageSize;
+  _stage = (char *)mmap(nullptr, _stage_size + kPageSize,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  THROW_IF(_stage == MAP_FAILED, os_error, errno,
+           "Unable to allocate log staging buffer");
+  _tail = _stage + _stage_size;
+}
+
+log_uring_writer::~log_uring_writer() {
+  if (_fd >= 0) {
+    os_close(_fd);
+  }
+  munmap(_stage, _stage_size + kPageSize);
+  munmap(_sqes, _sqes_size);
+  if (_cq_ptr != _sq_ptr) {
+    munmap(_cq_ptr, _cq_ring_size);
+  }
+  munmap(_sq_ptr, _sq_ring_size);
+  close(_ring_fd);
+}
+
+void log_uring_writer::submit_write(char const *buf, uint32_t len,
+                                    uint64_t offset, uint64_t tag) {
+  // We are the only producer, and never have more than _depth entries
+  // outstanding, so the submission queue cannot overflow.
+  unsigned tail = *_sq_tail;
+  unsigned idx = tail & *_sq_mask;
+  struct io_uring_sqe *sqe = &_sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = _fd;
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->rw_flags = RWF_DSYNC;
+  sqe->user_data = tag;
+  _sq_array[idx] = idx;
+  __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void log_uring_writer::enter(uint32_t to_submit, uint32_t min_complete) {
+  int ret;
+  do {
+    ret = sys_io_uring_enter(_ring_fd, to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 and errno == EINTR);
+  THROW_IF(ret < 0, os_error, errno, "io_uring_enter failed");
+}
+
+uint64_t log_uring_writer::write(segment_id *sid, char const *buf,
+                                 uint64_t nbytes, uint64_t offset) {
+  THROW_IF(nbytes > _max_bytes, illegal_argument,
+           "Log write of %zd bytes exceeds the staging buffer", nbytes);
+  if (_fd < 0 or _fd_segnum != sid->segnum) {
+    if (_fd >= 0) {
+      os_close(_fd);
+    }
+    _fd = _lm->open_for_direct_write(sid);
+    _fd_segnum = sid->segnum;
+    _tail_valid = false;
+  }
+
+  // Rebuild the first page if the write doesn't start on a page boundary
+  uint64_t head = offset % kPageSize;
+  uint64_t page = offset - head;
+  if (head) {
+    if (_tail_valid and _tail_offset == page) {
+      memcpy(_stage, _tail, head);
+    } else {
+      memset(_stage, 0, kPageSize);
+      ssize_t m = pread(_fd, _stage, kPageSize, page);
+      THROW_IF(m < 0, os_error, errno, "Unable to read log page at %zd",
+               page);
+    }
+  }
+  memcpy(_stage + head, buf, nbytes);
+  uint64_t total = head + nbytes;
+  uint64_t full = total - total % kPageSize;
+
+  // Zero-fill the last partial page so it goes out whole with the rest
+  uint64_t padded = align_up(total, kPageSize);
+  memset(_stage + total, 0, padded - total);
+
+  // Spread the pages over the queue depth, but not in tiny pieces
+  uint64_t chunk = std::max(
+      kMinChunkSize, align_up((padded + _depth - 1) / _depth, kPageSize));
+  chunk = std::min<uint64_t>(chunk, uint64_t{1} << 30);
+
+  struct request {
+    uint64_t start;
+    uint32_t len;
+  };
+  std::vector<request> requests(_depth);
+  std::vector<uint32_t> free_slots;
+  for (uint32_t i = 0; i < _depth; ++i) {
+    free_slots.push_back(i);
+  }
+
+  uint64_t next = 0;
+  uint32_t inflight = 0;
+  uint32_t to_submit = 0;
+  while (next < padded or inflight) {
+    while (next < padded and not free_slots.empty()) {
+      uint32_t slot = free_slots.back();
+      free_slots.pop_back();
+      uint32_t len = std::min(chunk, padded - next);
+      requests[slot] = {next, len};
+      submit_write(_stage + next, len, page + next, slot);
+      next += len;
+      ++inflight;
+      ++to_submit;
+    }
+    enter(to_submit, 1);
+    to_submit = 0;
+
+    unsigned head_idx = *_cq_head;
+    while (head_idx != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &_cqes[head_idx & *_cq_mask];
+      uint32_t slot = (uint32_t)cqe->user_data;
+      int res = cqe->res;
+      ++head_idx;
+      THROW_IF(res < 0, os_error, -res, "Error writing log at offset %zd",
+               page + requests[slot].start);
+      THROW_IF(res == 0, log_file_error, "Incomplete log write");
+      request &r = requests[slot];
+      if ((uint32_t)res < r.len) {
+        r.start += res;
+        r.len -= res;
+        submit_write(_stage + r.start, r.len, page + r.start, slot);
+        ++to_submit;
+      } else {
+        free_slots.push_back(slot);
+        --inflight;
+      }
+    }
+    __atomic_store_n(_cq_head, head_idx, __ATOMIC_RELEASE);
+  }
+
+  // Keep the partial last page; the next write rewrites it in full
+  if (total % kPageSize) {
+    memcpy(_tail, _stage + full, total - full);
+    _tail_offset = page + full;
+    _tail_valid = true;
+  } else {
+    _tail_valid = false;
+  }
+  return nbytes;
+}
+
+}  // namespace ermia
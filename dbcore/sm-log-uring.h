@@ -0,0 +1,101 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include "sm-log-file.h"
+
+namespace ermia {
+
+/* Asynchronous, direct-I/O log writer.
+
+   The default log flusher writes each flush with one blocking
+   pwrite on an O_SYNC file descriptor, so there is only ever one
+   write outstanding and every write also waits for the file's
+   metadata. With config::log_uring the flusher hands its flushes to
+   this writer instead, which:
+
+   - opens segment files with O_DIRECT, bypassing the page cache;
+
+   - splits each flush into up to config::log_uring_depth chunks and
+     submits them all at once through io_uring, so the device works
+     on them in parallel;
+
+   - asks for per-write data durability (RWF_DSYNC, i.e. fdatasync
+     semantics) instead of O_SYNC;
+
+   - writes into segment files that were fallocate()d when they were
+     created (see sm_log_file_mgr::_create_nxt_seg_file), so writes
+     never have to allocate blocks.
+
+   O_DIRECT needs page-aligned buffers, offsets and lengths, while
+   flushes end wherever the oldest in-flight log block starts. The
+   writer therefore copies each flush into an aligned staging buffer,
+   zero-fills the last partial page and writes every page, that one
+   included, in the same batch. It remembers the partial page and
+   prepends it to the next flush, which writes the page again, instead
+   of reading it back. Segment files can thus run up to a page past
+   the log end; recovery stops at the first invalid block and trims
+   the file, and backup bootstrap goes by the durable LSN rather than
+   the file size (see rep::LogFileDataSize).
+
+   The ring is driven with raw syscalls so we don't need liburing.
+ */
+struct log_uring_writer {
+  static const uint64_t kPageSize = 4096;
+  static const uint64_t kMinChunkSize = 64 * 1024;
+
+  log_uring_writer(sm_log_file_mgr *lm, uint32_t depth, uint64_t max_bytes);
+  ~log_uring_writer();
+
+  /* Whether the running kernel supports io_uring (checked once).
+   */
+  static bool available();
+
+  /* Durably write [nbytes] from [buf] at segment offset [offset] of
+     [sid]; returns once all of it is on stable storage. [nbytes] must
+     not exceed the [max_bytes] given at construction.
+   */
+  uint64_t write(segment_id *sid, char const *buf, uint64_t nbytes,
+                 uint64_t offset);
+
+ private:
+  void submit_write(char const *buf, uint32_t len, uint64_t offset,
+                    uint64_t tag);
+  void enter(uint32_t to_submit, uint32_t min_complete);
+
+  sm_log_file_mgr *_lm;
+  uint32_t _depth;
+  uint64_t _max_bytes;
+
+  int _ring_fd;
+  void *_sq_ptr;
+  size_t _sq_ring_size;
+  void *_cq_ptr;
+  size_t _cq_ring_size;
+  struct io_uring_sqe *_sqes;
+  size_t _sqes_size;
+  unsigned *_sq_tail;
+  unsigned *_sq_mask;
+  unsigned *_sq_array;
+  unsigned *_cq_head;
+  unsigned *_cq_tail;
+  unsigned *_cq_mask;
+  struct io_uring_cqe *_cqes;
+
+  // Page-aligned staging area: one page of carried-over tail plus
+  // [_max_bytes] plus one page of padding
+  char *_stage;
+  uint64_t _stage_size;
+
+  // The segment file currently open for writing, and its segment
+  // number (segment_ids can be reused once reclaimed)
+  int _fd;
+  uint32_t _fd_segnum;
+
+  // Copy of the last, partially filled page written to [_fd_segnum]
+  char *_tail;
+  uint64_t _tail_offset;
+  bool _tail_valid;
+};
+
+}  // namespace ermia
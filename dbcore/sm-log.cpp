@@ -69,6 +69,8 @@ void sm_log::BackupFlushLog(uint64_t new_dlsn_offset) {
   return get_impl(this)->_lm.BackupFlushLog(new_dlsn_offset);
 }
 
+void sm_log::BackupPromote() { get_impl(this)->_lm.BackupPromote(); }
+
 void sm_log::enqueue_committed_xct(uint32_t worker_id, uint64_t start_time) {
   get_impl(this)->_lm.enqueue_committed_xct(worker_id, start_time);
 }
@@ -79,6 +81,14 @@ void sm_log::update_chkpt_mark(LSN cstart, LSN cend) {
   get_impl(this)->_lm._lm.update_chkpt_mark(cstart, cend);
 }
 
+uint32_t sm_log::reclaim_segments(uint64_t offset, uint64_t (*limit)()) {
+  return get_impl(this)->_lm._lm.reclaim_upto(offset, limit);
+}
+
+void sm_log::lock_segments() { get_impl(this)->_lm._lm.lock_segments(); }
+
+void sm_log::unlock_segments() { get_impl(this)->_lm._lm.unlock_segments(); }
+
 void sm_log::load_object(char *buf, size_t bufsz, fat_ptr ptr,
                          size_t align_bits) {
   get_impl(this)->_lm._lm.load_object(buf, bufsz, ptr, align_bits);
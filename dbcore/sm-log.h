@@ -193,6 +193,17 @@ struct sm_log_scan_mgr {
 
     LSN block_lsn();
 
+    /* Return the index of the current record within its log block */
+    uint32_t record_index();
+
+    /* Reposition the cursor on record [i] of the log block at [block],
+       e.g., one found by another scan (see block_lsn and
+       record_index). Meant for replay threads that are handed records
+       by a decoding scan of the log buffer on backups, where this
+       neither copies nor re-reads the block.
+    */
+    void seek(LSN block, uint32_t i);
+
     /* Copy the current record's payload into [buf]. Throw
        illegal_argument if the record has no payload, or the payload
        is larger than [bufsz], or the record does not reside in the
@@ -333,6 +344,19 @@ struct sm_log {
   static window_buffer *logbuf;
 
   void update_chkpt_mark(LSN cstart, LSN cend);
+
+  /* Delete (or recycle) the log segments that end at or before LSN
+     offset [offset], which must not be past the checkpoint mark.
+     Returns the number of segments reclaimed. [limit], if given, is
+     evaluated while segments are locked and caps [offset].
+   */
+  uint32_t reclaim_segments(uint64_t offset, uint64_t (*limit)() = nullptr);
+
+  /* Keep reclaim_segments from running until unlock_segments, e.g.
+     while pinning what its limit reads.
+   */
+  void lock_segments();
+  void unlock_segments();
   LSN flush();
   void set_tls_lsn_offset(uint64_t offset);
   uint64_t get_tls_lsn_offset();
@@ -398,6 +422,9 @@ struct sm_log {
   static window_buffer *get_logbuf();
   segment_id *assign_segment(uint64_t lsn_begin, uint64_t lsn_end);
   void BackupFlushLog(uint64_t new_dlsn_offset);
+  // Backup taking over: start allocating from the durable LSN like a
+  // primary; the log must be flushed and nobody writing it
+  void BackupPromote();
   segment_id *get_segment(uint32_t segnum);
   void redo_log(LSN start_lsn, LSN end_lsn);
   LSN backup_redo_log_by_oid(LSN start_lsn, LSN end_lsn);
@@ -77,7 +77,8 @@ void Object::Pin(bool load_from_logbuf) {
     ASSERT(tuple->size < data_sz);
     if (tuple->size == 0) {
       final_status = kStatusDeleted;
-      ASSERT(next_pdest_.offset());
+      // Only filled in above on backups
+      ASSERT(!config::is_backup_srv() || next_pdest_.offset());
     }
     memmove(tuple->get_value_start(),
             (char *)tuple->get_value_start() + sizeof(varstr), tuple->size);
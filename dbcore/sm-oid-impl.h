@@ -55,6 +55,16 @@ struct sm_oid_mgr_impl : sm_oid_mgr {
      unlikely.
    */
   os_mutex mutexen[MUTEX_COUNT];
+
+  /* (allocator FID, array) pairs the prefault daemon keeps ahead of
+     the allocator's high water mark.
+   */
+  std::vector<std::pair<FID, oid_array *>> prefault_arrays;
+  os_mutex prefault_mutex;
+
+  // The prefault daemon, if any, runs until told to stop on teardown
+  std::thread prefault_thread;
+  std::atomic<bool> prefault_stop{false};
 };
 
 /* Make sure things are consistent */
@@ -1,13 +1,16 @@
 #include <fcntl.h>
+#include <numa.h>
 #include <unistd.h>
 
 #include <map>
+#include <thread>
 
 #include "../ermia.h"
 #include "../txn.h"
 #include "../util.h"
 
 #include "burt-hash.h"
+#include "rcu.h"
 #include "sc-hash.h"
 #include "sm-alloc.h"
 #include "sm-chkpt.h"
@@ -190,16 +193,39 @@ fat_ptr oid_array::make() {
   return fat_ptr::make(rval, 1);
 }
 
-void oid_array::destroy(oid_array *oa) { oa->~oid_array(); }
+void oid_array::destroy(oid_array *oa) {
+  if (oa->_dirty) {
+    munmap(oa->_dirty, DIRTY_WORDS * sizeof(uint64_t));
+  }
+  oa->~oid_array();
+}
 
-oid_array::oid_array(dynarray &&self) : _backing_store(std::move(self)) {
+oid_array::oid_array(dynarray &&self)
+    : _backing_store(std::move(self)), _dirty(nullptr) {
   ASSERT(this == (void *)_backing_store.data());
 }
 
+void oid_array::track_dirty() {
+  if (_dirty) {
+    return;
+  }
+  // 1MB of bits covers all 4G OIDs; untouched parts are never backed
+  void *p = mmap(nullptr, DIRTY_WORDS * sizeof(uint64_t),
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  THROW_IF(p == MAP_FAILED, os_error, errno,
+           "Unable to allocate dirty page bitmap");
+  _dirty = (uint64_t *)p;
+}
+
 void oid_array::ensure_size(size_t n) {
   _backing_store.ensure_size(OFFSETOF(oid_array, _entries[n]));
 }
 
+void oid_array::ensure_size(size_t n, size_t extra) {
+  _backing_store.ensure_size(OFFSETOF(oid_array, _entries[n]), extra);
+}
+
 sm_oid_mgr_impl::sm_oid_mgr_impl() {
   /* Bootstrap the OBJARRAY, which contains everything (including
      itself). Then seed it with OID arrays for allocators and
@@ -243,6 +269,11 @@ sm_oid_mgr_impl::sm_oid_mgr_impl() {
 }
 
 sm_oid_mgr_impl::~sm_oid_mgr_impl() {
+  if (prefault_thread.joinable()) {
+    prefault_stop.store(true);
+    prefault_thread.join();
+  }
+
   oid_mutex.lock();
   DEFER(oid_mutex.unlock());
 
@@ -401,103 +432,154 @@ oid_array *sm_oid_mgr::get_array(FID f) { return get_impl(this)->get_array(f); }
 
 void sm_oid_mgr::create() {
   // Create an empty oidmgr, with initial internal files
-  oidmgr = new sm_oid_mgr_impl{};
+  auto *om = new sm_oid_mgr_impl{};
+  oidmgr = om;
   oidmgr->dfd = dirent_iterator(config::log_dir.c_str()).dup();
+  if (config::oid_array_prefault_mb) {
+    om->prefault_thread = std::thread(&sm_oid_mgr::prefault_daemon, om);
+  }
 }
 
-void sm_oid_mgr::PrimaryTakeChkpt() {
-#if 0
+void sm_oid_mgr::PrimaryTakeChkpt(LSN parent) {
   ASSERT(!config::is_backup_srv());
-  // Now the real work. The format of a chkpt file is:
-  // [number of indexes]
-  // [primary index 1 name length, name, tuple/key FID, himark]
-  // [primary index 2 name length, name, tuple/key FID, himark]
-  // ...
-  // [2nd index 1 name length, name, FID, himark]
-  // [2nd index 2 name length, name, FID, himark]
+  bool full = parent == INVALID_LSN;
+  // The format of a chkpt is:
+  // [parent chkpt start LSN, INVALID_LSN for a full chkpt]
+  // [number of tables]
+  // [table 1 name length, name, tuple/key FID, himark]
+  // [table 2 name length, name, tuple/key FID, himark]
   // ...
+  // [number of chunks, node of each chunk (see sm_chkpt_mgr)]
   //
-  // [index 1 himark]
-  // [index 1 tuple_fid, key_fid]
-  // [OID1, key and/or data]
-  // [OID2, key and/or data]
-  // [index 1 himark]
+  // followed by sections of data, in the manifest itself if there are
+  // no chunks, or spread over the chunks otherwise:
+  // [table 1 himark]
+  // [table 1 tuple_fid, key_fid]
+  // [OID1, key length, key, size code, object]
+  // [OID2, key length, key, size code, object]
+  // [table 1 himark]
   // ...
-  // same thing for index 2
-  // ...
-
-  // Write the number of indexes
-  // TODO(tzwang): handle dynamically created tables/indexes
-  uint64_t chkpt_size = 0;
-  uint32_t num_idx = IndexDescriptor::NumIndexes();
-  chkptmgr->write_buffer(&num_idx, sizeof(uint32_t));
-  chkpt_size += sizeof(uint32_t);
-
-  // Write details about each primary index, then secondary index
-  // so that during recovery we have primary indexes first and then
-  // 2nd indexes can refer to the FID of the corresponding primary.
-  bool handling_2nd = false;
-iterate_index:
-  for (auto &fm : IndexDescriptor::name_map) {
-    IndexDescriptor *id = fm.second;
-    if (!((id->IsPrimary() && !handling_2nd) || (!id->IsPrimary() && handling_2nd))) {
-      continue;
+  // Each section covers up to kSectionOids OIDs of a table.
+  //
+  // A full chkpt has a record for every live OID. An incremental one
+  // (with a parent) has one for every OID in the pages that changed
+  // since the parent was taken; OIDs that became empty there get a
+  // tombstone: [OID, key length 0].
+  static const OID kSectionOids = oid_array::DIRTY_PAGE_ENTRIES * 64 * 32;
+
+  // Consume the dirty bits before reading himarks: an insert marks its
+  // page only after allocating the OID, so any page whose bit we take
+  // has all its changed OIDs below the himark. Entries must be mapped
+  // before they can be changed, so the array's current size bounds the
+  // bits to look at. A full chkpt covers everything anyway, but still
+  // resets the bits so the next one can be incremental.
+  struct table_state {
+    TableDescriptor *td;
+    OID himark;
+    std::vector<uint64_t> dirty;
+  };
+  std::vector<table_state> tables;
+  for (auto &nm : TableDescriptor::name_map) {
+    TableDescriptor *td = nm.second;
+    oid_array *oa = td->GetTupleArray();
+    tables.push_back(table_state{td, 0, {}});
+    table_state &ts = tables.back();
+    if (oa->tracks_dirty()) {
+      size_t nwords = std::min<size_t>(
+          oa->nentries() / oid_array::DIRTY_PAGE_ENTRIES / 64 + 1,
+          oid_array::DIRTY_WORDS);
+      for (size_t i = 0; i < nwords; ++i) {
+        uint64_t w = oa->take_dirty(i);
+        if (!full) {
+          ts.dirty.push_back(w);
+        }
+      }
+    } else {
+      ALWAYS_ASSERT(full);
     }
-    size_t len = id->GetName().length();
-    FID tuple_fid = id->GetTupleFid();
-    FID key_fid = id->GetKeyFid();
-    auto *alloc = get_impl(this)->get_allocator(tuple_fid);
-    OID himark = alloc->head.hiwater_mark;
-
-    // [Name length, name, tuple/key FID, himark]
-    chkptmgr->write_buffer(&len, sizeof(size_t));
-    chkptmgr->write_buffer((void *)id->GetName().c_str(), len);
-    chkptmgr->write_buffer(&tuple_fid, sizeof(FID));
-    chkptmgr->write_buffer(&key_fid, sizeof(FID));
-    chkptmgr->write_buffer(&himark, sizeof(OID));
-    chkpt_size += (sizeof(size_t) + len + sizeof(FID) + sizeof(OID));
+    auto *alloc = get_impl(this)->get_allocator(td->GetTupleFid());
+    ts.himark = volatile_read(alloc->head.hiwater_mark);
   }
-  if (!handling_2nd) {
-    handling_2nd = true;
-    goto iterate_index;
-  }
-  LOG(INFO) << "[Checkpoint] header size: " << chkpt_size;
 
-  // Write keys and/or tuples for each index, primary first
-  for (auto &fm : IndexDescriptor::name_map) {
-    IndexDescriptor *id = fm.second;
-    FID tuple_fid = id->GetTupleFid();
-    // Find the high watermark of this file and dump its
-    // backing store up to the size of the high watermark
-    auto *alloc = get_impl(this)->get_allocator(tuple_fid);
-    OID himark = alloc->head.hiwater_mark;
+  std::string header;
+  auto put = [&header](const void *p, size_t s) {
+    header.append((const char *)p, s);
+  };
+  put(&parent, sizeof(LSN));
+  uint32_t num_tables = tables.size();
+  put(&num_tables, sizeof(uint32_t));
+  for (auto &ts : tables) {
+    std::string &name = ts.td->GetName();
+    size_t len = name.length();
+    FID tuple_fid = ts.td->GetTupleFid();
+    FID key_fid = ts.td->GetKeyFid();
 
-    // Write himark
-    chkptmgr->write_buffer(&himark, sizeof(OID));
+    // [Name length, name, tuple/key FID, himark]
+    put(&len, sizeof(size_t));
+    put(name.c_str(), len);
+    put(&tuple_fid, sizeof(FID));
+    put(&key_fid, sizeof(FID));
+    put(&ts.himark, sizeof(OID));
+  }
+  LOG(INFO) << "[Checkpoint] header size: " << header.size();
 
-    // Write the tuple FID to note which table these OIDs to follow belongs to
-    chkptmgr->write_buffer(&tuple_fid, sizeof(FID));
+  // Incremental chkpts only need the sections with dirty pages
+  struct section {
+    table_state *ts;
+    OID start;
+    OID end;
+  };
+  std::vector<section> sections;
+  for (auto &ts : tables) {
+    for (uint64_t start = 0; start < ts.himark; start += kSectionOids) {
+      OID end = std::min<uint64_t>(start + kSectionOids, ts.himark);
+      bool dirty = full;
+      for (size_t i = start / oid_array::DIRTY_PAGE_ENTRIES / 64;
+           !dirty and i < ts.dirty.size() and
+           i * 64 * oid_array::DIRTY_PAGE_ENTRIES < end;
+           ++i) {
+        dirty = ts.dirty[i] != 0;
+      }
+      if (dirty) {
+        sections.push_back(section{&ts, (OID)start, end});
+      }
+    }
+  }
 
-    // Key FID
-    FID key_fid = id->GetKeyFid();
-    chkptmgr->write_buffer(&key_fid, sizeof(FID));
+  struct chunk_stats {
+    uint64_t nrecords;
+    uint64_t ntombstones;
+    uint64_t size;
+  };
 
-    auto *oa = fm.second->GetTupleArray();
-    auto *ka = fm.second->GetKeyArray();
+  auto write_section = [&](chkpt_writer *w, section &sec, chunk_stats &cs) {
+    table_state &ts = *sec.ts;
+    FID tuple_fid = ts.td->GetTupleFid();
+    FID key_fid = ts.td->GetKeyFid();
+    OID himark = ts.himark;
+    w->write_buffer(&himark, sizeof(OID));
+    w->write_buffer(&tuple_fid, sizeof(FID));
+    w->write_buffer(&key_fid, sizeof(FID));
+
+    auto *oa = ts.td->GetTupleArray();
+    auto *ka = ts.td->GetKeyArray();
     ASSERT(oa);
     ASSERT(ka);
 
-    // Now write the [OID, payload] pairs. Record both OID and keys for
-    // primary indexes; keys only for 2nd indexes.
-    uint64_t nrecords = 0;
-    bool is_primary = id->IsPrimary();
-    for (OID oid = 0; oid < himark; oid++) {
+    auto write_oid = [&](OID oid) {
       // Checkpoints need not be consistent: grab the latest committed
       // version and leave.
       fat_ptr ptr = oid_get(oa, oid);
     retry:
       if (not ptr.offset()) {
-        continue;
+        if (!full) {
+          uint32_t zero = 0;
+          w->write_buffer(&oid, sizeof(OID));
+          w->write_buffer(&zero, sizeof(uint32_t));
+          cs.size += sizeof(OID) + sizeof(uint32_t);
+          cs.ntombstones++;
+        }
+        return;
       }
 
       Object *obj = (Object *)ptr.offset();
@@ -508,23 +590,22 @@ iterate_index:
         ptr = oid_get(oa, oid);
         goto retry;
       } else if (clsn.asi_type() != fat_ptr::ASI_LOG) {
-        // Someone is still working on this version
+        // Someone is still working on this version; the next
+        // checkpoint must look at this page again.
+        oa->mark_dirty(oid);
         ptr = next;
         goto retry;
       }
 
-      ASSERT(obj->GetClsn().offset());
-      ASSERT(obj->GetClsn().asi_type() == fat_ptr::ASI_LOG);
-
       fat_ptr pdest = obj->GetPersistentAddress();
       if (pdest.offset() == 0) {
-        // must be a delete, skip it
-        continue;
+        // Must be a delete
+        ptr = NULL_PTR;
+        goto retry;
       }
 
-      nrecords++;
-      // Write OID
-      chkptmgr->write_buffer(&oid, sizeof(OID));
+      cs.nrecords++;
+      w->write_buffer(&oid, sizeof(OID));
 
       // Key
       fat_ptr key_ptr = oid_get(ka, oid);
@@ -532,37 +613,99 @@ iterate_index:
       ALWAYS_ASSERT(key);
       ALWAYS_ASSERT(key->l);
       ALWAYS_ASSERT(key->p);
-      chkptmgr->write_buffer(&key->l, sizeof(uint32_t));
-      chkptmgr->write_buffer(key->data(), key->size());
+      w->write_buffer(&key->l, sizeof(uint32_t));
+      w->write_buffer((void *)key->data(), key->size());
+
+      // Tuple data
+      if (!obj->IsInMemory()) {
+        obj->Pin();
+      }
+      uint8_t size_code = ptr.size_code();
+      ALWAYS_ASSERT(size_code != INVALID_SIZE_CODE);
+      auto data_size = decode_size_aligned(size_code);
+      ALWAYS_ASSERT(obj->GetPinnedTuple()->size <=
+                    data_size - sizeof(Object) - sizeof(dbtuple));
+      w->write_buffer(&size_code, sizeof(uint8_t));
+      w->write_buffer((char *)obj, data_size);
+      cs.size += sizeof(OID) + sizeof(uint32_t) + key->size() +
+                 sizeof(uint8_t) + data_size;
+    };
 
-      // Tuple data if it's the primary index
-      if (fm.second->IsPrimary()) {
-        if (!obj->IsInMemory()) {
-          obj->Pin();
+    if (full) {
+      for (OID oid = sec.start; oid < sec.end; oid++) {
+        write_oid(oid);
+      }
+    } else {
+      size_t first = sec.start / oid_array::DIRTY_PAGE_ENTRIES / 64;
+      for (size_t i = first;
+           i < ts.dirty.size() and i * 64 * oid_array::DIRTY_PAGE_ENTRIES <
+                                       sec.end;
+           ++i) {
+        for (uint64_t word = ts.dirty[i]; word; word &= word - 1) {
+          size_t page = i * 64 + __builtin_ctzll(word);
+          OID start = page * oid_array::DIRTY_PAGE_ENTRIES;
+          OID end = std::min<uint64_t>(
+              uint64_t{start} + oid_array::DIRTY_PAGE_ENTRIES, sec.end);
+          for (OID oid = start; oid < end; oid++) {
+            write_oid(oid);
+          }
         }
-        uint8_t size_code = ptr.size_code();
-        ALWAYS_ASSERT(size_code != INVALID_SIZE_CODE);
-        auto data_size = decode_size_aligned(size_code);
-        data_size = decode_size_aligned(size_code);
-        ALWAYS_ASSERT(obj->GetPinnedTuple()->size <=
-                      data_size - sizeof(Object) - sizeof(dbtuple));
-        chkptmgr->write_buffer(&size_code, sizeof(uint8_t));
-        // It's already there if we're digging out a tuple from a previous chkpt
-        chkptmgr->write_buffer((char *)obj, data_size);
-        ALWAYS_ASSERT(obj->GetClsn().asi_type() == fat_ptr::ASI_LOG);
-        ALWAYS_ASSERT(obj->GetPinnedTuple()->size <=
-                      data_size - sizeof(Object) - sizeof(dbtuple));
-        chkpt_size += (sizeof(OID) + sizeof(uint8_t) + data_size);
       }
     }
     // Write himark to denote end
-    chkptmgr->write_buffer(&himark, sizeof(OID));
-    LOG(INFO) << "[Checkpoint] " << id->GetName() << " (" << tuple_fid << ", "
-              << key_fid << ") himark=" << himark << ", wrote " << chkpt_size
-              << " bytes, " << nrecords << " records";
+    w->write_buffer(&himark, sizeof(OID));
+    cs.size += 2 * sizeof(OID) + 2 * sizeof(FID);
+  };
+
+  // Chunk i gets sections i, i + nchunks, ...
+  uint32_t nchunks = chkptmgr->NumChunks();
+  std::vector<chunk_stats> stats(nchunks, chunk_stats{0, 0, 0});
+  auto write_chunk = [&](uint32_t chunk) {
+    chkpt_writer *w = chkptmgr->OpenChunk(chunk);
+    if (nchunks == 1) {
+      uint32_t zero = 0;
+      w->write_buffer((void *)header.data(), header.size());
+      w->write_buffer(&zero, sizeof(uint32_t));
+    }
+    for (size_t i = chunk; i < sections.size(); i += nchunks) {
+      write_section(w, sections[i], stats[chunk]);
+    }
+    w->close();
+  };
+
+  if (nchunks == 1) {
+    write_chunk(0);
+  } else {
+    std::vector<std::thread> producers;
+    for (uint32_t i = 0; i < nchunks; ++i) {
+      producers.emplace_back([&, i] {
+        if (numa_available() >= 0) {
+          numa_run_on_node(chkptmgr->ChunkNode(i));
+        }
+        RCU::rcu_register();
+        RCU::rcu_enter();
+        write_chunk(i);
+        RCU::rcu_exit();
+        RCU::rcu_deregister();
+      });
+    }
+    for (auto &t : producers) {
+      t.join();
+    }
+    chkptmgr->WriteManifest(header.data(), header.size());
   }
-  chkptmgr->sync_buffer();
-#endif
+
+  uint64_t chkpt_size = header.size(), nrecords = 0, ntombstones = 0;
+  for (auto &cs : stats) {
+    chkpt_size += cs.size;
+    nrecords += cs.nrecords;
+    ntombstones += cs.ntombstones;
+  }
+  LOG(INFO) << "[Checkpoint] " << (full ? "full" : "incremental") << ", "
+            << tables.size() << " tables, " << sections.size()
+            << " sections in " << nchunks << " chunk(s), " << nrecords
+            << " records, " << ntombstones << " tombstones, " << chkpt_size
+            << " bytes";
 }
 
 sm_allocator *sm_oid_mgr::get_allocator(FID f) {
@@ -595,6 +738,44 @@ void sm_oid_mgr::warm_up() {
     */
 }
 
+void sm_oid_mgr::track_prefault(FID alloc_fid, oid_array *oa) {
+  if (!config::oid_array_prefault_mb) {
+    return;
+  }
+  auto *self = get_impl(this);
+  self->prefault_mutex.lock();
+  self->prefault_arrays.emplace_back(alloc_fid, oa);
+  self->prefault_mutex.unlock();
+}
+
+void sm_oid_mgr::prefault_daemon() {
+  auto *om = get_impl(this);
+  uint64_t headroom = config::oid_array_prefault_mb * config::MB / sizeof(fat_ptr);
+  std::vector<std::pair<FID, oid_array *>> arrays;
+  while (!om->prefault_stop.load()) {
+    om->prefault_mutex.lock();
+    if (arrays.size() != om->prefault_arrays.size()) {
+      arrays = om->prefault_arrays;
+    }
+    om->prefault_mutex.unlock();
+
+    for (auto &a : arrays) {
+      // Backups only get an allocator when recovering from a chkpt
+      if (!om->oid_get(sm_oid_mgr_impl::ALLOCATOR_FID, a.first).offset()) {
+        continue;
+      }
+      OID himark = volatile_read(om->get_allocator(a.first)->head.hiwater_mark);
+      // Grow in big steps once we're half way into the headroom; dynarray
+      // growth is safe against concurrent ensure_size() on the insert path.
+      if (a.second->nentries() < himark + headroom / 2) {
+        uint64_t n = std::min<uint64_t>(himark + headroom, oid_array::MAX_ENTRIES);
+        a.second->ensure_size(n, 0);
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
 FID sm_oid_mgr::create_file(bool needs_alloc) {
   return get_impl(this)->create_file(needs_alloc);
 }
@@ -633,6 +814,7 @@ fat_ptr sm_oid_mgr::free_oid(FID f, OID o) {
   auto *ptr = self->oid_access(f, o);
   auto rval = *ptr;
   *ptr = NULL_PTR;
+  self->get_array(f)->mark_dirty(o);
   thread_free(self, f, o);
   return rval;
 }
@@ -646,19 +828,23 @@ fat_ptr *sm_oid_mgr::oid_get_ptr(FID f, OID o) {
 }
 
 void sm_oid_mgr::oid_put(FID f, OID o, fat_ptr p) {
-  *get_impl(this)->oid_access(f, o) = p;
+  oid_put(get_impl(this)->get_array(f), o, p);
 }
 
 void sm_oid_mgr::oid_put_new(FID f, OID o, fat_ptr p) {
-  auto *entry = get_impl(this)->oid_access(f, o);
+  auto *oa = get_impl(this)->get_array(f);
+  auto *entry = oa->get(o);
   ALWAYS_ASSERT(*entry == NULL_PTR);
   *entry = p;
+  oa->mark_dirty(o);
 }
 
 void sm_oid_mgr::oid_put_new_if_absent(FID f, OID o, fat_ptr p) {
-  auto *entry = get_impl(this)->oid_access(f, o);
+  auto *oa = get_impl(this)->get_array(f);
+  auto *entry = oa->get(o);
   if (*entry == NULL_PTR) {
     *entry = p;
+    oa->mark_dirty(o);
   }
 }
 
@@ -730,7 +916,7 @@ start_over:
     }
     ASSERT(holder_xid != updater_xid);
     if (state == TXN::TXN_CMMTD) {
-#ifndef RC
+#if !defined(RC) && !defined(OCC)
    if (holder_lsn >= updater_xc->begin) {
      return NULL_PTR;
    }
@@ -748,7 +934,9 @@ start_over:
   // check dirty writes
   else {
     ASSERT(clsn.asi_type() == fat_ptr::ASI_LOG);
-#ifndef RC
+    // OCC lets anyone overwrite the latest committed version; conflicts with
+    // reads are caught by read-set validation at commit.
+#if !defined(RC) && !defined(OCC)
     // First updater wins: if some concurrent tx committed first,
     // I have to abort. Same as in Oracle. Otherwise it's an isolation
     // failure: I can modify concurrent transaction's writes.
@@ -785,6 +973,7 @@ install:
                                      new_obj_ptr->_ptr)) {
       // Succeeded installing a new version, now only I can modify the
       // chain, try recycle some objects
+      oa->mark_dirty(o);
       if (config::enable_gc) {
         MM::gc_version_chain(ptr);
       }
@@ -1126,7 +1315,7 @@ bool sm_oid_mgr::TestVisibility(Object *object, TXN::xid_context *xc, bool &retr
     if (state == TXN::TXN_CMMTD) {
       ASSERT(volatile_read(holder->end));
       ASSERT(owner == holder_xid);
-#if defined(RC) || defined(RC_SPIN)
+#if defined(RC) || defined(RC_SPIN) || defined(OCC)
 #ifdef SSN
       if (config::enable_safesnap &&
           (xc->xct->flags & transaction::TXN_FLAG_READ_ONLY)) {
@@ -1153,7 +1342,7 @@ bool sm_oid_mgr::TestVisibility(Object *object, TXN::xid_context *xc, bool &retr
            object->GetPersistentAddress().asi_type() == fat_ptr::ASI_CHK ||
            object->GetPersistentAddress() == NULL_PTR);  // Delete
     uint64_t lsn_offset = LSN::from_ptr(clsn).offset();
-#if defined(RC) || defined(RC_SPIN)
+#if defined(RC) || defined(RC_SPIN) || defined(OCC)
 #if defined(SSN)
     if (config::enable_safesnap &&
         (xc->xct->flags & transaction::TXN_FLAG_READ_ONLY)) {
@@ -30,10 +30,18 @@ static size_t const SZCODE_ALIGN_BITS = dynarray::page_bits();
 struct oid_array {
   static size_t const MAX_SIZE = sizeof(fat_ptr) << 32;
   static uint64_t const MAX_ENTRIES =
-      (size_t(1) << 32) - sizeof(dynarray) / sizeof(fat_ptr);
+      (size_t(1) << 32) -
+      (sizeof(dynarray) + sizeof(uint64_t *)) / sizeof(fat_ptr);
   static size_t const ENTRIES_PER_PAGE =
       (sizeof(fat_ptr) << SZCODE_ALIGN_BITS) / 2;
 
+  /* Granularity of dirty tracking for incremental checkpoints: one
+     bit covers this many consecutive OIDs (4KB of entries).
+   */
+  static size_t const DIRTY_PAGE_ENTRIES = 512;
+  static size_t const DIRTY_WORDS =
+      (size_t(1) << 32) / DIRTY_PAGE_ENTRIES / 64;
+
   /* How much space is required for an array with [n] entries?
    */
   static size_t alloc_size(size_t n = MAX_ENTRIES) {
@@ -43,7 +51,8 @@ struct oid_array {
   static fat_ptr make();
 
   static dynarray make_oid_dynarray() {
-    return dynarray(oid_array::alloc_size(), 128 * config::MB);
+    return dynarray(oid_array::alloc_size(), 128 * config::MB,
+                    config::oid_array_hugepage);
   }
 
   static void destroy(oid_array *oa);
@@ -63,6 +72,11 @@ struct oid_array {
    */
   void ensure_size(size_t n);
 
+  /* Same as above, but map exactly [extra] more bytes than needed
+     when the array has to grow.
+   */
+  void ensure_size(size_t n, size_t extra);
+
   /* Return a pointer to the given OID's slot.
 
      WARNING: The caller is responsible for handling races in
@@ -74,7 +88,39 @@ struct oid_array {
    */
   fat_ptr *get(OID o) { return &_entries[o]; }
 
+  /* Start recording which pages of entries are modified, see
+     mark_dirty(). Only tuple arrays are tracked, and only when
+     checkpoints may be incremental (config::chkpt_max_deltas).
+   */
+  void track_dirty();
+  inline bool tracks_dirty() { return _dirty != nullptr; }
+
+  /* Note that the entry for [o] was changed. Must be called after the
+     new value is visible, so that a checkpoint which consumes the bit
+     is guaranteed to see the change.
+   */
+  inline void mark_dirty(OID o) {
+    if (_dirty) {
+      size_t page = o / DIRTY_PAGE_ENTRIES;
+      uint64_t bit = uint64_t{1} << (page % 64);
+      uint64_t *word = &_dirty[page / 64];
+      // Most updates hit pages that are already dirty
+      if (not(volatile_read(*word) & bit)) {
+        __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+      }
+    }
+  }
+
+  /* Atomically fetch and clear the dirty bits of pages
+     [64 * i, 64 * i + 63].
+   */
+  inline uint64_t take_dirty(size_t i) {
+    ASSERT(_dirty);
+    return __atomic_exchange_n(&_dirty[i], 0, __ATOMIC_SEQ_CST);
+  }
+
   dynarray _backing_store;
+  uint64_t *_dirty;
   fat_ptr _entries[];
 };
 
@@ -138,8 +184,12 @@ struct sm_oid_mgr {
      checkpoint. The data will be durable by the time this function
      returns, but will only be reachable if the checkpoint
      transaction commits and its location is properly recorded.
+
+     With [parent] = INVALID_LSN the checkpoint is full; otherwise it
+     only covers the OID pages marked dirty since the checkpoint that
+     started at [parent] (see oid_array::mark_dirty()).
    */
-  void PrimaryTakeChkpt();
+  void PrimaryTakeChkpt(LSN parent = INVALID_LSN);
 
   /* Create a new file and return its FID. If [needs_alloc]=true,
      the new file will be managed by an allocator and its FID can be
@@ -313,11 +363,13 @@ struct sm_oid_mgr {
     auto *entry = oa->get(o);
     ASSERT(*entry == NULL_PTR);
     *entry = p;
+    oa->mark_dirty(o);
   }
 
   inline void oid_put(oid_array *oa, OID o, fat_ptr p) {
     auto *ptr = oa->get(o);
     *ptr = p;
+    oa->mark_dirty(o);
   }
 
   inline fat_ptr oid_get(oid_array *oa, OID o) { return *oa->get(o); }
@@ -332,6 +384,14 @@ struct sm_oid_mgr {
   static void warm_up();
   void start_warm_up();
 
+  /* Keep [oa] mapped and prefaulted config::oid_array_prefault_mb
+     ahead of the high water mark of [alloc_fid]'s allocator, so
+     inserts don't pay for mprotect and page faults when the array
+     grows. No-op if prefaulting is disabled.
+   */
+  void track_prefault(FID alloc_fid, oid_array *oa);
+  void prefault_daemon();
+
   int dfd;  // dir for storing OID chkpt data file
 
   virtual ~sm_oid_mgr() {}
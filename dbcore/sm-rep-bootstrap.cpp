@@ -0,0 +1,430 @@
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "sm-rep.h"
+#include "stopwatch.h"
+#include "../ermia.h"
+
+namespace ermia {
+namespace rep {
+
+// The files backups fetch, the same list on both ends
+static std::vector<bootstrap_file> bootstrap_files;
+
+// What a backup asks for over a bootstrap stream; the primary answers
+// with a bootstrap_reply, followed by the chunk if it could read it
+struct bootstrap_request {
+  uint32_t file;  // index into bootstrap_files, or one of the below
+  uint32_t size;
+  uint64_t offset;
+};
+// Hang up
+static const uint32_t kBootstrapDone = ~uint32_t{0};
+// Sent once by each backup when it has fetched every chunk, after which
+// the primary no longer keeps the files for it
+static const uint32_t kBootstrapFetched = ~uint32_t{0} - 1;
+
+struct bootstrap_reply {
+  uint32_t error;  // errno reading the chunk; no chunk follows if set
+  uint32_t csum;   // CRC32C of the chunk
+};
+
+// Primary: backups that have not reported their fetch complete, each
+// holding a bootstrap hold
+static std::atomic<uint32_t> fetching_backups(0);
+
+// Give up on the primary after this many failed attempts of a chunk
+static const uint32_t kMaxChunkAttempts = 50;
+
+// Unlike tcp::receive, tell a dropped connection
+static bool receive_all(int fd, void *buf, size_t size) {
+  char *p = (char *)buf;
+  while (size) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const void *buf, size_t size) {
+  const char *p = (const char *)buf;
+  while (size) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+void PrimaryPrepareBootstrap(backup_start_metadata *md) {
+  ALWAYS_ASSERT(md->bootstrap_streams);
+  // After the forwarding ports (see ship_forward_port)
+  md->bootstrap_port =
+      std::stoul(config::primary_port) + 1 + config::num_backups;
+
+  // The streams' own holds come and go with their connections, and a
+  // backup may be between connections for a while
+  for (uint32_t i = 0; i < config::num_backups; ++i) {
+    AcquireBootstrapHold();
+  }
+  fetching_backups = config::num_backups;
+
+  bootstrap_files.clear();
+  dirent_iterator dir(config::log_dir.c_str());
+  int dfd = dir.dup();
+  auto add_file = [&](const char *name, uint64_t offset,
+                      uint64_t max_size = ~uint64_t{0}) {
+    struct stat st;
+    if (fstatat(dfd, name, &st, 0) != 0) {
+      return false;
+    }
+    uint64_t size = std::min<uint64_t>(st.st_size, max_size);
+    bootstrap_file f;
+    memset(&f, 0, sizeof(f));
+    strncpy(f.name, name, sizeof(f.name) - 1);
+    f.offset = std::min<uint64_t>(offset, size);
+    f.size = size - f.offset;
+    bootstrap_files.push_back(f);
+    return true;
+  };
+
+  // The manifest first, then the log, so that the backup can start
+  // while the chunks are still coming
+  char canary_unused;
+  uint64_t chkpt_start = 0, chkpt_end_unused;
+  int n = sscanf(md->chkpt_marker, CHKPT_FILE_NAME_FMT "%c", &chkpt_start,
+                 &chkpt_end_unused, &canary_unused);
+  LOG_IF(FATAL, n != 2) << "Unable to open chkpt";
+  char chkpt_fname[CHKPT_DATA_FILE_NAME_BUFSZ];
+  os_snprintf(chkpt_fname, sizeof(chkpt_fname), CHKPT_DATA_FILE_NAME_FMT,
+              chkpt_start);
+  ALWAYS_ASSERT(add_file(chkpt_fname, 0));
+
+  for (uint32_t i = 0; i < md->num_log_files; ++i) {
+    backup_start_metadata::log_segment *ls = md->get_log_segment(i);
+    uint32_t segnum = 0;
+    uint64_t start_offset = 0, end_offset = 0;
+    n = sscanf(ls->file_name.buf, SEGMENT_FILE_NAME_FMT "%c", &segnum,
+               &start_offset, &end_offset, &canary_unused);
+    ALWAYS_ASSERT(n == 3);
+    // Only the part after chkpt start, where it is in the segment
+    uint64_t offset =
+        ls->data_start > start_offset ? ls->data_start - start_offset : 0;
+    ALWAYS_ASSERT(add_file(ls->file_name.buf, offset,
+                           LogFileDataSize(start_offset, end_offset,
+                                           ~uint64_t{0})));
+  }
+
+  for (uint32_t c = 0; c < config::kMaxChkptThreads; ++c) {
+    char buf[CHKPT_CHUNK_FILE_NAME_BUFSZ];
+    os_snprintf(buf, sizeof(buf), "%s" CHKPT_CHUNK_SUFFIX_FMT, chkpt_fname, c);
+    if (!add_file(buf, 0)) {
+      break;
+    }
+  }
+
+  uint64_t total = 0;
+  for (auto &f : bootstrap_files) {
+    total += f.size;
+  }
+  LOG(INFO) << "[Primary] Backups will fetch " << bootstrap_files.size()
+            << " files, " << total << " bytes, over "
+            << md->bootstrap_streams << " streams from port "
+            << md->bootstrap_port;
+}
+
+void PrimarySendBootstrapFiles(int backup_fd) {
+  uint32_t nfiles = bootstrap_files.size();
+  ALWAYS_ASSERT(send_all(backup_fd, &nfiles, sizeof(nfiles)));
+  ALWAYS_ASSERT(send_all(backup_fd, bootstrap_files.data(),
+                         sizeof(bootstrap_file) * nfiles));
+}
+
+// Read a chunk for a backup; returns 0 or the errno to answer with
+static int read_chunk(int fd, char *buf, uint32_t size, uint64_t offset) {
+  uint32_t n = 0;
+  while (n < size) {
+    ssize_t m = pread(fd, buf + n, size - n, offset + n);
+    if (m < 0 and errno == EINTR) {
+      continue;
+    }
+    if (m < 0) {
+      return errno;
+    }
+    if (m == 0) {
+      // Shorter than when it was listed
+      return ENODATA;
+    }
+    n += m;
+  }
+  return 0;
+}
+
+// Drop the hold of a backup that has fetched everything; a backup that
+// asks again after losing the reply can't release someone else's
+static void release_backup_hold() {
+  uint32_t n = fetching_backups.load();
+  while (n and !fetching_backups.compare_exchange_weak(n, n - 1)) {
+  }
+  if (n) {
+    --bootstrap_holds;
+    LOG(INFO) << "[Primary] A backup finished its bootstrap fetch, " << n - 1
+              << " to go";
+  }
+}
+
+// Serve chunk requests on one bootstrap stream until the backup hangs up
+static void serve_bootstrap_stream(int fd) {
+  // Keep the log segments (and chkpt files) around while a backup may
+  // still fetch them
+  AcquireBootstrapHold();
+  DEFER(--bootstrap_holds);
+  DEFER(close(fd));
+
+  dirent_iterator dir(config::log_dir.c_str());
+  int dfd = dir.dup();
+  std::vector<int> fds(bootstrap_files.size(), -1);
+  DEFER(for (int f : fds) if (f >= 0) os_close(f));
+
+  std::vector<char> buf;
+  bootstrap_request req;
+  while (receive_all(fd, &req, sizeof(req)) and req.file != kBootstrapDone) {
+    bootstrap_reply reply = {0, 0};
+    if (req.file == kBootstrapFetched) {
+      release_backup_hold();
+      if (!send_all(fd, &reply, sizeof(reply))) {
+        return;
+      }
+      continue;
+    }
+    if (req.file >= bootstrap_files.size()) {
+      LOG(WARNING) << "[Primary] Bad bootstrap request for file " << req.file;
+      return;
+    }
+    bootstrap_file &f = bootstrap_files[req.file];
+    if (req.offset < f.offset or req.offset + req.size > f.offset + f.size) {
+      LOG(WARNING) << "[Primary] Bad bootstrap request for " << f.name
+                   << " at " << req.offset;
+      return;
+    }
+    if (fds[req.file] < 0) {
+      fds[req.file] = openat(dfd, f.name, O_RDONLY);
+    }
+    buf.resize(req.size);
+    if (fds[req.file] < 0) {
+      reply.error = errno;
+    } else {
+      reply.error = read_chunk(fds[req.file], buf.data(), req.size, req.offset);
+    }
+    if (reply.error) {
+      LOG(WARNING) << "[Primary] Unable to read " << f.name << " at "
+                   << req.offset << " for a backup: " << strerror(reply.error);
+      send_all(fd, &reply, sizeof(reply));
+      return;
+    }
+    reply.csum = crc32c(buf.data(), req.size);
+    if (!send_all(fd, &reply, sizeof(reply)) or
+        !send_all(fd, buf.data(), req.size)) {
+      return;
+    }
+  }
+}
+
+// A daemon on the primary that hands each bootstrap stream a thread of
+// its own; backups may reconnect at any time, so it never stops
+void PrimaryBootstrapServer(uint32_t port, uint32_t nclients) {
+  std::string p = std::to_string(port);
+  tcp::server_context ctx(p, nclients);
+  while (true) {
+    int fd = ctx.expect_client();
+    std::thread t(serve_bootstrap_stream, fd);
+    t.detach();
+  }
+}
+
+// Backup side
+namespace {
+struct fetch_chunk {
+  uint32_t file;
+  uint32_t size;
+  uint64_t offset;
+};
+
+// Chunks still to fetch, taken in order by the streams
+std::vector<fetch_chunk> fetch_queue;
+std::atomic<uint32_t> fetch_next(0);
+// Chunks left per file
+std::unique_ptr<std::atomic<uint32_t>[]> pending_chunks;
+std::vector<int> fetch_fds;
+
+std::atomic<uint64_t> fetched_bytes(0);
+std::atomic<uint64_t> fetch_retries(0);
+}  // namespace
+
+static tcp::client_context *connect_bootstrap(uint32_t bootstrap_port) {
+  std::string port = std::to_string(bootstrap_port);
+  for (uint32_t attempt = 0;; ++attempt) {
+    try {
+      return new tcp::client_context(config::primary_srv, port);
+    } catch (illegal_argument &e) {
+      LOG_IF(FATAL, attempt == kMaxChunkAttempts)
+          << "[Backup] Unable to reach the bootstrap server at "
+          << config::primary_srv << ":" << port;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+}
+
+static void fetch_stream(uint32_t port, uint64_t chunk_size) {
+  std::vector<char> buf(chunk_size);
+  tcp::client_context *conn = nullptr;
+  uint32_t attempts = 0;
+  uint32_t i = fetch_next++;
+  while (i < fetch_queue.size()) {
+    if (!conn) {
+      conn = connect_bootstrap(port);
+    }
+    int fd = conn->server_sockfd;
+    fetch_chunk &c = fetch_queue[i];
+    bootstrap_request req = {c.file, c.size, c.offset};
+    bootstrap_reply reply = {0, 0};
+    bool received = send_all(fd, &req, sizeof(req)) and
+                    receive_all(fd, &reply, sizeof(reply));
+    // Asking again won't help
+    LOG_IF(FATAL, received and reply.error)
+        << "[Backup] The primary can't read " << bootstrap_files[c.file].name
+        << " at " << c.offset << ": " << strerror(reply.error);
+    received = received and receive_all(fd, buf.data(), c.size);
+    if (received and crc32c(buf.data(), c.size) == reply.csum) {
+      int file_fd = fetch_fds[c.file];
+      os_pwrite(file_fd, buf.data(), c.size, c.offset);
+      fdatasync(file_fd);
+      --pending_chunks[c.file];
+      fetched_bytes += c.size;
+      attempts = 0;
+      i = fetch_next++;
+      continue;
+    }
+
+    ++fetch_retries;
+    LOG_IF(FATAL, ++attempts == kMaxChunkAttempts)
+        << "[Backup] Unable to fetch " << bootstrap_files[c.file].name
+        << " at " << c.offset;
+    if (received) {
+      // The stream is still in sync, just ask again
+      LOG(WARNING) << "[Backup] Checksum mismatch in "
+                   << bootstrap_files[c.file].name << " at " << c.offset;
+    } else {
+      LOG(WARNING) << "[Backup] Bootstrap stream lost, reconnecting";
+      delete conn;
+      conn = nullptr;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  if (conn) {
+    bootstrap_request req = {kBootstrapDone, 0, 0};
+    send_all(conn->server_sockfd, &req, sizeof(req));
+    delete conn;
+  }
+}
+
+// Tell the primary it no longer needs to keep the files for us
+static void report_fetched(uint32_t port) {
+  for (uint32_t attempt = 0; attempt < kMaxChunkAttempts; ++attempt) {
+    tcp::client_context *conn = connect_bootstrap(port);
+    int fd = conn->server_sockfd;
+    bootstrap_request req = {kBootstrapFetched, 0, 0};
+    bootstrap_reply reply;
+    bool reported = send_all(fd, &req, sizeof(req)) and
+                    receive_all(fd, &reply, sizeof(reply));
+    if (reported) {
+      req.file = kBootstrapDone;
+      send_all(fd, &req, sizeof(req));
+    }
+    delete conn;
+    if (reported) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  LOG(WARNING) << "[Backup] Unable to report the bootstrap fetch complete, "
+                  "the primary keeps the log for us until it restarts";
+}
+
+void BackupBootstrapFetch(int primary_fd, backup_start_metadata *md) {
+  ALWAYS_ASSERT(md->bootstrap_streams and md->bootstrap_chunk_size);
+  uint32_t nfiles = 0;
+  tcp::receive(primary_fd, (char *)&nfiles, sizeof(nfiles));
+  bootstrap_files.resize(nfiles);
+  tcp::receive(primary_fd, (char *)bootstrap_files.data(),
+               sizeof(bootstrap_file) * nfiles);
+
+  dirent_iterator dir(config::log_dir.c_str());
+  int dfd = dir.dup();
+  pending_chunks.reset(new std::atomic<uint32_t>[nfiles]);
+  for (uint32_t f = 0; f < nfiles; ++f) {
+    bootstrap_file &file = bootstrap_files[f];
+    fetch_fds.push_back(
+        os_openat(dfd, file.name, O_CREAT | O_TRUNC | O_WRONLY));
+    pending_chunks[f] = 0;
+    for (uint64_t off = 0; off < file.size; off += md->bootstrap_chunk_size) {
+      uint32_t size = std::min(md->bootstrap_chunk_size, file.size - off);
+      fetch_queue.push_back(fetch_chunk{f, size, file.offset + off});
+      ++pending_chunks[f];
+    }
+  }
+
+  uint32_t nstreams = md->bootstrap_streams;
+  uint32_t port = md->bootstrap_port;
+  uint64_t chunk_size = md->bootstrap_chunk_size;
+  LOG(INFO) << "[Backup] Fetching " << fetch_queue.size() << " chunks over "
+            << nstreams << " streams";
+  std::thread([nstreams, port, chunk_size] {
+    stopwatch_t sw;
+    std::vector<std::thread> streams;
+    for (uint32_t s = 0; s < nstreams; ++s) {
+      streams.emplace_back(fetch_stream, port, chunk_size);
+    }
+    for (auto &t : streams) {
+      t.join();
+    }
+    for (int fd : fetch_fds) {
+      os_fsync(fd);
+      os_close(fd);
+    }
+    report_fetched(port);
+    LOG(INFO) << "[Backup] Bootstrap fetched " << fetched_bytes << " bytes in "
+              << sw.time_ms() << " ms, " << fetch_retries << " retries";
+  }).detach();
+
+  // The log must be complete before the log manager starts
+  for (uint32_t f = 0; f < nfiles; ++f) {
+    if (bootstrap_files[f].name[0] == 'l') {
+      BackupWaitForBootstrapFile(bootstrap_files[f].name);
+    }
+  }
+}
+
+void BackupWaitForBootstrapFile(const char *fname) {
+  if (!config::is_backup_srv()) {
+    return;
+  }
+  for (uint32_t f = 0; f < bootstrap_files.size(); ++f) {
+    if (strcmp(bootstrap_files[f].name, fname) == 0) {
+      while (pending_chunks[f].load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      return;
+    }
+  }
+}
+
+}  // namespace rep
+}  // namespace ermia
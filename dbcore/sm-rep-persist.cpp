@@ -0,0 +1,51 @@
+#include "sm-log-alloc.h"
+#include "sm-rep.h"
+#include "../ermia.h"
+
+namespace ermia {
+namespace rep {
+
+std::atomic<bool> persist_async(false);
+
+void PersistPolicyDaemon() {
+  ALWAYS_ASSERT(config::persist_adaptive);
+  typedef sm_log_alloc_mgr::commit_queue commit_queue;
+  uint64_t last_commits = volatile_read(commit_queue::total_commits);
+  uint64_t last_latency_us = volatile_read(commit_queue::total_latency_us);
+  util::latency_histogram last_acks = BackupAckLatencyTcp();
+  while (!config::IsShutdown()) {
+    usleep(config::persist_adapt_interval_ms * 1000);
+
+    // Average commit latency and ACK latencies over the interval
+    uint64_t commits = volatile_read(commit_queue::total_commits);
+    uint64_t latency_us = volatile_read(commit_queue::total_latency_us);
+    uint64_t ncommits = commits - last_commits;
+    double commit_us =
+        ncommits ? (double)(latency_us - last_latency_us) / ncommits : 0;
+    last_commits = commits;
+    last_latency_us = latency_us;
+    util::latency_histogram cur = BackupAckLatencyTcp(), acks;
+    for (uint32_t b = 0; b < util::latency_histogram::kBuckets; ++b) {
+      acks.counts[b] = cur.counts[b] - last_acks.counts[b];
+    }
+    last_acks = cur;
+    uint64_t ack_us = acks.percentile(0.99);
+
+    if (!persist_async.load()) {
+      if (commit_us > config::persist_latency_us) {
+        persist_async.store(true);
+        LOG(INFO) << "[Primary] Persist policy pipelined -> async: commit "
+                  << "latency " << commit_us << "us, ACK p99 " << ack_us
+                  << "us";
+      }
+    } else if (ncommits == 0 or
+               (acks.total() and ack_us * 2 < config::persist_latency_us)) {
+      persist_async.store(false);
+      LOG(INFO) << "[Primary] Persist policy async -> pipelined: commit "
+                << "latency " << commit_us << "us, ACK p99 " << ack_us << "us";
+    }
+  }
+}
+
+}  // namespace rep
+}  // namespace ermia
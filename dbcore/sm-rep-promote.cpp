@@ -0,0 +1,228 @@
+#include <map>
+
+#include "rcu.h"
+#include "sm-chkpt.h"
+#include "sm-oid.h"
+#include "sm-rep.h"
+#include "sm-table.h"
+#include "../ermia.h"
+
+namespace ermia {
+namespace rep {
+
+std::atomic<bool> promoting(false);
+std::atomic<uint32_t> backup_readers[config::MAX_THREADS];
+std::atomic<bool> log_flush_stop(false);
+
+namespace {
+// Have [nthreads] threads pull [ntasks] tasks off a shared counter
+template <typename Work>
+void run_tasks(uint32_t nthreads, size_t ntasks, Work work) {
+  std::atomic<size_t> next_task(0);
+  auto pull = [&]() {
+    size_t i = 0;
+    while ((i = next_task.fetch_add(1)) < ntasks) {
+      work(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < nthreads; ++i) {
+    threads.emplace_back(pull);
+  }
+  pull();
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+// Put the latest version of each record in [begin, end) of [td] that is
+// only known by its pdest at the head of its tuple array chain, still in
+// the log, and clear the pdest array; returns one past the highest OID
+// in use.
+OID install_latest_versions(TableDescriptor *td, OID begin, OID end) {
+  oid_array *ta = td->GetTupleArray();
+  oid_array *pa = td->GetPersistentAddressArray();
+  OID himark = 0;
+  for (OID oid = begin; oid < end; ++oid) {
+    fat_ptr pdest =
+        oid < pa->nentries() ? volatile_read(*pa->get(oid)) : NULL_PTR;
+    fat_ptr head =
+        oid < ta->nentries() ? volatile_read(*ta->get(oid)) : NULL_PTR;
+    if (pdest.offset() == 0) {
+      if (head.offset()) {
+        himark = oid + 1;
+      }
+      continue;
+    }
+    himark = oid + 1;
+    Object *head_obj = (Object *)head.offset();
+    uint64_t head_lsn = head_obj ? head_obj->GetClsn().offset() : 0;
+    if (pdest.offset() > head_lsn) {
+      // Same as BackupGetVersion would dig out, minus loading it: the
+      // new primary's readers Pin() it when they get there
+      ALWAYS_ASSERT(pdest.asi_type() == fat_ptr::ASI_LOG);
+      size_t sz = align_up(sizeof(Object) + sizeof(dbtuple) +
+                           decode_size_aligned(pdest.size_code()));
+      Object *obj = (Object *)MM::allocate(sz);
+      new (obj) Object(pdest, NULL_PTR, 0, false);
+      obj->SetClsn(LSN::make(pdest.offset(), 0).to_log_ptr());
+      obj->SetNextVolatile(head);
+      ta->ensure_size(oid + 1);
+      oidmgr->oid_put(ta, oid, fat_ptr::make(obj, encode_size_aligned(sz), 0));
+    }
+    oidmgr->oid_put(pa, oid, NULL_PTR);
+  }
+  return himark;
+}
+
+// One past the highest OID [index] points to: logged index inserts can
+// be replayed ahead of their tuples, and the allocator must not hand
+// those OIDs out again
+OID index_himark(OrderedIndex *index) {
+  TXN::xid_context xc;
+  xc.begin_epoch = 0;
+  varstr start;
+  auto *masstree = &((ConcurrentMasstreeIndex *)index)->GetMasstree();
+  auto iter = sync_wait_coro(
+      ConcurrentMasstree::ScanIterator</*IsRerverse=*/false>::factory(
+          masstree, &xc, start, nullptr));
+  OID himark = 0;
+  bool more = sync_wait_coro(iter.init_or_next</*IsNext=*/false>());
+  while (more) {
+    himark = std::max<OID>(himark, iter.value() + 1);
+    more = sync_wait_coro(iter.init_or_next</*IsNext=*/true>());
+  }
+  return himark;
+}
+
+// Fill [index]'s table's key array (the former pdest array) with the
+// primary index's keys, for the checkpointer
+void rebuild_key_array(OrderedIndex *index) {
+  oid_array *ka = index->GetTableDescriptor()->GetKeyArray();
+  TXN::xid_context xc;
+  xc.begin_epoch = 0;
+  varstr start;
+  auto *masstree = &((ConcurrentMasstreeIndex *)index)->GetMasstree();
+  auto iter = sync_wait_coro(
+      ConcurrentMasstree::ScanIterator</*IsRerverse=*/false>::factory(
+          masstree, &xc, start, nullptr));
+  bool more = sync_wait_coro(iter.init_or_next</*IsNext=*/false>());
+  while (more) {
+    OID oid = iter.value();
+    Masstree::Str k = iter.key();
+    varstr *key = (varstr *)MM::allocate(sizeof(varstr) + k.length());
+    new (key) varstr((char *)key + sizeof(varstr), 0);
+    key->copy_from(k.data(), k.length());
+    ka->ensure_size(oid + 1);
+    oidmgr->oid_put(ka, oid, fat_ptr::make((void *)key, INVALID_SIZE_CODE));
+    more = sync_wait_coro(iter.init_or_next</*IsNext=*/true>());
+  }
+}
+}  // namespace
+
+void BackupTakeOver() {
+  LOG_IF(FATAL, config::command_log or config::log_ship_by_rdma or
+                    config::replay_policy == config::kReplayNone)
+      << "Backup promotion needs TCP log shipping and replay";
+  util::timer total, phase;
+
+  // Make everything received durable and replayed; reads go on meanwhile
+  log_flush_stop.store(true);
+  while (log_flush_stop.load()) {
+  }
+  uint64_t flush_us = phase.lap();
+  uint64_t end_offset = volatile_read(new_end_lsn_offset);
+  while (volatile_read(replayed_lsn_offset) < end_offset) {
+  }
+  uint64_t replay_us = phase.lap();
+
+  // Hold off new reads and wait for those in flight
+  promoting.store(true);
+  for (auto &r : backup_readers) {
+    while (r.load()) {
+    }
+  }
+  uint64_t drain_us = phase.lap();
+
+  // Replay left the latest versions in the pdest arrays (see
+  // sm_log_recover_impl::recover_update), or with -full_replay in the
+  // tuple arrays, which install_latest_versions leaves alone
+  static const OID kOIDsPerTask = 1 << 18;
+  struct Task {
+    TableDescriptor *td;
+    OID begin;
+    OID end;
+  };
+  std::vector<Task> tasks;
+  std::map<TableDescriptor *, std::atomic<OID>> himarks;
+  for (auto &t : TableDescriptor::name_map) {
+    TableDescriptor *td = t.second;
+    himarks[td] = 0;
+    size_t n = std::max(td->GetPersistentAddressArray()->nentries(),
+                        td->GetTupleArray()->nentries());
+    for (size_t begin = 0; begin < n; begin += kOIDsPerTask) {
+      tasks.push_back(
+          Task{td, (OID)begin, (OID)std::min(n, begin + kOIDsPerTask)});
+    }
+  }
+  auto raise_himark = [&](TableDescriptor *td, OID himark) {
+    std::atomic<OID> &mark = himarks.at(td);
+    OID cur = mark.load();
+    while (himark > cur and !mark.compare_exchange_weak(cur, himark)) {
+    }
+  };
+  uint32_t nthreads = std::max<uint32_t>(config::replay_threads, 1);
+  run_tasks(nthreads, tasks.size(), [&](size_t i) {
+    Task &task = tasks[i];
+    raise_himark(task.td,
+                 install_latest_versions(task.td, task.begin, task.end));
+  });
+  uint64_t version_us = phase.lap();
+
+  // Keys whose tuples are not in the arrays still hold their OIDs
+  std::vector<OrderedIndex *> all_indexes;
+  for (auto &i : TableDescriptor::index_map) {
+    all_indexes.push_back(i.second);
+  }
+  run_tasks(nthreads, all_indexes.size(), [&](size_t i) {
+    OrderedIndex *index = all_indexes[i];
+    raise_himark(index->GetTableDescriptor(), index_himark(index));
+  });
+  uint64_t index_us = phase.lap();
+
+  // Now the primary
+  volatile_write(config::backup_promoted, true);
+  for (auto &i : TableDescriptor::index_map) {
+    i.second->SetArrays(i.second->IsPrimary());
+  }
+  for (auto &h : himarks) {
+    oidmgr->recreate_allocator(h.first->GetTupleFid(), h.second.load());
+  }
+  if (config::enable_chkpt) {
+    std::vector<OrderedIndex *> indexes;
+    for (auto &t : TableDescriptor::name_map) {
+      indexes.push_back(t.second->GetPrimaryIndex());
+    }
+    run_tasks(nthreads, indexes.size(),
+              [&](size_t i) { rebuild_key_array(indexes[i]); });
+  }
+  uint64_t key_us = phase.lap();
+
+  logmgr->BackupPromote();
+  if (config::enable_chkpt) {
+    chkptmgr = new sm_chkpt_mgr(logmgr->get_chkpt_start());
+    chkptmgr->start_chkpt_thread();
+  }
+  volatile_write(config::state, config::kStateForwardProcessing);
+  promoting.store(false);
+
+  LOG(INFO) << "[Backup] Promoted to primary in " << total.lap() / 1000.0
+            << "ms: flush " << flush_us / 1000.0 << "ms, replay "
+            << replay_us / 1000.0 << "ms, drain " << drain_us / 1000.0
+            << "ms, versions " << version_us / 1000.0 << "ms, indexes "
+            << index_us / 1000.0 << "ms, keys "
+            << key_us / 1000.0 << "ms, " << tasks.size() << " OID ranges";
+}
+
+}  // namespace rep
+}  // namespace ermia
@@ -113,6 +113,7 @@ void primary_daemon_rdma() {
     w->join();
   }
   os_close(chkpt_fd);
+  --bootstrap_holds;
 
   for (auto &rn : nodes) {
     rn->SetActive();
@@ -130,8 +131,10 @@ void primary_daemon_rdma() {
       std::unique_lock<std::mutex> lock(nodes_lock);
       nodes.push_back(rn);
     }
+    AcquireBootstrapHold();
     auto* md = prepare_start_metadata(chkpt_fd, chkpt_start_lsn);
     bring_up_backup_rdma(rn, chkpt_fd, md);
+    --bootstrap_holds;
     // Set the node to be active after shipping the first batch for correct
     // control flow poll
     //rn->WaitForMessageAsPrimary(kRdmaReadyToReceive);
@@ -426,6 +429,7 @@ void start_as_backup_rdma() {
   config::persist_policy = md->system_config.persist_policy;
   config::log_ship_offset_replay = md->system_config.offset_replay;
   LOG_IF(FATAL, md->system_config.command_log_buffer_mb > 0);
+  BackupMapIndexes(md);
 
   logmgr = sm_log::new_log(config::recover_functor, nullptr);
   sm_oid_mgr::create();
@@ -0,0 +1,243 @@
+#include <sys/un.h>
+
+#include <fstream>
+
+#include "sm-log-recover-impl.h"
+#include "sm-rep.h"
+#include "../ermia.h"
+
+namespace ermia {
+namespace rep {
+
+namespace {
+// One sample, columns in the same order every time
+struct stat_sample {
+  std::vector<std::string> names;
+  std::vector<double> values;
+
+  inline void add(const std::string &name, double value) {
+    names.push_back(name);
+    values.push_back(value);
+  }
+};
+
+// Where samples go, see ReplicationStatsDaemon
+class stat_sink {
+ public:
+  stat_sink(const std::string &dest) : _sock(-1), _header(false) {
+    static const std::string kSocketPrefix = "unix:";
+    if (dest.compare(0, kSocketPrefix.size(), kSocketPrefix) == 0) {
+      std::string path = dest.substr(kSocketPrefix.size());
+      LOG_IF(FATAL, path.size() >= sizeof(_addr.sun_path))
+          << "Replication stat socket path too long: " << path;
+      memset(&_addr, 0, sizeof(_addr));
+      _addr.sun_family = AF_UNIX;
+      strncpy(_addr.sun_path, path.c_str(), sizeof(_addr.sun_path) - 1);
+      _sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+      LOG_IF(FATAL, _sock < 0) << "Unable to create replication stat socket";
+    } else {
+      _file.open(dest, std::ios::out | std::ios::trunc);
+      LOG_IF(FATAL, !_file.is_open()) << "Replication stat file not open";
+    }
+  }
+  ~stat_sink() {
+    if (_sock >= 0) {
+      close(_sock);
+    }
+  }
+
+  void write(const stat_sample &s) {
+    std::ostringstream line;
+    if (_sock >= 0) {
+      for (uint32_t i = 0; i < s.names.size(); ++i) {
+        line << (i ? "," : "") << s.names[i] << "=" << s.values[i];
+      }
+      line << "\n";
+      std::string msg = line.str();
+      sendto(_sock, msg.data(), msg.size(), MSG_DONTWAIT,
+             (struct sockaddr *)&_addr, sizeof(_addr));
+      return;
+    }
+    if (!_header) {
+      for (uint32_t i = 0; i < s.names.size(); ++i) {
+        _file << (i ? "," : "") << s.names[i];
+      }
+      _file << std::endl;
+      _header = true;
+    }
+    for (uint32_t i = 0; i < s.values.size(); ++i) {
+      line << (i ? "," : "") << s.values[i];
+    }
+    _file << line.str() << std::endl;
+  }
+
+ private:
+  std::ofstream _file;
+  int _sock;
+  struct sockaddr_un _addr;
+  bool _header;
+};
+
+// ACK rate and latencies of [channels] since [last], which is updated
+struct ack_stats {
+  std::vector<util::latency_histogram> last;
+
+  // [Channel] is tcp::channel or shm::channel
+  template <class Channel>
+  void sample(stat_sample &s, const char *prefix,
+              std::vector<Channel *> &channels, double secs) {
+    last.resize(channels.size());
+    for (uint32_t i = 0; i < channels.size(); ++i) {
+      util::latency_histogram delta;
+      if (channels[i]) {
+        util::latency_histogram cur = channels[i]->ack_latency();
+        for (uint32_t b = 0; b < util::latency_histogram::kBuckets; ++b) {
+          delta.counts[b] = cur.counts[b] - last[i].counts[b];
+        }
+        last[i] = cur;
+      }
+      std::string name = prefix + std::to_string(i);
+      s.add(name + "AckRate", delta.total() / secs);
+      s.add(name + "AckP50Us", delta.percentile(0.5));
+      s.add(name + "AckP99Us", delta.percentile(0.99));
+      s.add(name + "AckMaxUs", delta.percentile(1));
+    }
+  }
+};
+
+// Batches replayed so far and the time spent on them, where the replay
+// functor keeps count
+void replay_totals(uint64_t &batches, uint64_t &us) {
+  batches = us = 0;
+  sm_log_recover_impl *f = logmgr->get_backup_replay_functor();
+  if (!f) {
+    return;
+  }
+  if (config::log_ship_hash_replay) {
+    parallel_hash_replay *h = (parallel_hash_replay *)f;
+    batches = volatile_read(h->redo_batches);
+    us = volatile_read(h->redo_latency_us);
+  } else if (config::log_ship_offset_replay) {
+    // Every redoer replays its part of each batch
+    for (auto *r : ((parallel_offset_replay *)f)->redoers) {
+      batches = std::max(batches, volatile_read(r->redo_batches));
+      us = std::max(us, volatile_read(r->redo_latency_us));
+    }
+  }
+}
+
+std::thread stat_daemon;
+std::mutex stat_stop_mutex;
+std::condition_variable stat_stop_cv;
+bool stat_stop = false;
+}  // namespace
+
+void ReplicationStatsDaemon() {
+  ALWAYS_ASSERT(config::rep_stat_interval_ms);
+  stat_sink sink(config::rep_stat_dest);
+  ack_stats acks;
+  uint64_t last_bytes = 0, last_batches = 0, last_replay_us = 0;
+  uint64_t last_stalls = 0, last_stall_ns = 0;
+  // Same columns throughout, even if the backup is promoted
+  const bool backup = config::is_backup_srv();
+  stopwatch_t sw;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> l(stat_stop_mutex);
+      if (stat_stop_cv.wait_for(
+              l, std::chrono::milliseconds(config::rep_stat_interval_ms),
+              [] { return stat_stop; })) {
+        break;
+      }
+    }
+    double secs = std::max(sw.time(), 1e-9);
+    stat_sample s;
+    s.add("Time", std::chrono::system_clock::now().time_since_epoch() /
+                      std::chrono::milliseconds(1));
+    uint64_t durable = logmgr->durable_flushed_lsn().offset();
+    if (!backup) {
+      uint64_t bytes = volatile_read(shipped_log_bytes);
+      uint64_t cur = logmgr->cur_lsn().offset();
+      s.add("ShippedMBps", (bytes - last_bytes) / secs / config::MB);
+      s.add("LSN", cur);
+      s.add("DLSN", durable);
+      s.add("UnflushedBytes", cur > durable ? cur - durable : 0);
+      if (config::persist_adaptive) {
+        s.add("PersistAsync", persist_async.load());
+      }
+      last_bytes = bytes;
+      // The channels are sized once backups start to come up; RDMA
+      // shipping has no channels. PrimaryShutdownTcp deletes them under
+      // the same lock.
+      std::unique_lock<std::mutex> l(backup_sockfds_mutex);
+      bool up = !config::log_ship_by_rdma and
+                volatile_read(config::num_active_backups);
+      if (config::log_ship_shm) {
+        std::vector<shm::channel *> channels(config::num_backups, nullptr);
+        for (uint32_t i = 0; up and i < channels.size(); ++i) {
+          channels[i] = volatile_read(shm_channels[i]);
+        }
+        acks.sample(s, "Backup", channels, secs);
+      } else {
+        std::vector<tcp::channel *> channels(config::num_backups, nullptr);
+        for (uint32_t i = 0; up and i < channels.size(); ++i) {
+          channels[i] = volatile_read(backup_channels[i]);
+        }
+        acks.sample(s, "Backup", channels, secs);
+      }
+    } else {
+      // Restarts from zero when the backup daemon starts
+      uint64_t bytes = volatile_read(received_log_size);
+      uint64_t replayed = volatile_read(replayed_lsn_offset);
+      s.add("ReceivedMBps",
+            (bytes > last_bytes ? bytes - last_bytes : 0) / secs / config::MB);
+      s.add("DLSN", durable);
+      s.add("ReplayedLSN", replayed);
+      s.add("ReplayGapBytes", durable > replayed ? durable - replayed : 0);
+      last_bytes = bytes;
+
+      uint64_t batches = 0, replay_us = 0;
+      replay_totals(batches, replay_us);
+      uint64_t nbatches = batches - last_batches;
+      s.add("ReplayBatchRate", nbatches / secs);
+      s.add("ReplayBatchMs",
+            nbatches ? (replay_us - last_replay_us) / 1e3 / nbatches : 0);
+      last_batches = batches;
+      last_replay_us = replay_us;
+
+      uint64_t stalls = volatile_read(logbuf_stalls);
+      uint64_t stall_ns = volatile_read(logbuf_stall_ns);
+      s.add("LogBufBytes", sm_log::get_logbuf()->available_to_read());
+      s.add("LogBufStallRate", (stalls - last_stalls) / secs);
+      s.add("LogBufStallMs", (stall_ns - last_stall_ns) / 1e6);
+      last_stalls = stalls;
+      last_stall_ns = stall_ns;
+
+      std::unique_lock<std::mutex> l(downstream_channels_mutex);
+      acks.sample(s, "Downstream", downstream_channels, secs);
+    }
+    sink.write(s);
+  }
+}
+
+void StartReplicationStats() {
+  if (config::rep_stat_interval_ms and
+      (config::num_backups or config::is_backup_srv())) {
+    stat_daemon = std::thread(ReplicationStatsDaemon);
+  }
+}
+
+void StopReplicationStats() {
+  if (!stat_daemon.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> l(stat_stop_mutex);
+    stat_stop = true;
+  }
+  stat_stop_cv.notify_all();
+  stat_daemon.join();
+}
+
+}  // namespace rep
+}  // namespace ermia
@@ -1,9 +1,11 @@
 #include <sys/stat.h>
 
+#include "lz4-block.h"
 #include "rcu.h"
 #include "sm-cmd-log.h"
 #include "sm-log-file.h"
 #include "sm-rep.h"
+#include "stopwatch.h"
 #include "../ermia.h"
 
 namespace ermia {
@@ -11,26 +13,119 @@ namespace rep {
 tcp::client_context* cctx CACHE_ALIGNED;
 uint64_t global_persisted_lsn_tcp CACHE_ALIGNED;
 
-void bring_up_backup_tcp(int backup_sockfd, backup_start_metadata *md) {
+// Primary: backup addresses, in the order they connected
+std::vector<std::string> backup_addrs;
+
+// Backup: where the log comes from (the primary's or an upstream
+// backup's socket) and the backups we forward it to
+int upstream_sockfd CACHE_ALIGNED = -1;
+std::vector<tcp::channel *> downstream_channels;
+std::mutex downstream_channels_mutex;
+
+// Backup: the primary's ring, if it ships through shared memory
+static shm::ring *upstream_ring = nullptr;
+
+// Backup: whether the log comes from the primary rather than another
+// backup, and whether BackupPromote() was called
+static bool upstream_is_primary = true;
+static std::atomic<bool> promote_requested(false);
+
+// Backup i of a forwarding tree listens for its downstream backups here
+static uint32_t ship_forward_port(uint32_t backup) {
+  return std::stoul(config::primary_port) + 1 + backup;
+}
+
+// Backup i's ring for shared memory log shipping
+static std::string ship_shm_name(uint32_t backup) {
+  return "/ermia-ship-" + config::primary_port + "-" + std::to_string(backup);
+}
+
+// False if the upstream is gone
+static inline bool receive_upstream(char *buf, size_t size) {
+  if (upstream_ring) {
+    return upstream_ring->read(buf, size);
+  }
+  return tcp::try_receive(upstream_sockfd, buf, size);
+}
+
+static inline void ack_upstream() {
+  if (upstream_ring) {
+    upstream_ring->ack();
+  } else {
+    tcp::send_ack(upstream_sockfd);
+  }
+}
+
+static void send_chkpt_and_log_tcp(int backup_sockfd,
+                                   backup_start_metadata *md);
+
+void bring_up_backup_tcp(uint32_t idx, backup_start_metadata *shared_md) {
+  int backup_sockfd = backup_sockfds[idx];
+
+  // Tell the backup its place in the forwarding tree
+  backup_start_metadata *md =
+      (backup_start_metadata *)malloc(shared_md->size());
+  memcpy(md, shared_md, shared_md->size());
+  DEFER(free(md));
+  md->num_downstream = ShipNumDownstream(idx, backup_sockfds.size());
+  md->forward_port = ship_forward_port(idx);
+  if (!ShipsFromPrimary(idx)) {
+    uint32_t up = ShipUpstream(idx);
+    strncpy(md->upstream_addr, backup_addrs[up].c_str(),
+            sizeof(md->upstream_addr) - 1);
+    md->upstream_addr[sizeof(md->upstream_addr) - 1] = '\0';
+    md->upstream_port = ship_forward_port(up);
+  }
+  // Created before the backup could look for it
+  shm::ring *ring = nullptr;
+  if (config::log_ship_shm) {
+    ring = shm::ring::create(ship_shm_name(idx),
+                             (uint64_t)config::log_ship_shm_mb * config::MB);
+    strncpy(md->shm_ring, ring->name().c_str(), sizeof(md->shm_ring) - 1);
+    md->shm_ring[sizeof(md->shm_ring) - 1] = '\0';
+  }
+
   auto sent_bytes = send(backup_sockfd, md, md->size(), 0);
   ALWAYS_ASSERT(sent_bytes == md->size());
 
-  int chkpt_fd = -1;
-  dirent_iterator dir(config::log_dir.c_str());
-  int dfd = dir.dup();
-  for (char const *fname : dir) {
-    if (fname[0] == 'o') {
-      chkpt_fd = os_openat(dfd, fname, O_RDONLY);
-      break;
-    }
+  if (md->bootstrap_streams) {
+    // The backup fetches the files on its own
+    PrimarySendBootstrapFiles(backup_sockfd);
+  } else {
+    send_chkpt_and_log_tcp(backup_sockfd, md);
   }
+
+  // Wait for the backup to notify me that it persisted the logs (and
+  // joined the forwarding tree)
+  tcp::expect_ack(backup_sockfd);
+  if (ring) {
+    shm_channels[idx] = new shm::channel(ring);
+  } else if (ShipsFromPrimary(idx)) {
+    backup_channels[idx] = new tcp::channel(backup_sockfd);
+  }
+  ++config::num_active_backups;
+}
+
+// Stream the chkpt and the log after it over the backup's connection
+static void send_chkpt_and_log_tcp(int backup_sockfd,
+                                   backup_start_metadata *md) {
+  // The marker names the full chkpt chosen by prepare_start_metadata
+  char canary_unused;
+  uint64_t chkpt_start = 0, chkpt_end_unused;
+  int n = sscanf(md->chkpt_marker, CHKPT_FILE_NAME_FMT "%c", &chkpt_start,
+                 &chkpt_end_unused, &canary_unused);
   // TODO(tzwang): support log-only bootstrap
-  LOG_IF(FATAL, chkpt_fd == -1) << "Unable to open chkpt";
+  LOG_IF(FATAL, n != 2) << "Unable to open chkpt";
+  char chkpt_fname[CHKPT_DATA_FILE_NAME_BUFSZ];
+  os_snprintf(chkpt_fname, sizeof(chkpt_fname), CHKPT_DATA_FILE_NAME_FMT,
+              chkpt_start);
+  dirent_iterator dir(config::log_dir.c_str());
+  int chkpt_fd = os_openat(dir.dup(), chkpt_fname, O_RDONLY);
 
   off_t offset = 0;
   uint64_t to_send = md->chkpt_size;
   while (to_send > 0) {
-    sent_bytes = sendfile(backup_sockfd, chkpt_fd, &offset, to_send);
+    auto sent_bytes = sendfile(backup_sockfd, chkpt_fd, &offset, to_send);
     ALWAYS_ASSERT(sent_bytes);
     to_send -= sent_bytes;
   }
@@ -38,10 +133,6 @@ void bring_up_backup_tcp(int backup_sockfd, backup_start_metadata *md) {
 
   // Now send the log after chkpt
   send_log_files_after_tcp(backup_sockfd, md);
-
-  // Wait for the backup to notify me that it persisted the logs
-  tcp::expect_ack(backup_sockfd);
-  ++config::num_active_backups;
 }
 
 // A daemon that runs on the primary for bringing up backups by shipping
@@ -58,29 +149,43 @@ void primary_daemon_tcp() {
   LSN chkpt_start_lsn = INVALID_LSN;
   auto *md = prepare_start_metadata(chkpt_fd, chkpt_start_lsn);
   os_close(chkpt_fd);
+  if (md->bootstrap_streams) {
+    PrimaryPrepareBootstrap(md);
+    std::thread t(PrimaryBootstrapServer, md->bootstrap_port,
+                  config::num_backups * md->bootstrap_streams);
+    t.detach();
+  }
 
   std::vector<std::thread*> workers;
   for (uint32_t i = 0; i < config::num_backups; ++i) {
     std::cout << "Expecting node " << i << std::endl;
-    int backup_sockfd = primary_tcp_ctx.expect_client();
+    char addr[INET_ADDRSTRLEN];
+    int backup_sockfd = primary_tcp_ctx.expect_client(addr);
     backup_sockfds.push_back(backup_sockfd);
+    backup_addrs.emplace_back(addr);
   }
 
   // Fire workers to do the real job - must do this after got all backups
   // as we need to broadcast to everyone the complete list of all backup nodes
-  for (auto &fd : backup_sockfds) {
-    workers.push_back(new std::thread(bring_up_backup_tcp, fd, md));
+  backup_channels.resize(backup_sockfds.size(), nullptr);
+  shm_channels.resize(backup_sockfds.size(), nullptr);
+  for (uint32_t i = 0; i < backup_sockfds.size(); ++i) {
+    workers.push_back(new std::thread(bring_up_backup_tcp, i, md));
   }
 
   for (auto &w : workers) {
     w->join();
     delete w;
   }
+  --bootstrap_holds;
 
   // All done, start async shipping daemon if needed
   if (!config::command_log && config::persist_policy == config::kPersistAsync) {
     primary_async_ship_daemon = std::move(std::thread(PrimaryAsyncShippingDaemon));
   }
+  if (config::persist_adaptive) {
+    primary_persist_policy_daemon = std::thread(PersistPolicyDaemon);
+  }
 }
 
 void send_log_files_after_tcp(int backup_fd, backup_start_metadata* md) {
@@ -104,41 +209,16 @@ void send_log_files_after_tcp(int backup_fd, backup_start_metadata* md) {
       while (to_send) {
         auto sent_bytes = sendfile(backup_fd, log_fd, &file_off, to_send);
         ALWAYS_ASSERT(sent_bytes);
+        to_send -= sent_bytes;
       }
       os_close(log_fd);
     }
   }
 }
 
-void start_as_backup_tcp() {
-  memset(log_redo_partition_bounds, 0,
-         sizeof(uint64_t) * kMaxLogBufferPartitions);
-  ALWAYS_ASSERT(config::is_backup_srv());
-
-  LOG(INFO) << "[Backup] Primary: " << config::primary_srv << ":"
-            << config::primary_port;
-  cctx = new tcp::client_context(config::primary_srv, config::primary_port);
-
-  // Expect the primary to send metadata, the header first
-  const int kNumPreAllocFiles = 10;
-  backup_start_metadata* md = allocate_backup_start_metadata(kNumPreAllocFiles);
-  tcp::receive(cctx->server_sockfd, (char*)md, sizeof(*md));
-  LOG(INFO) << "[Backup] Receive chkpt " << md->chkpt_marker << " "
-            << md->chkpt_size << " bytes";
-  if (md->num_log_files > kNumPreAllocFiles) {
-    auto* d = md;
-    md = allocate_backup_start_metadata(d->num_log_files);
-    memcpy(md, d, sizeof(*d));
-    free(d);
-  }
-  md->persist_marker_files();
-
-  // Get log file names
-  if (md->num_log_files > 0) {
-    uint64_t s = md->size() - sizeof(*md);
-    tcp::receive(cctx->server_sockfd, (char*)&md->segments[0], s);
-  }
-
+// Receive the chkpt and the log after it, streamed over the connection
+// to the primary
+static void receive_chkpt_and_log_tcp(backup_start_metadata* md) {
   static const uint64_t kBufSize = 512 * 1024 * 1024;
   static char buf[kBufSize];
   if (md->chkpt_size > 0) {
@@ -183,6 +263,42 @@ void start_as_backup_tcp() {
     os_fsync(log_fd);
     os_close(log_fd);
   }
+}
+
+void start_as_backup_tcp() {
+  memset(log_redo_partition_bounds, 0,
+         sizeof(uint64_t) * kMaxLogBufferPartitions);
+  ALWAYS_ASSERT(config::is_backup_srv());
+
+  LOG(INFO) << "[Backup] Primary: " << config::primary_srv << ":"
+            << config::primary_port;
+  cctx = new tcp::client_context(config::primary_srv, config::primary_port);
+
+  // Expect the primary to send metadata, the header first
+  const int kNumPreAllocFiles = 10;
+  backup_start_metadata* md = allocate_backup_start_metadata(kNumPreAllocFiles);
+  tcp::receive(cctx->server_sockfd, (char*)md, sizeof(*md));
+  LOG(INFO) << "[Backup] Receive chkpt " << md->chkpt_marker << " "
+            << md->chkpt_size << " bytes";
+  if (md->num_log_files > kNumPreAllocFiles) {
+    auto* d = md;
+    md = allocate_backup_start_metadata(d->num_log_files);
+    memcpy(md, d, sizeof(*d));
+    free(d);
+  }
+  md->persist_marker_files();
+
+  // Get log file names
+  if (md->num_log_files > 0) {
+    uint64_t s = md->size() - sizeof(*md);
+    tcp::receive(cctx->server_sockfd, (char*)&md->segments[0], s);
+  }
+
+  if (md->bootstrap_streams) {
+    BackupBootstrapFetch(cctx->server_sockfd, md);
+  } else {
+    receive_chkpt_and_log_tcp(md);
+  }
 
   // Extract system config and set them before new_log
   config::benchmark_scale_factor = md->system_config.scale_factor;
@@ -191,6 +307,7 @@ void start_as_backup_tcp() {
   config::log_ship_offset_replay = md->system_config.offset_replay;
   config::command_log_buffer_mb = md->system_config.command_log_buffer_mb;
   config::command_log = config::command_log_buffer_mb > 0;
+  BackupMapIndexes(md);
 
   logmgr = sm_log::new_log(config::recover_functor, nullptr);
   sm_oid_mgr::create();
@@ -199,36 +316,141 @@ void start_as_backup_tcp() {
     CommandLog::cmd_log = new CommandLog::CommandLogManager();
   }
   LOG(INFO) << "[Backup] Received log file.";
+  BackupJoinShipTreeTcp(md);
 }
 
 // Send the log buffer to backups. Note: here we don't wait for backups' ack.
 // The caller (ie logmgr) handles it when necessary.
-void primary_ship_log_buffer_tcp(const char* buf, uint32_t size) {
+void primary_ship_log_buffer_tcp(const char* buf, uint32_t size,
+                                 bool async_batch) {
   ASSERT(backup_sockfds.size());
-  for (int &fd : backup_sockfds) {
-    // Send real log data, size first
-    ALWAYS_ASSERT(size);
-    uint32_t nbytes = send(fd, (char*)&size, sizeof(uint32_t), 0);
-    LOG_IF(FATAL, nbytes != sizeof(uint32_t)) << "Incomplete log shipping (header)";
-    nbytes = send(fd, buf, size, 0);
-    LOG_IF(FATAL, nbytes != size) << "Incomplete log shipping: " << nbytes << "/"
-                                  << size;
+  ALWAYS_ASSERT(size and not(size & (kCompressedBatch | kAsyncBatch)));
+
+  // Compress once for all backups; only the log flusher ships (under
+  // backup_sockfds_mutex) so a single scratch buffer will do.
+  static std::vector<char> compressed;
+  uint32_t header = size;
+  uint32_t csize = 0;
+  const char *payload = buf;
+  uint32_t payload_size = size;
+  if (config::log_ship_compress) {
+    stopwatch_t sw;
+    compressed.resize(lz4_compress_bound(size));
+    csize = lz4_compress(buf, size, compressed.data(), compressed.size());
+    ship_compress_ns += sw.time_ns();
+    ship_raw_bytes += size;
+    if (csize and csize < size) {
+      header = size | kCompressedBatch;
+      payload = compressed.data();
+      payload_size = csize;
+      ship_compressed_bytes += csize + sizeof(csize);
+    } else {
+      ship_compressed_bytes += size;
+    }
+  }
+  if (async_batch) {
+    header |= kAsyncBatch;
+  }
 
-    if (config::log_ship_offset_replay) {
-      // Send redo partition boundary information - after sending real data
-      // because we send data size=0 to indicate primary shutdown.
-      const uint32_t bounds_size = sizeof(uint64_t) * config::log_redo_partitions;
-      nbytes = send(fd, log_redo_partition_bounds, bounds_size, 0);
-      LOG_IF(FATAL, nbytes != bounds_size) << "Error sending bounds array";
+  // Real log data, size first. Send redo partition boundary information
+  // after the data because we send data size=0 to indicate primary
+  // shutdown. All backups are sent to in parallel, and we return once
+  // the last one is done with the log buffer (and the scratch buffer).
+  tcp::channel::piece pieces[tcp::channel::kMaxPieces] = {
+      {&header, sizeof(uint32_t)}};
+  uint32_t npieces = 1;
+  if (header & kCompressedBatch) {
+    pieces[npieces++] = {&csize, sizeof(uint32_t)};
+  }
+  pieces[npieces++] = {payload, payload_size};
+  if (config::log_ship_offset_replay) {
+    pieces[npieces++] = {log_redo_partition_bounds,
+                         sizeof(uint64_t) * config::log_redo_partitions};
+  }
+  PostToBackupsTcp(pieces, npieces, true, true);
+}
+
+void PostToBackupsTcp(const tcp::channel::piece *pieces, uint32_t npieces,
+                      bool expect_ack, bool wait) {
+  if (config::log_ship_shm) {
+    tcp::post_all(shm_channels, pieces, npieces, expect_ack, wait);
+  } else {
+    tcp::post_all(backup_channels, pieces, npieces, expect_ack, wait);
+  }
+}
+
+void WaitForBackupAcksTcp(bool all, uint32_t lag) {
+  uint32_t need = all ? 0 : config::ship_quorum;
+  if (config::log_ship_shm) {
+    tcp::wait_acks(shm_channels, need, lag);
+  } else {
+    tcp::wait_acks(backup_channels, need, lag);
+  }
+}
+
+util::latency_histogram BackupAckLatencyTcp() {
+  util::latency_histogram h;
+  for (auto *c : shm_channels) {
+    if (c) {
+      h.merge(c->ack_latency());
     }
   }
+  for (auto *c : backup_channels) {
+    if (c) {
+      h.merge(c->ack_latency());
+    }
+  }
+  return h;
+}
+
+void BackupJoinShipTreeTcp(backup_start_metadata *md) {
+  upstream_sockfd = cctx->server_sockfd;
+  if (md->shm_ring[0]) {
+    upstream_ring = shm::ring::attach(md->shm_ring);
+    LOG_IF(FATAL, !upstream_ring)
+        << "[Backup] No log shipping ring " << md->shm_ring
+        << ", shared memory log shipping needs the primary on this host";
+    LOG(INFO) << "[Backup] Receiving log through " << md->shm_ring;
+  }
+  // Listen before connecting upstream: our downstream backups may be
+  // done with their bootstrap first
+  tcp::server_context *forward_ctx = nullptr;
+  if (md->num_downstream) {
+    std::string port = std::to_string(md->forward_port);
+    forward_ctx = new tcp::server_context(port, md->num_downstream);
+  }
+  if (md->upstream_addr[0]) {
+    std::string addr(md->upstream_addr);
+    std::string port = std::to_string(md->upstream_port);
+    tcp::client_context *up = nullptr;
+    while (!up) {
+      try {
+        up = new tcp::client_context(addr, port);
+      } catch (illegal_argument &e) {
+        // Upstream backup is still being bootstrapped
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    }
+    upstream_sockfd = up->server_sockfd;
+    upstream_is_primary = false;
+    LOG(INFO) << "[Backup] Receiving log from " << addr << ":" << port;
+  }
+  for (uint32_t i = 0; i < md->num_downstream; ++i) {
+    int fd = forward_ctx->expect_client();
+    std::unique_lock<std::mutex> l(downstream_channels_mutex);
+    downstream_channels.push_back(new tcp::channel(fd));
+  }
+  LOG_IF(INFO, md->num_downstream)
+      << "[Backup] Forwarding log to " << md->num_downstream << " backups";
 }
 
-// Receives the bounds array sent from the primary.
+// Receives the bounds array sent from the primary, false if it's gone.
 // The only caller is backup daemon.
-void BackupReceiveBoundsArrayTcp(ReplayPipelineStage& pipeline_stage) {
-    uint32_t bsize = config::log_redo_partitions * sizeof(uint64_t);
-    tcp::receive(cctx->server_sockfd, (char*)log_redo_partition_bounds, bsize);
+bool BackupReceiveBoundsArrayTcp(ReplayPipelineStage& pipeline_stage) {
+  uint32_t bsize = config::log_redo_partitions * sizeof(uint64_t);
+  if (!receive_upstream((char*)log_redo_partition_bounds, bsize)) {
+    return false;
+  }
 
 #ifndef NDEBUG
   for (uint32_t i = 0; i < config::log_redo_partitions; ++i) {
@@ -253,6 +475,32 @@ void BackupReceiveBoundsArrayTcp(ReplayPipelineStage& pipeline_stage) {
     pipeline_stage.consumed[i] = false;
   }
   pipeline_stage.num_replaying_threads = config::replay_threads;
+  return true;
+}
+
+// Backup: send the zero size shutdown signal down the forwarding tree
+static void shutdown_downstream() {
+  uint32_t zero = 0;
+  tcp::channel::piece piece(&zero, sizeof(uint32_t));
+  tcp::post_all(downstream_channels, &piece, 1, true, true);
+  tcp::wait_acks(downstream_channels, 0);
+  std::unique_lock<std::mutex> l(downstream_channels_mutex);
+  for (auto *c : downstream_channels) {
+    delete c;
+  }
+  downstream_channels.clear();
+}
+
+void BackupPromote() {
+  LOG_IF(FATAL, config::log_ship_by_rdma or config::command_log)
+      << "Backup promotion is not supported with RDMA or the command log";
+  promote_requested.store(true);
+  // Wake the backup daemon up from receiving
+  if (upstream_ring) {
+    upstream_ring->abandon();
+  } else {
+    shutdown(upstream_sockfd, SHUT_RDWR);
+  }
 }
 
 void BackupDaemonTcp() {
@@ -267,11 +515,13 @@ void BackupDaemonTcp() {
 
   // Listen to incoming log records from the primary
   uint32_t size = 0;
+  bool stopped = false;  // by the primary
 
   // Done with receiving files and they should all be persisted, now ack the
   // primary
   tcp::send_ack(cctx->server_sockfd);
   received_log_size = 0;
+  std::vector<char> compressed_buf;
   uint32_t recv_idx = 0;
   ReplayPipelineStage *stage = nullptr;
   if (config::replay_policy == config::kReplayBackground) {
@@ -287,7 +537,13 @@ void BackupDaemonTcp() {
     WaitForLogBufferSpace(start_lsn);
 
     // expect an integer indicating data size
-    tcp::receive(cctx->server_sockfd, (char*)&size, sizeof(size));
+    if (!receive_upstream((char*)&size, sizeof(size))) {
+      break;
+    }
+    uint32_t header = size;
+    bool compressed = size & kCompressedBatch;
+    bool async_batch = size & kAsyncBatch;
+    size &= ~(kCompressedBatch | kAsyncBatch);
 
     if (!config::IsForwardProcessing()) {
       // Received the first batch, for sure the backup can start benchmarks.
@@ -299,11 +555,19 @@ void BackupDaemonTcp() {
 
     // Zero size indicates 'shutdown' signal from the primary
     if (size == 0) {
-      tcp::send_ack(cctx->server_sockfd);
+      // Downstream backups first
+      shutdown_downstream();
+      ack_upstream();
+      delete upstream_ring;
+      upstream_ring = nullptr;
       volatile_write(config::state, config::kStateShutdown);
       LOG(INFO) << "Got shutdown signal from primary, exit.";
+      LOG_IF(INFO, ship_decompress_ns)
+          << "[Backup] Log decompression took " << ship_decompress_ns / 1e6
+          << "ms";
       rep::backup_shutdown_trigger
           .notify_all();  // Actually only needed if no query workers
+      stopped = true;
       break;
     }
 
@@ -322,7 +586,22 @@ void BackupDaemonTcp() {
     char* buf = sm_log::logbuf->write_buf(sid->buf_offset(start_lsn), size);
     ALWAYS_ASSERT(buf);  // XXX: consider different log buffer sizes than the
                          // primary's later
-    tcp::receive(cctx->server_sockfd, buf, size);
+    uint32_t csize = 0;
+    if (compressed) {
+      if (!receive_upstream((char*)&csize, sizeof(csize))) {
+        break;
+      }
+      compressed_buf.resize(csize);
+      if (!receive_upstream(compressed_buf.data(), csize)) {
+        break;
+      }
+      stopwatch_t sw;
+      bool ok = lz4_decompress(compressed_buf.data(), csize, buf, size);
+      ship_decompress_ns += sw.time_ns();
+      LOG_IF(FATAL, !ok) << "Corrupt compressed log batch from primary";
+    } else if (!receive_upstream(buf, size)) {
+      break;
+    }
     DLOG(INFO) << "[Backup] Recieved " << size << " bytes (" << std::hex
                << start_lsn.offset() << "-" << end_lsn.offset() << std::dec
                << ")";
@@ -333,19 +612,49 @@ void BackupDaemonTcp() {
 
     if (config::log_ship_offset_replay) {
       // Receive bounds array
-      BackupReceiveBoundsArrayTcp(*stage);
+      if (!BackupReceiveBoundsArrayTcp(*stage)) {
+        break;
+      }
+    }
+
+    // Forward the batch as we got it while persisting it ourselves
+    if (downstream_channels.size()) {
+      tcp::channel::piece pieces[tcp::channel::kMaxPieces] = {
+          {&header, sizeof(uint32_t)}};
+      uint32_t npieces = 1;
+      if (compressed) {
+        pieces[npieces++] = {&csize, sizeof(uint32_t)};
+        pieces[npieces++] = {compressed_buf.data(), csize};
+      } else {
+        pieces[npieces++] = {buf, size};
+      }
+      if (config::log_ship_offset_replay) {
+        pieces[npieces++] = {log_redo_partition_bounds,
+                             config::log_redo_partitions * sizeof(uint64_t)};
+      }
+      tcp::post_all(downstream_channels, pieces, npieces, true, false);
     }
 
     BackupProcessLogData(*stage, start_lsn, end_lsn);
 
-    // Ack the primary after persisting data
-    tcp::send_ack(cctx->server_sockfd);
+    // Ack upstream after persisting data, on behalf of the downstream
+    // backups as well (which also frees the buffers forwarded from)
+    tcp::wait_acks(downstream_channels, 0);
+    ack_upstream();
 
-    if (config::persist_policy != config::kPersistAsync) {
+    if (async_batch) {
+      // Nobody waits for us: what we persisted is as good as it gets.
+      // The primary's next global persisted LSN is past it.
+      volatile_write(*global_persisted_lsn_ptr, end_lsn.offset());
+    } else if (config::persist_policy != config::kPersistAsync) {
       // Get global persisted LSN
       uint64_t glsn = 0;
-      tcp::receive(cctx->server_sockfd, (char*)&glsn, sizeof(uint64_t));
+      if (!receive_upstream((char*)&glsn, sizeof(uint64_t))) {
+        break;
+      }
       volatile_write(*global_persisted_lsn_ptr, glsn);
+      tcp::channel::piece lsn(&glsn, sizeof(uint64_t));
+      tcp::post_all(downstream_channels, &lsn, 1, false, false);
     }
 
     // Next iteration
@@ -354,16 +663,38 @@ void BackupDaemonTcp() {
   if (config::replay_policy == config::kReplayBackground) {
     delete stage;
   }
+  if (stopped) {
+    return;
+  }
+
+  // Lost the upstream, or asked to take over; a partially received batch
+  // is dropped
+  bool promote = promote_requested.load() or
+                 (config::promote_on_primary_loss and upstream_is_primary);
+  LOG_IF(FATAL, !promote) << "[Backup] Lost the log shipping upstream";
+  LOG(INFO) << "[Backup] Taking over as the primary at LSN " << std::hex
+            << volatile_read(new_end_lsn_offset) << std::dec;
+  shutdown_downstream();
+  delete upstream_ring;
+  upstream_ring = nullptr;
+  BackupTakeOver();
 }
 
 void PrimaryShutdownTcp() {
   static const uint32_t kZero = 0;
   backup_sockfds_mutex.lock();
   ASSERT(backup_sockfds.size());
-  for (int& fd : backup_sockfds) {
-    size_t nbytes = send(fd, (char*)&kZero, sizeof(uint32_t), 0);
-    ALWAYS_ASSERT(nbytes == sizeof(uint32_t));
-    tcp::expect_ack(fd);
+  tcp::channel::piece zero(&kZero, sizeof(uint32_t));
+  PostToBackupsTcp(&zero, 1, true, true);
+  WaitForBackupAcksTcp(true);
+  for (auto*& c : backup_channels) {
+    delete c;
+    c = nullptr;
+  }
+  // Also removes the rings
+  for (auto*& c : shm_channels) {
+    delete c;
+    c = nullptr;
   }
   backup_sockfds_mutex.unlock();
 }
@@ -1,6 +1,8 @@
 #include "rcu.h"
 #include "sm-cmd-log.h"
 #include "sm-rep.h"
+#include "sm-table.h"
+#include "stopwatch.h"
 #include "../ermia.h"
 
 namespace ermia {
@@ -11,7 +13,12 @@ uint64_t log_redo_partition_bounds[kMaxLogBufferPartitions] CACHE_ALIGNED;
 // for primary server only
 std::vector<int> backup_sockfds CACHE_ALIGNED;
 std::mutex backup_sockfds_mutex CACHE_ALIGNED;
+std::vector<tcp::channel *> backup_channels CACHE_ALIGNED;
+std::vector<shm::channel *> shm_channels CACHE_ALIGNED;
 std::thread primary_async_ship_daemon;
+std::thread primary_persist_policy_daemon;
+std::atomic<uint32_t> bootstrap_holds(0);
+uint64_t async_ship_offset CACHE_ALIGNED = ~uint64_t{0};
 
 // For backups only
 ReplayPipelineStage *pipeline_stages CACHE_ALIGNED;
@@ -24,13 +31,79 @@ int replay_bounds_fd CACHE_ALIGNED;
 std::condition_variable bg_replay_cond CACHE_ALIGNED;
 std::mutex bg_replay_mutex CACHE_ALIGNED;
 uint64_t received_log_size CACHE_ALIGNED;
+uint64_t ship_raw_bytes CACHE_ALIGNED;
+uint64_t ship_compressed_bytes;
+uint64_t ship_compress_ns;
+uint64_t ship_decompress_ns CACHE_ALIGNED;
+uint64_t shipped_log_bytes CACHE_ALIGNED;
+uint64_t logbuf_stalls CACHE_ALIGNED;
+uint64_t logbuf_stall_ns;
 std::mutex async_ship_mutex CACHE_ALIGNED;
 std::condition_variable async_ship_cond CACHE_ALIGNED;
 
+// When recently received batches arrived, in log order. Written by the
+// backup daemon only; ReadViewStaleness reads it without synchronization,
+// which is good enough for statistics.
+struct batch_arrival {
+  uint64_t end_offset;
+  uint64_t ns;
+};
+static const uint32_t kArrivalHistory = 1024;
+static batch_arrival batch_arrivals[kArrivalHistory];
+static std::atomic<uint64_t> num_batch_arrivals(0);
+
+uint64_t GetReadView(TableDescriptor *const *tables, uint32_t ntables) {
+  uint64_t replayed = volatile_read(replayed_lsn_offset);
+  if (ntables == 0) {
+    return ReadViewBound(replayed);
+  }
+  uint64_t lsn = ~uint64_t{0};
+  for (uint32_t i = 0; i < ntables; ++i) {
+    lsn = std::min<uint64_t>(
+        lsn, std::max<uint64_t>(replayed, tables[i]->GetReplayedLsnOffset()));
+  }
+  return ReadViewBound(lsn);
+}
+
+void RecordBatchArrival(uint64_t end_offset) {
+  uint64_t n = num_batch_arrivals.load(std::memory_order_relaxed);
+  batch_arrival &a = batch_arrivals[n % kArrivalHistory];
+  a.end_offset = end_offset;
+  a.ns = stopwatch_t::now();
+  num_batch_arrivals.store(n + 1, std::memory_order_release);
+}
+
+uint64_t ReadViewStaleness(uint64_t read_view) {
+  uint64_t n = num_batch_arrivals.load(std::memory_order_acquire);
+  uint64_t first = n > kArrivalHistory ? n - kArrivalHistory : 0;
+  uint64_t since = 0;
+  for (uint64_t i = n; i > first; --i) {
+    batch_arrival &a = batch_arrivals[(i - 1) % kArrivalHistory];
+    if (a.end_offset <= read_view) {
+      break;
+    }
+    since = a.ns;
+  }
+  return since ? stopwatch_t::now() - since : 0;
+}
+
+void AcquireBootstrapHold() {
+  logmgr->lock_segments();
+  ++bootstrap_holds;
+  logmgr->unlock_segments();
+}
+
 void start_as_primary() {
   memset(log_redo_partition_bounds, 0,
          sizeof(uint64_t) * kMaxLogBufferPartitions);
   ALWAYS_ASSERT(not config::is_backup_srv());
+  // Released by the daemon once the initial backups are up
+  AcquireBootstrapHold();
+  if (config::persist_policy == config::kPersistAsync and
+      (config::log_ship_by_rdma or not config::command_log)) {
+    // Until PrimaryAsyncShippingDaemon knows where it starts
+    async_ship_offset = 0;
+  }
   if (config::log_ship_by_rdma) {
     std::thread t(primary_daemon_rdma);
     t.detach();
@@ -48,6 +121,9 @@ void LogFlushDaemon() {
   DEFER(RCU::rcu_exit());
   uint64_t dlsn = logmgr->durable_flushed_lsn().offset();
   while (true) {
+    // Receiving stopped before a promotion asks us to stop, so one more
+    // round flushes everything
+    bool stop = log_flush_stop.load();
     uint64_t lsn = volatile_read(new_end_lsn_offset);
     // Use another variable to record the durable flushed LSN offset
     // here, as the backup daemon might change a new sgment ID's
@@ -59,6 +135,10 @@ void LogFlushDaemon() {
       logmgr->BackupFlushLog(lsn);
       dlsn = lsn;
     }
+    if (stop) {
+      log_flush_stop.store(false);
+      break;
+    }
   }
 }
 
@@ -66,6 +146,7 @@ void LogFlushDaemon() {
 void PrimaryAsyncShippingDaemon() {
   ALWAYS_ASSERT(config::persist_policy == config::kPersistAsync);
   uint64_t start_offset = logmgr->durable_flushed_lsn().offset();
+  volatile_write(async_ship_offset, start_offset);
   // FIXME(tzwang): support segment boundary crossing
   auto* sid = logmgr->get_offset_segment(start_offset);
   int log_fd = logmgr->open_segment_for_read(sid);
@@ -77,21 +158,15 @@ void PrimaryAsyncShippingDaemon() {
     uint32_t size = std::min<uint64_t>(config::group_commit_bytes,
       logmgr->durable_flushed_lsn().offset() - start_offset);
     ALWAYS_ASSERT(size);
-    for (int &fd : backup_sockfds) {
-      // Send real log data, size first
-      uint32_t nbytes = send(fd, (char*)&size, sizeof(uint32_t), 0);
-      LOG_IF(FATAL, nbytes != sizeof(uint32_t)) << "Incomplete log shipping (header)";
-      uint32_t to_send = size;
-      auto off = sid->offset(start_offset);
-      while (to_send) {
-        nbytes = sendfile(fd, log_fd, (off_t*)&off, to_send);
-        to_send -= nbytes;
-      }
-    }
+    // Send real log data, size first. The segment may go once every
+    // backup has been sent its part.
+    tcp::channel::piece pieces[] = {
+        {&size, sizeof(uint32_t)},
+        {log_fd, (off_t)sid->offset(start_offset), size}};
+    PostToBackupsTcp(pieces, 2, true, true);
     start_offset += size;
-    for (int &fd : backup_sockfds) {
-      tcp::expect_ack(fd);
-    }
+    volatile_write(async_ship_offset, start_offset);
+    WaitForBackupAcksTcp();
   }
   os_close(log_fd);
 }
@@ -203,7 +278,7 @@ void BackupStartReplication() {
         std::thread t(BackupBackgroundReplay);
         t.detach();
       }
-      if (config::log_ship_offset_replay) {
+      if (config::log_ship_offset_replay || config::log_ship_hash_replay) {
         logmgr->start_logbuf_redoers();
       }
     }
@@ -221,26 +296,52 @@ void BackupStartReplication() {
   }
 }
 
+void BackupMapIndexes(backup_start_metadata *md) {
+  bool secondary = false;
+  for (uint32_t i = 0; i < md->num_indexes; ++i) {
+    auto &entry = md->indexes[i];
+    TableDescriptor::upstream_index_fids[entry.fid] = entry.name;
+    secondary |= !entry.primary;
+  }
+  // Checkpoints only have the primary keys
+  LOG_IF(WARNING, secondary and md->chkpt_size)
+      << "[Backup] Secondary indexes only get keys inserted after the "
+         "checkpoint";
+}
+
 void PrimaryShutdown() {
   if (config::persist_policy == config::kPersistAsync) {
     primary_async_ship_daemon.join();
   }
+  if (primary_persist_policy_daemon.joinable()) {
+    primary_persist_policy_daemon.join();
+  }
   if (config::log_ship_by_rdma) {
     PrimaryShutdownRdma();
   } else {
     PrimaryShutdownTcp();
   }
+  if (config::log_ship_compress and ship_raw_bytes) {
+    LOG(INFO) << "[Primary] Shipped " << ship_raw_bytes << " log bytes as "
+              << ship_compressed_bytes << " ("
+              << (double)ship_compressed_bytes / ship_raw_bytes
+              << " of original), compression took " << ship_compress_ns / 1e6
+              << "ms (" << (double)ship_raw_bytes / std::max<uint64_t>(ship_compress_ns, 1)
+              << " GB/s)";
+  }
 }
 
 void primary_ship_log_buffer_all(const char *buf, uint32_t size, bool new_seg,
-                                 uint64_t new_seg_start_offset) {
+                                 uint64_t new_seg_start_offset,
+                                 bool async_batch) {
   backup_sockfds_mutex.lock();
+  volatile_write(shipped_log_bytes, shipped_log_bytes + size);
   if (config::log_ship_by_rdma) {
     // This is async - returns immediately. Caller should poll/wait for ack.
     primary_ship_log_buffer_rdma(buf, size, new_seg, new_seg_start_offset);
   } else {
     // This is blocking because of send(), but doesn't wait for backup ack.
-    primary_ship_log_buffer_tcp(buf, size);
+    primary_ship_log_buffer_tcp(buf, size, async_batch);
   }
   backup_sockfds_mutex.unlock();
 }
@@ -259,6 +360,20 @@ void TruncateFilesInLogDir() {
 
 // Generate a metadata structure for sending to the new backup.
 // No CC whatsoever, single-threaded execution only.
+uint64_t LogFileDataSize(uint64_t start_offset, uint64_t end_offset,
+                         uint64_t file_size) {
+  // The io_uring writer zero-pads the log's last page (see
+  // log_uring_writer), so the segment holding the log end can be
+  // longer than the log
+  if (config::log_uring) {
+    uint64_t dlsn = logmgr->durable_flushed_lsn().offset();
+    if (dlsn >= start_offset and dlsn < end_offset) {
+      return std::min<uint64_t>(file_size, dlsn - start_offset);
+    }
+  }
+  return file_size;
+}
+
 backup_start_metadata *prepare_start_metadata(int &chkpt_fd,
                                               LSN &chkpt_start_lsn) {
   chkpt_fd = -1;
@@ -277,26 +392,63 @@ backup_start_metadata *prepare_start_metadata(int &chkpt_fd,
     md = allocate_backup_start_metadata(nlogfiles);
   }
   new (md) backup_start_metadata;
+  for (auto &i : TableDescriptor::index_map) {
+    LOG_IF(FATAL, md->num_indexes == backup_start_metadata::kMaxIndexes)
+        << "Too many indexes to replicate";
+    auto &entry = md->indexes[md->num_indexes++];
+    LOG_IF(FATAL, i.first.size() >= sizeof(entry.name))
+        << "Index name too long to replicate: " << i.first;
+    strncpy(entry.name, i.first.c_str(), sizeof(entry.name));
+    entry.fid = i.second->GetIndexFid();
+    entry.primary = i.second->IsPrimary();
+  }
   chkpt_start_lsn = INVALID_LSN;
   int dfd = dir.dup();
-  // Find chkpt first
+  // Find chkpt first. The backup gets the latest full chkpt and the log
+  // after it, not the incremental chkpts that build on it, so the
+  // marker we ship must point to the full one. Ignore a full chkpt
+  // that is still being written (newer than the marker).
+  LSN marker_start = INVALID_LSN;
+  std::vector<uint64_t> full_chkpts;
   for (char const *fname : dir) {
     char l = fname[0];
+    char canary_unused;
     if (l == 'c') {
       memcpy(md->chkpt_marker, fname, CHKPT_FILE_NAME_BUFSZ);
+      uint64_t end_unused;
+      sscanf(fname, CHKPT_FILE_NAME_FMT "%c", &marker_start._val, &end_unused,
+             &canary_unused);
     } else if (l == 'o') {
       // chkpt file
       ALWAYS_ASSERT(config::enable_chkpt);
-      struct stat st;
-      chkpt_fd = os_openat(dfd, fname, O_RDONLY);
-      int ret = fstat(chkpt_fd, &st);
-      THROW_IF(ret != 0, log_file_error, "Error fstat");
-      ASSERT(st.st_size);
-      md->chkpt_size = st.st_size;
-      char canary_unused;
-      int n = sscanf(fname, CHKPT_DATA_FILE_NAME_FMT "%c",
-                     &chkpt_start_lsn._val, &canary_unused);
-      ALWAYS_ASSERT(chkpt_start_lsn != INVALID_LSN);
+      uint64_t start = 0;
+      if (sscanf(fname, CHKPT_DATA_FILE_NAME_FMT "%c", &start,
+                 &canary_unused) == 1) {
+        full_chkpts.push_back(start);
+      }
+    }
+  }
+  for (uint64_t start : full_chkpts) {
+    if (start <= marker_start._val and start > chkpt_start_lsn._val) {
+      chkpt_start_lsn._val = start;
+    }
+  }
+  if (chkpt_start_lsn != INVALID_LSN) {
+    char fname[CHKPT_DATA_FILE_NAME_BUFSZ];
+    os_snprintf(fname, sizeof(fname), CHKPT_DATA_FILE_NAME_FMT,
+                chkpt_start_lsn._val);
+    struct stat st;
+    chkpt_fd = os_openat(dfd, fname, O_RDONLY);
+    int ret = fstat(chkpt_fd, &st);
+    THROW_IF(ret != 0, log_file_error, "Error fstat");
+    ASSERT(st.st_size);
+    md->chkpt_size = st.st_size;
+    if (chkpt_start_lsn != marker_start) {
+      // Same cend emulation as sm_chkpt_mgr::do_chkpt
+      cmark_file_name full_marker(
+          chkpt_start_lsn, LSN::make(align_up(chkpt_start_lsn.offset() + 1),
+                                     chkpt_start_lsn.segment()));
+      memcpy(md->chkpt_marker, *full_marker, CHKPT_FILE_NAME_BUFSZ);
     }
   }
   LOG(INFO) << "[Primary] Will ship checkpoint taken at 0x" << std::hex
@@ -323,11 +475,12 @@ backup_start_metadata *prepare_start_metadata(int &chkpt_fd,
       int ret = fstat(log_fd, &st);
       os_close(log_fd);
       ASSERT(st.st_size);
-      uint64_t size = st.st_size - chkpt_start_lsn.offset();
+      uint64_t size = LogFileDataSize(start, end, st.st_size) -
+                      chkpt_start_lsn.offset();
       // FIXME(tzwang): handle multiple segments
       md->add_log_segment(seg, start, end, chkpt_start_lsn.offset(), size);
       LOG(INFO) << "Will ship segment " << seg << ", " << size << " bytes";
-    } else if (l == 'c' || l == 'o' || l == '.' || l == 'm') {
+    } else if (l == 'c' || l == 'o' || l == '.' || l == 'm' || l == 'r') {
       // Nothing to do or already handled
     } else {
       LOG(FATAL) << "Unrecognized file name";
@@ -337,6 +490,8 @@ backup_start_metadata *prepare_start_metadata(int &chkpt_fd,
 }
 
 void BackupProcessLogData(ReplayPipelineStage &stage, LSN start_lsn, LSN end_lsn) {
+  RecordBatchArrival(end_lsn.offset());
+
   // Now "notify" the flusher to write log records out, asynchronously.
   volatile_write(new_end_lsn_offset, end_lsn.offset());
 
@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
 
 #include <iostream>
@@ -20,16 +21,20 @@
 #include <thread>
 
 #include "rdma.h"
+#include "shm.h"
 #include "tcp.h"
 #include "../macros.h"
 
 #include "sm-chkpt.h"
 #include "sm-config.h"
 #include "sm-log.h"
+#include "sm-thread.h"
+#include "stopwatch.h"
 
 namespace ermia {
 
 struct write_record_t;
+class TableDescriptor;
 
 namespace rep {
 
@@ -46,7 +51,30 @@ extern uint64_t persisted_nvram_offset;
 extern uint64_t new_end_lsn_offset;
 extern std::condition_variable bg_replay_cond;
 extern uint64_t received_log_size;
+
+// Compressed log shipping (config::log_ship_compress, TCP only). A
+// compressed batch sets kCompressedBatch in the size word, which
+// then carries the uncompressed size, and is followed by the
+// compressed size and the compressed bytes. Batches that don't
+// compress are sent as is, so backups need no configuration.
+static const uint32_t kCompressedBatch = uint32_t{1} << 31;
+// Adaptive persist policy (config::persist_adaptive): a batch shipped
+// asynchronously sets kAsyncBatch in the size word and is not followed
+// by a global persisted LSN; backups use the batch's end instead.
+static const uint32_t kAsyncBatch = uint32_t{1} << 30;
+extern uint64_t ship_raw_bytes;         // primary: log bytes shipped
+extern uint64_t ship_compressed_bytes;  // primary: bytes put on the wire
+extern uint64_t ship_compress_ns;       // primary: time spent compressing
+extern uint64_t ship_decompress_ns;     // backup: time spent decompressing
+extern uint64_t shipped_log_bytes;      // primary: log bytes shipped
+// Backup: how often and how long receiving waited for log buffer space
+extern uint64_t logbuf_stalls;
+extern uint64_t logbuf_stall_ns;
 extern std::thread primary_async_ship_daemon;
+extern std::thread primary_persist_policy_daemon;
+// Primary: whether the adaptive persist policy currently ships
+// asynchronously, see PersistPolicyDaemon
+extern std::atomic<bool> persist_async;
 extern std::condition_variable backup_shutdown_trigger;
 
 static const uint32_t kMaxLogBufferPartitions = 64;
@@ -55,18 +83,73 @@ extern int replay_bounds_fd CACHE_ALIGNED;
 extern std::vector<int> backup_sockfds;
 extern std::mutex backup_sockfds_mutex;
 
+// TCP: everything sent to backup i after its bootstrap goes through
+// backup_channels[i] (null until then, or if another backup forwards
+// the log to it), see tcp::channel
+extern std::vector<tcp::channel*> backup_channels;
+// Shared memory (config::log_ship_shm): the same through shm_channels[i]
+// instead, and backup_channels stays null
+extern std::vector<shm::channel*> shm_channels;
+// Backup: the backups we forward the log to (config::ship_fanout);
+// the mutex keeps them around while the stats sampler looks at them
+extern std::vector<tcp::channel*> downstream_channels;
+extern std::mutex downstream_channels_mutex;
+
+// Log forwarding tree over the backups in the order they connected:
+// the primary ships to backups [0, fanout), backup i forwards to
+// [(i + 1) * fanout, (i + 2) * fanout). Without config::ship_fanout
+// the primary ships to every backup itself.
+inline bool ShipsFromPrimary(uint32_t backup) {
+  return config::ship_fanout == 0 or backup < config::ship_fanout;
+}
+inline uint32_t ShipUpstream(uint32_t backup) {
+  ASSERT(not ShipsFromPrimary(backup));
+  return backup / config::ship_fanout - 1;
+}
+inline uint32_t ShipNumDownstream(uint32_t backup, uint32_t nbackups) {
+  if (config::ship_fanout == 0) {
+    return 0;
+  }
+  uint64_t first = (uint64_t)(backup + 1) * config::ship_fanout;
+  return std::min<uint64_t>(config::ship_fanout,
+                            nbackups > first ? nbackups - first : 0);
+}
+
 extern std::mutex async_ship_mutex;
 extern std::condition_variable async_ship_cond;
 
-inline uint64_t GetReadView() {
+// Log segments the primary may still read for replication: backups
+// being brought up get the checkpoint and the log files after it
+// (bootstrap_holds counts bring-ups in progress), and asynchronous
+// shipping sends from the segment file at async_ship_offset.
+extern std::atomic<uint32_t> bootstrap_holds;
+extern uint64_t async_ship_offset;
+
+// Take a bootstrap hold; under the log segment lock, so that it can't
+// slip in between a reclaimer reading LogRetentionHorizon and deleting
+// segments. Release with --bootstrap_holds.
+void AcquireBootstrapHold();
+
+// The log offset below which replication needs no segment files
+inline uint64_t LogRetentionHorizon() {
+  if (bootstrap_holds.load(std::memory_order_acquire)) {
+    return 0;
+  }
+  return volatile_read(async_ship_offset);
+}
+
+// The read view for data replayed up to [replayed]: no later than what's
+// persisted as well (asynchronously shipped batches count as persisted
+// once they are here, see kAsyncBatch)
+inline uint64_t ReadViewBound(uint64_t replayed) {
   uint64_t lsn = 0;
   if (config::command_log) {
-    return volatile_read(rep::replayed_lsn_offset);
+    return replayed;
   }
   if (config::persist_policy == config::kPersistAsync) {
-    lsn = volatile_read(rep::replayed_lsn_offset);
+    lsn = replayed;
   } else {
-    lsn = std::min<uint64_t>(volatile_read(rep::replayed_lsn_offset),
+    lsn = std::min<uint64_t>(replayed,
                              volatile_read(*rep::global_persisted_lsn_ptr));
   }
   if (config::nvram_log_buffer) {
@@ -75,6 +158,72 @@ inline uint64_t GetReadView() {
   return lsn;
 }
 
+inline uint64_t GetReadView() {
+  return ReadViewBound(volatile_read(rep::replayed_lsn_offset));
+}
+
+// The freshest read view that is consistent for [tables] only; never older
+// than GetReadView()
+uint64_t GetReadView(TableDescriptor *const *tables, uint32_t ntables);
+
+// Backups: remember when log up to [end_offset] arrived, and tell how long
+// ago (in ns) the oldest arrived batch beyond [read_view] did, or 0 if the
+// read view is caught up with everything received.
+void RecordBatchArrival(uint64_t end_offset);
+uint64_t ReadViewStaleness(uint64_t read_view);
+
+/* Backup promotion (failover). When the log stops coming from the
+   primary (config::promote_on_primary_loss) or BackupPromote() is
+   called, the backup daemon stops receiving and the backup takes over:
+
+   1. flush and replay everything received, while reads go on;
+   2. hold off new read-only transactions and wait for those in flight;
+   3. install the latest replayed version of each record, still in the
+      log (like BackupGetVersion does on demand), at the head of its
+      tuple array chain and clear the pdest arrays, in parallel;
+   4. become the primary (config::backup_promoted): indexes drop their
+      pdest arrays, the OID allocators are raised above what replay
+      inserted, the key arrays are rebuilt from the primary indexes in
+      the former pdest arrays if checkpointing is on, and the log
+      manager starts allocating from the durable LSN;
+   5. let transactions in again, now as read-write ones.
+
+   Backups downstream of us are shut down, and the new primary runs
+   without backups. Not available with RDMA or the command log.
+ */
+extern std::atomic<bool> promoting;
+extern std::atomic<uint32_t> backup_readers[config::MAX_THREADS];
+// Set to have LogFlushDaemon flush what's received and exit, which it
+// acknowledges by clearing it
+extern std::atomic<bool> log_flush_stop;
+
+// Backup: enter a read-only transaction, unless the backup got promoted
+// while we waited for a promotion in progress. Threads with reads in
+// flight (e.g., coroutines) don't wait: the promotion waits for them.
+inline bool BackupBeginRead() {
+  std::atomic<uint32_t> &mine = backup_readers[thread::MyId()];
+  while (true) {
+    if (mine.fetch_add(1) or not promoting.load()) {
+      return true;
+    }
+    mine.fetch_sub(1);
+    while (promoting.load()) {
+      std::this_thread::yield();
+    }
+    if (not config::is_backup_srv()) {
+      return false;
+    }
+  }
+}
+
+inline void BackupEndRead() { backup_readers[thread::MyId()].fetch_sub(1); }
+
+// Backup: ask the backup daemon to stop receiving and take over
+void BackupPromote();
+
+// Backup daemon: take over as the primary, see above
+void BackupTakeOver();
+
 struct backup_start_metadata {
   struct log_segment {
     segment_file_name file_name;
@@ -92,6 +241,37 @@ struct backup_start_metadata {
   };
 
   struct backup_config system_config;
+
+  // Position in the log forwarding tree (config::ship_fanout): where to
+  // receive the log from (no address: the primary), and how many
+  // backups will connect to us for it, on which port
+  char upstream_addr[INET_ADDRSTRLEN];
+  uint32_t upstream_port;
+  uint32_t num_downstream;
+  uint32_t forward_port;
+
+  // Multi-stream bootstrap (config::bootstrap_streams): how many
+  // connections to fetch the files over, from which port, and in
+  // chunks of what size; no streams means they follow right here
+  uint32_t bootstrap_streams;
+  uint32_t bootstrap_port;
+  uint64_t bootstrap_chunk_size;
+
+  // Shared memory log shipping (config::log_ship_shm): the ring to
+  // receive the log from instead of the connection, if any
+  char shm_ring[64];
+
+  // The primary's FID of each index, so backups can tell which index a
+  // logged key goes to (see BackupMapIndexes)
+  static const uint32_t kMaxIndexes = 256;
+  struct index_fid {
+    char name[64];
+    FID fid;
+    bool primary;
+  };
+  uint32_t num_indexes;
+  index_fid indexes[kMaxIndexes];
+
   char chkpt_marker[CHKPT_FILE_NAME_BUFSZ];
   char durable_marker[DURABLE_FILE_NAME_BUFSZ];
   char nxt_marker[NXT_SEG_FILE_NAME_BUFSZ];
@@ -100,7 +280,19 @@ struct backup_start_metadata {
   uint64_t num_log_files;
   log_segment segments[0];  // must be the last one
 
-  backup_start_metadata() : chkpt_size(0), log_size(0), num_log_files(0) {
+  backup_start_metadata()
+      : upstream_port(0),
+        num_downstream(0),
+        forward_port(0),
+        bootstrap_streams(config::bootstrap_streams),
+        bootstrap_port(0),
+        bootstrap_chunk_size(config::bootstrap_chunk_mb * config::MB),
+        num_indexes(0),
+        chkpt_size(0),
+        log_size(0),
+        num_log_files(0) {
+    upstream_addr[0] = '\0';
+    shm_ring[0] = '\0';
     system_config.scale_factor = config::benchmark_scale_factor;
     system_config.log_segment_mb = config::log_segment_mb;
     system_config.offset_replay = config::log_ship_offset_replay;
@@ -159,12 +351,17 @@ inline void WaitForLogBufferSpace(LSN target_lsn) {
   // and replayed (if needed).
   uint64_t off = target_lsn.offset();
   if (off) {
-    while (off > logmgr->durable_flushed_lsn().offset()) {
-    }
-    if (config::replay_policy != config::kReplayNone &&
-        config::replay_policy != config::kReplayBackground) {
-      while (off > volatile_read(replayed_lsn_offset)) {
+    bool wait_replay = config::replay_policy != config::kReplayNone &&
+                       config::replay_policy != config::kReplayBackground;
+    if (off > logmgr->durable_flushed_lsn().offset() or
+        (wait_replay and off > volatile_read(replayed_lsn_offset))) {
+      stopwatch_t sw;
+      while (off > logmgr->durable_flushed_lsn().offset()) {
+      }
+      while (wait_replay and off > volatile_read(replayed_lsn_offset)) {
       }
+      volatile_write(logbuf_stall_ns, logbuf_stall_ns + sw.time_ns());
+      volatile_write(logbuf_stalls, logbuf_stalls + 1);
     }
 
     // Really make room for the incoming data.
@@ -194,11 +391,14 @@ void BackupProcessLogData(ReplayPipelineStage &stage, LSN start_lsn, LSN end_lsn
 void start_as_primary();
 void BackupStartReplication();
 void primary_ship_log_buffer_all(const char* buf, uint32_t size, bool new_seg,
-                                 uint64_t new_seg_start_offset);
+                                 uint64_t new_seg_start_offset,
+                                 bool async_batch);
 backup_start_metadata* prepare_start_metadata(int& chkpt_fd,
                                               LSN& chkpt_start_lsn);
 void PrimaryAsyncShippingDaemon();
 void PrimaryShutdown();
+// Backup: remember the primary's index FIDs that came with [md]
+void BackupMapIndexes(backup_start_metadata* md);
 void LogFlushDaemon();
 void TruncateFilesInLogDir(); 
 
@@ -223,8 +423,117 @@ void primary_daemon_tcp();
 void send_log_files_after_tcp(int backup_fd, backup_start_metadata* md);
 void PrimaryShutdownTcp();
 
+/* Multi-stream bootstrap (config::bootstrap_streams). Instead of
+   streaming the chkpt and log files over its one connection, the
+   primary sends a new backup the list of files to fetch: the chkpt
+   manifest, the log segments after it and the chkpt's chunk files.
+   The backup splits them into chunks of bootstrap_chunk_size and has
+   bootstrap_streams connections pull them from the primary's
+   bootstrap server in parallel, each chunk checked against the
+   CRC32C the primary sends with it. A dropped connection or a bad
+   chunk only costs that chunk, which is asked for again (over a new
+   connection if need be). A backup that restarts bootstraps from
+   scratch. The primary keeps the files (one bootstrap hold per
+   backup) until each backup reports that it has fetched every chunk;
+   a chunk it can't read is answered with an error that fails the
+   backup.
+
+   The backup goes on as soon as the log segments are in; chkpt
+   recovery waits for each file it reads, so chunks already received
+   are loaded while later ones are still arriving.
+ */
+struct bootstrap_file {
+  char name[CHKPT_CHUNK_FILE_NAME_BUFSZ > SEGMENT_FILE_NAME_BUFSZ
+                ? CHKPT_CHUNK_FILE_NAME_BUFSZ
+                : SEGMENT_FILE_NAME_BUFSZ];
+  uint64_t offset;  // [size] bytes from here go to the same offset
+  uint64_t size;
+};
+
+// Primary: list the files of [md]'s chkpt and log for new backups, and
+// serve their chunks on md->bootstrap_port
+void PrimaryPrepareBootstrap(backup_start_metadata* md);
+void PrimaryBootstrapServer(uint32_t port, uint32_t nclients);
+void PrimarySendBootstrapFiles(int backup_fd);
+
+// Primary: bytes of log in a segment file of [file_size] bytes
+// covering LSN offsets [start_offset, end_offset)
+uint64_t LogFileDataSize(uint64_t start_offset, uint64_t end_offset,
+                         uint64_t file_size);
+
+// Backup: receive the file list from [primary_fd] and start fetching;
+// returns once the log segments are complete
+void BackupBootstrapFetch(int primary_fd, backup_start_metadata* md);
+
+// Backup: wait until [fname] is completely fetched (if it is being
+// fetched at all)
+void BackupWaitForBootstrapFile(const char* fname);
+
+/* Sample replication statistics every config::rep_stat_interval_ms
+   until StopReplicationStats(), to config::rep_stat_dest: a CSV file, or with a
+   "unix:" prefix a local datagram socket that gets one line of
+   name=value pairs per sample (dropped if nobody is listening, so
+   sampling never holds up replication). Rates are per second over the
+   interval, ACK latencies cover the ACKs received during it.
+
+   Primary: log bytes shipped, the unflushed part of the log, whether
+   the adaptive persist policy ships asynchronously and, per backup it
+   ships to, ACKs and their latencies. Backup: log bytes
+   received, the gap between durable and replayed LSN, replayed batches
+   and their average latency (offset and hash replay), log buffer
+   occupancy and WaitForLogBufferSpace stalls, and ACK latencies of the
+   backups it forwards to.
+ */
+void ReplicationStatsDaemon();
+
+// Start ReplicationStatsDaemon if configured; stop and join it before
+// the log manager or the channels it samples go away
+void StartReplicationStats();
+void StopReplicationStats();
+
+/* Primary, with config::persist_adaptive: every
+   config::persist_adapt_interval_ms, decide whether the log flusher
+   ships pipelined or asynchronously (persist_async) from the commit
+   latency and backup ACK latency of the interval.
+
+   Pipelined shipping goes async once the average commit latency exceeds
+   config::persist_latency_us: transactions then commit as soon as the
+   log is persistent locally, while the flusher still holds off shipping
+   once backups leave more than config::persist_max_lag_mb un-ACKed.
+   Async goes back to pipelined once backups ACK within half the target
+   (at the 99th percentile), or nothing is shipped at all. Each switch
+   is logged as "[Primary] Persist policy ...".
+
+   The flusher applies a switch at the next batch: before the first
+   async batch it waits for the last pipelined one to be ACKed and sends
+   its global persisted LSN, so backups always know what to expect next
+   (see kAsyncBatch).
+ */
+void PersistPolicyDaemon();
+
 /* Send a chunk of log records (still in memory log buffer) to a backup via TCP.
  */
-void primary_ship_log_buffer_tcp(const char* buf, uint32_t size);
+void primary_ship_log_buffer_tcp(const char* buf, uint32_t size,
+                                 bool async_batch);
+
+/* Queue a message to every backup that is up; if [wait], return only
+   once all of them have sent it, so the pieces may be reused.
+ */
+void PostToBackupsTcp(const tcp::channel::piece* pieces, uint32_t npieces,
+                      bool expect_ack, bool wait);
+
+/* Wait until config::ship_quorum backups (or all if [all] or no quorum
+   is set) acked every message posted to them so far, but the last
+   [lag] of them.
+ */
+void WaitForBackupAcksTcp(bool all = false, uint32_t lag = 0);
+
+// ACK latencies (in microseconds) of the backups the primary ships to
+util::latency_histogram BackupAckLatencyTcp();
+
+/* Backup: connect to our place in the log forwarding tree described by
+   [md], before acking the bootstrap.
+ */
+void BackupJoinShipTreeTcp(backup_start_metadata* md);
 }  // namespace rep
 }  // namespace ermia
@@ -6,6 +6,7 @@ namespace ermia {
 std::unordered_map<std::string, TableDescriptor*> TableDescriptor::name_map;
 std::unordered_map<FID, TableDescriptor*> TableDescriptor::fid_map;
 std::unordered_map<std::string, OrderedIndex*> TableDescriptor::index_map;
+std::unordered_map<FID, std::string> TableDescriptor::upstream_index_fids;
 
 TableDescriptor::TableDescriptor(std::string& name)
     : name(name),
@@ -13,17 +14,25 @@ TableDescriptor::TableDescriptor(std::string& name)
       tuple_fid(0),
       tuple_array(nullptr),
       aux_fid_(0),
-      aux_array_(nullptr) {
+      aux_array_(nullptr),
+      replayed_lsn_offset_(0) {
 }
 
 void TableDescriptor::Initialize() {
   tuple_fid = oidmgr->create_file(true);
   fid_map[tuple_fid] = this;
   tuple_array = oidmgr->get_array(tuple_fid);
+  if (config::enable_chkpt and config::chkpt_max_deltas) {
+    tuple_array->track_dirty();
+  }
 
   // Dedicated array for keys
   aux_fid_ = oidmgr->create_file(true);
   aux_array_ = oidmgr->get_array(aux_fid_);
+
+  // Key arrays are indexed by the same OIDs as the tuple array
+  oidmgr->track_prefault(tuple_fid, tuple_array);
+  oidmgr->track_prefault(tuple_fid, aux_array_);
 }
 
 void TableDescriptor::SetPrimaryIndex(OrderedIndex *index, const std::string &name) {
@@ -36,14 +45,18 @@ void TableDescriptor::SetPrimaryIndex(OrderedIndex *index, const std::string &na
 
 void TableDescriptor::AddSecondaryIndex(OrderedIndex *index, const std::string &name) {
   ALWAYS_ASSERT(index);
+  // Checkpoints carry only primary keys, secondary keys are only in the
+  // log (see sm_chkpt_mgr::recover)
+  LOG_IF(FATAL, config::log_reclaim)
+      << "-log_reclaim would drop the only copy of secondary index " << name;
   sec_indexes.push_back(index);
   index_map[name] = index;
   index->SetArrays(false);
 }
 
 void TableDescriptor::Recover(FID tuple_fid, FID aux_fid, OID himark) {
-  ALWAYS_ASSERT(tuple_fid == 0);
-  tuple_fid = tuple_fid;
+  ALWAYS_ASSERT(this->tuple_fid == 0);
+  this->tuple_fid = tuple_fid;
   aux_fid_ = aux_fid;
 
   // Both primary and secondary indexes point to the same descriptor
@@ -57,6 +70,10 @@ void TableDescriptor::Recover(FID tuple_fid, FID aux_fid, OID himark) {
 
   ALWAYS_ASSERT(oidmgr->file_exists(tuple_fid));
   tuple_array = oidmgr->get_array(tuple_fid);
+  if (config::enable_chkpt and config::chkpt_max_deltas and
+      not config::is_backup_srv()) {
+    tuple_array->track_dirty();
+  }
   ALWAYS_ASSERT(oidmgr->file_exists(aux_fid));
   aux_array_ = oidmgr->get_array(aux_fid_);
 
@@ -65,5 +82,7 @@ void TableDescriptor::Recover(FID tuple_fid, FID aux_fid, OID himark) {
     aux_array_->ensure_size(aux_array_->alloc_size(himark));
     oidmgr->recreate_allocator(tuple_fid, himark);
   }
+  oidmgr->track_prefault(tuple_fid, tuple_array);
+  oidmgr->track_prefault(tuple_fid, aux_array_);
 }
 }  // namespace ermia
@@ -19,6 +19,12 @@ class TableDescriptor {
   // Map index name to OrderedIndex (primary or secondary), global, no CC
   static std::unordered_map<std::string, OrderedIndex*> index_map;
 
+  // Backups: map the FIDs the primary node gave its indexes (primary and
+  // secondary) to index names, which is how logged index inserts find
+  // their index; index FIDs are allocated on each node on its own (see
+  // backup_start_metadata)
+  static std::unordered_map<FID, std::string> upstream_index_fids;
+
   static inline OrderedIndex *GetIndex(const std::string &name) {
     return index_map[name];
   }
@@ -57,6 +63,10 @@ class TableDescriptor {
   FID aux_fid_;
   oid_array* aux_array_;
 
+  // Backups: log up to this offset is replayed for this table, which can be
+  // ahead of rep::replayed_lsn_offset (see parallel_hash_replay)
+  uint64_t replayed_lsn_offset_;
+
  public:
   TableDescriptor(std::string& name);
 
@@ -66,6 +76,7 @@ class TableDescriptor {
   void Recover(FID tuple_fid, FID key_fid, OID himark = 0);
   inline std::string& GetName() { return name; }
   inline OrderedIndex* GetPrimaryIndex() { return primary_index; }
+  inline uint32_t NumSecondaryIndexes() { return sec_indexes.size(); }
   inline FID GetTupleFid() { return tuple_fid; }
   inline FID GetKeyFid() {
     ASSERT(!config::is_backup_srv() || (config::command_log && config::replay_threads));
@@ -84,5 +95,11 @@ class TableDescriptor {
     return aux_array_;
   }
   inline oid_array* GetTupleArray() { return tuple_array; }
+  inline uint64_t GetReplayedLsnOffset() {
+    return volatile_read(replayed_lsn_offset_);
+  }
+  inline void SetReplayedLsnOffset(uint64_t offset) {
+    volatile_write(replayed_lsn_offset_, offset);
+  }
 };
 }  // namespace ermia
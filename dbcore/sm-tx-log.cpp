@@ -172,7 +172,8 @@ void sm_tx_log_impl::add_payload_request(log_record_type type, FID f, OID o,
     b->records->size_align_bits = abits;
 
     uint32_t csum = b->body_checksum();
-    b->checksum = adler32_memcpy(b->payload_begin(), p, psize, csum);
+    b->checksum = log_checksum_memcpy(b->checksum_type, b->payload_begin(), p,
+                                      psize, csum);
 
     // update the request to point to the external record
     req.type = (log_record_type)(req.type | LOG_FLAG_IS_EXT);
@@ -214,7 +215,7 @@ void sm_tx_log_impl::add_request(log_request const &req) {
 void sm_tx_log_impl::_populate_block(log_block *b) {
   size_t i = 0;
   uint32_t payload_end = 0;
-  uint32_t csum_payload = ADLER32_CSUM_INIT;
+  uint32_t csum_payload = log_checksum_init(b->checksum_type);
 
   // link to previous overflow?
   if (_prev_overflow != INVALID_LSN) {
@@ -247,8 +248,8 @@ void sm_tx_log_impl::_populate_block(log_block *b) {
       }
 
       char *dest = b->payload_begin() + payload_end;
-      csum_payload =
-          adler32_memcpy(dest, it->payload_ptr, it->payload_size, csum_payload);
+      csum_payload = log_checksum_memcpy(b->checksum_type, dest, it->payload_ptr,
+                                         it->payload_size, csum_payload);
       payload_end += it->payload_size;
     } else {
       r->size_code = INVALID_SIZE_CODE;
@@ -261,7 +262,8 @@ void sm_tx_log_impl::_populate_block(log_block *b) {
 
   // finalize the checksum
   uint32_t csum = b->body_checksum();
-  b->checksum = adler32_merge(csum, csum_payload, payload_end);
+  b->checksum =
+      log_checksum_merge(b->checksum_type, csum, csum_payload, payload_end);
 }
 
 /* Transactions assign this value to their commit block as a signal of
@@ -290,13 +292,16 @@ void sm_tx_log_impl::spill_overflow() {
 
   auto *inner = (log_block *)b->payload(0);
   inner->nrec = inner_nreq;
+  inner->checksum_type = b->checksum_type;
+  inner->reserved = 0;
   inner->lsn = b->payload_lsn(0);
   fill_skip_record(&inner->records[inner_nreq], INVALID_LSN, _payload_bytes,
                    false);
   _populate_block(inner);
 
   uint32_t csum = b->body_checksum();
-  b->checksum = adler32_merge(csum, inner->checksum, pbytes);
+  b->checksum =
+      log_checksum_merge(b->checksum_type, csum, inner->checksum, pbytes);
   _nreq = 1;  // for the overflow LSN
   _prev_overflow = inner->lsn;
   _payload_bytes = 0;
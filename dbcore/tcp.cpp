@@ -2,9 +2,11 @@
 #include <string.h>
 
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <iostream>
 
+#include "stopwatch.h"
 #include "tcp.h"
 
 namespace tcp {
@@ -62,6 +64,145 @@ int server_context::expect_client(char *client_addr) {
   return fd;
 }
 
+channel::channel(int fd)
+    : _fd(fd),
+      _shutdown(false),
+      _posted(0),
+      _sent(0),
+      _acks(0),
+      _expected_acks(0) {
+  _sender = std::thread(&channel::sender, this);
+  _receiver = std::thread(&channel::receiver, this);
+}
+
+channel::~channel() {
+  {
+    std::unique_lock<std::mutex> l(_mutex);
+    _shutdown = true;
+    _cv.notify_all();
+  }
+  _sender.join();
+  // Unblocks the receiver if the peer is still there
+  shutdown(_fd, SHUT_RD);
+  _receiver.join();
+}
+
+uint64_t channel::post(const piece *pieces, uint32_t npieces,
+                       bool expect_ack) {
+  ALWAYS_ASSERT(npieces <= kMaxPieces);
+  if (expect_ack) {
+    _expected_acks.fetch_add(1, std::memory_order_release);
+  }
+  std::unique_lock<std::mutex> l(_mutex);
+  if (expect_ack) {
+    _ack_posted_ns.push_back(stopwatch_t::now());
+  }
+  _queue.emplace_back();
+  message &m = _queue.back();
+  m.npieces = npieces;
+  for (uint32_t i = 0; i < npieces; ++i) {
+    m.pieces[i] = pieces[i];
+    if (pieces[i].file_fd < 0 and pieces[i].size <= kInlineSize) {
+      memcpy(m.inline_data[i], pieces[i].data, pieces[i].size);
+      m.pieces[i].data = m.inline_data[i];
+    }
+  }
+  _cv.notify_all();
+  return ++_posted;
+}
+
+void channel::wait_sent(uint64_t seq) {
+  std::unique_lock<std::mutex> l(_mutex);
+  _cv.wait(l, [&] { return _sent >= seq; });
+}
+
+void channel::sender() {
+  std::unique_lock<std::mutex> l(_mutex);
+  while (true) {
+    _cv.wait(l, [this] { return !_queue.empty() or _shutdown; });
+    if (_queue.empty()) {
+      break;
+    }
+    // Only we pop, so the front stays put while we send it
+    message &m = _queue.front();
+    l.unlock();
+
+    struct iovec iov[kMaxPieces];
+    uint32_t i = 0;
+    while (i < m.npieces) {
+      if (m.pieces[i].file_fd >= 0) {
+        off_t off = m.pieces[i].file_offset;
+        size_t to_send = m.pieces[i].size;
+        while (to_send) {
+          ssize_t n = sendfile(_fd, m.pieces[i].file_fd, &off, to_send);
+          LOG_IF(FATAL, n <= 0) << "Error sending file to peer: " << errno;
+          to_send -= n;
+        }
+        ++i;
+        continue;
+      }
+      // Gather the memory pieces up to the next file piece
+      uint32_t niov = 0;
+      for (; i < m.npieces and m.pieces[i].file_fd < 0; ++i) {
+        iov[niov].iov_base = (void *)m.pieces[i].data;
+        iov[niov].iov_len = m.pieces[i].size;
+        ++niov;
+      }
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = niov;
+      while (msg.msg_iovlen) {
+        ssize_t n = sendmsg(_fd, &msg, MSG_NOSIGNAL);
+        LOG_IF(FATAL, n < 0) << "Error sending to peer: " << errno;
+        while (n and msg.msg_iovlen) {
+          size_t done = std::min<size_t>(n, msg.msg_iov->iov_len);
+          msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + done;
+          msg.msg_iov->iov_len -= done;
+          n -= done;
+          if (msg.msg_iov->iov_len == 0) {
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+          }
+        }
+      }
+    }
+
+    l.lock();
+    _queue.pop_front();
+    ++_sent;
+    _cv.notify_all();
+  }
+}
+
+void channel::receiver() {
+  char buf[ACK_TEXT_LEN];
+  while (true) {
+    size_t got = 0;
+    while (got < ACK_TEXT_LEN) {
+      ssize_t n = recv(_fd, buf + got, ACK_TEXT_LEN - got, 0);
+      if (n <= 0) {
+        return;  // peer gone or channel closing
+      }
+      got += n;
+    }
+    ALWAYS_ASSERT(strcmp(buf, ACK_TEXT) == 0);
+    {
+      std::unique_lock<std::mutex> l(_mutex);
+      if (!_ack_posted_ns.empty()) {
+        _ack_latency.add((stopwatch_t::now() - _ack_posted_ns.front()) / 1000);
+        _ack_posted_ns.pop_front();
+      }
+    }
+    _acks.fetch_add(1, std::memory_order_release);
+  }
+}
+
+util::latency_histogram channel::ack_latency() {
+  std::unique_lock<std::mutex> l(_mutex);
+  return _ack_latency;
+}
+
 client_context::client_context(std::string &server, std::string &port)
     : server_sockfd(0) {
   struct addrinfo hints;
@@ -84,7 +225,10 @@ client_context::client_context(std::string &server, std::string &port)
     int yes = 1;
     int ret =
         setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-    THROW_IF(ret == -1, illegal_argument, "setsocketopt() failed");
+    if (ret == -1) {
+      close(server_sockfd);
+      THROW_IF(true, illegal_argument, "setsocketopt() failed");
+    }
 
     if (connect(server_sockfd, r->ai_addr, r->ai_addrlen) == 0) {
       inet_ntop(r->ai_family,
@@ -93,6 +237,9 @@ client_context::client_context(std::string &server, std::string &port)
       std::cout << "[Client] Connected to " << server << "\n";
       return;
     }
+    // Callers retry until the server is up, don't leak the socket
+    close(server_sockfd);
+    server_sockfd = -1;
   }
   THROW_IF(true, illegal_argument, "Can't bind()");
 }
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <arpa/inet.h>
@@ -26,6 +31,23 @@ inline void receive(int fd, char* buf, size_t to_receive) {
   }
 }
 
+// Same as receive(), but returns false if the peer went away (or the
+// socket was shut down) first
+inline bool try_receive(int fd, char* buf, size_t to_receive) {
+  auto total = to_receive;
+  while (to_receive) {
+    ssize_t n = recv(fd, buf + total - to_receive, to_receive, 0);
+    if (n < 0 and errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    to_receive -= n;
+  }
+  return true;
+}
+
 inline void expect_ack(int bfd) {
   static char buf[ACK_TEXT_LEN];
   receive(bfd, buf, ACK_TEXT_LEN);
@@ -53,6 +75,139 @@ struct server_context {
   int expect_client(char *client_addr = nullptr);
 };
 
+/* One peer's end of a connection that is sent to from a dedicated
+   thread, so that sending the same data to several peers proceeds in
+   parallel, while another thread counts the ACKs the peer returns, so
+   that nobody has to read them on the send path.
+
+   Messages go out in the order posted, each as one sendmsg() of its
+   pieces, or sendfile() for pieces that come from a file. Pieces of
+   up to kInlineSize bytes are copied; larger ones are sent from where
+   they are and must stay valid until wait_sent() covers the message.
+   Nobody else may send to or receive from the socket while the
+   channel exists.
+
+   The channel also records how long each ACK took, from posting the
+   message it answers until it arrived.
+ */
+class channel {
+ public:
+  static const uint32_t kMaxPieces = 4;
+  static const uint32_t kInlineSize = 16;
+
+  struct piece {
+    const void* data;
+    size_t size;
+    int file_fd;  // if >= 0, send [size] bytes at [file_offset] instead
+    off_t file_offset;
+
+    piece() : data(nullptr), size(0), file_fd(-1), file_offset(0) {}
+    piece(const void* d, size_t s)
+        : data(d), size(s), file_fd(-1), file_offset(0) {}
+    piece(int fd, off_t offset, size_t s)
+        : data(nullptr), size(s), file_fd(fd), file_offset(offset) {}
+  };
+
+  channel(int fd);
+  ~channel();
+
+  inline int fd() { return _fd; }
+
+  // Queue a message, which the peer answers with an ACK if
+  // [expect_ack]; returns its sequence number
+  uint64_t post(const piece* pieces, uint32_t npieces, bool expect_ack);
+
+  // Wait until message [seq] and all before it are sent
+  void wait_sent(uint64_t seq);
+
+  // ACKs received and expected for the messages posted so far
+  inline uint64_t acks() { return _acks.load(std::memory_order_acquire); }
+  inline uint64_t expected_acks() {
+    return _expected_acks.load(std::memory_order_acquire);
+  }
+
+  // Send errors are fatal, so unlike shm::channel this never fails
+  inline bool failed() { return false; }
+
+  // ACK latencies (in microseconds) so far
+  util::latency_histogram ack_latency();
+
+ private:
+  struct message {
+    piece pieces[kMaxPieces];
+    uint32_t npieces;
+    char inline_data[kMaxPieces][kInlineSize];
+  };
+
+  int _fd;
+  bool _shutdown;
+  std::deque<message> _queue;
+  uint64_t _posted;
+  uint64_t _sent;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::atomic<uint64_t> _acks;
+  std::atomic<uint64_t> _expected_acks;
+  std::deque<uint64_t> _ack_posted_ns;  // of messages not yet ACKed
+  util::latency_histogram _ack_latency;
+  std::thread _sender;
+  std::thread _receiver;
+
+  void sender();
+  void receiver();
+};
+
+/* Queue a message to each of [channels] (null ones are skipped); if
+   [wait], return only once all of them have sent it, so the pieces
+   may be reused. [Channel] is tcp::channel or shm::channel.
+ */
+template <class Channel>
+void post_all(std::vector<Channel *> &channels, const channel::piece *pieces,
+              uint32_t npieces, bool expect_ack, bool wait) {
+  std::vector<std::pair<Channel *, uint64_t>> posted;
+  for (auto *c : channels) {
+    if (c) {
+      posted.emplace_back(c, c->post(pieces, npieces, expect_ack));
+    }
+  }
+  if (wait) {
+    for (auto &p : posted) {
+      p.first->wait_sent(p.second);
+    }
+  }
+}
+
+// Wait until [need] of [channels] (all if zero) acked everything
+// posted to them so far, but the last [lag] messages; channels that
+// failed don't count, and fewer are needed if fewer are left
+template <class Channel>
+void wait_acks(std::vector<Channel *> &channels, uint32_t need,
+               uint32_t lag = 0) {
+  std::vector<std::pair<Channel *, uint64_t>> targets;
+  for (auto *c : channels) {
+    if (c) {
+      uint64_t expected = c->expected_acks();
+      targets.emplace_back(c, expected > lag ? expected - lag : 0);
+    }
+  }
+  if (need == 0 or need > targets.size()) {
+    need = targets.size();
+  }
+  while (true) {
+    uint32_t acked = 0, live = 0;
+    for (auto &t : targets) {
+      if (!t.first->failed()) {
+        ++live;
+        acked += t.first->acks() >= t.second;
+      }
+    }
+    if (acked >= std::min(need, live)) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+}
+
 struct client_context {
   int server_sockfd;
   char server_sock_addr[INET_ADDRSTRLEN];
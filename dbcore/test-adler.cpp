@@ -1,4 +1,5 @@
 #include "adler.h"
+#include "crc32c.h"
 
 #include "sm-defs.h"
 #include "sm-exceptions.h"
@@ -390,6 +391,15 @@ uint32_t __attribute__((noinline)) adler32_custom(char *data, size_t nbytes)
 #include <unistd.h>
 #include <fcntl.h>
 
+/* Print a result line: the checksum, wall time, and throughput over
+   all [ntimes] passes.
+ */
+static void report(uint32_t x, double secs, size_t ntimes, size_t len,
+                   char const *name) {
+  printf("\n%08xd %.3f %7.2f GB/s %s\n", x, secs, ntimes * len / secs / 1e9,
+         name);
+}
+
 void bakeoff(char const *msg, size_t nbytes, char *data, size_t len) {
   printf("\n\n%s (%zd bytes):\n", msg, len);
   size_t ntimes = nbytes / len;
@@ -423,29 +433,68 @@ void bakeoff(char const *msg, size_t nbytes, char *data, size_t len) {
     if (not(i % tick)) fprintf(stderr, ".");
     x = adler32_vanilla(data, len);
   }
-  printf("\n%08xd %.3f adler32_vanilla\n", x, timer.time());
+  report(x, timer.time(), ntimes, len, "adler32_vanilla");
 
   for (size_t i = 0; i < ntimes; i++) {
     if (not(i % tick)) fprintf(stderr, ".");
     x = adler32_memcpy_vanilla(dest, data, len);
   }
   ASSERT(not memcmp(dest, data, len));
-  printf("\n%08xd %.3f adler32_memcpy_vanilla\n", x, timer.time());
+  report(x, timer.time(), ntimes, len, "adler32_memcpy_vanilla");
 
 #ifdef __SSSE3__
   for (size_t i = 0; i < ntimes; i++) {
     if (not(i % tick)) fprintf(stderr, ".");
     x = adler32_sse(data, len);
   }
-  printf("\n%08xd %.3f adler32_sse\n", x, timer.time());
+  report(x, timer.time(), ntimes, len, "adler32_sse");
 
   for (size_t i = 0; i < ntimes; i++) {
     if (not(i % tick)) fprintf(stderr, ".");
     x = adler32_memcpy_sse(dest, data, len);
   }
-  printf("\n%08xd %.3f adler32_memcpy_sse\n", x, timer.time());
+  report(x, timer.time(), ntimes, len, "adler32_memcpy_sse");
   ASSERT(not memcmp(dest, data, len));
 #endif
+
+  if (adler32_avx2_available()) {
+    timer.reset();
+    for (size_t i = 0; i < ntimes; i++) {
+      if (not(i % tick)) fprintf(stderr, ".");
+      x = adler32_avx2(data, len);
+    }
+    report(x, timer.time(), ntimes, len, "adler32_avx2");
+
+    for (size_t i = 0; i < ntimes; i++) {
+      if (not(i % tick)) fprintf(stderr, ".");
+      x = adler32_memcpy_avx2(dest, data, len);
+    }
+    report(x, timer.time(), ntimes, len, "adler32_memcpy_avx2");
+    ASSERT(not memcmp(dest, data, len));
+  }
+
+  timer.reset();
+  for (size_t i = 0; i < ntimes; i++) {
+    if (not(i % tick)) fprintf(stderr, ".");
+    x = crc32c_vanilla(data, len);
+  }
+  report(x, timer.time(), ntimes, len, "crc32c_vanilla");
+
+  if (crc32c_hw_available()) {
+    timer.reset();
+    for (size_t i = 0; i < ntimes; i++) {
+      if (not(i % tick)) fprintf(stderr, ".");
+      x = crc32c_sse42(data, len);
+    }
+    report(x, timer.time(), ntimes, len, "crc32c_sse42");
+
+    for (size_t i = 0; i < ntimes; i++) {
+      if (not(i % tick)) fprintf(stderr, ".");
+      x = crc32c_memcpy_sse42(dest, data, len);
+    }
+    report(x, timer.time(), ntimes, len, "crc32c_memcpy_sse42");
+    ASSERT(not memcmp(dest, data, len));
+  }
   free(dest_buf);
 }
 
@@ -495,4 +544,19 @@ int main(int argc, char const *argv[]) {
     uint32_t lr = adler32(data + lsz, rsz, left);
     printf("%08xd cont[%zd/%zd]\n", lr, lsz, rsz);
   }
+
+  // CRC32C must agree with the standard check value, across kernels,
+  // and when built up piecewise (the log merges body and payload sums)
+  ASSERT(crc32c_vanilla("123456789", 9) == 0xe3069283);
+  csum = crc32c_vanilla(data, len);
+  printf("\n%08xd crc32c bulk[%zd]\n", csum, len);
+  ASSERT(crc32c(data, len) == csum);
+  for (int i = 2; i < 10; i++) {
+    size_t lsz = len / i, rsz = len - lsz;
+    uint32_t left = crc32c(data, lsz);
+    uint32_t lr = crc32c_merge(left, crc32c(data + lsz, rsz), rsz);
+    printf("%08xd crc32c incr[%zd/%zd]\n", lr, lsz, rsz);
+    ASSERT(lr == csum);
+    ASSERT(crc32c(data + lsz, rsz, left) == csum);
+  }
 }
@@ -0,0 +1,95 @@
+#include "dynarray.h"
+
+#include "sm-common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace ermia;
+
+/* dTLB load misses of random 8-byte reads from a dynarray, with each
+   backing page type, i.e. what OID array lookups see.
+
+   Usage: test-dynarray-tlb [array MB (default 4096)] [million reads
+   (default 50)]. The 2mb/1gb rows need hugetlb pages reserved
+   (vm.nr_hugepages, hugepagesz=1G at boot); without them the array
+   falls back to transparent huge pages and says so.
+ */
+
+static int open_dtlb_miss_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char **argv) {
+  size_t bytes = (argc > 1 ? atol(argv[1]) : 4096) << 20;
+  size_t reads = (argc > 2 ? atol(argv[2]) : 50) * 1000 * 1000;
+  size_t n = bytes / sizeof(uint64_t);
+
+  int fd = open_dtlb_miss_counter();
+  if (fd < 0) {
+    fprintf(stderr, "perf_event_open failed (%s), only timing reads\n",
+            strerror(errno));
+  }
+
+  static const struct {
+    int type;
+    const char *name;
+  } kTypes[] = {{dynarray::kHugePageNone, "none"},
+                {dynarray::kHugePageTransparent, "thp"},
+                {dynarray::kHugePage2MB, "2mb"},
+                {dynarray::kHugePage1GB, "1gb"}};
+  printf("%-5s %12s %14s %10s\n", "pages", "ns/read", "dTLB-miss/read",
+         "sum");
+  for (auto &t : kTypes) {
+    dynarray d(size_t(64) << 30, 0, t.type);
+    d.ensure_size(bytes, 0);
+    uint64_t *a = (uint64_t *)d.data();
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = i;
+    }
+
+    std::mt19937_64 rng(42);
+    uint64_t sum = 0;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < reads; ++i) {
+      sum += a[rng() % n];
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    uint64_t misses = 0;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        misses = 0;
+      }
+    }
+    printf("%-5s %12.2f %14.4f %10lx\n", t.name, (double)ns / reads,
+           (double)misses / reads, sum & 0xffff);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
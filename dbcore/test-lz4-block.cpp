@@ -0,0 +1,118 @@
+#include "lz4-block.h"
+
+#include "../macros.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+/* Round trips through the LZ4 block codec at the edges log shipping
+   can hit: inputs too short to hold a match, incompressible and
+   all-zero batches, and the largest batch the primary ships (the
+   whole log buffer; pass its size in MB to override the 512MB
+   default).
+ */
+
+static std::mt19937_64 rng(42);
+
+// Compress and decompress [in], check we get it back, and that the
+// decompressor rejects the wrong size and truncated input
+static size_t round_trip(std::vector<char> const &in) {
+  std::vector<char> c(lz4_compress_bound(in.size()));
+  size_t csize = lz4_compress(in.data(), in.size(), c.data(), c.size());
+  ALWAYS_ASSERT(csize and csize <= c.size());
+
+  std::vector<char> out(in.size() + 1, 'x');
+  ALWAYS_ASSERT(lz4_decompress(c.data(), csize, out.data(), in.size()));
+  ALWAYS_ASSERT(memcmp(out.data(), in.data(), in.size()) == 0);
+  ALWAYS_ASSERT(out[in.size()] == 'x');
+
+  ALWAYS_ASSERT(not lz4_decompress(c.data(), csize, out.data(), in.size() + 1));
+  if (in.size()) {
+    ALWAYS_ASSERT(
+        not lz4_decompress(c.data(), csize, out.data(), in.size() - 1));
+    ALWAYS_ASSERT(not lz4_decompress(c.data(), csize - 1, out.data(),
+                                     in.size()));
+  }
+
+  // Too little room has to fail rather than overrun
+  if (csize > 1) {
+    ALWAYS_ASSERT(lz4_compress(in.data(), in.size(), c.data(), csize - 1) == 0);
+  }
+  return csize;
+}
+
+static std::vector<char> random_bytes(size_t n) {
+  std::vector<char> v(n);
+  for (auto &b : v) {
+    b = (char)rng();
+  }
+  return v;
+}
+
+// Log-like data: runs of repeated headers and keys with random values
+static std::vector<char> log_like(size_t n) {
+  static char const header[] = "\x01\x00\x00\x00record-header-key-000";
+  std::vector<char> v(n);
+  for (size_t i = 0; i < n;) {
+    size_t m = std::min(n - i, sizeof(header) - 1);
+    memcpy(&v[i], header, m);
+    i += m;
+    for (size_t j = 0; j < 8 and i < n; ++j) {
+      v[i++] = (char)rng();
+    }
+  }
+  return v;
+}
+
+int main(int argc, char **argv) {
+  size_t max_mb = argc > 1 ? atol(argv[1]) : 512;
+
+  printf("Inputs shorter than a match or the end-of-block literals...\n");
+  for (size_t n = 0; n <= 32; ++n) {
+    round_trip(random_bytes(n));
+    round_trip(std::vector<char>(n, 0));
+  }
+
+  printf("Incompressible input stays within the bound...\n");
+  for (size_t n : {100, 4096, 65536, 65537, 1 << 20}) {
+    auto in = random_bytes(n);
+    size_t csize = round_trip(in);
+    ALWAYS_ASSERT(csize <= lz4_compress_bound(n));
+    printf("\t%8zd -> %8zd\n", n, csize);
+  }
+
+  printf("All-zero and log-like input compresses...\n");
+  for (size_t n : {13, 255, 270, 4096, 65536, 65537, 1 << 20}) {
+    size_t zsize = round_trip(std::vector<char>(n, 0));
+    size_t lsize = round_trip(log_like(n));
+    ALWAYS_ASSERT(zsize <= n / 200 + 16);
+    ALWAYS_ASSERT(n < 4096 or lsize < n);
+    printf("\t%8zd -> %8zd (zeros) %8zd (log-like)\n", n, zsize, lsize);
+  }
+
+  printf("Largest batch (%zd MB)...\n", max_mb);
+  size_t n = max_mb << 20;
+  ALWAYS_ASSERT(n < (size_t{1} << 30));  // batch headers carry 30 bits
+  std::vector<char> in = log_like(n);
+  // An incompressible stretch longer than a match offset can reach
+  for (size_t i = n / 2; i < n / 2 + (1 << 17); ++i) {
+    in[i] = (char)rng();
+  }
+  printf("\t%8zd -> %8zd\n", n, round_trip(in));
+
+  printf("Malformed input is rejected...\n");
+  char out[64];
+  char const zero_offset[] = {(char)0x10, 'a', 0, 0};
+  ALWAYS_ASSERT(not lz4_decompress(zero_offset, sizeof(zero_offset), out, 8));
+  char const far_offset[] = {(char)0x10, 'a', 2, 0};
+  ALWAYS_ASSERT(not lz4_decompress(far_offset, sizeof(far_offset), out, 8));
+  char const long_literals[] = {(char)0xf0, (char)255};
+  ALWAYS_ASSERT(
+      not lz4_decompress(long_literals, sizeof(long_literals), out, 64));
+
+  printf("All good\n");
+  return 0;
+}
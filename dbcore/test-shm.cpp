@@ -0,0 +1,156 @@
+#include "shm.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+/* A writer and a reader thread going through a shm::ring: messages
+   bigger than the ring and odd sizes that wrap around at every
+   offset, ACKs, and either side giving up on the other (abandon(),
+   or the reader's process exiting) without leaving the other one
+   waiting.
+ */
+
+static const uint64_t kRingSize = 4096 + 7;
+
+static std::string ring_name(const char *what) {
+  return "/ermia-test-shm-" + std::to_string(getpid()) + "-" + what;
+}
+
+static std::vector<char> message(uint32_t i, size_t size) {
+  std::vector<char> m(size);
+  std::mt19937 rng(i);
+  for (auto &b : m) {
+    b = (char)rng();
+  }
+  return m;
+}
+
+static void test_round_trip() {
+  shm::ring *w = shm::ring::create(ring_name("rt"), kRingSize);
+  shm::ring *r = shm::ring::attach(ring_name("rt"));
+  ALWAYS_ASSERT(r);
+
+  const uint32_t kMessages = 2000;
+  auto size_of = [](uint32_t i) { return (i * 131) % (3 * kRingSize) + 1; };
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < kMessages; ++i) {
+    total += size_of(i);
+  }
+
+  std::thread reader([&] {
+    for (uint32_t i = 0; i < kMessages; ++i) {
+      std::vector<char> buf(size_of(i));
+      ALWAYS_ASSERT(r->read(buf.data(), buf.size()));
+      ALWAYS_ASSERT(buf == message(i, buf.size()));
+      r->ack();
+    }
+  });
+  for (uint32_t i = 0; i < kMessages; ++i) {
+    auto m = message(i, size_of(i));
+    ALWAYS_ASSERT(w->write(m.data(), m.size()));
+  }
+  reader.join();
+  ALWAYS_ASSERT(w->acks() == kMessages);
+  printf("\t%u messages, %lu bytes, %.1f times around\n", kMessages, total,
+         (double)total / kRingSize);
+  delete r;
+  delete w;
+}
+
+static void test_file_pieces() {
+  FILE *f = tmpfile();
+  ALWAYS_ASSERT(f);
+  auto data = message(0, 3 * kRingSize);
+  ALWAYS_ASSERT(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fflush(f);
+
+  shm::ring *w = shm::ring::create(ring_name("file"), kRingSize);
+  shm::ring *r = shm::ring::attach(ring_name("file"));
+  std::thread reader([&] {
+    std::vector<char> buf(data.size() - 5);
+    ALWAYS_ASSERT(r->read(buf.data(), buf.size()));
+    ALWAYS_ASSERT(memcmp(buf.data(), data.data() + 5, buf.size()) == 0);
+  });
+  ALWAYS_ASSERT(w->write_file(fileno(f), 5, data.size() - 5));
+  reader.join();
+  delete r;
+  delete w;
+  fclose(f);
+}
+
+static void test_abandon() {
+  // A reader waiting for data
+  shm::ring *w = shm::ring::create(ring_name("ab1"), kRingSize);
+  shm::ring *r = shm::ring::attach(ring_name("ab1"));
+  std::thread reader([&] {
+    char c;
+    ALWAYS_ASSERT(r->read(&c, 1));
+    ALWAYS_ASSERT(not r->read(&c, 1));
+  });
+  ALWAYS_ASSERT(w->write("x", 1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  r->abandon();
+  reader.join();
+  // ...and the writer no longer waits for room
+  std::vector<char> big(2 * kRingSize);
+  ALWAYS_ASSERT(not w->write(big.data(), big.size()));
+  delete r;
+  delete w;
+
+  // A writer waiting for room
+  w = shm::ring::create(ring_name("ab2"), kRingSize);
+  r = shm::ring::attach(ring_name("ab2"));
+  std::thread writer(
+      [&] { ALWAYS_ASSERT(not w->write(big.data(), big.size())); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  r->abandon();
+  writer.join();
+  delete r;
+  delete w;
+}
+
+static void test_reader_exits() {
+  // Have children reaped right away, a zombie would still look alive
+  signal(SIGCHLD, SIG_IGN);
+  std::string name = ring_name("exit");
+  shm::ring *w = shm::ring::create(name, kRingSize);
+  pid_t child = fork();
+  ALWAYS_ASSERT(child >= 0);
+  if (child == 0) {
+    shm::ring *r = shm::ring::attach(name);
+    char c;
+    if (r and r->read(&c, 1)) {
+      r->ack();
+    }
+    _exit(0);
+  }
+  std::vector<char> big(2 * kRingSize);
+  auto start = std::chrono::steady_clock::now();
+  ALWAYS_ASSERT(not w->write(big.data(), big.size()));
+  ALWAYS_ASSERT(w->acks() == 1);
+  printf("\twriter gave up after %ld ms\n",
+         (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count());
+  delete w;
+}
+
+int main() {
+  printf("Messages wrapping around the ring...\n");
+  test_round_trip();
+  printf("File pieces...\n");
+  test_file_pieces();
+  printf("Abandoning the ring...\n");
+  test_abandon();
+  printf("Reader process exits...\n");
+  test_reader_exits();
+  printf("All good\n");
+  return 0;
+}
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <thread>
+
 #include "dbcore/rcu.h"
 #include "dbcore/sm-chkpt.h"
 #include "dbcore/sm-cmd-log.h"
@@ -91,6 +94,140 @@ void Engine::CreateIndex(const char *table_name, const std::string &index_name,
   LogIndexCreation(is_primary, td->GetTupleFid(), index_fid, index_name);
 }
 
+// Accumulate the footprint of OIDs [begin, end) of the given table. No CC:
+// we only read OID entries and version headers, which are never unmapped, and
+// stop following a chain once we hit a version that has been recycled.
+static void WalkTableOIDs(TableDescriptor *td, OID begin, OID end,
+                          TableFootprint &fp) {
+  // Guard against following a chain that got recycled into another chain
+  static const uint32_t kMaxChainLength = 1 << 16;
+
+  oid_array *ta = td->GetTupleArray();
+  for (OID oid = begin; oid < std::min<size_t>(end, ta->nentries()); ++oid) {
+    fat_ptr ptr = volatile_read(*ta->get(oid));
+    if (!ptr.offset() || ptr.asi_type()) {
+      continue;
+    }
+    ++fp.nrecords;
+    uint32_t nversions = 0;
+    while (ptr.offset() && !ptr.asi_type() && nversions < kMaxChainLength) {
+      Object *obj = (Object *)ptr.offset();
+      uint64_t bytes = ptr.size_code() == INVALID_SIZE_CODE
+                           ? sizeof(Object)
+                           : decode_size_aligned(ptr.size_code());
+      if (nversions++ == 0) {
+        ++fp.live_versions;
+        fp.live_bytes += bytes;
+      } else {
+        if (obj->GetClsn() == NULL_PTR) {
+          // Recycled under our feet
+          break;
+        }
+        ++fp.dead_versions;
+        fp.dead_bytes += bytes;
+      }
+      ptr = obj->GetNextVolatile();
+    }
+  }
+
+  if (!config::is_backup_srv()) {
+    oid_array *ka = td->GetKeyArray();
+    for (OID oid = begin; oid < std::min<size_t>(end, ka->nentries()); ++oid) {
+      fat_ptr ptr = volatile_read(*ka->get(oid));
+      if (ptr.offset()) {
+        fp.key_bytes += sizeof(varstr) + ((varstr *)ptr.offset())->size();
+      }
+    }
+  }
+}
+
+std::vector<TableFootprint> Engine::GetFootprint(uint32_t nthreads) {
+  static const OID kOIDsPerTask = 1 << 18;
+
+  std::vector<TableDescriptor *> tables;
+  std::vector<TableFootprint> result;
+  for (auto &t : TableDescriptor::name_map) {
+    tables.push_back(t.second);
+    result.emplace_back(t.first);
+    auto &fp = result.back();
+    fp.tuple_array_bytes = t.second->GetTupleArray()->nentries() * sizeof(fat_ptr);
+    oid_array *aux = config::is_backup_srv()
+                         ? t.second->GetPersistentAddressArray()
+                         : t.second->GetKeyArray();
+    fp.aux_array_bytes = aux ? aux->nentries() * sizeof(fat_ptr) : 0;
+  }
+
+  // Indexes are attributed to the table they belong to
+  std::vector<std::pair<OrderedIndex *, IndexFootprint *>> indexes;
+  for (auto &i : TableDescriptor::index_map) {
+    for (uint32_t t = 0; t < tables.size(); ++t) {
+      if (tables[t] == i.second->GetTableDescriptor()) {
+        result[t].indexes.emplace_back(i.first, i.second->IsPrimary());
+      }
+    }
+  }
+  for (auto &fp : result) {
+    for (auto &ifp : fp.indexes) {
+      indexes.emplace_back(TableDescriptor::GetIndex(ifp.name), &ifp);
+    }
+  }
+
+  // Chop the OID arrays into tasks, then let the threads pull tasks; each
+  // index is one task.
+  struct Task {
+    uint32_t table;
+    OID begin;
+    OID end;
+  };
+  std::vector<Task> tasks;
+  for (uint32_t t = 0; t < tables.size(); ++t) {
+    size_t n = tables[t]->GetTupleArray()->nentries();
+    for (size_t begin = 0; begin < n; begin += kOIDsPerTask) {
+      tasks.push_back(Task{t, (OID)begin, (OID)std::min(n, begin + kOIDsPerTask)});
+    }
+  }
+
+  std::atomic<uint32_t> next_task(0);
+  std::atomic<uint32_t> next_index(0);
+  std::vector<std::vector<TableFootprint>> partials(
+      std::max(nthreads, 1U),
+      std::vector<TableFootprint>(result.size(), TableFootprint("")));
+  auto walk = [&](uint32_t me) {
+    auto &mine = partials[me];
+    uint32_t i = 0;
+    while ((i = next_index.fetch_add(1)) < indexes.size()) {
+      auto *ifp = indexes[i].second;
+      ifp->nkeys = indexes[i].first->Size();
+      indexes[i].first->GetNodeStats(ifp->nnodes, ifp->node_bytes);
+    }
+    while ((i = next_task.fetch_add(1)) < tasks.size()) {
+      auto &task = tasks[i];
+      WalkTableOIDs(tables[task.table], task.begin, task.end, mine[task.table]);
+    }
+  };
+
+  std::vector<std::thread> walkers;
+  for (uint32_t i = 1; i < partials.size(); ++i) {
+    walkers.emplace_back(walk, i);
+  }
+  walk(0);
+  for (auto &w : walkers) {
+    w.join();
+  }
+
+  for (uint32_t t = 0; t < result.size(); ++t) {
+    for (auto &p : partials) {
+      result[t].key_bytes += p[t].key_bytes;
+      result[t].nrecords += p[t].nrecords;
+      result[t].live_versions += p[t].live_versions;
+      result[t].live_bytes += p[t].live_bytes;
+      result[t].dead_versions += p[t].dead_versions;
+      result[t].dead_bytes += p[t].dead_bytes;
+    }
+  }
+  return result;
+}
+
 PROMISE(rc_t) ConcurrentMasstreeIndex::Scan(transaction *t, const varstr &start_key,
                                    const varstr *end_key, ScanCallback &callback) {
   SearchRangeCallback c(callback);
@@ -215,15 +352,15 @@ PROMISE(bool) ConcurrentMasstreeIndex::InsertIfAbsent(transaction *t, const vars
   if (config::phantom_prot && !t->masstree_absent_set.empty()) {
     // Update node version number
     ASSERT(ins_info.node);
-    auto it = t->masstree_absent_set.find(ins_info.node);
-    if (it != t->masstree_absent_set.end()) {
-      if (unlikely(it->second != ins_info.old_version)) {
+    auto *it = t->masstree_absent_set.find(ins_info.node);
+    if (it) {
+      if (unlikely(it->version != ins_info.old_version)) {
         // Important: caller should unlink the version, otherwise we risk
         // leaving a dead version at chain head -> infinite loop or segfault...
         RETURN false;
       }
       // otherwise, bump the version
-      it->second = ins_info.new_version;
+      it->version = ins_info.new_version;
     }
   }
   RETURN true;
@@ -235,7 +372,8 @@ PROMISE(bool) ConcurrentMasstreeIndex::InsertOID(transaction *t, const varstr &k
   bool inserted = AWAIT InsertIfAbsent(t, key, oid);
   if (inserted) {
     t->LogIndexInsert(this, oid, &key);
-    if (config::enable_chkpt) {
+    // Secondary indexes share the OID, but the key array holds primary keys
+    if (config::enable_chkpt and IsPrimary()) {
       auto *key_array = GetTableDescriptor()->GetKeyArray();
       volatile_write(key_array->get(oid)->_ptr, 0);
     }
@@ -323,10 +461,10 @@ rc_t ConcurrentMasstreeIndex::DoNodeRead(
     uint64_t version) {
   ALWAYS_ASSERT(config::phantom_prot);
   ASSERT(node);
-  auto it = t->masstree_absent_set.find(node);
-  if (it == t->masstree_absent_set.end()) {
-    t->masstree_absent_set[node] = version;
-  } else if (it->second != version) {
+  auto *it = t->masstree_absent_set.find(node);
+  if (!it) {
+    t->masstree_absent_set.insert(node, version);
+  } else if (it->version != version) {
     return rc_t{RC_ABORT_PHANTOM};
   }
   return rc_t{RC_TRUE};
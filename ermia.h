@@ -11,6 +11,51 @@ namespace ermia {
 
 class Table;
 
+// Memory footprint of an index, see Engine::GetFootprint()
+struct IndexFootprint {
+  std::string name;
+  bool is_primary;
+  uint64_t nkeys;
+  uint64_t nnodes;
+  uint64_t node_bytes;
+
+  IndexFootprint(const std::string &name, bool is_primary)
+    : name(name), is_primary(is_primary), nkeys(0), nnodes(0), node_bytes(0) {}
+};
+
+// Memory footprint of a table, see Engine::GetFootprint(). Live versions are
+// the chain heads; dead versions are the older ones kept in the chains for
+// snapshots (or waiting for GC).
+struct TableFootprint {
+  std::string name;
+  uint64_t tuple_array_bytes;  // OID array (oid_array::nentries) for tuples
+  uint64_t aux_array_bytes;    // Key array on primary, pdest array on backups
+  uint64_t key_bytes;          // Keys hanging off the key array (primary only)
+  uint64_t nrecords;           // Number of non-empty OID entries
+  uint64_t live_versions;
+  uint64_t live_bytes;
+  uint64_t dead_versions;
+  uint64_t dead_bytes;
+  std::vector<IndexFootprint> indexes;
+
+  TableFootprint(const std::string &name)
+    : name(name), tuple_array_bytes(0), aux_array_bytes(0), key_bytes(0),
+      nrecords(0), live_versions(0), live_bytes(0), dead_versions(0),
+      dead_bytes(0) {}
+
+  inline uint64_t TotalBytes() const {
+    uint64_t total = tuple_array_bytes + aux_array_bytes + key_bytes +
+                     live_bytes + dead_bytes;
+    for (auto &i : indexes) {
+      total += i.node_bytes;
+    }
+    return total;
+  }
+  inline double AvgChainLength() const {
+    return nrecords ? (live_versions + dead_versions) / (double)nrecords : 0;
+  }
+};
+
 class Engine {
 private:
   void LogIndexCreation(bool primary, FID table_fid, FID index_fid, const std::string &index_name);
@@ -55,6 +100,12 @@ public:
     t->Abort();
     t->~transaction();
   }
+
+  // Report per-table and per-index memory usage by walking the OID arrays,
+  // version chains and indexes with [nthreads] threads. The walk is latch-free
+  // and does not block transactions, so the numbers are approximate if the
+  // database is being updated meanwhile.
+  std::vector<TableFootprint> GetFootprint(uint32_t nthreads);
 };
 
 // User-facing table abstraction, operates on OIDs only
@@ -175,6 +226,13 @@ public:
   inline size_t Size() override { return masstree_.size(); }
   std::map<std::string, uint64_t> Clear() override;
   inline void SetArrays(bool primary) override { masstree_.set_arrays(table_descriptor, primary); }
+  inline void GetNodeStats(uint64_t &nnodes, uint64_t &nbytes) override {
+    size_t nleaves = 0, ninternodes = 0;
+    masstree_.node_count(nleaves, ninternodes);
+    nnodes = nleaves + ninternodes;
+    nbytes = nleaves * ConcurrentMasstree::LeafNodeSize() +
+             ninternodes * ConcurrentMasstree::InternalNodeSize();
+  }
 
   inline PROMISE(void)
   GetOID(const varstr &key, rc_t &rc, TXN::xid_context *xc, OID &out_oid,
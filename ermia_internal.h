@@ -68,6 +68,10 @@ public:
   virtual std::map<std::string, uint64_t> Clear() = 0;
   virtual void SetArrays(bool) = 0;
 
+  // Number of index nodes and the bytes they occupy. Does not block
+  // concurrent readers/writers; the result is approximate under updates.
+  virtual void GetNodeStats(uint64_t &nnodes, uint64_t &nbytes) = 0;
+
   /**
    * Insert key-oid pair to the underlying actual index structure.
    *
@@ -409,6 +409,13 @@ public:
    */
   inline size_t size() const;
 
+  /**
+   * Count the leaf and internal nodes across all layers. Same caveats as
+   * size(): readers and writers are not blocked, so the counts are not
+   * consistent given concurrent modifications.
+   */
+  void node_count(size_t &nleaves, size_t &ninternodes) const;
+
   static inline uint64_t ExtractVersionNumber(const node_opaque_t *n) {
     // XXX(stephentu): I think we must use stable_version() for
     // correctness, but I am not 100% sure. It's definitely correct to use it,
@@ -783,6 +790,43 @@ template <typename P> inline size_t mbtree<P>::size() const {
   return c.size_;
 }
 
+template <typename P>
+void mbtree<P>::node_count(size_t &nleaves, size_t &ninternodes) const {
+  nleaves = ninternodes = 0;
+  std::vector<node_base_type *> q;
+  node_base_type *children[internode_type::width + 1];
+  q.push_back(table_.root()->unsplit_ancestor());
+  while (!q.empty()) {
+    node_base_type *cur = q.back();
+    q.pop_back();
+    prefetch(cur);
+  retry:
+    auto version = cur->stable();
+    if (cur->isleaf()) {
+      leaf_type *leaf = static_cast<leaf_type *>(cur);
+      auto perm = leaf->permutation();
+      int nlayers = 0;
+      for (int i = 0; i != perm.size(); ++i)
+        if (leaf->is_layer(perm[i]))
+          children[nlayers++] = leaf->lv_[perm[i]].layer();
+      if (unlikely(leaf->has_changed(version)))
+        goto retry;
+      ++nleaves;
+      for (int i = 0; i < nlayers; ++i)
+        q.push_back(children[i]->unsplit_ancestor());
+    } else {
+      internode_type *in = static_cast<internode_type *>(cur);
+      int n = in->size() + 1;
+      for (int i = 0; i < n; ++i)
+        children[i] = in->child_[i];
+      if (unlikely(in->has_changed(version)))
+        goto retry;
+      ++ninternodes;
+      q.insert(q.end(), children, children + n);
+    }
+  }
+}
+
 template <typename P>
 inline PROMISE(bool) mbtree<P>::search(const key_type &k, OID &o, epoch_num e,
                               versioned_node_t *search_info) const {
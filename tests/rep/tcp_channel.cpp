@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dbcore/tcp.h>
+
+// A channel on one end of a socketpair, and a peer on the other end
+// that reads messages and answers them with ACKs when told to
+struct ChannelPair {
+    int fds[2];
+    tcp::channel *channel;
+
+    ChannelPair() {
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        channel = new tcp::channel(fds[0]);
+    }
+
+    ~ChannelPair() {
+        delete channel;
+        close(fds[0]);
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+    }
+
+    std::string receive(size_t size) {
+        std::string s(size, 0);
+        EXPECT_TRUE(tcp::try_receive(fds[1], &s[0], size));
+        return s;
+    }
+
+    void ack() { tcp::send_ack(fds[1]); }
+};
+
+static void waitForAcks(tcp::channel *c, uint64_t n) {
+    while (c->acks() < n) {
+        std::this_thread::yield();
+    }
+}
+
+class TcpChannel : public ::testing::Test {
+   protected:
+    // Post a header, an inline piece and a large piece
+    uint64_t postMessage(tcp::channel *c, uint32_t i, bool expect_ack) {
+        header_ = i;
+        tcp::channel::piece pieces[] = {
+            {&header_, sizeof(header_)},
+            {"inline", 6},
+            {payload_.data(), payload_.size()},
+        };
+        return c->post(pieces, 3, expect_ack);
+    }
+
+    void receiveMessage(ChannelPair &p, uint32_t i) {
+        std::string header = p.receive(sizeof(uint32_t));
+        EXPECT_EQ(i, *(uint32_t *)header.data());
+        EXPECT_EQ("inline", p.receive(6));
+        EXPECT_EQ(payload_, p.receive(payload_.size()));
+    }
+
+    uint32_t header_ = 0;
+    std::string payload_ = std::string(1 << 20, 'x');
+};
+
+TEST_F(TcpChannel, PostInOrderAndCountAcks) {
+    ChannelPair p;
+    const uint32_t kMessages = 16;
+    for (uint32_t i = 0; i < kMessages; ++i) {
+        uint64_t seq = postMessage(p.channel, i, true);
+        EXPECT_EQ(i + 1, seq);
+        // The large piece is sent in place, so it has to go out before
+        // the next message may reuse it
+        std::thread peer([&] { receiveMessage(p, i); });
+        p.channel->wait_sent(seq);
+        peer.join();
+    }
+    EXPECT_EQ(kMessages, p.channel->expected_acks());
+    EXPECT_EQ(0u, p.channel->acks());
+
+    for (uint32_t i = 0; i < kMessages; ++i) {
+        p.ack();
+    }
+    waitForAcks(p.channel, kMessages);
+    EXPECT_EQ(kMessages, p.channel->acks());
+    EXPECT_EQ(kMessages, p.channel->ack_latency().total());
+}
+
+TEST_F(TcpChannel, InlinePiecesAreCopied) {
+    ChannelPair p;
+    char small[tcp::channel::kInlineSize];
+    memset(small, 'a', sizeof(small));
+    tcp::channel::piece piece(small, sizeof(small));
+    uint64_t seq = p.channel->post(&piece, 1, false);
+    // Overwritten before it may have gone out
+    memset(small, 'b', sizeof(small));
+    EXPECT_EQ(std::string(sizeof(small), 'a'), p.receive(sizeof(small)));
+    p.channel->wait_sent(seq);
+    EXPECT_EQ(0u, p.channel->expected_acks());
+}
+
+TEST_F(TcpChannel, FilePieces) {
+    FILE *f = tmpfile();
+    ASSERT_NE(nullptr, f);
+    std::string data = "0123456789abcdef";
+    ASSERT_EQ(data.size(), fwrite(data.data(), 1, data.size(), f));
+    fflush(f);
+
+    ChannelPair p;
+    tcp::channel::piece pieces[] = {
+        {"head", 4},
+        {fileno(f), 10, 6},
+        {"tail", 4},
+    };
+    p.channel->wait_sent(p.channel->post(pieces, 3, false));
+    EXPECT_EQ("headabcdeftail", p.receive(14));
+    fclose(f);
+}
+
+TEST_F(TcpChannel, QuorumOfAcks) {
+    const uint32_t kPeers = 3;
+    std::vector<ChannelPair *> pairs;
+    std::vector<tcp::channel *> channels;
+    for (uint32_t i = 0; i < kPeers; ++i) {
+        pairs.push_back(new ChannelPair());
+        channels.push_back(pairs.back()->channel);
+    }
+    // Backups that are not up are skipped
+    channels.push_back(nullptr);
+
+    tcp::channel::piece piece(&header_, sizeof(header_));
+    for (uint32_t m = 0; m < 2; ++m) {
+        tcp::post_all(channels, &piece, 1, true, true);
+    }
+    for (auto *p : pairs) {
+        p->receive(2 * sizeof(header_));
+    }
+
+    // Only the first two answer
+    for (uint32_t i = 0; i < 2; ++i) {
+        pairs[i]->ack();
+        pairs[i]->ack();
+    }
+    tcp::wait_acks(channels, 2);
+    EXPECT_EQ(0u, pairs[2]->channel->acks());
+
+    // Everyone is needed without a quorum, or if there are fewer
+    std::atomic<bool> done(false);
+    std::thread all([&] {
+        tcp::wait_acks(channels, 0);
+        done = true;
+    });
+    std::thread too_many([&] { tcp::wait_acks(channels, kPeers + 1); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(done);
+
+    // Allowing a lag of one message, one ACK from the last is enough
+    pairs[2]->ack();
+    tcp::wait_acks(channels, 0, 1);
+    EXPECT_FALSE(done);
+
+    pairs[2]->ack();
+    all.join();
+    too_many.join();
+    EXPECT_TRUE(done);
+
+    for (auto *p : pairs) {
+        delete p;
+    }
+}
+
+TEST_F(TcpChannel, TeardownWithPeerGone) {
+    ChannelPair p;
+    close(p.fds[1]);
+    p.fds[1] = -1;
+    // The receiver sees the peer go away; tearing the channel down must
+    // not wait for it
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(0u, p.channel->acks());
+}
@@ -30,7 +30,8 @@ struct dbtuple {
   uint64_t preader;  // did I have some reader thinking I'm old?
 #endif
 
-#ifdef MVOCC
+#if defined(MVOCC) || defined(OCC)
+  // Overwriter's XID while it's in flight, its cstamp once committed
   fat_ptr sstamp;
 #endif
 
@@ -61,6 +62,9 @@ struct dbtuple {
 #endif
 #ifdef SSI
         s2(0),
+#endif
+#if defined(MVOCC) || defined(OCC)
+        sstamp(NULL_PTR),
 #endif
         size(CheckBounds(size)),
         pvalue(NULL) {
@@ -9,9 +9,39 @@ extern thread_local ermia::epoch_num coroutine_batch_end_epoch;
 
 namespace ermia {
 
+// Spilled write-set chunks are recycled per thread; transactions (including
+// coroutine ones) never migrate threads between begin and commit/abort.
+static thread_local std::vector<write_record_t *> write_set_chunk_pool;
+
+write_record_t *write_set_t::AllocateChunk() {
+  if (write_set_chunk_pool.empty()) {
+    return new write_record_t[kChunkEntries];
+  }
+  write_record_t *chunk = write_set_chunk_pool.back();
+  write_set_chunk_pool.pop_back();
+  return chunk;
+}
+
+void write_set_t::FreeChunk(write_record_t *chunk) {
+  if (write_set_chunk_pool.size() < kMaxChunks) {
+    write_set_chunk_pool.push_back(chunk);
+  } else {
+    delete[] chunk;
+  }
+}
+
+// Read-only transactions on backups hold off promotions until they end
+static inline uint64_t backup_read_flags(uint64_t flags) {
+  if (!(flags & transaction::TXN_FLAG_CMD_REDO) && config::is_backup_srv() &&
+      rep::BackupBeginRead()) {
+    return flags | transaction::TXN_FLAG_BACKUP_READ;
+  }
+  return flags;
+}
+
 transaction::transaction(uint64_t flags, str_arena &sa, uint32_t coro_batch_idx)
-    : flags(flags), sa(&sa), coro_batch_idx(coro_batch_idx) {
-  if (!(flags & TXN_FLAG_CMD_REDO) && config::is_backup_srv()) {
+    : flags(backup_read_flags(flags)), sa(&sa), coro_batch_idx(coro_batch_idx) {
+  if (this->flags & TXN_FLAG_BACKUP_READ) {
     // Read-only transaction on backup - grab a begin timestamp and go.
     // A read-only 'transaction' on a backup basically is reading a
     // consistent snapshot back in time. No CC involved.
@@ -28,13 +58,21 @@ transaction::transaction(uint64_t flags, str_arena &sa, uint32_t coro_batch_idx)
   }
 }
 
+void transaction::SetReadView(TableDescriptor *const *tables,
+                              uint32_t ntables) {
+  if (!(flags & TXN_FLAG_BACKUP_READ)) {
+    return;
+  }
+  xc->begin = rep::GetReadView(tables, ntables);
+  ASSERT(xc->begin);
+}
+
 void transaction::initialize_read_write() {
   if (config::phantom_prot) {
-    masstree_absent_set.set_empty_key(NULL);  // google dense map
     masstree_absent_set.clear();
   }
   write_set.clear();
-#if defined(SSN) || defined(SSI) || defined(MVOCC)
+#if defined(SSN) || defined(SSI) || defined(MVOCC) || defined(OCC)
  read_set.clear();
 #endif
   xid = TXN::xid_alloc();
@@ -79,6 +117,15 @@ void transaction::initialize_read_write() {
 #elif defined(MVOCC)
   log = logmgr->new_tx_log((char*)string_allocator().next(sizeof(sm_tx_log_impl))->data());
   xc->begin = logmgr->cur_lsn().offset() + 1;
+#elif defined(OCC)
+  // OCC always reads the latest committed version, begin is only kept for
+  // bookkeeping (e.g., read views).
+  if (flags & TXN_FLAG_READ_ONLY) {
+    log = nullptr;
+  } else {
+    log = logmgr->new_tx_log((char*)string_allocator().next(sizeof(sm_tx_log_impl))->data());
+  }
+  xc->begin = logmgr->cur_lsn().offset() + 1;
 #else
   // SI - see if it's read only. If so, skip logging etc.
   if (flags & TXN_FLAG_READ_ONLY) {
@@ -92,7 +139,8 @@ void transaction::initialize_read_write() {
 
 transaction::~transaction() {
   // "Normal" transactions
-  if (config::is_backup_srv() && !(flags & TXN_FLAG_CMD_REDO)) {
+  if (flags & TXN_FLAG_BACKUP_READ) {
+    rep::BackupEndRead();
     return;
   }
 
@@ -139,7 +187,7 @@ void transaction::Abort() {
     auto &w = write_set[i];
     dbtuple *tuple = (dbtuple *)w.get_object()->GetPayload();
     ASSERT(tuple);
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
     ASSERT(XID::from_ptr(tuple->GetObject()->GetClsn()) == xid);
     if (tuple->NextVolatile()) {
       volatile_write(tuple->NextVolatile()->sstamp, NULL_PTR);
@@ -190,6 +238,8 @@ rc_t transaction::commit() {
   }
 #elif defined(MVOCC)
   return mvocc_commit();
+#elif defined(OCC)
+  return occ_commit();
 #else
   return si_commit();
 #endif
@@ -986,7 +1036,7 @@ rc_t transaction::parallel_ssi_commit() {
 }
 #elif defined(MVOCC)
 rc_t transaction::mvocc_commit() {
-  if (!(flags & TXN_FLAG_CMD_REDO) && config::is_backup_srv()) {
+  if (flags & TXN_FLAG_BACKUP_READ) {
     return rc_t{RC_TRUE};
   }
 
@@ -1098,9 +1148,102 @@ rc_t transaction::mvocc_commit() {
   volatile_write(xc->state, TXN::TXN_CMMTD);
   return rc_t{RC_TRUE};
 }
+#elif defined(OCC)
+// Silo-style validation: the read set is valid if every version read is
+// still there and hasn't been overwritten by anyone else - committed or not
+// (an in-flight overwrite is the equivalent of a locked record in Silo).
+// A version read while its creator was still in post-commit carries an XID
+// clsn that has become an LSN by now; that's a (rare) spurious abort.
+bool transaction::OCCCheckReadSet() {
+  for (uint32_t i = 0; i < read_set.size(); ++i) {
+    auto &r = read_set[i];
+    if (r.tuple->GetObject()->GetClsn() != r.clsn) {
+      return false;
+    }
+    fat_ptr sstamp = volatile_read(r.tuple->sstamp);
+    if (sstamp != NULL_PTR &&
+        (sstamp.asi_type() != fat_ptr::ASI_XID || XID::from_ptr(sstamp) != xc->owner)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+rc_t transaction::occ_commit() {
+  if (flags & TXN_FLAG_BACKUP_READ) {
+    return rc_t{RC_TRUE};
+  }
+
+  // Read-only: no need to get a clsn (and log space) at all, the
+  // transaction serializes at the point it passes validation.
+  if (write_set.size() == 0) {
+    if (config::phantom_prot && !MasstreeCheckPhantom()) {
+      return rc_t{RC_ABORT_PHANTOM};
+    }
+    if (!OCCCheckReadSet()) {
+      return rc_t{RC_ABORT_SERIAL};
+    }
+    if (log) {
+      log->discard();
+    }
+    volatile_write(xc->state, TXN::TXN_CMMTD);
+    return rc_t{RC_TRUE};
+  }
+
+  // All writes are "locked" already (installed as in-flight heads by
+  // Update/Insert), so pre-commit is the serialization point.
+  ASSERT(log);
+  xc->end = log->pre_commit().offset();
+  if (xc->end == 0) {
+    return rc_t{RC_ABORT_INTERNAL};
+  }
+
+  if (config::phantom_prot && !MasstreeCheckPhantom()) {
+    return rc_t{RC_ABORT_PHANTOM};
+  }
+
+  if (!OCCCheckReadSet()) {
+    return rc_t{RC_ABORT_SERIAL};
+  }
+
+  log->commit(NULL);  // will populate log block
+
+  // Stamp clsn on the new versions, then unlink the overwritten ones: nobody
+  // starts reading anything but the latest committed version, so the chain
+  // never grows beyond the head (plus an in-flight overwrite). The new
+  // version must become visible (clsn stamped) before the old one is
+  // unlinked so readers always find one of the two, and readers already on
+  // the old one may keep using it until the epoch manager says otherwise.
+  auto clsn = xc->end;
+  for (uint32_t i = 0; i < write_set.size(); ++i) {
+    auto &w = write_set[i];
+    Object *object = w.get_object();
+    dbtuple *tuple = (dbtuple *)object->GetPayload();
+    ASSERT(w.entry);
+    tuple->DoWrite();
+    fat_ptr clsn_ptr = object->GenerateClsnPtr(clsn);
+    object->SetClsn(clsn_ptr);
+    ASSERT(tuple->GetObject()->GetClsn().asi_type() == fat_ptr::ASI_LOG);
+
+    fat_ptr overwritten_ptr = object->GetNextVolatile();
+    if (overwritten_ptr.offset()) {
+      dbtuple *overwritten_tuple = tuple->NextVolatile();
+      ASSERT(overwritten_tuple->sstamp.asi_type() == fat_ptr::ASI_XID);
+      ASSERT(XID::from_ptr(overwritten_tuple->sstamp) == xid);
+      volatile_write(overwritten_tuple->sstamp, clsn_ptr);
+      object->SetNextVolatile(NULL_PTR);
+      if (config::enable_gc) {
+        MM::deallocate_after_epoch(overwritten_ptr, xc->begin_epoch);
+      }
+    }
+  }
+
+  volatile_write(xc->state, TXN::TXN_CMMTD);
+  return rc_t{RC_TRUE};
+}
 #else
 rc_t transaction::si_commit() {
-  if ((!(flags & TXN_FLAG_CMD_REDO) && config::is_backup_srv())) {
+  if (flags & TXN_FLAG_BACKUP_READ) {
     return rc_t{RC_TRUE};
   }
 
@@ -1124,7 +1267,21 @@ rc_t transaction::si_commit() {
   // (traverse write-tuple)
   // stuff clsn in tuples in write-set
   auto clsn = xc->end;
-  for (uint32_t i = 0; i < write_set.size(); ++i) {
+  // Versions are scattered all over memory: prefetch the OID entry
+  // 2 * kPrefetchDistance ahead, and the object behind the entry
+  // kPrefetchDistance ahead (by then its entry should be in cache).
+  static const uint32_t kPrefetchDistance = 4;
+  uint32_t nwrites = write_set.size();
+  for (uint32_t i = 0; i < nwrites && i < 2 * kPrefetchDistance; ++i) {
+    ::prefetch((const char *)write_set[i].entry);
+  }
+  for (uint32_t i = 0; i < nwrites; ++i) {
+    if (i + 2 * kPrefetchDistance < nwrites) {
+      ::prefetch((const char *)write_set[i + 2 * kPrefetchDistance].entry);
+    }
+    if (i + kPrefetchDistance < nwrites) {
+      ::prefetch((const char *)write_set[i + kPrefetchDistance].get_object());
+    }
     auto &w = write_set[i];
     Object *object = w.get_object();
     ASSERT(object);
@@ -1153,9 +1310,18 @@ rc_t transaction::si_commit() {
 
 // returns true if btree versions have changed, ie there's phantom
 bool transaction::MasstreeCheckPhantom() {
-  for (auto &r : masstree_absent_set) {
-    const uint64_t v = ConcurrentMasstree::ExtractVersionNumber(r.first);
-    if (unlikely(v != r.second)) return false;
+  static const uint32_t kPrefetchDistance = 4;
+  MasstreeAbsentSet::entry_t *entries = masstree_absent_set.begin();
+  uint32_t n = masstree_absent_set.size();
+  for (uint32_t i = 0; i < n && i < kPrefetchDistance; ++i) {
+    ::prefetch((const char *)entries[i].node);
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    if (i + kPrefetchDistance < n) {
+      ::prefetch((const char *)entries[i + kPrefetchDistance].node);
+    }
+    const uint64_t v = ConcurrentMasstree::ExtractVersionNumber(entries[i].node);
+    if (unlikely(v != entries[i].version)) return false;
   }
   return true;
 }
@@ -1268,7 +1434,7 @@ rc_t transaction::Update(TableDescriptor *td, OID oid, const varstr *k, varstr *
       // GC later.
       //MM::deallocate(prev_obj_ptr);
     } else {  // prev is committed (or precommitted but in post-commit now) head
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
+#if defined(SSI) || defined(SSN) || defined(MVOCC) || defined(OCC)
       volatile_write(prev->sstamp, xc->owner.to_ptr());
       ASSERT(prev->sstamp.asi_type() == fat_ptr::ASI_XID);
       ASSERT(XID::from_ptr(prev->sstamp) == xc->owner);
@@ -1386,7 +1552,13 @@ rc_t transaction::DoTupleRead(dbtuple *tuple, varstr *out_v) {
           XID::from_ptr(tuple->GetObject()->GetClsn()) == xc->owner));
   ASSERT(not read_my_own or not(flags & TXN_FLAG_READ_ONLY));
 
-#if defined(SSI) || defined(SSN) || defined(MVOCC)
+#ifdef OCC
+  // Read-only transactions need validation too: they see the latest
+  // committed versions rather than a snapshot.
+  if (not read_my_own) {
+    occ_read(tuple);
+  }
+#elif defined(SSI) || defined(SSN) || defined(MVOCC)
   if (not read_my_own) {
     rc_t rc = {RC_INVALID};
     if (flags & TXN_FLAG_READ_ONLY) {
@@ -1513,4 +1685,13 @@ rc_t transaction::mvocc_read(dbtuple *tuple) {
   return rc_t{RC_TRUE};
 }
 #endif
+
+#ifdef OCC
+rc_t transaction::occ_read(dbtuple *tuple) {
+  // Remember the clsn before copying the data out: if the version gets
+  // recycled under us the clsn won't match at commit.
+  read_set.emplace_back(occ_read_t{tuple, tuple->GetObject()->GetClsn()});
+  return rc_t{RC_TRUE};
+}
+#endif
 }  // namespace ermia
@@ -3,6 +3,10 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <cstdlib>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "dbcore/xid.h"
@@ -32,20 +36,207 @@ struct write_record_t {
   inline Object *get_object() { return (Object *)entry->offset(); }
 };
 
+// Write-set with the first kInlineEntries entries stored inline (enough for
+// the common case, e.g., TPC-C's largest is 133); the rest spill over to
+// fixed-size chunks taken from a per-thread pool and recycled by clear().
+// Lookups stay O(1) through a small chunk directory.
 struct write_set_t {
-  static const uint32_t kMaxEntries = 256;
+  static const uint32_t kInlineEntries = 256;
+  static const uint32_t kChunkBits = 14;
+  static const uint32_t kChunkEntries = 1 << kChunkBits;
+  static const uint32_t kMaxChunks = 64;
+  static const uint32_t kMaxEntries = kInlineEntries + kMaxChunks * kChunkEntries;
+
   uint32_t num_entries;
-  write_record_t entries[kMaxEntries];
-  write_set_t() : num_entries(0) {}
+  uint32_t num_chunks;
+  write_record_t entries[kInlineEntries];
+  write_record_t *chunks[kMaxChunks];
+
+  write_set_t() : num_entries(0), num_chunks(0) {}
+  ~write_set_t() { clear(); }
+
   inline void emplace_back(fat_ptr *oe) {
-    ALWAYS_ASSERT(num_entries < kMaxEntries);
-    new (&entries[num_entries]) write_record_t(oe);
+    if (likely(num_entries < kInlineEntries)) {
+      new (&entries[num_entries]) write_record_t(oe);
+    } else {
+      uint32_t idx = num_entries - kInlineEntries;
+      if (unlikely(idx >> kChunkBits == num_chunks)) {
+        LOG_IF(FATAL, num_chunks == kMaxChunks)
+            << "Write-set too large (" << num_entries << " entries)";
+        chunks[num_chunks++] = AllocateChunk();
+      }
+      new (&chunks[idx >> kChunkBits][idx & (kChunkEntries - 1)]) write_record_t(oe);
+    }
     ++num_entries;
-    ASSERT(entries[num_entries - 1].entry == oe);
+    ASSERT((*this)[num_entries - 1].entry == oe);
   }
   inline uint32_t size() { return num_entries; }
-  inline void clear() { num_entries = 0; }
-  inline write_record_t &operator[](uint32_t idx) { return entries[idx]; }
+  inline void clear() {
+    num_entries = 0;
+    while (num_chunks) {
+      FreeChunk(chunks[--num_chunks]);
+    }
+  }
+  inline write_record_t &operator[](uint32_t idx) {
+    if (likely(idx < kInlineEntries)) {
+      return entries[idx];
+    }
+    idx -= kInlineEntries;
+    return chunks[idx >> kChunkBits][idx & (kChunkEntries - 1)];
+  }
+
+  static write_record_t *AllocateChunk();
+  static void FreeChunk(write_record_t *chunk);
+};
+
+// A flat array whose buffer goes back to a per-thread pool, instead of the
+// heap, when the owning transaction is destroyed. The next transaction on
+// the same worker picks it up with its capacity intact, so after warm-up
+// buffers match the workload's footprint and emplace_back doesn't allocate.
+template <typename T>
+struct recycled_vector {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "recycled_vector only holds trivially copyable types");
+  static const uint32_t kInitialCapacity = 64;
+  static const uint32_t kMaxPooled = 256;
+
+  T *data_;
+  uint32_t size_;
+  uint32_t capacity_;
+
+  recycled_vector() : data_(nullptr), size_(0), capacity_(0) {}
+  ~recycled_vector() {
+    if (!data_) {
+      return;
+    }
+    if (pool().size() < kMaxPooled) {
+      pool().emplace_back(data_, capacity_);
+    } else {
+      free(data_);
+    }
+  }
+  recycled_vector(const recycled_vector &) = delete;
+  recycled_vector &operator=(const recycled_vector &) = delete;
+
+  inline void emplace_back(const T &v) {
+    if (unlikely(size_ == capacity_)) {
+      grow();
+    }
+    data_[size_++] = v;
+  }
+  inline uint32_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline void clear() { size_ = 0; }
+  inline T &operator[](uint32_t idx) { return data_[idx]; }
+  inline T *begin() { return data_; }
+  inline T *end() { return data_ + size_; }
+
+ private:
+  static std::vector<std::pair<T *, uint32_t>> &pool() {
+    static thread_local std::vector<std::pair<T *, uint32_t>> p;
+    return p;
+  }
+
+  void grow() {
+    if (!data_ && !pool().empty()) {
+      std::tie(data_, capacity_) = pool().back();
+      pool().pop_back();
+      return;
+    }
+    uint32_t new_capacity = capacity_ ? capacity_ * 2 : kInitialCapacity;
+    T *new_data = (T *)malloc(sizeof(T) * new_capacity);
+    ALWAYS_ASSERT(new_data);
+    if (data_) {
+      memcpy(new_data, data_, sizeof(T) * size_);
+      free(data_);
+    }
+    data_ = new_data;
+    capacity_ = new_capacity;
+  }
+};
+
+// The absent set maps Masstree nodes to the version number observed when
+// the node was read. Entries are kept in a flat array so commit-time
+// validation is a linear pass; lookups scan linearly while the set is small
+// and use an open-addressing index (slot -> entry + 1) once it grows.
+class MasstreeAbsentSet {
+ public:
+  typedef ConcurrentMasstree::node_opaque_t node_t;
+  struct entry_t {
+    const node_t *node;
+    uint64_t version;
+  };
+  static const uint32_t kLinearLimit = 32;
+
+  MasstreeAbsentSet() : index_capacity_(0) {}
+
+  inline bool empty() const { return entries_.empty(); }
+  inline uint32_t size() const { return entries_.size(); }
+  inline void clear() {
+    entries_.clear();
+    index_capacity_ = 0;
+  }
+  inline entry_t *begin() { return entries_.begin(); }
+  inline entry_t *end() { return entries_.end(); }
+
+  inline entry_t *find(const node_t *node) {
+    if (entries_.size() <= kLinearLimit) {
+      for (auto &e : entries_) {
+        if (e.node == node) return &e;
+      }
+      return nullptr;
+    }
+    if (unlikely(!index_capacity_)) {
+      Reindex();
+    }
+    for (uint32_t i = Hash(node);; i = (i + 1) & (index_capacity_ - 1)) {
+      uint32_t slot = index_[i];
+      if (!slot) return nullptr;
+      if (entries_[slot - 1].node == node) return &entries_[slot - 1];
+    }
+  }
+
+  // Caller makes sure [node] isn't in the set already
+  inline void insert(const node_t *node, uint64_t version) {
+    entries_.emplace_back(entry_t{node, version});
+    if (index_capacity_) {
+      if (entries_.size() * 2 > index_capacity_) {
+        Reindex();
+      } else {
+        IndexInsert(entries_.size() - 1);
+      }
+    }
+  }
+
+ private:
+  inline uint32_t Hash(const node_t *node) {
+    return (((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ull >> 32) &
+           (index_capacity_ - 1);
+  }
+  inline void IndexInsert(uint32_t idx) {
+    uint32_t i = Hash(entries_[idx].node);
+    while (index_[i]) {
+      i = (i + 1) & (index_capacity_ - 1);
+    }
+    index_[i] = idx + 1;
+  }
+  void Reindex() {
+    index_capacity_ = 1;
+    while (index_capacity_ < entries_.size() * 4) {
+      index_capacity_ *= 2;
+    }
+    index_.clear();
+    for (uint32_t i = 0; i < index_capacity_; ++i) {
+      index_.emplace_back(0);
+    }
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+      IndexInsert(i);
+    }
+  }
+
+  recycled_vector<entry_t> entries_;
+  recycled_vector<uint32_t> index_;
+  uint32_t index_capacity_;
 };
 
 class transaction {
@@ -56,7 +247,15 @@ public:
   typedef TXN::txn_state txn_state;
 
 #if defined(SSN) || defined(SSI) || defined(MVOCC)
-  typedef std::vector<dbtuple *> read_set_t;
+  typedef recycled_vector<dbtuple *> read_set_t;
+#elif defined(OCC)
+  // A read is valid as long as the version is still there (same clsn,
+  // i.e., not recycled) and nobody else has overwritten it.
+  struct occ_read_t {
+    dbtuple *tuple;
+    fat_ptr clsn;
+  };
+  typedef recycled_vector<occ_read_t> read_set_t;
 #endif
 
   enum {
@@ -76,6 +275,10 @@ public:
 
     // A context-switch transaction doesn't enter/exit thread during construct/destruct.
     TXN_FLAG_CSWITCH = 0x8,
+
+    // A read-only transaction on a backup (set by the constructor); stays
+    // one to the end even if the backup is promoted meanwhile.
+    TXN_FLAG_BACKUP_READ = 0x10,
   };
 
   inline bool is_read_mostly() { return flags & TXN_FLAG_READ_MOSTLY; }
@@ -85,7 +288,6 @@ protected:
   inline txn_state state() const { return xc->state; }
 
   // the absent set is a mapping from (masstree node -> version_number).
-  typedef dense_hash_map<const ConcurrentMasstree::node_opaque_t *, uint64_t > MasstreeAbsentSet;
   MasstreeAbsentSet masstree_absent_set;
 
  public:
@@ -108,6 +310,10 @@ protected:
 #elif defined MVOCC
   rc_t mvocc_commit();
   rc_t mvocc_read(dbtuple *tuple);
+#elif defined OCC
+  rc_t occ_commit();
+  rc_t occ_read(dbtuple *tuple);
+  bool OCCCheckReadSet();
 #else
   rc_t si_commit();
 #endif
@@ -127,6 +333,11 @@ protected:
 
   void LogIndexInsert(OrderedIndex *index, OID oid, const varstr *key);
 
+  // Read-only transactions on backups: declare the only tables this
+  // transaction will read, to move its snapshot to the freshest one that is
+  // consistent for them. Call before any reads; no-op elsewhere.
+  void SetReadView(TableDescriptor *const *tables, uint32_t ntables);
+
  public:
   // Reads the contents of tuple into v within this transaction context
   rc_t DoTupleRead(dbtuple *tuple, varstr *out_v);
@@ -156,7 +367,7 @@ protected:
   str_arena *sa;
   uint32_t coro_batch_idx; // its index in the batch
   write_set_t write_set;
-#if defined(SSN) || defined(SSI) || defined(MVOCC)
+#if defined(SSN) || defined(SSI) || defined(MVOCC) || defined(OCC)
   read_set_t read_set;
 #endif
 };
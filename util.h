@@ -10,6 +10,7 @@
 #include <atomic>
 #include <tuple>
 #include <algorithm>
+#include <cstring>
 
 #include <stdint.h>
 #include <pthread.h>
@@ -290,6 +291,56 @@ inline size_t first_pos_diff(const char *p0, size_t sz0, const char *p1,
   return n;
 }
 
+// Latencies in log-linear buckets: four per power of two, so a reported
+// percentile is at most ~25% above the real one.
+struct latency_histogram {
+  static const uint32_t kBuckets = 64 * 4;
+  uint64_t counts[kBuckets];
+
+  latency_histogram() { memset(counts, 0, sizeof(counts)); }
+
+  static inline uint32_t bucket(uint64_t us) {
+    if (us < 4) {
+      return us;
+    }
+    uint32_t msb = 63 - __builtin_clzll(us);
+    return msb * 4 + ((us >> (msb - 2)) & 3);
+  }
+  // Largest latency that falls into bucket [b]
+  static inline uint64_t upper_bound(uint32_t b) {
+    if (b < 4) {
+      return b;
+    }
+    uint32_t msb = b / 4;
+    return ((uint64_t)(4 + b % 4 + 1) << (msb - 2)) - 1;
+  }
+
+  inline void add(uint64_t us) { ++counts[bucket(us)]; }
+  inline void merge(const latency_histogram &other) {
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      counts[i] += other.counts[i];
+    }
+  }
+  uint64_t total() const {
+    uint64_t n = 0;
+    for (auto c : counts) {
+      n += c;
+    }
+    return n;
+  }
+  // Upper bound of the [p] (e.g., 0.99) quantile of recorded latencies
+  uint64_t percentile(double p) const {
+    uint64_t n = total(), seen = 0;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (n and seen >= p * n) {
+        return upper_bound(i);
+      }
+    }
+    return 0;
+  }
+};
+
 class timer {
  private:
   timer &operator=(const timer &) = delete;